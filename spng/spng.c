@@ -26,10 +26,32 @@
     #include <pthread.h>
 #endif
 
+#if defined(SPNG_USE_LIBDEFLATE) && !defined(SPNG_USE_MINIZ)
+    #include <libdeflate.h>
+#endif
+
+/* Checkpoints require Z_BLOCK, inflateGetDictionary() and inflatePrime() */
+#if !defined(SPNG_USE_MINIZ) && !defined(__FRAMAC__) && ZLIB_VERNUM >= 0x1271
+    #define SPNG_INFLATE_INDEX
+#endif
+
+/* Speculative inflate uses the same zlib features */
+#if defined(SPNG_MULTITHREADING) && defined(SPNG_INFLATE_INDEX)
+    #define SPNG_INFLATE_SPECULATIVE_SUPPORTED
+#endif
+
 /* Not build options, edit at your own risk! */
 #define SPNG_READ_SIZE (8192)
 #define SPNG_WRITE_SIZE SPNG_READ_SIZE
 #define SPNG_MAX_CHUNK_COUNT (1000)
+#define SPNG_MAX_THREADS (64) /* SPNG_DECODE_THREADS, SPNG_ENCODE_THREADS */
+#define SPNG_ICC_HINT_MAX (1024 * 1024) /* largest allocation from an ICC profile header */
+#define SPNG_CONVERT_BLOCK_SIZE (8192) /* bytes per column block */
+#define SPNG_DEFAULT_LLC_SIZE (8 * 1024 * 1024) /* when it can't be detected */
+#define SPNG_INDEX_HEADER_SIZE (20)
+#define SPNG_CHECKPOINT_SIZE (28) /* without the variable-length data */
+#define SPNG_SPECULATIVE_MIN_RANGE (256 * 1024) /* compressed bytes per thread */
+#define SPNG_SPECULATIVE_STEP (64 * 1024)
 
 #define SPNG_TARGET_CLONES(x)
 
@@ -49,6 +71,17 @@
         #define SPNG_DISABLE_OPT
     #endif
 
+    /* AVX2 and AVX-512 functions are compiled with target attributes and selected at runtime */
+    #if defined(SPNG_X86_64) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5) || (defined(_MSC_VER) && _MSC_VER >= 1910))
+        #define SPNG_X86_AVX
+    #endif
+
+    /* 256-bit carry-less multiplication for CRC32, needs newer compilers */
+    #if defined(SPNG_X86_AVX) && (defined(__clang__) && __clang_major__ >= 10 || \
+        (defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8) || (defined(_MSC_VER) && _MSC_VER >= 1920))
+        #define SPNG_X86_VPCLMUL
+    #endif
+
     #if defined(SPNG_X86_64) && defined(SPNG_ENABLE_TARGET_CLONES)
         #undef SPNG_TARGET_CLONES
         #define SPNG_TARGET_CLONES(x) __attribute__((target_clones(x)))
@@ -64,9 +97,63 @@
         static void defilter_paeth3(size_t rowbytes, unsigned char *row, const unsigned char *prev);
         static void defilter_paeth4(size_t rowbytes, unsigned char *row, const unsigned char *prev);
 
+        static void defilter_up_simd(size_t rowbytes, unsigned char *row, const unsigned char *prev);
+        static void defilter_sub1(size_t rowbytes, unsigned char *row);
+        static void defilter_sub2(size_t rowbytes, unsigned char *row);
+        static void defilter_sub6(size_t rowbytes, unsigned char *row);
+        static void defilter_sub8(size_t rowbytes, unsigned char *row);
+        static void defilter_avg6(size_t rowbytes, unsigned char *row, const unsigned char *prev);
+        static void defilter_avg8(size_t rowbytes, unsigned char *row, const unsigned char *prev);
+        static void defilter_paeth6(size_t rowbytes, unsigned char *row, const unsigned char *prev);
+        static void defilter_paeth8(size_t rowbytes, unsigned char *row, const unsigned char *prev);
+
+        #if defined(SPNG_X86)
+        static void copy_nontemporal(unsigned char *dst, const unsigned char *src, size_t len);
+        static void nontemporal_fence(void);
+        static size_t accumulate_u8_sse2(uint16_t *acc, const unsigned char *row, size_t n);
+        static uint32_t interleave_pixels_sse2(unsigned char *out, const unsigned char *a, const unsigned char *b,
+                                               uint32_t n, size_t pixel_size);
+        static size_t filter_candidates_sse2(unsigned char *rows, size_t stride, const unsigned char *prev, const unsigned char *row,
+                                             size_t i, size_t rowbytes, unsigned bpp, uint64_t scores[5]);
+        #endif
+
+        #if defined(SPNG_X86_AVX)
+        static size_t filter_candidates_avx2(unsigned char *rows, size_t stride, const unsigned char *prev, const unsigned char *row,
+                                             size_t i, size_t rowbytes, unsigned bpp, uint64_t scores[5]);
+        static size_t filter_sub_up_avx2(unsigned char *rows, size_t stride, const unsigned char *prev, const unsigned char *row,
+                                         size_t i, size_t rowbytes, unsigned bpp, uint64_t scores[5]);
+        static int get_x86_simd_level(void);
+        static size_t x86_llc_size(void);
+        static int defilter_avx2(size_t rowbytes, unsigned char *row, const unsigned char *prev, unsigned bpp, unsigned filter);
+        static int defilter_avx512(size_t rowbytes, unsigned char *row, const unsigned char *prev, unsigned bpp, unsigned filter);
+        static uint32_t expand_palette_rgba8_avx2(unsigned char *row, const unsigned char *scanline, const unsigned char *plte, uint32_t width);
+        static uint32_t expand_palette_rgb8_avx2(unsigned char *row, const unsigned char *scanline, const unsigned char *plte, uint32_t width);
+        static uint32_t rgb8_row_to_rgba8_avx2(const unsigned char *row, unsigned char *out, uint32_t n);
+        static int get_x86_crc_level(int simd_level);
+        static size_t adler32_avx2(uint32_t *adler, const unsigned char *data, size_t len);
+        struct spng__fast_parser;
+        static size_t fast_parse_avx2(struct spng__fast_parser *p, size_t i);
+        static size_t crc32_pclmul(uint32_t *crc, unsigned char *dst, const unsigned char *src, size_t len);
+        #endif
+
+        #if defined(SPNG_X86_VPCLMUL)
+        static size_t crc32_vpclmul(uint32_t *crc, unsigned char *dst, const unsigned char *src, size_t len);
+        #endif
+
+        #if defined(SPNG_X86) && defined(SPNG_SSE) && (SPNG_SSE >= 3)
+        static uint32_t expand_palette16_rgba8_ssse3(unsigned char *row, const unsigned char *scanline, const unsigned char *plte, uint32_t width);
+        static uint32_t expand_palette16_rgb8_ssse3(unsigned char *row, const unsigned char *scanline, const unsigned char *plte, uint32_t width);
+        static uint32_t rgb8_row_to_rgba8_ssse3(const unsigned char *row, unsigned char *out, uint32_t n);
+        #endif
+
         #if defined(SPNG_ARM)
+        static size_t filter_candidates_neon(unsigned char *rows, size_t stride, const unsigned char *prev, const unsigned char *row,
+                                             size_t i, size_t rowbytes, unsigned bpp, uint64_t scores[5]);
         static uint32_t expand_palette_rgba8_neon(unsigned char *row, const unsigned char *scanline, const unsigned char *plte, uint32_t width);
         static uint32_t expand_palette_rgb8_neon(unsigned char *row, const unsigned char *scanline, const unsigned char *plte, uint32_t width);
+        static size_t accumulate_u8_neon(uint16_t *acc, const unsigned char *row, size_t n);
+        static uint32_t interleave_pixels_neon(unsigned char *out, const unsigned char *a, const unsigned char *b,
+                                               uint32_t n, size_t pixel_size);
         #endif
     #endif
 #endif
@@ -82,6 +169,27 @@
     #define SPNG_LITTLE_ENDIAN
 #endif
 
+/* The CRC32 instructions are optional in ARMv8.0, only used when the compiler targets them */
+#if defined(SPNG_ARM) && defined(__ARM_FEATURE_CRC32) && defined(SPNG_LITTLE_ENDIAN)
+    #define SPNG_ARM_CRC32
+    static size_t crc32_armv8(uint32_t *crc, unsigned char *dst, const unsigned char *src, size_t len);
+#endif
+
+enum spng__simd
+{
+    SPNG__SIMD_NONE = 0, /* scalar code only */
+    SPNG__SIMD_BASE = 1, /* SSE2 (or SPNG_SSE) on x86, NEON on ARM */
+    SPNG__SIMD_AVX2 = 2,
+    SPNG__SIMD_AVX512 = 3 /* AVX-512F and AVX-512BW */
+};
+
+enum spng__crc
+{
+    SPNG__CRC_ZLIB = 0, /* zlib's crc32() */
+    SPNG__CRC_HW = 1, /* PCLMULQDQ on x86, CRC32 instructions on ARM */
+    SPNG__CRC_VPCLMUL = 2 /* VPCLMULQDQ with AVX2 */
+};
+
 enum spng_state
 {
     SPNG_STATE_INVALID = 0,
@@ -133,6 +241,16 @@ struct spng_subimage
     uint32_t height;
     size_t out_width; /* byte width based on output format */
     size_t scanline_width;
+    uint32_t crop_first, crop_end; /* pixels inside the crop rectangle */
+};
+
+/* Compressed iCCP/zTXt/iTXt data that is inflated on first access */
+struct spng__zdata
+{
+    uint64_t offset; /* of the zlib stream in the PNG */
+    uint32_t length;
+    unsigned char *copy; /* compressed bytes of inputs without random access */
+    int pending;
 };
 
 struct spng_text2
@@ -149,6 +267,8 @@ struct spng_text2
 
     size_t cache_usage;
     char user_keyword_storage[80];
+
+    struct spng__zdata zdata;
 };
 
 struct decode_flags
@@ -162,6 +282,12 @@ struct decode_flags
     unsigned same_layout: 1;
     unsigned zerocopy:    1;
     unsigned unpack:      1;
+    unsigned nontemporal: 1;
+    unsigned crop:        1;
+    unsigned stop_early:  1; /* the crop rectangle ends before the last scanline */
+    unsigned downscale:   1;
+    unsigned progressive: 1;
+    unsigned build_index: 1; /* add checkpoints every SPNG_INDEX_INTERVAL rows */
 };
 
 struct encode_flags
@@ -193,6 +319,8 @@ struct spng_chunk_bitfield
     unsigned time: 1;
     unsigned offs: 1;
     unsigned exif: 1;
+    unsigned actl: 1;
+    unsigned fctl: 1;
     unsigned unknown: 1;
 };
 
@@ -224,6 +352,10 @@ struct spng__zlib_options
 
 typedef void spng__undo(spng_ctx *ctx);
 
+/* Converts pixels of a defiltered scanline to the output format,
+   *scanline and *out point to the first pixel which is always byte-aligned */
+typedef void spng__convert_row(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width);
+
 struct spng_ctx
 {
     size_t data_size;
@@ -242,6 +374,10 @@ struct spng_ctx
     size_t bytes_left;
     size_t last_read_size;
 
+    /* Data passed to spng_feed() is appended to feed_buf and read like a buffer */
+    unsigned char *feed_buf;
+    size_t feed_buf_size;
+
     /* Used for encoding */
     int user_owns_out_png;
     unsigned char *out_png;
@@ -271,8 +407,24 @@ struct spng_ctx
     unsigned discard: 1;
     unsigned skip_crc: 1;
     unsigned keep_unknown: 1;
+    unsigned filter_chunks: 1;
     unsigned prev_was_idat: 1;
 
+    /* Fed input, reads that need more data return SPNG_EAGAIN */
+    unsigned feed: 1;
+    unsigned feed_eof: 1; /* no more data will be fed */
+    unsigned feed_chunks: 1; /* read_non_idat_chunks() stopped before a chunk header */
+    unsigned filter_pending: 1; /* the first filter byte is read by read_scanline() */
+
+    unsigned resume_inflate: 1; /* read_scanline_bytes() continues a partial output */
+    unsigned index_loaded: 1; /* index_buf was set with spng_set_index() */
+
+    /* APNG */
+    unsigned apng_frames: 1; /* spng_decode_frame() was called */
+    unsigned fdat: 1; /* image data is read from fdAT chunks */
+    unsigned fctl_pending: 1; /* next_fctl was read, its image data comes next */
+    unsigned next_frame: 1; /* read_chunks() stopped at the first fdAT of next_fctl */
+
     struct spng__zlib_options image_options;
     struct spng__zlib_options text_options;
 
@@ -294,23 +446,46 @@ struct spng_ctx
 
     uint32_t max_width, max_height;
 
+    /* Set by spng_set_crop(), the whole image if crop_width is zero */
+    uint32_t crop_x, crop_y, crop_width, crop_height;
+    int stop_pass; /* last pass and scanline inside the crop rectangle */
+    uint32_t stop_scanline;
+
     size_t max_chunk_size;
     size_t chunk_cache_limit;
     size_t chunk_cache_usage;
     uint32_t chunk_count_limit;
     uint32_t chunk_count_total;
 
+    /* Ancillary chunk types kept by spng_set_chunk_filter() */
+    uint32_t *keep_chunks;
+    uint32_t n_keep_chunks;
+
     int crc_action_critical;
     int crc_action_ancillary;
 
     uint32_t optimize_option;
 
+    uint32_t encode_threads;
+    uint32_t decode_threads;
+    int restart_strips;
+
+    int inflate_backend;
+    int deflate_backend;
+    int nontemporal_stores;
+    int downscale_shift; /* log2 of SPNG_DOWNSCALE */
+    int downscale_mode;
+
+    int simd_level; /* enum spng__simd, detected by spng_ctx_new2() */
+    int crc_level; /* enum spng__crc, lowered along with simd_level */
+
     struct spng_ihdr ihdr;
 
     struct spng_plte plte;
 
     struct spng_chrm_int chrm_int;
     struct spng_iccp iccp;
+    struct spng__zdata iccp_zdata;
 
     uint32_t gama;
 
@@ -333,13 +508,51 @@ struct spng_ctx
     struct spng_offs offs;
     struct spng_exif exif;
 
+    struct spng_actl actl;
+    struct spng_fctl fctl, next_fctl; /* the last frame decoded and the frame after it, next_fctl has the encoder's delay */
+    uint32_t apng_seq; /* next sequence number */
+    uint32_t frame_index; /* frames decoded or encoded */
+
     uint32_t n_chunks;
     struct spng_unknown_chunk *chunk_list;
 
     struct spng_subimage subimage[7];
 
     z_stream zstream;
+    z_stream text_zstream; /* iCCP/text inflated on demand, separate from a possibly unfinished image stream */
     unsigned char *scanline_buf, *prev_scanline_buf, *row_buf, *filtered_scanline_buf;
+    size_t scanline_buf_size, prev_scanline_buf_size, row_buf_size, filtered_scanline_buf_size;
+
+    /* Used by the whole-image inflate path */
+    unsigned char *idat_buf;
+    size_t idat_buf_size;
+
+    /* Downscaling sums for a band of rows, or for the whole output of interlaced images */
+    unsigned char *downscale_buf;
+    size_t downscale_buf_size;
+    uint32_t *downscale_sums; /* box sums of a band, inside downscale_buf */
+
+    /* Frame pixels before blending and the canvas under frames with SPNG_DISPOSE_OP_PREVIOUS,
+       the encoder keeps the previous frame in frame_buf */
+    unsigned char *frame_buf, *dispose_buf;
+    size_t frame_buf_size, dispose_buf_size;
+
+    /* Frames being compressed by spng_encode_frame(), a ring buffer written in order */
+    struct spng__frame *frame_queue;
+    uint32_t frame_queue_head, frame_queue_len, frame_queue_size;
+
+    /* Inflate checkpoints in their serialized form without the header, see spng_get_index() */
+    unsigned char *index_buf;
+    size_t index_buf_size;
+    size_t index_len;
+    uint32_t index_count;
+    uint32_t index_interval; /* SPNG_INDEX_INTERVAL */
+    uint32_t index_span; /* rows between the checkpoints of index_buf */
+    uint32_t index_next_row; /* the next checkpoint is added in this row or after */
+    uint8_t index_last_in; /* last input byte consumed by inflate */
+#if defined(SPNG_USE_LIBDEFLATE) && !defined(SPNG_USE_MINIZ)
+    struct libdeflate_decompressor *decompressor;
+#endif
     unsigned char *scanline, *prev_scanline, *row, *filtered_scanline;
 
     /* based on fmt */
@@ -354,8 +567,13 @@ struct spng_ctx
     uint16_t *gamma_lut; /* points to either _lut8 or _lut16 */
     uint16_t *gamma_lut16;
     uint16_t gamma_lut8[256];
+    uint16_t linear_lut[256]; /* 8-bit samples to 12-bit linear light for SPNG_DOWNSCALE_LINEAR */
+    uint8_t encode_lut[4096]; /* and back */
     unsigned char trns_px[8];
     union spng__decode_plte decode_plte;
+    spng__convert_row *convert_row; /* selected by spng_decode_image() */
+    uint32_t convert_block; /* pixels per column block, a multiple of 8 */
+    unsigned scanline_bits, out_bits; /* bits per pixel before and after conversion */
     struct spng_sbit decode_sb;
     struct decode_flags decode_flags;
     struct spng_row_info row_info;
@@ -395,6 +613,14 @@ static const uint8_t type_time[4] = { 116, 73, 77, 69 };
 static const uint8_t type_offs[4] = { 111, 70, 70, 115 };
 static const uint8_t type_exif[4] = { 101, 88, 73, 102 };
 
+/* APNG */
+static const uint8_t type_actl[4] = { 97, 99, 84, 76 };
+static const uint8_t type_fctl[4] = { 102, 99, 84, 76 };
+static const uint8_t type_fdat[4] = { 102, 100, 65, 84 };
+
+/* Private chunk with the offsets of SPNG_RESTART_STRIPS strips */
+static const uint8_t type_sprs[4] = { 115, 112, 82, 83 };
+
 static inline void *spng__malloc(spng_ctx *ctx,  size_t size)
 {
     return ctx->alloc.malloc_fn(size);
@@ -415,6 +641,20 @@ static inline void spng__free(spng_ctx *ctx, void *ptr)
     ctx->alloc.free_fn(ptr);
 }
 
+/* Buffers are kept by spng_ctx_reset() and only reallocated when they're too small */
+static void *spng__reuse(spng_ctx *ctx, void *ptr, size_t *capacity, size_t size)
+{
+    if(ptr != NULL && *capacity >= size) return ptr;
+
+    spng__free(ctx, ptr);
+
+    ptr = spng__malloc(ctx, size);
+
+    *capacity = ptr != NULL ? size : 0;
+
+    return ptr;
+}
+
 #if defined(SPNG_USE_MINIZ)
 static void *spng__zalloc(void *opaque, size_t items, size_t size)
 #else
@@ -513,14 +753,17 @@ static inline uint8_t get_sample(struct spng__iter *iter)
     return x;
 }
 
+/* row may be unaligned, it often starts after the filter byte */
 static void u16_row_to_host(void *row, size_t size)
 {
-    uint16_t *px = row;
-    size_t i, n = size / 2;
+    unsigned char *px = row;
+    size_t i;
 
-    for(i=0; i < n; i++)
+    for(i=0; i + 1 < size; i += 2)
     {
-        px[i] = read_u16(&px[i]);
+        uint16_t sample = read_u16(px + i);
+
+        memcpy(px + i, &sample, 2);
     }
 }
 
@@ -535,10 +778,21 @@ static void u16_row_to_bigendian(void *row, size_t size)
     }
 }
 
-static void rgb8_row_to_rgba8(const unsigned char *row, unsigned char *out, uint32_t n)
+static void rgb8_row_to_rgba8(const unsigned char *row, unsigned char *out, uint32_t n, int simd_level)
 {
-    uint32_t i;
-    for(i=0; i < n; i++)
+    uint32_t i = 0;
+
+#if defined(SPNG_X86_AVX)
+    if(simd_level >= SPNG__SIMD_AVX2) i = rgb8_row_to_rgba8_avx2(row, out, n);
+#endif
+
+#if defined(SPNG_X86) && defined(SPNG_SSE) && (SPNG_SSE >= 3)
+    if(simd_level) i += rgb8_row_to_rgba8_ssse3(row + i * 3, out + i * 4, n - i);
+#endif
+
+    (void)simd_level;
+
+    for(; i < n; i++)
     {
         memcpy(out + i * 4, row + i * 3, 3);
         out[i*4+3] = 255;
@@ -712,6 +966,29 @@ static int calculate_image_size(const struct spng_ihdr *ihdr, int fmt, size_t *l
     return 0;
 }
 
+/* Returns the image header with the dimensions of the decoded image,
+   the crop rectangle divided by the downscaling factor rounded up */
+static int output_ihdr(const spng_ctx *ctx, int fmt, struct spng_ihdr *ihdr)
+{
+    *ihdr = ctx->ihdr;
+
+    if(ctx->downscale_shift && !(fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGB8 | SPNG_FMT_G8 | SPNG_FMT_GA8))) return SPNG_EFMT;
+
+    if(ctx->crop_width)
+    {
+        if(ctx->crop_x >= ihdr->width || ctx->crop_width > ihdr->width - ctx->crop_x) return SPNG_ECROP;
+        if(ctx->crop_y >= ihdr->height || ctx->crop_height > ihdr->height - ctx->crop_y) return SPNG_ECROP;
+
+        ihdr->width = ctx->crop_width;
+        ihdr->height = ctx->crop_height;
+    }
+
+    ihdr->width = ((ihdr->width - 1) >> ctx->downscale_shift) + 1;
+    ihdr->height = ((ihdr->height - 1) >> ctx->downscale_shift) + 1;
+
+    return 0;
+}
+
 static int increase_cache_usage(spng_ctx *ctx, size_t bytes, int new_chunk)
 {
     if(ctx == NULL || !bytes) return SPNG_EINTERNAL;
@@ -745,6 +1022,26 @@ static int decrease_cache_usage(spng_ctx *ctx, size_t usage)
     return 0;
 }
 
+/* Returns non-zero for chunk types that are read by read_non_idat_chunks() */
+static int is_known_chunk(const uint8_t type[4])
+{
+    static const uint8_t *const known[] =
+    {
+        type_ihdr, type_plte, type_idat, type_iend, type_trns, type_chrm, type_gama, type_iccp,
+        type_sbit, type_srgb, type_text, type_ztxt, type_itxt, type_bkgd, type_hist, type_phys,
+        type_splt, type_time, type_offs, type_exif, type_actl, type_fctl, type_fdat
+    };
+
+    size_t i;
+
+    for(i=0; i < sizeof(known) / sizeof(known[0]); i++)
+    {
+        if(!memcmp(type, known[i], 4)) return 1;
+    }
+
+    return 0;
+}
+
 static int is_critical_chunk(struct spng_chunk *chunk)
 {
     if(chunk == NULL) return 0;
@@ -755,6 +1052,8 @@ static int is_critical_chunk(struct spng_chunk *chunk)
 
 static int decode_err(spng_ctx *ctx, int err)
 {
+    if(err == SPNG_EAGAIN) return err; /* the call is repeated after more data is fed */
+
     ctx->state = SPNG_STATE_INVALID;
 
     return err;
@@ -778,6 +1077,8 @@ static inline int read_data(spng_ctx *ctx, size_t bytes)
 
     if(ret)
     {
+        if(ctx->feed && ret == SPNG_EAGAIN) return ret;
+
         if(ret > 0 || ret < SPNG_IO_ERROR) ret = SPNG_IO_ERROR;
 
         return ret;
@@ -883,6 +1184,32 @@ static int write_data(spng_ctx *ctx, const void *data, size_t bytes)
     return 0;
 }
 
+/* Update a chunk CRC with src, if dst is not NULL src is also copied to it in the same pass */
+static uint32_t chunk_crc(const spng_ctx *ctx, uint32_t crc, void *dst, const void *src, size_t len)
+{
+    size_t i = 0;
+    unsigned char *out = dst;
+    const unsigned char *in = src;
+
+    (void)ctx;
+
+#if defined(SPNG_X86_VPCLMUL)
+    if(ctx->crc_level >= SPNG__CRC_VPCLMUL && len >= 256) i = crc32_vpclmul(&crc, out, in, len);
+#endif
+
+#if defined(SPNG_X86_AVX)
+    if(ctx->crc_level && !i && len >= 64) i = crc32_pclmul(&crc, out, in, len);
+#elif defined(SPNG_ARM_CRC32)
+    if(ctx->crc_level) i = crc32_armv8(&crc, out, in, len);
+#endif
+
+    if(i == len) return crc;
+
+    if(out != NULL) memcpy(out + i, in + i, len - i);
+
+    return crc32(crc, in + i, (uInt)(len - i));
+}
+
 static int write_header(spng_ctx *ctx, const uint8_t chunk_type[4], size_t chunk_length, unsigned char **data)
 {
     if(ctx == NULL || chunk_type == NULL) return SPNG_EINTERNAL;
@@ -917,7 +1244,8 @@ static int trim_chunk(spng_ctx *ctx, uint32_t length)
     return 0;
 }
 
-static int finish_chunk(spng_ctx *ctx)
+/* finish_chunk(), crc_data is zero if the chunk data is already included in the CRC */
+static int finish_chunk2(spng_ctx *ctx, int crc_data)
 {
     if(ctx == NULL) return SPNG_EINTERNAL;
 
@@ -940,7 +1268,7 @@ static int finish_chunk(spng_ctx *ctx)
     write_u32(header, chunk->length);
     memcpy(header + 4, chunk->type, 4);
 
-    chunk->crc = crc32(chunk->crc, chunk_data, chunk->length);
+    if(crc_data) chunk->crc = chunk_crc(ctx, chunk->crc, NULL, chunk_data, chunk->length);
 
     write_u32(chunk_data + chunk->length, chunk->crc);
 
@@ -977,6 +1305,11 @@ static int finish_chunk(spng_ctx *ctx)
     return 0;
 }
 
+static int finish_chunk(spng_ctx *ctx)
+{
+    return finish_chunk2(ctx, 1);
+}
+
 static int write_chunk(spng_ctx *ctx, const uint8_t type[4], const void *data, size_t length)
 {
     if(ctx == NULL || type == NULL) return SPNG_EINTERNAL;
@@ -987,9 +1320,9 @@ static int write_chunk(spng_ctx *ctx, const uint8_t type[4], const void *data, s
     int ret = write_header(ctx, type, length, &write_ptr);
     if(ret) return ret;
 
-    if(length) memcpy(write_ptr, data, length);
+    if(length) ctx->current_chunk.crc = chunk_crc(ctx, ctx->current_chunk.crc, write_ptr, data, length);
 
-    return finish_chunk(ctx);
+    return finish_chunk2(ctx, 0);
 }
 
 static int write_iend(spng_ctx *ctx)
@@ -1048,6 +1381,41 @@ static inline int read_and_check_crc(spng_ctx *ctx)
     return 0;
 }
 
+static int keep_chunk(spng_ctx *ctx, struct spng_chunk *chunk);
+
+/* Fed input: return SPNG_EAGAIN unless the current chunk's crc, the next chunk header
+   and everything up to the next chunk's crc is available, chunks are read whole
+   so that chunk parsing never stops halfway.
+   IDAT data and chunks that are skipped are the exception, they are streamed.
+   The length is checked against the chunk limits before anything is buffered. */
+static int feed_check_header(spng_ctx *ctx)
+{
+    if(ctx->feed_eof) return 0;
+    if(ctx->bytes_left < 12) return SPNG_EAGAIN;
+
+    const unsigned char *next = ctx->data + ctx->last_read_size;
+    struct spng_chunk chunk = { .length = read_u32(next + 4) };
+
+    memcpy(chunk.type, next + 8, 4);
+
+    if(!memcmp(chunk.type, type_idat, 4) && ctx->state < SPNG_STATE_EOI) return 0;
+
+    if(chunk.length > spng_u32max) return 0; /* read_header() returns an error */
+
+    if(!keep_chunk(ctx, &chunk)) return 0;
+
+    if(!is_critical_chunk(&chunk) && !is_known_chunk(chunk.type) && (!ctx->keep_unknown || ctx->user.unknown)) return 0;
+
+    if(chunk.length > ctx->max_chunk_size) return SPNG_ECHUNK_LIMITS;
+
+    /* Image data is not cached */
+    if(memcmp(chunk.type, type_fdat, 4) && chunk.length > ctx->chunk_cache_limit - ctx->chunk_cache_usage) return SPNG_ECHUNK_LIMITS;
+
+    if(ctx->bytes_left - 12 < (size_t)chunk.length + 4) return SPNG_EAGAIN;
+
+    return 0;
+}
+
 /* Read and validate the current chunk's crc and the next chunk header */
 static inline int read_header(spng_ctx *ctx)
 {
@@ -1056,6 +1424,12 @@ static inline int read_header(spng_ctx *ctx)
     int ret;
     struct spng_chunk chunk = { 0 };
 
+    if(ctx->feed)
+    {
+        ret = feed_check_header(ctx);
+        if(ret) return ret;
+    }
+
     ret = read_and_check_crc(ctx);
     if(ret)
     {
@@ -1106,7 +1480,7 @@ static int read_chunk_bytes(spng_ctx *ctx, uint32_t bytes)
     ret = read_data(ctx, bytes);
     if(ret) return ret;
 
-    if(!ctx->skip_crc) ctx->cur_actual_crc = crc32(ctx->cur_actual_crc, ctx->data, bytes);
+    if(!ctx->skip_crc) ctx->cur_actual_crc = chunk_crc(ctx, ctx->cur_actual_crc, NULL, ctx->data, bytes);
 
     ctx->cur_chunk_bytes_left -= bytes;
 
@@ -1132,13 +1506,17 @@ static int read_chunk_bytes2(spng_ctx *ctx, void *out, uint32_t bytes)
         ret = ctx->read_fn(ctx, ctx->stream_user_ptr, out, len);
         if(ret) return ret;
 
-        if(!ctx->streaming) memcpy(out, ctx->data, len);
+        /* Buffered input is copied and checked in one pass */
+        if(ctx->skip_crc)
+        {
+            if(!ctx->streaming) memcpy(out, ctx->data, len);
+        }
+        else if(ctx->streaming) ctx->cur_actual_crc = chunk_crc(ctx, ctx->cur_actual_crc, NULL, out, len);
+        else ctx->cur_actual_crc = chunk_crc(ctx, ctx->cur_actual_crc, out, ctx->data, len);
 
         ctx->bytes_read += len;
         if(ctx->bytes_read < len) return SPNG_EOVERFLOW;
 
-        if(!ctx->skip_crc) ctx->cur_actual_crc = crc32(ctx->cur_actual_crc, out, len);
-
         ctx->cur_chunk_bytes_left -= len;
 
         out = (char*)out + len;
@@ -1156,7 +1534,21 @@ static int discard_chunk_bytes(spng_ctx *ctx, uint32_t bytes)
 
     int ret;
 
-    if(ctx->streaming) /* Do small, consecutive reads */
+    if(ctx->feed) /* Discard what is available, the caller continues after more data is fed */
+    {
+        uint32_t len = bytes;
+
+        if(len > ctx->bytes_left && !ctx->feed_eof) len = (uint32_t)ctx->bytes_left;
+
+        if(len)
+        {
+            ret = read_chunk_bytes(ctx, len);
+            if(ret) return ret;
+        }
+
+        return len < bytes ? SPNG_EAGAIN : 0;
+    }
+    else if(ctx->streaming) /* Do small, consecutive reads */
     {
         while(bytes)
         {
@@ -1181,6 +1573,11 @@ static int discard_chunk_bytes(spng_ctx *ctx, uint32_t bytes)
 
 static int spng__inflate_init(spng_ctx *ctx, int window_bits)
 {
+#if !defined(SPNG_USE_MINIZ)
+    /* Reuse the existing state and window */
+    if(ctx->zstream.state && ctx->inflate && inflateReset2(&ctx->zstream, window_bits) == Z_OK) goto validate;
+#endif
+
     if(ctx->zstream.state) inflateEnd(&ctx->zstream);
 
     ctx->inflate = 1;
@@ -1191,6 +1588,10 @@ static int spng__inflate_init(spng_ctx *ctx, int window_bits)
 
     if(inflateInit2(&ctx->zstream, window_bits) != Z_OK) return SPNG_EZLIB_INIT;
 
+#if !defined(SPNG_USE_MINIZ)
+validate:
+#endif
+
 #if ZLIB_VERNUM >= 0x1290 && !defined(SPNG_USE_MINIZ)
 
     int validate = 1;
@@ -1234,156 +1635,127 @@ static int spng__deflate_init(spng_ctx *ctx, struct spng__zlib_options *options)
     return 0;
 }
 
-/* Inflate a zlib stream starting with start_buf if non-NULL,
-   continuing from the datastream till an end marker,
-   allocating and writing the inflated stream to *out,
-   leaving "extra" bytes at the end, final buffer length is *len.
-
-   Takes into account the chunk size and cache limits.
-*/
-static int spng__inflate_stream(spng_ctx *ctx, char **out, size_t *len, size_t extra, const void *start_buf, size_t start_len)
+/* Read and check the sequence number at the start of an fdAT chunk */
+static int read_fdat_sequence(spng_ctx *ctx)
 {
-    int ret = spng__inflate_init(ctx, 15);
-    if(ret) return ret;
+    if(ctx->cur_chunk_bytes_left < 4) return SPNG_EFDAT;
 
-    size_t max = ctx->chunk_cache_limit - ctx->chunk_cache_usage;
+    int ret = read_chunk_bytes(ctx, 4);
+    if(ret) return ret;
 
-    if(ctx->max_chunk_size < max) max = ctx->max_chunk_size;
+    if(read_u32(ctx->data) != ctx->apng_seq) return SPNG_EFDAT;
 
-    if(extra > max) return SPNG_ECHUNK_LIMITS;
-    max -= extra;
+    ctx->apng_seq++;
 
-    uint32_t read_size;
-    size_t size = 8 * 1024;
-    void *t, *buf = spng__malloc(ctx, size);
+    return 0;
+}
 
-    if(buf == NULL) return SPNG_EMEM;
+/* Read at least one byte from the IDAT stream, or the fdAT stream of the current frame */
+static int read_idat_bytes(spng_ctx *ctx, uint32_t *bytes_read)
+{
+    if(ctx == NULL || bytes_read == NULL) return SPNG_EINTERNAL;
 
-    z_stream *stream = &ctx->zstream;
+    const uint8_t *type = ctx->fdat ? type_fdat : type_idat;
 
-    if(start_buf != NULL && start_len)
-    {
-        stream->avail_in = (uInt)start_len;
-        stream->next_in = start_buf;
-    }
-    else
-    {
-        stream->avail_in = 0;
-        stream->next_in = NULL;
-    }
+    if(memcmp(ctx->current_chunk.type, type, 4)) return SPNG_EIDAT_TOO_SHORT;
 
-    stream->avail_out = (uInt)size;
-    stream->next_out = buf;
+    int ret;
+    uint32_t len;
 
-    while(ret != Z_STREAM_END)
+    while(!ctx->cur_chunk_bytes_left)
     {
-        ret = inflate(stream, Z_NO_FLUSH);
-
-        if(ret == Z_STREAM_END) break;
-
-        if(ret != Z_OK && ret != Z_BUF_ERROR)
-        {
-            ret = SPNG_EZLIB;
-            goto err;
-        }
-
-        if(!stream->avail_out) /* Resize buffer */
-        {
-            /* overflow or reached chunk/cache limit */
-            if( (2 > SIZE_MAX / size) || (size > max / 2) )
-            {
-                ret = SPNG_ECHUNK_LIMITS;
-                goto err;
-            }
-
-            size *= 2;
-
-            t = spng__realloc(ctx, buf, size);
-            if(t == NULL) goto mem;
+        ret = read_header(ctx);
+        if(ret) return ret;
 
-            buf = t;
+        if(memcmp(ctx->current_chunk.type, type, 4)) return SPNG_EIDAT_TOO_SHORT;
 
-            stream->avail_out = (uInt)size / 2;
-            stream->next_out = (unsigned char*)buf + size / 2;
-        }
-        else if(!stream->avail_in) /* Read more chunk bytes */
+        if(ctx->fdat)
         {
-            read_size = ctx->cur_chunk_bytes_left;
-            if(ctx->streaming && read_size > SPNG_READ_SIZE) read_size = SPNG_READ_SIZE;
-
-            ret = read_chunk_bytes(ctx, read_size);
-
-            if(ret)
-            {
-                if(!read_size) ret = SPNG_EZLIB;
-
-                goto err;
-            }
-
-            stream->avail_in = read_size;
-            stream->next_in = ctx->data;
+            ret = read_fdat_sequence(ctx);
+            if(ret) return ret;
         }
     }
 
-    size = stream->total_out;
-
-    if(!size)
-    {
-        ret = SPNG_EZLIB;
-        goto err;
+    if(ctx->streaming)
+    {/* TODO: estimate bytes to read for progressive reads */
+        len = SPNG_READ_SIZE;
+        if(len > ctx->cur_chunk_bytes_left) len = ctx->cur_chunk_bytes_left;
     }
+    else if(ctx->feed)
+    {
+        len = ctx->cur_chunk_bytes_left;
+        if(len > ctx->bytes_left && !ctx->feed_eof) len = (uint32_t)ctx->bytes_left;
 
-    size += extra;
-    if(size < extra) goto mem;
-
-    t = spng__realloc(ctx, buf, size);
-    if(t == NULL) goto mem;
-
-    buf = t;
-
-    (void)increase_cache_usage(ctx, size, 0);
+        if(!len) return SPNG_EAGAIN;
+    }
+    else len = ctx->cur_chunk_bytes_left;
 
-    *out = buf;
-    *len = size;
+    ret = read_chunk_bytes(ctx, len);
 
-    return 0;
+    *bytes_read = len;
 
-mem:
-    ret = SPNG_EMEM;
-err:
-    spng__free(ctx, buf);
     return ret;
 }
 
-/* Read at least one byte from the IDAT stream */
-static int read_idat_bytes(spng_ctx *ctx, uint32_t *bytes_read)
+/* Save the inflate state at a deflate block boundary inside the current scanline,
+   everything needed to continue decoding from this point without the preceding data */
+static int add_checkpoint(spng_ctx *ctx)
 {
-    if(ctx == NULL || bytes_read == NULL) return SPNG_EINTERNAL;
-    if(memcmp(ctx->current_chunk.type, type_idat, 4)) return SPNG_EIDAT_TOO_SHORT;
-
-    int ret;
-    uint32_t len;
+#if defined(SPNG_INFLATE_INDEX)
+    z_stream *zstream = &ctx->zstream;
+    const struct spng_row_info *ri = &ctx->row_info;
+    uint32_t row = ri->scanline_idx;
+    uint32_t row_offset = (uint32_t)(zstream->next_out - ctx->scanline);
+    size_t prev_size = row ? ctx->subimage[0].scanline_width - 1 : 0;
+    size_t size = SPNG_CHECKPOINT_SIZE + 32768 + prev_size + row_offset;
+    uint64_t chunk_offset = ctx->current_chunk.offset - ctx->first_idat.offset;
+    uInt window_len = 32768;
 
-    while(!ctx->cur_chunk_bytes_left)
+    if(ctx->index_buf_size - ctx->index_len < size)
     {
-        ret = read_header(ctx);
-        if(ret) return ret;
+        size_t new_size = ctx->index_buf_size > SIZE_MAX / 2 ? SIZE_MAX : ctx->index_buf_size * 2;
 
-        if(memcmp(ctx->current_chunk.type, type_idat, 4)) return SPNG_EIDAT_TOO_SHORT;
-    }
+        if(size > SIZE_MAX - ctx->index_len) return SPNG_EOVERFLOW;
+        if(new_size < ctx->index_len + size) new_size = ctx->index_len + size;
 
-    if(ctx->streaming)
-    {/* TODO: estimate bytes to read for progressive reads */
-        len = SPNG_READ_SIZE;
-        if(len > ctx->cur_chunk_bytes_left) len = ctx->cur_chunk_bytes_left;
+        void *t = spng__realloc(ctx, ctx->index_buf, new_size);
+        if(t == NULL) return SPNG_EMEM;
+
+        ctx->index_buf = t;
+        ctx->index_buf_size = new_size;
     }
-    else len = ctx->current_chunk.length;
 
-    ret = read_chunk_bytes(ctx, len);
+    unsigned char *cp = ctx->index_buf + ctx->index_len;
 
-    *bytes_read = len;
+    if(inflateGetDictionary(zstream, cp + SPNG_CHECKPOINT_SIZE, &window_len) != Z_OK) return SPNG_EZLIB;
 
-    return ret;
+    write_u32(cp, row);
+    write_u32(cp + 4, row_offset);
+    write_u32(cp + 8, (uint32_t)(chunk_offset >> 32));
+    write_u32(cp + 12, (uint32_t)chunk_offset);
+    write_u32(cp + 16, ctx->current_chunk.length - ctx->cur_chunk_bytes_left - zstream->avail_in);
+    cp[20] = ri->filter;
+    cp[21] = zstream->data_type & 7; /* unused bits of the last input byte */
+    cp[22] = ctx->index_last_in;
+    cp[23] = 0;
+    write_u32(cp + 24, window_len);
+
+    cp += SPNG_CHECKPOINT_SIZE + window_len;
+
+    memcpy(cp, ctx->prev_scanline, prev_size);
+    memcpy(cp + prev_size, ctx->scanline, row_offset);
+
+    ctx->index_len += SPNG_CHECKPOINT_SIZE + window_len + prev_size + row_offset;
+    ctx->index_count++;
+
+    if(ctx->index_interval > UINT32_MAX - row) ctx->index_next_row = UINT32_MAX;
+    else ctx->index_next_row = row + ctx->index_interval;
+
+    return 0;
+#else
+    (void)ctx;
+    return SPNG_EINTERNAL;
+#endif
 }
 
 static int read_scanline_bytes(spng_ctx *ctx, unsigned char *dest, size_t len)
@@ -1395,23 +1767,51 @@ static int read_scanline_bytes(spng_ctx *ctx, unsigned char *dest, size_t len)
 
     z_stream *zstream = &ctx->zstream;
 
-    zstream->avail_out = (uInt)len;
-    zstream->next_out = dest;
+    /* Stop at the end of each deflate block to look for checkpoints */
+    const int flush = ctx->decode_flags.build_index && dest == ctx->scanline ? Z_BLOCK : Z_NO_FLUSH;
+
+    if(ctx->resume_inflate) ctx->resume_inflate = 0; /* continue with the same *dest */
+    else
+    {
+        zstream->avail_out = (uInt)len;
+        zstream->next_out = dest;
+    }
 
     while(zstream->avail_out != 0)
     {
-        ret = inflate(zstream, Z_NO_FLUSH);
+        uInt avail_in = zstream->avail_in;
 
-        if(ret == Z_OK) continue;
+        ret = inflate(zstream, flush);
 
-        if(ret == Z_STREAM_END) /* Reached an end-marker */
+        if(flush == Z_BLOCK && ret == Z_OK)
+        {
+            if(zstream->avail_in != avail_in) ctx->index_last_in = zstream->next_in[-1];
+
+            /* At a block boundary and not after the last block */
+            if((zstream->data_type & 192) == 128 && ctx->row_info.scanline_idx >= ctx->index_next_row)
+            {
+                ret = add_checkpoint(ctx);
+                if(ret) return ret;
+            }
+
+            continue;
+        }
+
+        if(ret == Z_OK) continue;
+
+        if(ret == Z_STREAM_END) /* Reached an end-marker */
         {
             if(zstream->avail_out != 0) return SPNG_EIDAT_TOO_SHORT;
         }
         else if(ret == Z_BUF_ERROR) /* Read more IDAT bytes */
         {
             ret = read_idat_bytes(ctx, &bytes_read);
-            if(ret) return ret;
+            if(ret)
+            {
+                if(ret == SPNG_EAGAIN) ctx->resume_inflate = 1;
+
+                return ret;
+            }
 
             zstream->avail_in = bytes_read;
             zstream->next_in = ctx->data;
@@ -1422,6 +1822,426 @@ static int read_scanline_bytes(spng_ctx *ctx, unsigned char *dest, size_t len)
     return 0;
 }
 
+static int buffer_read_fn(spng_ctx *ctx, void *user, void *data, size_t n);
+static int file_read_fn(spng_ctx *ctx, void *user, void *data, size_t n);
+
+/* Continue reading the PNG at offset, *seekable is set to zero for inputs without random access
+   such as pipes, the input is left where it was */
+static int seek_input(spng_ctx *ctx, uint64_t offset, int *seekable)
+{
+    *seekable = 1;
+
+    if(ctx->read_fn == buffer_read_fn)
+    {
+        if(offset > ctx->data_size) return SPNG_EINDEX;
+
+        ctx->data = ctx->png_base + offset;
+        ctx->last_read_size = 0;
+        ctx->bytes_left = ctx->data_size - (size_t)offset;
+    }
+    else if(ctx->read_fn == file_read_fn)
+    {
+        /* Relative to the current position, the PNG may not start at the beginning of the file */
+        int64_t diff = (int64_t)offset - (int64_t)ctx->bytes_read;
+
+        if(offset > INT64_MAX || diff > LONG_MAX || diff < LONG_MIN) return SPNG_IO_ERROR;
+
+        if(fseek(ctx->stream_user_ptr, (long)diff, SEEK_CUR))
+        {
+            *seekable = 0;
+            return 0;
+        }
+    }
+    else
+    {
+        *seekable = 0;
+        return 0;
+    }
+
+    ctx->bytes_read = (size_t)offset;
+
+    return 0;
+}
+
+/* Record the rest of the current chunk as a zlib stream beginning with the start_len bytes at start,
+   buffer and seekable file inputs are read again when the data is accessed, pipes and other streams
+   keep a copy */
+static int defer_inflate(spng_ctx *ctx, struct spng__zdata *zd, const unsigned char *start, uint32_t start_len)
+{
+    int ret, seekable;
+
+    zd->offset = ctx->bytes_read - start_len;
+    zd->length = start_len + ctx->cur_chunk_bytes_left;
+
+    if(!zd->length) return SPNG_EZLIB;
+
+    seekable = ctx->read_fn == buffer_read_fn;
+
+    if(ctx->read_fn == file_read_fn)
+    {/* Seeking to the current position tells whether the chunk can be read again later */
+        ret = seek_input(ctx, ctx->bytes_read, &seekable);
+        if(ret) return ret;
+    }
+
+    if(seekable)
+    {
+        ret = discard_chunk_bytes(ctx, ctx->cur_chunk_bytes_left);
+        if(ret) return ret;
+    }
+    else
+    {
+        if(increase_cache_usage(ctx, zd->length, 0)) return SPNG_ECHUNK_LIMITS;
+
+        zd->copy = spng__malloc(ctx, zd->length);
+        if(zd->copy == NULL) return SPNG_EMEM;
+
+        if(start_len) memcpy(zd->copy, start, start_len);
+
+        if(ctx->cur_chunk_bytes_left)
+        {
+            ret = read_chunk_bytes2(ctx, zd->copy + start_len, ctx->cur_chunk_bytes_left);
+            if(ret) return ret;
+        }
+    }
+
+    zd->pending = 1;
+
+    return 0;
+}
+
+/* Free the compressed copy of deferred data, returns the number of bytes released from the cache */
+static size_t release_deferred(spng_ctx *ctx, struct spng__zdata *zd)
+{
+    size_t released = 0;
+
+    if(zd->copy != NULL)
+    {
+        released = zd->length;
+        decrease_cache_usage(ctx, released);
+
+        spng__free(ctx, zd->copy);
+        zd->copy = NULL;
+    }
+
+    zd->pending = 0;
+
+    return released;
+}
+
+/* Inflate deferred data to *out leaving "extra" bytes at the end, final buffer length is *len.
+
+   The output is sized from a hint and grown as needed: with icc_size set the stream starts with
+   the size of an ICC profile, otherwise text is assumed to compress to a quarter of its size.
+   Takes into account the chunk size and cache limits.
+*/
+static int inflate_deferred(spng_ctx *ctx, struct spng__zdata *zd, char **out, size_t *len, size_t extra, int icc_size)
+{
+    int ret, seekable;
+    size_t max = ctx->chunk_cache_limit - ctx->chunk_cache_usage;
+
+    if(ctx->max_chunk_size < max) max = ctx->max_chunk_size;
+
+    if(extra > max) return SPNG_ECHUNK_LIMITS;
+    max -= extra;
+
+    if(max < 4) return SPNG_ECHUNK_LIMITS;
+
+    z_stream *stream = &ctx->text_zstream;
+
+    if(stream->state == NULL)
+    {
+        stream->zalloc = spng__zalloc;
+        stream->zfree = spng__zfree;
+        stream->opaque = ctx;
+
+        if(inflateInit(stream) != Z_OK) return SPNG_EZLIB_INIT;
+    }
+    else if(inflateReset(stream) != Z_OK) return SPNG_EZLIB_INIT;
+
+#if ZLIB_VERNUM >= 0x1290 && !defined(SPNG_USE_MINIZ)
+    int validate = !(ctx->flags & SPNG_CTX_IGNORE_ADLER32) && ctx->crc_action_ancillary != SPNG_CRC_USE;
+
+    if(inflateValidate(stream, validate)) return SPNG_EZLIB_INIT;
+#endif
+
+    unsigned char head[4];
+    unsigned char *scratch = NULL;
+    const unsigned char *in = zd->copy;
+    size_t saved_pos = ctx->bytes_read;
+    uint32_t remaining = 0;
+    char *t, *buf = NULL;
+    size_t size, total = 0;
+
+    if(in == NULL && ctx->read_fn == buffer_read_fn)
+    {
+        if(zd->offset > ctx->data_size || zd->length > ctx->data_size - zd->offset) return SPNG_EINTERNAL;
+
+        in = ctx->png_base + zd->offset;
+    }
+
+    if(in != NULL)
+    {
+        stream->next_in = in;
+        stream->avail_in = zd->length;
+    }
+    else /* Read the chunk data again, the file position is restored at the end */
+    {
+        scratch = spng__malloc(ctx, SPNG_READ_SIZE);
+        if(scratch == NULL) return SPNG_EMEM;
+
+        stream->next_in = NULL;
+        stream->avail_in = 0;
+
+        remaining = zd->length;
+
+        ret = seek_input(ctx, zd->offset, &seekable);
+        if(!ret && !seekable) ret = SPNG_IO_ERROR;
+        if(ret) goto cleanup;
+    }
+
+    if(icc_size)
+    {
+        size = 4;
+        stream->next_out = head;
+    }
+    else
+    {
+        size = zd->length < max / 4 ? (size_t)zd->length * 4 : max;
+
+        buf = spng__malloc(ctx, size + extra);
+        if(buf == NULL) goto mem;
+
+        stream->next_out = (unsigned char*)buf;
+    }
+
+    stream->avail_out = (uInt)size;
+
+    ret = Z_OK;
+
+    while(ret != Z_STREAM_END)
+    {
+        ret = inflate(stream, Z_NO_FLUSH);
+
+        if(ret == Z_STREAM_END) break;
+
+        if(ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            ret = SPNG_EZLIB;
+            goto cleanup;
+        }
+
+        if(!stream->avail_in && remaining)
+        {
+            uint32_t read_size = remaining < SPNG_READ_SIZE ? remaining : SPNG_READ_SIZE;
+
+            ret = ctx->read_fn(ctx, ctx->stream_user_ptr, scratch, read_size);
+
+            if(ret)
+            {
+                if(ret > 0 || ret < SPNG_IO_ERROR) ret = SPNG_IO_ERROR;
+
+                goto cleanup;
+            }
+
+            ctx->bytes_read += read_size;
+            remaining -= read_size;
+
+            stream->next_in = scratch;
+            stream->avail_in = read_size;
+        }
+        else if(!stream->avail_out)
+        {
+            if(buf == NULL) /* Allocate the profile size from the header */
+            {/* The header is untrusted, it is limited by the maximum deflate ratio and a fixed size,
+                larger profiles grow the buffer as it fills up */
+                size = read_u32(head);
+
+                if(size > SPNG_ICC_HINT_MAX) size = SPNG_ICC_HINT_MAX;
+                if(size / 1032 > zd->length) size = (size_t)zd->length * 1032;
+                if(size < 4) size = 4;
+                if(size > max) size = max;
+
+                buf = spng__malloc(ctx, size + extra);
+                if(buf == NULL) goto mem;
+
+                memcpy(buf, head, 4);
+
+                stream->next_out = (unsigned char*)buf + 4;
+                stream->avail_out = (uInt)(size - 4);
+            }
+            else /* The hint was too small */
+            {
+                if(size == max)
+                {
+                    ret = SPNG_ECHUNK_LIMITS;
+                    goto cleanup;
+                }
+
+                size_t new_size = size > max / 2 ? max : size * 2;
+
+                t = spng__realloc(ctx, buf, new_size + extra);
+                if(t == NULL) goto mem;
+
+                buf = t;
+
+                stream->next_out = (unsigned char*)buf + size;
+                stream->avail_out = (uInt)(new_size - size);
+
+                size = new_size;
+            }
+        }
+        else if(!stream->avail_in)
+        {
+            ret = SPNG_EZLIB;
+            goto cleanup;
+        }
+    }
+
+    total = stream->total_out;
+
+    if(!total)
+    {
+        ret = SPNG_EZLIB;
+        goto cleanup;
+    }
+
+    if(buf == NULL) /* Shorter than the profile header */
+    {
+        buf = spng__malloc(ctx, total + extra);
+        if(buf == NULL) goto mem;
+
+        memcpy(buf, head, total);
+    }
+    else if(total != size)
+    {
+        t = spng__realloc(ctx, buf, total + extra);
+        if(t == NULL) goto mem;
+
+        buf = t;
+    }
+
+    total += extra;
+    ret = 0;
+
+    goto cleanup;
+
+mem:
+    ret = SPNG_EMEM;
+cleanup:
+    if(scratch != NULL)
+    {
+        int seek_ret = seek_input(ctx, saved_pos, &seekable);
+        if(!seek_ret && !seekable) seek_ret = SPNG_IO_ERROR;
+        if(!ret) ret = seek_ret;
+
+        spng__free(ctx, scratch);
+    }
+
+    if(ret)
+    {
+        spng__free(ctx, buf);
+        return ret;
+    }
+
+    (void)increase_cache_usage(ctx, total, 0);
+
+    *out = buf;
+    *len = total;
+
+    return 0;
+}
+
+/* Continue decoding from the last checkpoint before the crop rectangle,
+   *restored is set to zero if decoding starts from the first scanline */
+static int restore_checkpoint(spng_ctx *ctx, int *restored)
+{
+    *restored = 0;
+
+#if defined(SPNG_INFLATE_INDEX)
+    int ret, seekable;
+    z_stream *zstream = &ctx->zstream;
+    struct spng_row_info *ri = &ctx->row_info;
+    const size_t scanline_width = ctx->subimage[0].scanline_width;
+    const unsigned char *cp = NULL, *p = ctx->index_buf, *end = ctx->index_buf + ctx->index_len;
+
+    while(p < end)
+    {
+        uint32_t row = read_u32(p);
+
+        if(row > ctx->crop_y) break;
+
+        cp = p;
+        p += SPNG_CHECKPOINT_SIZE + read_u32(p + 24) + (row ? scanline_width - 1 : 0) + read_u32(p + 4);
+    }
+
+    if(cp == NULL) return 0;
+
+    uint32_t row = read_u32(cp);
+    uint32_t row_offset = read_u32(cp + 4);
+    uint64_t chunk_offset = (uint64_t)read_u32(cp + 8) << 32 | read_u32(cp + 12);
+    uint32_t data_offset = read_u32(cp + 16);
+    unsigned filter = cp[20], bits = cp[21], prime = cp[22];
+    uint32_t window_len = read_u32(cp + 24);
+    size_t len = row == ctx->ihdr.height - 1 ? scanline_width - 1 : scanline_width;
+
+    if(row_offset > len || chunk_offset > UINT64_MAX - ctx->first_idat.offset - 8) return SPNG_EINDEX;
+
+    uint64_t chunk_start = ctx->first_idat.offset + chunk_offset;
+
+    ret = seek_input(ctx, chunk_start, &seekable);
+    if(ret || !seekable) return ret;
+
+    /* Read the chunk header, the chunk's crc can't be checked */
+    ret = read_data(ctx, 8);
+    if(ret) return ret;
+
+    struct spng_chunk chunk = { .offset = (size_t)chunk_start, .length = read_u32(ctx->data) };
+
+    memcpy(&chunk.type, ctx->data + 4, 4);
+
+    if(memcmp(chunk.type, type_idat, 4) || chunk.length > spng_u32max || data_offset > chunk.length) return SPNG_EINDEX;
+
+    ret = seek_input(ctx, chunk_start + 8 + data_offset, &seekable);
+    if(ret) return ret;
+    if(!seekable) return SPNG_IO_ERROR;
+
+    ctx->current_chunk = chunk;
+    ctx->cur_chunk_bytes_left = chunk.length - data_offset;
+    ctx->skip_crc = 1;
+
+    if(inflateReset2(zstream, -15) != Z_OK) return SPNG_EZLIB;
+    if(bits && inflatePrime(zstream, bits, prime >> (8 - bits)) != Z_OK) return SPNG_EZLIB;
+    if(inflateSetDictionary(zstream, cp + SPNG_CHECKPOINT_SIZE, window_len) != Z_OK) return SPNG_EZLIB;
+
+    zstream->avail_in = 0;
+
+    cp += SPNG_CHECKPOINT_SIZE + window_len;
+
+    if(row)
+    {
+        memcpy(ctx->prev_scanline, cp, scanline_width - 1);
+        cp += scanline_width - 1;
+    }
+
+    memcpy(ctx->scanline, cp, row_offset);
+
+    /* The first read_scanline() continues the checkpoint's scanline */
+    zstream->next_out = ctx->scanline + row_offset;
+    zstream->avail_out = (uInt)(len - row_offset);
+    ctx->resume_inflate = 1;
+
+    ri->scanline_idx = row;
+    ri->row_num = row;
+    ri->filter = filter;
+
+    *restored = 1;
+#else
+    (void)ctx;
+#endif
+
+    return 0;
+}
+
 static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
 {
     int16_t p = a + b - c;
@@ -1450,17 +2270,31 @@ static void defilter_up(size_t bytes, unsigned char *row, const unsigned char *p
    scanline_width is the width of the scanline including the filter byte.
 */
 static int defilter_scanline(const unsigned char *prev_scanline, unsigned char *scanline,
-                             size_t scanline_width, unsigned bytes_per_pixel, unsigned filter)
+                             size_t scanline_width, unsigned bytes_per_pixel, unsigned filter, int simd_level)
 {
     if(prev_scanline == NULL || scanline == NULL || !scanline_width) return SPNG_EINTERNAL;
 
     size_t i;
     scanline_width--;
 
+    (void)simd_level;
+
     if(filter == 0) return 0;
 
 #ifndef SPNG_DISABLE_OPT
-    if(filter == SPNG_FILTER_UP) goto no_opt;
+    if(simd_level == SPNG__SIMD_NONE) goto no_opt;
+
+#if defined(SPNG_X86_AVX)
+    /* The wider kernels only cover some filters, the rest use SSE */
+    if(simd_level >= SPNG__SIMD_AVX512 && defilter_avx512(scanline_width, scanline, prev_scanline, bytes_per_pixel, filter)) return 0;
+    if(simd_level >= SPNG__SIMD_AVX2 && defilter_avx2(scanline_width, scanline, prev_scanline, bytes_per_pixel, filter)) return 0;
+#endif
+
+    if(filter == SPNG_FILTER_UP)
+    {
+        defilter_up_simd(scanline_width, scanline, prev_scanline);
+        return 0;
+    }
 
     if(bytes_per_pixel == 4)
     {
@@ -1486,55 +2320,91 @@ static int defilter_scanline(const unsigned char *prev_scanline, unsigned char *
 
         return 0;
     }
-no_opt:
-#endif
-
-    if(filter == SPNG_FILTER_UP)
+    else if(bytes_per_pixel == 8)
     {
-        defilter_up(scanline_width, scanline, prev_scanline);
+        if(filter == SPNG_FILTER_SUB)
+            defilter_sub8(scanline_width, scanline);
+        else if(filter == SPNG_FILTER_AVERAGE)
+            defilter_avg8(scanline_width, scanline, prev_scanline);
+        else if(filter == SPNG_FILTER_PAETH)
+            defilter_paeth8(scanline_width, scanline, prev_scanline);
+        else return SPNG_EFILTER;
+
         return 0;
     }
-
-    for(i=0; i < scanline_width; i++)
+    else if(bytes_per_pixel == 6)
     {
-        uint8_t x, a, b, c;
+        if(filter == SPNG_FILTER_SUB)
+            defilter_sub6(scanline_width, scanline);
+        else if(filter == SPNG_FILTER_AVERAGE)
+            defilter_avg6(scanline_width, scanline, prev_scanline);
+        else if(filter == SPNG_FILTER_PAETH)
+            defilter_paeth6(scanline_width, scanline, prev_scanline);
+        else return SPNG_EFILTER;
 
-        if(i >= bytes_per_pixel)
-        {
-            a = scanline[i - bytes_per_pixel];
-            b = prev_scanline[i];
-            c = prev_scanline[i - bytes_per_pixel];
-        }
-        else /* First pixel in row */
-        {
-            a = 0;
-            b = prev_scanline[i];
-            c = 0;
-        }
+        return 0;
+    }
+    /* Avg and Paeth depend on the previous byte at 1 and 2 bytes per pixel,
+       only Sub can be computed in parallel with a prefix sum */
+    else if(bytes_per_pixel == 2 && filter == SPNG_FILTER_SUB)
+    {
+        defilter_sub2(scanline_width, scanline);
+        return 0;
+    }
+    else if(bytes_per_pixel == 1 && filter == SPNG_FILTER_SUB)
+    {
+        defilter_sub1(scanline_width, scanline);
+        return 0;
+    }
+no_opt:
+#endif
 
-        x = scanline[i];
+    if(filter == SPNG_FILTER_UP)
+    {
+        defilter_up(scanline_width, scanline, prev_scanline);
+        return 0;
+    }
 
-        switch(filter)
+    /* The first pixel has no left neighbor, a and c are zero */
+    size_t first = bytes_per_pixel < scanline_width ? bytes_per_pixel : scanline_width;
+
+    switch(filter)
+    {
+        case SPNG_FILTER_SUB:
         {
-            case SPNG_FILTER_SUB:
+            for(i=first; i < scanline_width; i++)
             {
-                x = x + a;
-                break;
+                scanline[i] += scanline[i - bytes_per_pixel];
             }
-            case SPNG_FILTER_AVERAGE:
+            break;
+        }
+        case SPNG_FILTER_AVERAGE:
+        {
+            for(i=0; i < first; i++)
             {
-                uint16_t avg = (a + b) / 2;
-                x = x + avg;
-                break;
+                scanline[i] += prev_scanline[i] / 2;
             }
-            case SPNG_FILTER_PAETH:
+
+            for(; i < scanline_width; i++)
             {
-                x = x + paeth(a,b,c);
-                break;
+                scanline[i] += (scanline[i - bytes_per_pixel] + prev_scanline[i]) / 2;
             }
+            break;
         }
+        case SPNG_FILTER_PAETH:
+        {
+            for(i=0; i < first; i++)
+            {
+                scanline[i] += prev_scanline[i];
+            }
 
-        scanline[i] = x;
+            for(; i < scanline_width; i++)
+            {
+                scanline[i] += paeth(scanline[i - bytes_per_pixel], prev_scanline[i], prev_scanline[i - bytes_per_pixel]);
+            }
+            break;
+        }
+        default: return SPNG_EFILTER;
     }
 
     return 0;
@@ -1703,6 +2573,135 @@ static unsigned get_best_filter(const unsigned char *prev_scanline, const unsign
     return best_filter;
 }
 
+#ifndef SPNG_DISABLE_OPT
+/* Same as the per-byte score in filter_sum() */
+static unsigned filter_cost(uint8_t x)
+{
+    return x < 128 ? x : 256 - x;
+}
+
+/* Filters bytes [start, end) with all filter types, rows are laid out as in filter_candidates() */
+static void filter_candidates_scalar(unsigned char *rows, size_t stride, const unsigned char *prev_scanline,
+                                     const unsigned char *scanline, size_t start, size_t end,
+                                     unsigned bytes_per_pixel, uint64_t scores[5])
+{
+    size_t i;
+    for(i=start; i < end; i++)
+    {
+        uint8_t x, a = 0, b, c = 0;
+
+        if(i >= bytes_per_pixel)
+        {
+            a = scanline[i - bytes_per_pixel];
+            c = prev_scanline[i - bytes_per_pixel];
+        }
+
+        b = prev_scanline[i];
+        x = scanline[i];
+
+        uint8_t sub = x - a;
+        uint8_t up = x - b;
+        uint8_t avg = x - (a + b) / 2;
+        uint8_t pae = x - paeth(a, b, c);
+
+        rows[i] = sub;
+        rows[stride + i] = up;
+        rows[stride * 2 + i] = avg;
+        rows[stride * 3 + i] = pae;
+
+        scores[0] += filter_cost(x);
+        scores[1] += filter_cost(sub);
+        scores[2] += filter_cost(up);
+        scores[3] += filter_cost(avg);
+        scores[4] += filter_cost(pae);
+    }
+}
+
+/* Filters the scanline with Sub, Up, Avg and Paeth in one pass,
+   filter type n is written to rows + (n - 1) * stride.
+   Scores are the same as filter_sum() for all five filter types,
+   Avg and Paeth may be skipped if they are not in choices. */
+static void filter_candidates(int simd_level, int choices, unsigned char *rows, size_t stride, const unsigned char *prev_scanline,
+                              const unsigned char *scanline, size_t size, unsigned bytes_per_pixel, uint64_t scores[5])
+{
+    /* The SIMD functions start after the first pixel */
+    size_t i = size < bytes_per_pixel ? size : bytes_per_pixel;
+
+    memset(scores, 0, 5 * sizeof(uint64_t));
+
+    filter_candidates_scalar(rows, stride, prev_scanline, scanline, 0, i, bytes_per_pixel, scores);
+
+#if defined(SPNG_X86_AVX)
+    if(simd_level >= SPNG__SIMD_AVX2 && !(choices & (SPNG_FILTER_CHOICE_AVG | SPNG_FILTER_CHOICE_PAETH)))
+        i = filter_sub_up_avx2(rows, stride, prev_scanline, scanline, i, size, bytes_per_pixel, scores);
+
+    if(simd_level >= SPNG__SIMD_AVX2)
+        i = filter_candidates_avx2(rows, stride, prev_scanline, scanline, i, size, bytes_per_pixel, scores);
+#endif
+
+#if defined(SPNG_X86)
+    i = filter_candidates_sse2(rows, stride, prev_scanline, scanline, i, size, bytes_per_pixel, scores);
+#elif defined(SPNG_ARM)
+    i = filter_candidates_neon(rows, stride, prev_scanline, scanline, i, size, bytes_per_pixel, scores);
+#endif
+
+    (void)simd_level;
+    (void)choices;
+
+    filter_candidates_scalar(rows, stride, prev_scanline, scanline, i, size, bytes_per_pixel, scores);
+}
+#endif
+
+/* Chooses a filter type with the same heuristic as get_best_filter() and filters the scanline,
+   *scratch must be at least 4 * scanline_width bytes.
+   If a filter is chosen *filtered points to the filtered pixels in *scratch, with room for the filter byte at [-1]. */
+static int filter_scanline_best(spng_ctx *ctx, int choices, unsigned char *scratch, const unsigned char *prev_scanline,
+                                const unsigned char *scanline, size_t scanline_width,
+                                unsigned *filter, unsigned char **filtered)
+{
+    *filter = SPNG_FILTER_NONE;
+    *filtered = NULL;
+
+    if(!choices) return 0;
+
+    unsigned char *rows = scratch + 1;
+
+#ifndef SPNG_DISABLE_OPT
+    /* Single choices are not scored, rows this wide would overflow filter_sum() */
+    if(ctx->simd_level && (choices & (choices - 1)) && (scanline_width - 1) <= (INT32_MAX / 128))
+    {
+        int i;
+        uint64_t scores[5], best_score = UINT64_MAX;
+
+        filter_candidates(ctx->simd_level, choices, rows, scanline_width, prev_scanline, scanline,
+                          scanline_width - 1, ctx->bytes_per_pixel, scores);
+
+        for(i=0; i < 5; i++)
+        {
+            if(!(choices & (1 << (i + 3)))) continue;
+
+            if(scores[i] < best_score)
+            {
+                best_score = scores[i];
+                *filter = i;
+            }
+        }
+
+        if(*filter) *filtered = rows + (*filter - 1) * scanline_width;
+
+        return 0;
+    }
+#endif
+
+    *filter = get_best_filter(prev_scanline, scanline, scanline_width, ctx->bytes_per_pixel, choices);
+
+    if(!*filter) return 0;
+
+    *filtered = rows;
+
+    return filter_scanline(rows, prev_scanline, scanline, scanline_width, ctx->bytes_per_pixel, *filter);
+}
+
 /* Scale "sbits" significant bits in "sample" from "bit_depth" to "target"
 
    "bit_depth" must be a valid PNG depth
@@ -1787,7 +2786,7 @@ static inline void trns_row(unsigned char *row,
                             const unsigned char *scanline,
                             const unsigned char *trns,
                             unsigned scanline_stride,
-                            struct spng_ihdr *ihdr,
+                            const struct spng_ihdr *ihdr,
                             uint32_t pixels,
                             int fmt)
 {
@@ -1924,23 +2923,45 @@ static inline void scale_row(unsigned char *row, uint32_t pixels, int fmt, unsig
     }
 }
 
-/* Expand to *row using 8-bit palette indices from *scanline */
+/* Expand to *row using 8-bit palette indices from *scanline,
+   indices are less than 2^bit_depth and may be stored at the end of *row */
 static void expand_row(unsigned char *row,
                        const unsigned char *scanline,
                        const union spng__decode_plte *decode_plte,
                        uint32_t width,
-                       int fmt)
+                       int fmt,
+                       unsigned bit_depth,
+                       int simd_level)
 {
     uint32_t i = 0;
     unsigned char *px;
     unsigned char entry;
     const struct spng_plte_entry *plte = decode_plte->rgba;
 
+    (void)bit_depth;
+    (void)simd_level;
+
+#if defined(SPNG_X86) && defined(SPNG_SSE) && (SPNG_SSE >= 3)
+    if(simd_level && bit_depth <= 4)
+    {
+        if(fmt == SPNG_FMT_RGBA8) i = expand_palette16_rgba8_ssse3(row, scanline, decode_plte->raw, width);
+        else if(fmt == SPNG_FMT_RGB8) i = expand_palette16_rgb8_ssse3(row, scanline, decode_plte->raw, width);
+    }
+#endif
+
+#if defined(SPNG_X86_AVX)
+    if(simd_level >= SPNG__SIMD_AVX2 && !i)
+    {
+        if(fmt == SPNG_FMT_RGBA8) i = expand_palette_rgba8_avx2(row, scanline, decode_plte->raw, width);
+        else if(fmt == SPNG_FMT_RGB8) i = expand_palette_rgb8_avx2(row, scanline, decode_plte->raw, width);
+    }
+#endif
+
 #if defined(SPNG_ARM)
-    if(fmt == SPNG_FMT_RGBA8) i = expand_palette_rgba8_neon(row, scanline, decode_plte->raw, width);
+    if(fmt == SPNG_FMT_RGBA8 && simd_level) i = expand_palette_rgba8_neon(row, scanline, decode_plte->raw, width);
     else if(fmt == SPNG_FMT_RGB8)
     {
-        i = expand_palette_rgb8_neon(row, scanline, decode_plte->raw, width);
+        if(simd_level) i = expand_palette_rgb8_neon(row, scanline, decode_plte->raw, width);
 
         for(; i < width; i++)
         {/* In this case the LUT is 3 bytes packed */
@@ -2186,6 +3207,19 @@ static int check_offs(const struct spng_offs *offs)
     return 0;
 }
 
+static int check_fctl(const struct spng_fctl *fctl, const struct spng_ihdr *ihdr)
+{
+    if(fctl == NULL) return 1;
+
+    if(!fctl->width || !fctl->height) return 1;
+    if(fctl->x_offset > ihdr->width || fctl->width > ihdr->width - fctl->x_offset) return 1;
+    if(fctl->y_offset > ihdr->height || fctl->height > ihdr->height - fctl->y_offset) return 1;
+    if(fctl->dispose_op > SPNG_DISPOSE_OP_PREVIOUS) return 1;
+    if(fctl->blend_op > SPNG_BLEND_OP_OVER) return 1;
+
+    return 0;
+}
+
 static int check_exif(const struct spng_exif *exif)
 {
     if(exif == NULL) return 1;
@@ -2259,6 +3293,8 @@ static int is_small_chunk(uint8_t type[4])
     else if(!memcmp(type, type_phys, 4)) return 1;
     else if(!memcmp(type, type_time, 4)) return 1;
     else if(!memcmp(type, type_offs, 4)) return 1;
+    else if(!memcmp(type, type_actl, 4)) return 1;
+    else if(!memcmp(type, type_fctl, 4)) return 1;
     else return 0;
 }
 
@@ -2331,16 +3367,92 @@ static void text_undo(spng_ctx *ctx)
 
     spng__free(ctx, text->keyword);
     if(text->compression_flag) spng__free(ctx, text->text);
+    spng__free(ctx, text->zdata.copy);
 
     decrease_cache_usage(ctx, text->cache_usage);
     decrease_cache_usage(ctx, sizeof(struct spng_text2));
 
     text->keyword = NULL;
     text->text = NULL;
+    text->zdata.copy = NULL;
 
     ctx->n_text--;
 }
 
+static int inflate_iccp(spng_ctx *ctx)
+{
+    if(!ctx->iccp_zdata.pending) return 0;
+
+    int ret = inflate_deferred(ctx, &ctx->iccp_zdata, &ctx->iccp.profile, &ctx->iccp.profile_len, 0, 1);
+
+    /* Other errors may not happen on a later call */
+    if(ret && ret != SPNG_EZLIB) return ret;
+
+    release_deferred(ctx, &ctx->iccp_zdata);
+
+    if(ret && !ctx->strict) ctx->stored.iccp = 0;
+
+    return ret;
+}
+
+static int inflate_text(spng_ctx *ctx, struct spng_text2 *text)
+{
+    if(!text->zdata.pending) return 0;
+
+    int ret = inflate_deferred(ctx, &text->zdata, &text->text, &text->text_length, 1, 0);
+
+    if(ret && ret != SPNG_EZLIB) return ret;
+
+    text->cache_usage -= release_deferred(ctx, &text->zdata);
+
+    if(ret) return ret;
+
+    text->text[text->text_length - 1] = '\0';
+    text->cache_usage += text->text_length;
+
+    text->text_length = strlen(text->text);
+
+    if(text->type == SPNG_ZTXT && ctx->strict && check_png_text(text->text, text->text_length)) return SPNG_EZTXT;
+
+    return 0;
+}
+
+/* Inflate the compressed text chunks that were not accessed yet,
+   invalid streams are dropped like they would be while reading chunks */
+static int inflate_text_list(spng_ctx *ctx)
+{
+    uint32_t i = 0;
+
+    while(i < ctx->n_text)
+    {
+        struct spng_text2 *text = &ctx->text_list[i];
+
+        int ret = inflate_text(ctx, text);
+
+        if(!ret)
+        {
+            i++;
+            continue;
+        }
+
+        if(ctx->strict || ret != SPNG_EZLIB) return ret;
+
+        spng__free(ctx, text->keyword);
+        spng__free(ctx, text->text);
+
+        decrease_cache_usage(ctx, text->cache_usage);
+        decrease_cache_usage(ctx, sizeof(struct spng_text2));
+
+        ctx->n_text--;
+
+        memmove(text, text + 1, (ctx->n_text - i) * sizeof(struct spng_text2));
+    }
+
+    if(!ctx->n_text) ctx->stored.text = 0;
+
+    return 0;
+}
+
 static void chunk_undo(spng_ctx *ctx)
 {
     struct spng_unknown_chunk *chunk = &ctx->chunk_list[ctx->n_chunks - 1];
@@ -2355,15 +3467,78 @@ static void chunk_undo(spng_ctx *ctx)
     ctx->n_chunks--;
 }
 
+/* Ancillary chunks not listed with spng_set_chunk_filter() are skipped,
+   fcTL and fdAT are kept with acTL */
+static int keep_chunk(spng_ctx *ctx, struct spng_chunk *chunk)
+{
+    if(!ctx->filter_chunks || is_critical_chunk(chunk)) return 1;
+
+    const uint8_t *type = chunk->type;
+
+    if(!memcmp(type, type_fctl, 4) || !memcmp(type, type_fdat, 4)) type = type_actl;
+
+    uint32_t i, key = read_u32(type);
+
+    for(i=0; i < ctx->n_keep_chunks; i++)
+    {
+        if(ctx->keep_chunks[i] == key) return 1;
+    }
+
+    return 0;
+}
+
+/* Skip the rest of the current chunk without checking its crc,
+   buffer and file inputs seek past it, files that can't seek fall back to reading */
+static int skip_chunk(spng_ctx *ctx)
+{
+    int ret, seekable = 0;
+
+    ctx->skip_crc = 1;
+
+    /* Truncated buffers are left to the regular reader for the same error */
+    if(ctx->read_fn != buffer_read_fn || ctx->cur_chunk_bytes_left <= ctx->bytes_left)
+    {
+        ret = seek_input(ctx, (uint64_t)ctx->bytes_read + ctx->cur_chunk_bytes_left, &seekable);
+        if(ret) return ret;
+    }
+
+    if(seekable)
+    {
+        ctx->cur_chunk_bytes_left = 0;
+        return 0;
+    }
+
+    return discard_chunk_bytes(ctx, ctx->cur_chunk_bytes_left);
+}
+
+/* Frames can't be put together without each fcTL, the PNG is decoded as a static image
+   or the animation ends before the discarded chunk */
+static void apng_undo(spng_ctx *ctx)
+{
+    ctx->prev_stored.actl = 0;
+}
+
 static int read_non_idat_chunks(spng_ctx *ctx)
 {
     int ret;
     struct spng_chunk chunk;
     const unsigned char *data;
 
-    ctx->discard = 0;
-    ctx->undo = NULL;
-    ctx->prev_stored = ctx->stored;
+    if(ctx->feed_chunks)
+    {/* the previous chunk's crc is not checked yet */
+        ctx->feed_chunks = 0;
+
+        /* Continue discarding a streamed chunk */
+        ret = discard_chunk_bytes(ctx, ctx->cur_chunk_bytes_left);
+        if(ret == SPNG_EAGAIN) ctx->feed_chunks = 1;
+        if(ret) return ret;
+    }
+    else
+    {
+        ctx->discard = 0;
+        ctx->undo = NULL;
+        ctx->prev_stored = ctx->stored;
+    }
 
     while( !(ret = read_header(ctx)))
     {
@@ -2380,6 +3555,14 @@ static int read_non_idat_chunks(spng_ctx *ctx)
         ctx->prev_stored = ctx->stored;
         chunk = ctx->current_chunk;
 
+        if(!keep_chunk(ctx, &chunk))
+        {
+            ret = skip_chunk(ctx);
+            if(ret) break;
+
+            continue;
+        }
+
         if(!memcmp(chunk.type, type_idat, 4))
         {
             if(ctx->state < SPNG_STATE_FIRST_IDAT)
@@ -2685,6 +3868,61 @@ static int read_non_idat_chunks(spng_ctx *ctx)
             ctx->file.offs = 1;
             ctx->stored.offs = 1;
         }
+        else if(!memcmp(chunk.type, type_actl, 4))
+        {
+            if(ctx->state == SPNG_STATE_AFTER_IDAT) return SPNG_ECHUNK_POS;
+            if(ctx->file.actl) return SPNG_EACTL;
+
+            if(chunk.length != 8) return SPNG_ECHUNK_SIZE;
+
+            ctx->actl.num_frames = read_u32(data);
+            ctx->actl.num_plays = read_u32(data + 4);
+
+            if(!ctx->actl.num_frames || ctx->actl.num_frames > spng_u32max) return SPNG_EACTL;
+            if(ctx->actl.num_plays > spng_u32max) return SPNG_EACTL;
+
+            ctx->file.actl = 1;
+            ctx->stored.actl = 1;
+        }
+        else if(!memcmp(chunk.type, type_fctl, 4))
+        {
+            if(chunk.length != 26) return SPNG_ECHUNK_SIZE;
+
+            /* Frames after the default image are only read by spng_decode_frame() */
+            if(ctx->stored.actl && (ctx->state < SPNG_STATE_FIRST_IDAT || ctx->apng_frames))
+            {
+                struct spng_fctl fctl;
+
+                ctx->undo = apng_undo;
+
+                fctl.sequence_number = read_u32(data);
+                fctl.width = read_u32(data + 4);
+                fctl.height = read_u32(data + 8);
+                fctl.x_offset = read_u32(data + 12);
+                fctl.y_offset = read_u32(data + 16);
+                fctl.delay_num = read_u16(data + 20);
+                fctl.delay_den = read_u16(data + 22);
+                fctl.dispose_op = data[24];
+                fctl.blend_op = data[25];
+
+                if(check_fctl(&fctl, &ctx->ihdr)) return SPNG_EFCTL;
+                if(fctl.sequence_number != ctx->apng_seq) return SPNG_EFCTL;
+
+                if(ctx->state < SPNG_STATE_FIRST_IDAT)
+                {/* The default image is the first frame */
+                    if(ctx->file.fctl) return SPNG_EFCTL;
+                    if(fctl.x_offset || fctl.y_offset) return SPNG_EFCTL;
+                    if(fctl.width != ctx->ihdr.width || fctl.height != ctx->ihdr.height) return SPNG_EFCTL;
+                }
+
+                ctx->apng_seq++;
+                ctx->next_fctl = fctl;
+                ctx->fctl_pending = 1;
+
+                ctx->file.fctl = 1;
+                ctx->stored.fctl = 1;
+            }
+        }
         else /* Arbitrary-length chunk */
         {
 
@@ -2723,6 +3961,24 @@ static int read_non_idat_chunks(spng_ctx *ctx)
 
                 ctx->stored.exif = 1;
             }
+            else if(!memcmp(chunk.type, type_fdat, 4))
+            {
+                if(ctx->state < SPNG_STATE_FIRST_IDAT) return SPNG_ECHUNK_POS;
+                if(!ctx->stored.actl || !ctx->apng_frames) goto discard;
+
+                ret = read_fdat_sequence(ctx);
+                if(ret) return ret;
+
+                if(ctx->fctl_pending && ctx->frame_index < ctx->actl.num_frames)
+                {/* Image data of the next frame, read_idat_bytes() continues from here */
+                    ctx->fctl_pending = 0;
+                    ctx->next_frame = 1;
+
+                    return 0;
+                }
+
+                /* Otherwise the rest of the previous frame's image data */
+            }
             else if(!memcmp(chunk.type, type_iccp, 4))
             {/* TODO: add test file with color profile */
                 if(ctx->file.plte) return SPNG_ECHUNK_POS;
@@ -2752,10 +4008,15 @@ static int read_non_idat_chunks(spng_ctx *ctx)
 
                 if(ctx->data[keyword_len + 1] != 0) return SPNG_EICCP_COMPRESSION_METHOD;
 
-                ret = spng__inflate_stream(ctx, &ctx->iccp.profile, &ctx->iccp.profile_len, 0, ctx->data + keyword_len + 2, peek_bytes - (keyword_len + 2));
-
+                ret = defer_inflate(ctx, &ctx->iccp_zdata, ctx->data + keyword_len + 2, peek_bytes - (keyword_len + 2));
                 if(ret) return ret;
 
+                if(ctx->strict)
+                {
+                    ret = inflate_iccp(ctx);
+                    if(ret) return ret;
+                }
+
                 ctx->stored.iccp = 1;
             }
              else if(!memcmp(chunk.type, type_text, 4) ||
@@ -2860,7 +4121,8 @@ static int read_non_idat_chunks(spng_ctx *ctx)
 
                 if(text->compression_flag)
                 {
-                    /* cache usage = peek_bytes + decompressed text size + nul */
+                    /* cache usage = peek_bytes + decompressed text size + nul,
+                       the text is inflated on first access */
                     if(increase_cache_usage(ctx, peek_bytes, 0)) return SPNG_ECHUNK_LIMITS;
 
                     text->keyword = spng__calloc(ctx, 1, peek_bytes);
@@ -2868,14 +4130,21 @@ static int read_non_idat_chunks(spng_ctx *ctx)
 
                     memcpy(text->keyword, data, peek_bytes);
 
+                    text->cache_usage = peek_bytes;
+
                     zlib_stream = ctx->data + text_offset;
 
-                    ret = spng__inflate_stream(ctx, &text->text, &text->text_length, 1, zlib_stream, peek_bytes - text_offset);
+                    ret = defer_inflate(ctx, &text->zdata, zlib_stream, peek_bytes - text_offset);
+
+                    if(text->zdata.copy != NULL) text->cache_usage += text->zdata.length;
 
                     if(ret) return ret;
 
-                    text->text[text->text_length - 1] = '\0';
-                    text->cache_usage = text->text_length + peek_bytes;
+                    if(ctx->strict)
+                    {
+                        ret = inflate_text(ctx, text);
+                        if(ret) return ret;
+                    }
                 }
                 else
                 {
@@ -2898,12 +4167,12 @@ static int read_non_idat_chunks(spng_ctx *ctx)
 
                     text->text[text->text_length] = '\0';
                     text->cache_usage = chunk.length + 1;
+
+                    text->text_length = strlen(text->text);
                 }
 
                 if(check_png_keyword(text->keyword)) return SPNG_ETEXT_KEYWORD;
 
-                text->text_length = strlen(text->text);
-
                 if(text->type != SPNG_ITXT)
                 {
                     language_tag_offset = keyword_len;
@@ -3092,11 +4361,13 @@ static int read_non_idat_chunks(spng_ctx *ctx)
 
 discard:
             ret = discard_chunk_bytes(ctx, ctx->cur_chunk_bytes_left);
-            if(ret) return ret;
+            if(ret) break;
         }
 
     }
 
+    if(ret == SPNG_EAGAIN) ctx->feed_chunks = 1;
+
     return ret;
 }
 
@@ -3126,16 +4397,25 @@ static int read_chunks(spng_ctx *ctx, int only_ihdr)
 
     if(ctx->state == SPNG_STATE_EOI)
     {
+        /* With fed input end_of_idat() may have stopped before the end of the chunk */
+        ret = discard_chunk_bytes(ctx, ctx->cur_chunk_bytes_left);
+        if(ret) return decode_err(ctx, ret);
+
         ctx->state = SPNG_STATE_AFTER_IDAT;
         ctx->prev_was_idat = 1;
     }
 
+    /* Stopped at the next frame for spng_decode_frame() */
+    if(ctx->next_frame) return 0;
+
     while(ctx->state < SPNG_STATE_FIRST_IDAT || ctx->state == SPNG_STATE_AFTER_IDAT)
     {
         ret = read_non_idat_chunks(ctx);
 
         if(!ret)
         {
+            if(ctx->next_frame) return 0;
+
             if(ctx->state < SPNG_STATE_FIRST_IDAT) ctx->state = SPNG_STATE_FIRST_IDAT;
             else if(ctx->state == SPNG_STATE_AFTER_IDAT) ctx->state = SPNG_STATE_IEND;
         }
@@ -3185,6 +4465,8 @@ static int read_chunks(spng_ctx *ctx, int only_ihdr)
                 case SPNG_ETIME:
                 case SPNG_EOFFS:
                 case SPNG_EEXIF:
+                case SPNG_EACTL:
+                case SPNG_EFCTL:
                 case SPNG_EZLIB:
                 {
                     if(!ctx->strict && !is_critical_chunk(&ctx->current_chunk))
@@ -3223,6 +4505,16 @@ static int read_scanline(spng_ctx *ctx)
 
     uint8_t next_filter = 0;
 
+    if(ctx->filter_pending)
+    {
+        ret = read_scanline_bytes(ctx, &ri->filter, 1);
+        if(ret) return ret;
+
+        ctx->filter_pending = 0;
+
+        if(ri->filter > 4) return SPNG_EFILTER;
+    }
+
     if(scanline_idx == (sub[pass].height - 1) && ri->pass == ctx->last_pass)
     {
         ret = read_scanline_bytes(ctx, ctx->scanline, scanline_width - 1);
@@ -3246,7 +4538,7 @@ static int read_scanline(spng_ctx *ctx)
 
     if(ctx->ihdr.bit_depth == 16 && ctx->fmt != SPNG_FMT_RAW) u16_row_to_host(ctx->scanline, scanline_width - 1);
 
-    ret = defilter_scanline(ctx->prev_scanline, ctx->scanline, scanline_width, ctx->bytes_per_pixel, ri->filter);
+    ret = defilter_scanline(ctx->prev_scanline, ctx->scanline, scanline_width, ctx->bytes_per_pixel, ri->filter, ctx->simd_level);
     if(ret) return ret;
 
     ri->filter = next_filter;
@@ -3260,6 +4552,14 @@ static int update_row_info(spng_ctx *ctx)
     struct spng_row_info *ri = &ctx->row_info;
     const struct spng_subimage *sub = ctx->subimage;
 
+    if(ctx->decode_flags.stop_early && ri->pass == ctx->stop_pass && ri->scanline_idx == ctx->stop_scanline)
+    {/* The rest of the image data is skipped, the current chunk's crc can't be checked */
+        ctx->skip_crc = 1;
+        ctx->state = SPNG_STATE_EOI;
+
+        return SPNG_EOI;
+    }
+
     if(ri->scanline_idx == (sub[ri->pass].height - 1)) /* Last scanline */
     {
         if(ri->pass == ctx->last_pass)
@@ -3286,30 +4586,33 @@ static int update_row_info(spng_ctx *ctx)
     return 0;
 }
 
-int spng_decode_scanline(spng_ctx *ctx, void *out, size_t len)
+/* Called after the last scanline is read */
+static int end_of_idat(spng_ctx *ctx)
 {
-    if(ctx == NULL || out == NULL) return 1;
+    if(ctx->cur_chunk_bytes_left) /* zlib stream ended before an IDAT chunk boundary */
+    {/* Discard the rest of the chunk, with fed input read_chunks() discards what isn't available yet */
+        int ret = discard_chunk_bytes(ctx, ctx->cur_chunk_bytes_left);
+        if(ret && ret != SPNG_EAGAIN) return ret;
+    }
 
-    if(ctx->state >= SPNG_STATE_EOI) return SPNG_EOI;
+    ctx->last_idat = ctx->current_chunk;
 
-    struct decode_flags f = ctx->decode_flags;
+    return 0;
+}
 
-    struct spng_row_info *ri = &ctx->row_info;
-    const struct spng_subimage *sub = ctx->subimage;
+/* Per-pixel conversion for all combinations without a specialized kernel */
+static void convert_generic(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
+{
+    struct decode_flags f = ctx->decode_flags;
 
     const struct spng_ihdr *ihdr = &ctx->ihdr;
     const uint16_t *gamma_lut = ctx->gamma_lut;
-    unsigned char *trns_px = ctx->trns_px;
+    const unsigned char *trns_px = ctx->trns_px;
     const struct spng_sbit *sb = &ctx->decode_sb;
     const struct spng_plte_entry *plte = ctx->decode_plte.rgba;
-    struct spng__iter iter = spng__iter_init(ihdr->bit_depth, ctx->scanline);
-
-    const unsigned char *scanline;
+    struct spng__iter iter = spng__iter_init(ihdr->bit_depth, scanline);
 
-    const int pass = ri->pass;
     const int fmt = ctx->fmt;
-    const size_t scanline_width = sub[pass].scanline_width;
-    const uint32_t width = sub[pass].width;
     uint32_t k;
     uint8_t r_8, g_8, b_8, a_8, gray_8;
     uint16_t r_16, g_16, b_16, a_16, gray_16;
@@ -3325,14 +4628,6 @@ int spng_decode_scanline(spng_ctx *ctx, void *out, size_t len)
     if(fmt == SPNG_FMT_RGBA16) pixel_size = 8;
     else if(fmt == SPNG_FMT_RGB8) pixel_size = 3;
 
-    if(len < sub[pass].out_width) return SPNG_EBUFSIZ;
-
-    int ret = read_scanline(ctx);
-
-    if(ret) return decode_err(ctx, ret);
-
-    scanline = ctx->scanline;
-
     for(k=0; k < width; k++)
     {
         pixel = (unsigned char*)out + pixel_offset;
@@ -3342,7 +4637,7 @@ int spng_decode_scanline(spng_ctx *ctx, void *out, size_t len)
         {
             if(f.zerocopy) break;
 
-            memcpy(out, scanline, scanline_width - 1);
+            memcpy(out, scanline, ((size_t)width * ctx->scanline_bits + 7) / 8);
             break;
         }
 
@@ -3366,7 +4661,7 @@ int spng_decode_scanline(spng_ctx *ctx, void *out, size_t len)
             {
                 if(fmt == SPNG_FMT_RGBA8)
                 {
-                    rgb8_row_to_rgba8(scanline, out, width);
+                    rgb8_row_to_rgba8(scanline, out, width, ctx->simd_level);
                     break;
                 }
 
@@ -3381,49 +4676,26 @@ int spng_decode_scanline(spng_ctx *ctx, void *out, size_t len)
         {
             uint8_t entry = 0;
 
-            if(ihdr->bit_depth == 8)
-            {
-                if(fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGB8))
-                {
-                    expand_row(out, scanline, &ctx->decode_plte, width, fmt);
-                    break;
-                }
-
-                entry = scanline[k];
-            }
-            else /* < 8 */
-            {
-                entry = get_sample(&iter);
-            }
-
-            if(fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGB8))
-            {
-                pixel[0] = plte[entry].red;
-                pixel[1] = plte[entry].green;
-                pixel[2] = plte[entry].blue;
-                if(fmt == SPNG_FMT_RGBA8) pixel[3] = plte[entry].alpha;
+            if(ihdr->bit_depth == 8) entry = scanline[k];
+            else entry = get_sample(&iter);
 
-                continue;
-            }
-            else /* RGBA16 */
-            {
-                r_16 = plte[entry].red;
-                g_16 = plte[entry].green;
-                b_16 = plte[entry].blue;
-                a_16 = plte[entry].alpha;
+            /* RGBA16, RGBA8 and RGB8 are handled by convert_palette() */
+            r_16 = plte[entry].red;
+            g_16 = plte[entry].green;
+            b_16 = plte[entry].blue;
+            a_16 = plte[entry].alpha;
 
-                r_16 = (r_16 << 8) | r_16;
-                g_16 = (g_16 << 8) | g_16;
-                b_16 = (b_16 << 8) | b_16;
-                a_16 = (a_16 << 8) | a_16;
+            r_16 = (r_16 << 8) | r_16;
+            g_16 = (g_16 << 8) | g_16;
+            b_16 = (b_16 << 8) | b_16;
+            a_16 = (a_16 << 8) | a_16;
 
-                memcpy(pixel, &r_16, 2);
-                memcpy(pixel + 2, &g_16, 2);
-                memcpy(pixel + 4, &b_16, 2);
-                memcpy(pixel + 6, &a_16, 2);
+            memcpy(pixel, &r_16, 2);
+            memcpy(pixel + 2, &g_16, 2);
+            memcpy(pixel + 4, &b_16, 2);
+            memcpy(pixel + 6, &a_16, 2);
 
-                continue;
-            }
+            continue;
         }
         else if(ihdr->color_type == SPNG_COLOR_TYPE_TRUECOLOR_ALPHA)
         {
@@ -3521,2526 +4793,7922 @@ int spng_decode_scanline(spng_ctx *ctx, void *out, size_t len)
         }
     }/* for(k=0; k < width; k++) */
 
-    if(f.apply_trns) trns_row(out, scanline, trns_px, ctx->bytes_per_pixel, &ctx->ihdr, width, fmt);
+    if(f.apply_trns) trns_row(out, scanline, trns_px, ctx->bytes_per_pixel, ihdr, width, fmt);
 
     if(f.do_scaling) scale_row(out, width, fmt, processing_depth, sb);
 
     if(f.apply_gamma) gamma_correct_row(out, width, fmt, gamma_lut);
+}
 
-    /* The previous scanline is always defiltered */
-    void *t = ctx->prev_scanline;
-    ctx->prev_scanline = ctx->scanline;
-    ctx->scanline = t;
+static void convert_copy(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
+{
+    memcpy(out, scanline, ((size_t)width * ctx->scanline_bits + 7) / 8);
+}
 
-    ret = update_row_info(ctx);
+/* Indexed and 1/2/4/8-bit grayscale to RGBA8/RGB8,
+   transparency, sBIT and gamma are already applied to the palette */
+static void convert_palette(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
+{
+    const unsigned bit_depth = ctx->ihdr.bit_depth;
+    const unsigned pixel_size = ctx->fmt == SPNG_FMT_RGBA8 ? 4 : 3;
+    const unsigned char *indices = scanline;
 
-    if(ret == SPNG_EOI)
-    {
-        if(ctx->cur_chunk_bytes_left) /* zlib stream ended before an IDAT chunk boundary */
-        {/* Discard the rest of the chunk */
-            int error = discard_chunk_bytes(ctx, ctx->cur_chunk_bytes_left);
-            if(error) return decode_err(ctx, error);
-        }
+    if(bit_depth < 8)
+    {/* Indices are unpacked to the end of the row, each one is read before it is overwritten */
+        unsigned char *tail = out + (size_t)(pixel_size - 1) * width;
 
-        ctx->last_idat = ctx->current_chunk;
+        unpack_scanline(tail, scanline, width, bit_depth, SPNG_FMT_G8);
+        indices = tail;
     }
 
-    return ret;
+    expand_row(out, indices, &ctx->decode_plte, width, ctx->fmt, bit_depth, ctx->simd_level);
 }
 
-int spng_decode_row(spng_ctx *ctx, void *out, size_t len)
+/* 8/16-bit truecolor and grayscale with alpha to RGBA8/RGB8, only tRNS is applied.
+   The layout arguments are constants in each instance so the loop has no branches on them. */
+static inline void convert_to_rgb8(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width,
+                                   const unsigned depth, const unsigned channels, const unsigned out_channels)
 {
-    if(ctx == NULL || out == NULL) return 1;
-    if(ctx->state >= SPNG_STATE_EOI) return SPNG_EOI;
-    if(len < ctx->image_width) return SPNG_EBUFSIZ;
+    const size_t stride = channels * (depth / 8);
+    const int apply_trns = out_channels == 4 && (channels == 1 || channels == 3) && ctx->decode_flags.apply_trns;
+    uint16_t s[4];
+    uint32_t k;
+    unsigned c;
 
-    const struct spng_ihdr *ihdr = &ctx->ihdr;
-    int ret, pass = ctx->row_info.pass;
-    unsigned char *outptr = out;
+    for(k=0; k < width; k++, scanline += stride, out += out_channels)
+    {
+        for(c=0; c < channels; c++)
+        {
+            if(depth == 16) memcpy(&s[c], scanline + c * 2, 2);
+            else s[c] = scanline[c];
+        }
 
-    if(!ihdr->interlace_method || pass == 6) return spng_decode_scanline(ctx, out, len);
+        if(depth == 16)
+        {
+            for(c=0; c < channels; c++) s[c] >>= 8;
+        }
 
-    ret = spng_decode_scanline(ctx, ctx->row, ctx->image_width);
-    if(ret && ret != SPNG_EOI) return ret;
+        if(channels <= 2)
+        {/* Grayscale */
+            out[0] = s[0];
+            out[1] = s[0];
+            out[2] = s[0];
+        }
+        else
+        {
+            out[0] = s[0];
+            out[1] = s[1];
+            out[2] = s[2];
+        }
 
-    uint32_t k;
-    unsigned pixel_size = 4; /* RGBA8 */
-    if(ctx->fmt == SPNG_FMT_RGBA16) pixel_size = 8;
-    else if(ctx->fmt == SPNG_FMT_RGB8) pixel_size = 3;
-    else if(ctx->fmt == SPNG_FMT_G8) pixel_size = 1;
-    else if(ctx->fmt == SPNG_FMT_GA8) pixel_size = 2;
-    else if(ctx->fmt & (SPNG_FMT_PNG | SPNG_FMT_RAW))
-    {
-        if(ihdr->bit_depth < 8)
+        if(out_channels == 4)
         {
-            struct spng__iter iter = spng__iter_init(ihdr->bit_depth, ctx->row);
-            const uint8_t samples_per_byte = 8 / ihdr->bit_depth;
-            uint8_t sample;
+            uint8_t alpha = 255;
 
-            for(k=0; k < ctx->subimage[pass].width; k++)
+            if(channels == 2) alpha = s[1];
+            else if(channels == 4) alpha = s[3];
+            else if(apply_trns)
             {
-                sample = get_sample(&iter);
-
-                size_t ioffset = adam7_x_start[pass] + k * adam7_x_delta[pass];
-
-                sample = sample << (iter.initial_shift - ioffset * ihdr->bit_depth % 8);
+                int match;
 
-                ioffset /= samples_per_byte;
+                if(channels == 1)
+                {
+                    uint16_t gray;
+                    memcpy(&gray, scanline, 2);
+                    match = ctx->trns.gray == gray;
+                }
+                else match = !memcmp(scanline, ctx->trns_px, stride);
 
-                outptr[ioffset] |= sample;
+                alpha = match ? 0 : 255;
             }
 
-            return 0;
+            out[3] = alpha;
         }
-        else pixel_size = ctx->bytes_per_pixel;
     }
+}
 
-    for(k=0; k < ctx->subimage[pass].width; k++)
-    {
-        size_t ioffset = (adam7_x_start[pass] + (size_t) k * adam7_x_delta[pass]) * pixel_size;
+static void convert_rgb8_rgba8(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
+{
+    if(ctx->decode_flags.apply_trns) convert_to_rgb8(ctx, out, scanline, width, 8, 3, 4);
+    else rgb8_row_to_rgba8(scanline, out, width, ctx->simd_level);
+}
 
-        memcpy(outptr + ioffset, ctx->row + k * pixel_size, pixel_size);
-    }
+static void convert_rgba8_rgb8(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
+{
+    convert_to_rgb8(ctx, out, scanline, width, 8, 4, 3);
+}
 
-    return 0;
+static void convert_ga8_rgba8(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
+{
+    convert_to_rgb8(ctx, out, scanline, width, 8, 2, 4);
 }
 
-int spng_decode_chunks(spng_ctx *ctx)
+static void convert_ga8_rgb8(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
 {
-    if(ctx == NULL) return 1;
-    if(ctx->encode_only) return SPNG_ECTXTYPE;
-    if(ctx->state < SPNG_STATE_INPUT) return SPNG_ENOSRC;
-    if(ctx->state == SPNG_STATE_IEND) return 0;
+    convert_to_rgb8(ctx, out, scanline, width, 8, 2, 3);
+}
 
-    return read_chunks(ctx, 0);
+static void convert_g16_rgba8(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
+{
+    convert_to_rgb8(ctx, out, scanline, width, 16, 1, 4);
 }
 
-int spng_decode_image(spng_ctx *ctx, void *out, size_t len, int fmt, int flags)
+static void convert_g16_rgb8(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
 {
-    if(ctx == NULL) return 1;
-    if(ctx->encode_only) return SPNG_ECTXTYPE;
-    if(ctx->state >= SPNG_STATE_EOI) return SPNG_EOI;
+    convert_to_rgb8(ctx, out, scanline, width, 16, 1, 3);
+}
 
-    const struct spng_ihdr *ihdr = &ctx->ihdr;
+static void convert_ga16_rgba8(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
+{
+    convert_to_rgb8(ctx, out, scanline, width, 16, 2, 4);
+}
 
-    int ret = read_chunks(ctx, 0);
-    if(ret) return decode_err(ctx, ret);
+static void convert_ga16_rgb8(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
+{
+    convert_to_rgb8(ctx, out, scanline, width, 16, 2, 3);
+}
 
-    ret = check_decode_fmt(ihdr, fmt);
-    if(ret) return ret;
+static void convert_rgb16_rgba8(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
+{
+    convert_to_rgb8(ctx, out, scanline, width, 16, 3, 4);
+}
 
-    ret = calculate_image_width(ihdr, fmt, &ctx->image_width);
-    if(ret) return decode_err(ctx, ret);
+static void convert_rgb16_rgb8(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
+{
+    convert_to_rgb8(ctx, out, scanline, width, 16, 3, 3);
+}
 
-    if(ctx->image_width > SIZE_MAX / ihdr->height) ctx->image_size = 0; /* overflow */
-    else ctx->image_size = ctx->image_width * ihdr->height;
+static void convert_rgba16_rgba8(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
+{
+    convert_to_rgb8(ctx, out, scanline, width, 16, 4, 4);
+}
 
-    if( !(flags & SPNG_DECODE_PROGRESSIVE) )
+static void convert_rgba16_rgb8(const spng_ctx *ctx, unsigned char *out, const unsigned char *scanline, uint32_t width)
+{
+    convert_to_rgb8(ctx, out, scanline, width, 16, 4, 3);
+}
+
+/* Indexed by [bit_depth == 16][color_type][fmt == SPNG_FMT_RGBA8],
+   8-bit grayscale and indexed images use convert_palette() */
+static spng__convert_row *const convert_rgb8_table[2][7][2] =
+{
     {
-        if(out == NULL) return 1;
-        if(!ctx->image_size) return SPNG_EOVERFLOW;
-        if(len < ctx->image_size) return SPNG_EBUFSIZ;
+        [SPNG_COLOR_TYPE_TRUECOLOR] = { NULL, convert_rgb8_rgba8 },
+        [SPNG_COLOR_TYPE_GRAYSCALE_ALPHA] = { convert_ga8_rgb8, convert_ga8_rgba8 },
+        [SPNG_COLOR_TYPE_TRUECOLOR_ALPHA] = { convert_rgba8_rgb8, NULL }
+    },
+    {
+        [SPNG_COLOR_TYPE_GRAYSCALE] = { convert_g16_rgb8, convert_g16_rgba8 },
+        [SPNG_COLOR_TYPE_TRUECOLOR] = { convert_rgb16_rgb8, convert_rgb16_rgba8 },
+        [SPNG_COLOR_TYPE_GRAYSCALE_ALPHA] = { convert_ga16_rgb8, convert_ga16_rgba8 },
+        [SPNG_COLOR_TYPE_TRUECOLOR_ALPHA] = { convert_rgba16_rgb8, convert_rgba16_rgba8 }
     }
+};
 
-    uint32_t bytes_read = 0;
+/* Picks a row conversion kernel, called once the decode flags are final */
+static spng__convert_row *select_convert_row(const spng_ctx *ctx)
+{
+    const struct decode_flags f = ctx->decode_flags;
+    const struct spng_ihdr *ihdr = &ctx->ihdr;
+    spng__convert_row *fn = NULL;
 
-    ret = read_idat_bytes(ctx, &bytes_read);
-    if(ret) return decode_err(ctx, ret);
+    if(f.same_layout && !f.apply_trns && !f.do_scaling && !f.apply_gamma) return convert_copy;
 
-    if(bytes_read > 1)
+    if(!(ctx->fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGB8)) || f.unpack) return convert_generic;
+
+    if(f.indexed || (ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr->bit_depth <= 8)) return convert_palette;
+
+    if(f.do_scaling || f.apply_gamma) return convert_generic;
+
+    if(ihdr->bit_depth == 8 || ihdr->bit_depth == 16)
     {
-        int valid = read_u16(ctx->data) % 31 ? 0 : 1;
+        fn = convert_rgb8_table[ihdr->bit_depth == 16][ihdr->color_type][ctx->fmt == SPNG_FMT_RGBA8];
+    }
 
-        unsigned flg = ctx->data[1];
-        unsigned flevel = flg >> 6;
-        int compression_level = Z_DEFAULT_COMPRESSION;
+    return fn ? fn : convert_generic;
+}
 
-        if(flevel == 0) compression_level = 0; /* fastest */
-        else if(flevel == 1) compression_level = 1; /* fast */
-        else if(flevel == 2) compression_level = 6; /* default */
-        else if(flevel == 3) compression_level = 9; /* slowest, max compression */
+/* Converts a scanline one column block at a time, the generic kernel's
+   per-pixel loop and tRNS/sBIT/gamma passes then work on data in the L1 cache */
+static void convert_scanline(const spng_ctx *ctx, void *out, const unsigned char *scanline, int pass)
+{
+    const uint32_t width = ctx->subimage[pass].width;
+    uint32_t x, n;
 
-        if(valid) ctx->image_options.compression_level = compression_level;
+    for(x=0; x < width; x += n)
+    {
+        n = width - x < ctx->convert_block ? width - x : ctx->convert_block;
+
+        ctx->convert_row(ctx, (unsigned char*)out + (size_t)x * ctx->out_bits / 8,
+                         scanline + (size_t)x * ctx->scanline_bits / 8, n);
     }
+}
+
+int spng_decode_scanline(spng_ctx *ctx, void *out, size_t len)
+{
+    if(ctx == NULL || out == NULL) return 1;
+
+    if(ctx->state >= SPNG_STATE_EOI) return SPNG_EOI;
+
+    struct spng_row_info *ri = &ctx->row_info;
+    const int pass = ri->pass;
+
+    if(len < ctx->subimage[pass].out_width) return SPNG_EBUFSIZ;
+
+    int ret = read_scanline(ctx);
 
-    ret = spng__inflate_init(ctx, ctx->image_options.window_bits);
     if(ret) return decode_err(ctx, ret);
 
-    ctx->zstream.avail_in = bytes_read;
-    ctx->zstream.next_in = ctx->data;
+    convert_scanline(ctx, out, ctx->scanline, pass);
 
-    size_t scanline_buf_size = ctx->subimage[ctx->widest_pass].scanline_width;
+    /* The previous scanline is always defiltered */
+    void *t = ctx->prev_scanline;
+    ctx->prev_scanline = ctx->scanline;
+    ctx->scanline = t;
 
-    scanline_buf_size += 32;
+    ret = update_row_info(ctx);
 
-    if(scanline_buf_size < 32) return SPNG_EOVERFLOW;
+    if(ret == SPNG_EOI)
+    {
+        int error = end_of_idat(ctx);
+        if(error) return decode_err(ctx, error);
+    }
 
-    ctx->scanline_buf = spng__malloc(ctx, scanline_buf_size);
-    ctx->prev_scanline_buf = spng__malloc(ctx, scanline_buf_size);
+    return ret;
+}
 
-    ctx->scanline = ctx->scanline_buf;
-    ctx->prev_scanline = ctx->prev_scanline_buf;
+#if !defined(SPNG_X86)
+static void copy_nontemporal(unsigned char *dst, const unsigned char *src, size_t len)
+{
+    memcpy(dst, src, len);
+}
 
-    struct decode_flags f = {0};
+static void nontemporal_fence(void)
+{
+}
+#endif
 
-    ctx->fmt = fmt;
+#if defined(SPNG_X86)
+/* Size of the last-level cache in bytes */
+static size_t llc_size(void)
+{
+    size_t size = 0;
 
-    if(ihdr->color_type == SPNG_COLOR_TYPE_INDEXED) f.indexed = 1;
+#if defined(SPNG_X86_AVX)
+    size = x86_llc_size();
+#endif
 
-    unsigned processing_depth = ihdr->bit_depth;
+    return size ? size : SPNG_DEFAULT_LLC_SIZE;
+}
+#endif
 
-    if(f.indexed) processing_depth = 8;
+/* pixel_size is a constant after inlining */
+static inline void scatter_pixels_n(unsigned char *out, const unsigned char *row, uint32_t n, size_t stride, size_t pixel_size)
+{
+    uint32_t k;
 
-    if(ihdr->interlace_method)
-    {
-        f.interlaced = 1;
-        ctx->row_buf = spng__malloc(ctx, ctx->image_width);
-        ctx->row = ctx->row_buf;
+    for(k=0; k < n; k++) memcpy(out + k * stride, row + k * pixel_size, pixel_size);
+}
 
-        if(ctx->row == NULL) return decode_err(ctx, SPNG_EMEM);
+/* Copy n pixels to every stride bytes of out, leaving the bytes in between untouched */
+static void scatter_pixels(unsigned char *out, const unsigned char *row, uint32_t n, size_t stride, size_t pixel_size)
+{
+    switch(pixel_size)
+    {
+        case 1: scatter_pixels_n(out, row, n, stride, 1); break;
+        case 2: scatter_pixels_n(out, row, n, stride, 2); break;
+        case 3: scatter_pixels_n(out, row, n, stride, 3); break;
+        case 4: scatter_pixels_n(out, row, n, stride, 4); break;
+        case 6: scatter_pixels_n(out, row, n, stride, 6); break;
+        case 8: scatter_pixels_n(out, row, n, stride, 8); break;
+        default: scatter_pixels_n(out, row, n, stride, pixel_size); break;
     }
+}
 
-    if(ctx->scanline == NULL || ctx->prev_scanline == NULL)
+static inline void interleave_pixels_n(unsigned char *out, const unsigned char *a, const unsigned char *b,
+                                       uint32_t i, uint32_t n, size_t pixel_size)
+{
+    for(; i < n; i++)
     {
-        return decode_err(ctx, SPNG_EMEM);
+        memcpy(out + 2 * i * pixel_size, a + i * pixel_size, pixel_size);
+        memcpy(out + (2 * i + 1) * pixel_size, b + i * pixel_size, pixel_size);
     }
+}
 
-    f.do_scaling = 1;
-    if(f.indexed) f.do_scaling = 0;
+/* Interleave n pixels of a and b, followed by a[n] if tail is set.
+   Adam7 rows are built from the passes this way, each pass fills the gaps between the columns of the previous ones. */
+static void interleave_pixels(unsigned char *out, const unsigned char *a, const unsigned char *b,
+                              uint32_t n, int tail, size_t pixel_size, int simd_level)
+{
+    uint32_t i = 0;
 
-    unsigned depth_target = 8; /* FMT_RGBA8, G8 */
-    if(fmt == SPNG_FMT_RGBA16) depth_target = 16;
+    (void)simd_level;
 
-    if(flags & SPNG_DECODE_TRNS && ctx->stored.trns) f.apply_trns = 1;
-    else flags &= ~SPNG_DECODE_TRNS;
+#if defined(SPNG_X86)
+    if(simd_level) i = interleave_pixels_sse2(out, a, b, n, pixel_size);
+#elif defined(SPNG_ARM)
+    if(simd_level) i = interleave_pixels_neon(out, a, b, n, pixel_size);
+#endif
 
-    if(ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE_ALPHA ||
-       ihdr->color_type == SPNG_COLOR_TYPE_TRUECOLOR_ALPHA) flags &= ~SPNG_DECODE_TRNS;
+    switch(pixel_size)
+    {
+        case 1: interleave_pixels_n(out, a, b, i, n, 1); break;
+        case 2: interleave_pixels_n(out, a, b, i, n, 2); break;
+        case 3: interleave_pixels_n(out, a, b, i, n, 3); break;
+        case 4: interleave_pixels_n(out, a, b, i, n, 4); break;
+        case 6: interleave_pixels_n(out, a, b, i, n, 6); break;
+        case 8: interleave_pixels_n(out, a, b, i, n, 8); break;
+        default: interleave_pixels_n(out, a, b, i, n, pixel_size); break;
+    }
 
-    if(flags & SPNG_DECODE_GAMMA && ctx->stored.gama) f.apply_gamma = 1;
-    else flags &= ~SPNG_DECODE_GAMMA;
+    if(tail) memcpy(out + 2 * (size_t)n * pixel_size, a + (size_t)n * pixel_size, pixel_size);
+}
 
-    if(flags & SPNG_DECODE_USE_SBIT && ctx->stored.sbit) f.use_sbit = 1;
-    else flags &= ~SPNG_DECODE_USE_SBIT;
+/* Scatter the converted pixels [first, end) of a pass to the output row,
+   *row holds the pixels starting at x which is a multiple of 8.
+   Output columns are relative to the crop rectangle. */
+static void deinterlace_block(const spng_ctx *ctx, unsigned char *outptr, const unsigned char *row, int pass,
+                              uint32_t x, uint32_t first, uint32_t end)
+{
+    const struct spng_ihdr *ihdr = &ctx->ihdr;
+    const size_t pixel_size = ctx->out_bits / 8;
+    size_t start = 0, delta = 1;
+    uint32_t k;
 
-    if(fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGBA16))
+    if(ihdr->interlace_method)
     {
-        if(ihdr->color_type == SPNG_COLOR_TYPE_TRUECOLOR_ALPHA &&
-           ihdr->bit_depth == depth_target) f.same_layout = 1;
+        start = adam7_x_start[pass];
+        delta = adam7_x_delta[pass];
     }
-    else if(fmt == SPNG_FMT_RGB8)
+
+    start -= ctx->crop_x;
+
+    if(ctx->out_bits < 8)
     {
-        if(ihdr->color_type == SPNG_COLOR_TYPE_TRUECOLOR &&
-           ihdr->bit_depth == depth_target) f.same_layout = 1;
+        struct spng__iter iter = spng__iter_init(ihdr->bit_depth, row);
+        const uint8_t samples_per_byte = 8 / ihdr->bit_depth;
+        const uint8_t mask = (1 << ihdr->bit_depth) - 1;
+        uint8_t sample;
 
-        f.apply_trns = 0; /* not applicable */
-    }
-    else if(fmt & (SPNG_FMT_PNG | SPNG_FMT_RAW))
-    {
-        f.same_layout = 1;
-        f.do_scaling = 0;
-        f.apply_gamma = 0; /* for now */
-        f.apply_trns = 0;
-    }
-    else if(fmt == SPNG_FMT_G8 && ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr->bit_depth <= 8)
-    {
-        if(ihdr->bit_depth == depth_target) f.same_layout = 1;
-        else if(ihdr->bit_depth < 8) f.unpack = 1;
+        for(k=x; k < end; k++)
+        {
+            sample = get_sample(&iter);
 
-        f.apply_trns = 0;
-    }
-    else if(fmt == SPNG_FMT_GA8 && ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr->bit_depth <= 8)
-    {
-        if(ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE_ALPHA &&
-           ihdr->bit_depth == depth_target) f.same_layout = 1;
-        else if(ihdr->bit_depth <= 8) f.unpack = 1;
+            if(k < first) continue;
+
+            size_t ioffset = start + k * delta;
+            unsigned shift = iter.initial_shift - ioffset * ihdr->bit_depth % 8;
+
+            ioffset /= samples_per_byte;
+
+            outptr[ioffset] = (outptr[ioffset] & ~(mask << shift)) | (sample << shift);
+        }
+
+        return;
     }
-    else if(fmt == SPNG_FMT_GA16 && ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr->bit_depth == 16)
+
+    row += (first - x) * pixel_size;
+    outptr += (start + first * delta) * pixel_size;
+
+    if(delta == 1)
     {
-        if(ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE_ALPHA &&
-           ihdr->bit_depth == depth_target) f.same_layout = 1;
-        else if(ihdr->bit_depth == 16) f.unpack = 1;
+        memcpy(outptr, row, (end - first) * pixel_size);
+        return;
     }
 
-    /*if(f.same_layout && !flags && !f.interlaced) f.zerocopy = 1;*/
+    scatter_pixels(outptr, row, end - first, delta * pixel_size, pixel_size);
+}
 
-    uint16_t *gamma_lut = NULL;
+static void deinterlace_row(const spng_ctx *ctx, unsigned char *outptr, const unsigned char *row, int pass)
+{
+    deinterlace_block(ctx, outptr, row, pass, 0, 0, ctx->subimage[pass].width);
+}
 
-    if(f.apply_gamma)
-    {
-        float file_gamma = (float)ctx->gama / 100000.0f;
-        float max;
+int spng_decode_row(spng_ctx *ctx, void *out, size_t len)
+{
+    if(ctx == NULL || out == NULL) return 1;
+    if(ctx->state >= SPNG_STATE_EOI) return SPNG_EOI;
+    if(len < ctx->image_width) return SPNG_EBUFSIZ;
 
-        unsigned lut_entries;
+    int ret, pass = ctx->row_info.pass;
 
-        if(fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGB8))
-        {
-            lut_entries = 256;
-            max = 255.0f;
+    if(!ctx->ihdr.interlace_method || pass == 6) return spng_decode_scanline(ctx, out, len);
 
-            gamma_lut = ctx->gamma_lut8;
-            ctx->gamma_lut = ctx->gamma_lut8;
-        }
-        else /* SPNG_FMT_RGBA16 */
-        {
-            lut_entries = 65536;
-            max = 65535.0f;
+    ret = spng_decode_scanline(ctx, ctx->row, ctx->image_width);
+    if(ret && ret != SPNG_EOI) return ret;
 
-            ctx->gamma_lut16 = spng__malloc(ctx, lut_entries * sizeof(uint16_t));
-            if(ctx->gamma_lut16 == NULL) return decode_err(ctx, SPNG_EMEM);
+    deinterlace_row(ctx, out, ctx->row, pass);
 
-            gamma_lut = ctx->gamma_lut16;
-            ctx->gamma_lut = ctx->gamma_lut16;
-        }
+    return 0;
+}
 
-        float screen_gamma = 2.2f;
-        float exponent = file_gamma * screen_gamma;
+int spng_decode_chunks(spng_ctx *ctx)
+{
+    if(ctx == NULL) return 1;
+    if(ctx->encode_only) return SPNG_ECTXTYPE;
+    if(ctx->state < SPNG_STATE_INPUT) return SPNG_ENOSRC;
+    if(ctx->state == SPNG_STATE_IEND) return 0;
 
-        if(FP_ZERO == fpclassify(exponent)) return decode_err(ctx, SPNG_EGAMA);
+    return read_chunks(ctx, 0);
+}
 
-        exponent = 1.0f / exponent;
+/* SPNG_DOWNSCALE: every output pixel is the average of a box of pixels in the crop rectangle,
+   boxes on the right and bottom edges are smaller if the rectangle is not a multiple of the box size.
 
-        unsigned i;
-        for(i=0; i < lut_entries; i++)
-        {
-            float c = pow((float)i / max, exponent) * max;
-            if(c > max) c = max;
+   Non-interlaced images keep 16-bit column sums for one band of rows which is
+   reduced to an output row after the band's last row,
+   pixels of interlaced images are added to 32-bit sums and counts for the whole output.
+   In linear mode color samples are summed as 12-bit linear values, alpha is never linearized. */
+static unsigned downscale_alpha_channel(unsigned channels)
+{
+    return channels == 2 || channels == 4 ? channels - 1 : channels; /* channels if there is no alpha */
+}
 
-            gamma_lut[i] = (uint16_t)c;
-        }
-    }
+/* Multiplier for dividing by count, exact for the sums of up to 64 12-bit samples */
+static uint64_t box_reciprocal(uint32_t count)
+{
+    return count ? (((uint64_t)1 << 32) + count - 1) / count : 0;
+}
 
-    struct spng_sbit *sb = &ctx->decode_sb;
+static unsigned char box_average(const spng_ctx *ctx, uint32_t sum, uint32_t count, uint64_t reciprocal, int linear)
+{
+    sum = (uint32_t)(((sum + count / 2) * reciprocal) >> 32);
 
-    sb->red_bits = processing_depth;
-    sb->green_bits = processing_depth;
-    sb->blue_bits = processing_depth;
-    sb->alpha_bits = processing_depth;
-    sb->grayscale_bits = processing_depth;
+    return linear ? ctx->encode_lut[sum] : (unsigned char)sum;
+}
 
-    if(f.use_sbit)
+static void downscale_accumulate(const spng_ctx *ctx, const unsigned char *row, uint32_t first, uint32_t n)
+{
+    const unsigned channels = ctx->out_bits / 8;
+    uint16_t *acc = (uint16_t*)ctx->downscale_buf + (size_t)(first - ctx->crop_x) * channels;
+    const size_t len = (size_t)n * channels;
+    size_t i = 0;
+
+    if(ctx->downscale_mode & SPNG_DOWNSCALE_LINEAR)
     {
-        if(ihdr->color_type == 0)
-        {
-            sb->grayscale_bits = ctx->sbit.grayscale_bits;
-            sb->alpha_bits = ihdr->bit_depth;
-        }
-        else if(ihdr->color_type == 2 || ihdr->color_type == 3)
-        {
-            sb->red_bits = ctx->sbit.red_bits;
-            sb->green_bits = ctx->sbit.green_bits;
-            sb->blue_bits = ctx->sbit.blue_bits;
-            sb->alpha_bits = ihdr->bit_depth;
-        }
-        else if(ihdr->color_type == 4)
-        {
-            sb->grayscale_bits = ctx->sbit.grayscale_bits;
-            sb->alpha_bits = ctx->sbit.alpha_bits;
-        }
-        else /* == 6 */
+        const unsigned alpha = downscale_alpha_channel(channels);
+        unsigned c;
+
+        for(i=0; i < len; i += channels)
         {
-            sb->red_bits = ctx->sbit.red_bits;
-            sb->green_bits = ctx->sbit.green_bits;
-            sb->blue_bits = ctx->sbit.blue_bits;
-            sb->alpha_bits = ctx->sbit.alpha_bits;
+            for(c=0; c < channels; c++) acc[i + c] += c == alpha ? row[i + c] : ctx->linear_lut[row[i + c]];
         }
-    }
-
-    if(ihdr->bit_depth == 16 && fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGB8))
-    {/* samples are scaled down by 8 bits in the decode loop */
-        sb->red_bits -= 8;
-        sb->green_bits -= 8;
-        sb->blue_bits -= 8;
-        sb->alpha_bits -= 8;
-        sb->grayscale_bits -= 8;
 
-        processing_depth = 8;
+        return;
     }
 
-    /* Prevent infinite loops in sample_to_target() */
-    if(!depth_target || depth_target > 16 ||
-       !processing_depth || processing_depth > 16 ||
-       !sb->grayscale_bits || sb->grayscale_bits > processing_depth ||
-       !sb->alpha_bits || sb->alpha_bits > processing_depth ||
-       !sb->red_bits || sb->red_bits > processing_depth ||
-       !sb->green_bits || sb->green_bits > processing_depth ||
-       !sb->blue_bits || sb->blue_bits > processing_depth)
-    {
-        return decode_err(ctx, SPNG_ESBIT);
-    }
+#if defined(SPNG_X86)
+    i = accumulate_u8_sse2(acc, row, len);
+#elif defined(SPNG_ARM)
+    i = accumulate_u8_neon(acc, row, len);
+#endif
 
-    if(sb->red_bits == sb->green_bits &&
-       sb->green_bits == sb->blue_bits &&
-       sb->blue_bits == sb->alpha_bits &&
-       sb->alpha_bits == processing_depth &&
-       processing_depth == depth_target) f.do_scaling = 0;
+    for(; i < len; i++) acc[i] += row[i];
+}
 
-    struct spng_plte_entry *plte = ctx->decode_plte.rgba;
+/* Sum the column sums of each box, channels is a constant after inlining */
+static inline void sum_boxes(uint32_t *sums, const uint16_t *acc, uint32_t width, uint32_t box, unsigned channels)
+{
+    uint32_t x, k;
+    unsigned c;
 
-    /* Pre-process palette entries */
-    if(f.indexed)
+    for(x=0; x < width; x += box, sums += channels)
     {
-        uint8_t red, green, blue, alpha;
-
-        uint32_t i;
-        for(i=0; i < 256; i++)
-        {
-            if(f.apply_trns && i < ctx->trns.n_type3_entries)
-                ctx->plte.entries[i].alpha = ctx->trns.type3_alpha[i];
-            else
-                ctx->plte.entries[i].alpha = 255;
+        uint32_t cols = width - x < box ? width - x : box;
 
-            red   = sample_to_target(ctx->plte.entries[i].red, 8, sb->red_bits, 8);
-            green = sample_to_target(ctx->plte.entries[i].green, 8, sb->green_bits, 8);
-            blue  = sample_to_target(ctx->plte.entries[i].blue, 8, sb->blue_bits, 8);
-            alpha = sample_to_target(ctx->plte.entries[i].alpha, 8, sb->alpha_bits, 8);
+        for(c=0; c < channels; c++) sums[c] = 0;
 
-#if defined(SPNG_ARM)
-            if(fmt == SPNG_FMT_RGB8 && ihdr->bit_depth == 8)
-            {/* Working with 3 bytes at a time is more of an ARM thing */
-                ctx->decode_plte.rgb[i * 3 + 0] = red;
-                ctx->decode_plte.rgb[i * 3 + 1] = green;
-                ctx->decode_plte.rgb[i * 3 + 2] = blue;
-                continue;
-            }
-#endif
-            plte[i].red = red;
-            plte[i].green = green;
-            plte[i].blue = blue;
-            plte[i].alpha = alpha;
+        for(k=0; k < cols; k++, acc += channels)
+        {
+            for(c=0; c < channels; c++) sums[c] += acc[c];
         }
-
-        f.apply_trns = 0;
     }
+}
 
-    unsigned char *trns_px = ctx->trns_px;
+/* Reduce the column sums of a band to an output row */
+static void downscale_band(const spng_ctx *ctx, unsigned char *out, uint32_t rows)
+{
+    const unsigned channels = ctx->out_bits / 8;
+    const unsigned alpha = downscale_alpha_channel(channels);
+    const int linear = ctx->downscale_mode & SPNG_DOWNSCALE_LINEAR;
+    const uint32_t box = 1u << ctx->downscale_shift;
+    const uint32_t out_width = ((ctx->crop_width - 1) >> ctx->downscale_shift) + 1;
+    const uint32_t last_cols = ctx->crop_width - (out_width - 1) * box;
+    uint16_t *acc = (uint16_t*)ctx->downscale_buf;
+    uint32_t *sums = ctx->downscale_sums;
+    uint32_t x, count = box * rows;
+    uint64_t reciprocal = box_reciprocal(count);
+    unsigned c;
 
-    if(f.apply_trns)
+    switch(channels)
     {
-        uint16_t mask = ~0;
-        if(ctx->ihdr.bit_depth < 16) mask = (1 << ctx->ihdr.bit_depth) - 1;
+        case 1: sum_boxes(sums, acc, ctx->crop_width, box, 1); break;
+        case 2: sum_boxes(sums, acc, ctx->crop_width, box, 2); break;
+        case 3: sum_boxes(sums, acc, ctx->crop_width, box, 3); break;
+        default: sum_boxes(sums, acc, ctx->crop_width, box, 4); break;
+    }
 
-        if(fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGBA16))
+    for(x=0; x < out_width; x++, out += channels, sums += channels)
+    {
+        if(x == out_width - 1 && last_cols != box)
         {
-            if(ihdr->color_type == SPNG_COLOR_TYPE_TRUECOLOR)
-            {
-                if(ihdr->bit_depth == 16)
-                {
-                    memcpy(trns_px, &ctx->trns.red, 2);
-                    memcpy(trns_px + 2, &ctx->trns.green, 2);
-                    memcpy(trns_px + 4, &ctx->trns.blue, 2);
-                }
-                else
-                {
-                    trns_px[0] = ctx->trns.red & mask;
-                    trns_px[1] = ctx->trns.green & mask;
-                    trns_px[2] = ctx->trns.blue & mask;
-                }
-            }
+            count = last_cols * rows;
+            reciprocal = box_reciprocal(count);
         }
-        else if(ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE) // fmt == SPNG_FMT_GA8 &&
+
+        for(c=0; c < channels; c++)
         {
-            if(ihdr->bit_depth == 16)
-            {
-                memcpy(trns_px, &ctx->trns.gray, 2);
-            }
-            else
-            {
-                trns_px[0] = ctx->trns.gray & mask;
-            }
+            out[c] = box_average(ctx, sums[c], count, reciprocal, linear && c != alpha);
         }
     }
 
-    ctx->decode_flags = f;
+    memset(acc, 0, (size_t)ctx->crop_width * channels * sizeof(uint16_t));
+}
 
-    ctx->state = SPNG_STATE_DECODE_INIT;
+static inline void add_pass_pixels(uint32_t *acc, uint8_t *count, const unsigned char *row,
+                                   uint32_t x0, uint32_t dx, int shift, uint32_t first, uint32_t end, unsigned channels)
+{
+    uint32_t k;
+    unsigned c;
 
-    struct spng_row_info *ri = &ctx->row_info;
-    struct spng_subimage *sub = ctx->subimage;
+    for(k=first; k < end; k++, row += channels)
+    {
+        uint32_t x = (x0 + k * dx) >> shift;
 
-    while(!sub[ri->pass].width || !sub[ri->pass].height) ri->pass++;
+        for(c=0; c < channels; c++) acc[(size_t)x * channels + c] += row[c];
 
-    if(f.interlaced) ri->row_num = adam7_y_start[ri->pass];
+        count[x]++;
+    }
+}
 
-    unsigned pixel_size = 4; /* SPNG_FMT_RGBA8 */
+/* Add the converted pixels [first, end) of an interlaced pass to their output pixels */
+static void downscale_pass(const spng_ctx *ctx, const unsigned char *row, int pass, uint32_t row_num,
+                           uint32_t first, uint32_t end)
+{
+    const unsigned channels = ctx->out_bits / 8;
+    const unsigned alpha = downscale_alpha_channel(channels);
+    const int shift = ctx->downscale_shift;
+    const uint32_t out_width = ((ctx->crop_width - 1) >> shift) + 1;
+    const size_t out_pixels = (size_t)out_width * (((ctx->crop_height - 1) >> shift) + 1);
+    const size_t out_row = (size_t)((row_num - ctx->crop_y) >> shift) * out_width;
+    uint32_t *acc = (uint32_t*)ctx->downscale_buf + out_row * channels;
+    uint8_t *count = ctx->downscale_buf + out_pixels * channels * sizeof(uint32_t) + out_row;
+    const uint32_t x0 = adam7_x_start[pass] - ctx->crop_x, dx = adam7_x_delta[pass];
+    uint32_t k;
+    unsigned c;
 
-    if(fmt == SPNG_FMT_RGBA16) pixel_size = 8;
-    else if(fmt == SPNG_FMT_RGB8) pixel_size = 3;
-    else if(fmt == SPNG_FMT_G8) pixel_size = 1;
-    else if(fmt == SPNG_FMT_GA8) pixel_size = 2;
+    if(!(ctx->downscale_mode & SPNG_DOWNSCALE_LINEAR))
+    {
+        switch(channels)
+        {
+            case 1: add_pass_pixels(acc, count, row, x0, dx, shift, first, end, 1); break;
+            case 2: add_pass_pixels(acc, count, row, x0, dx, shift, first, end, 2); break;
+            case 3: add_pass_pixels(acc, count, row, x0, dx, shift, first, end, 3); break;
+            default: add_pass_pixels(acc, count, row, x0, dx, shift, first, end, 4); break;
+        }
 
-    int i;
-    for(i=ri->pass; i <= ctx->last_pass; i++)
+        return;
+    }
+
+    for(k=first; k < end; k++, row += channels)
     {
-        if(!sub[i].scanline_width) continue;
+        uint32_t x = (x0 + k * dx) >> shift;
+        uint32_t *px = acc + (size_t)x * channels;
 
-        if(fmt & (SPNG_FMT_PNG | SPNG_FMT_RAW)) sub[i].out_width = sub[i].scanline_width - 1;
-        else sub[i].out_width = (size_t)sub[i].width * pixel_size;
+        for(c=0; c < channels; c++) px[c] += c == alpha ? row[c] : ctx->linear_lut[row[c]];
 
-        if(sub[i].out_width > UINT32_MAX) return decode_err(ctx, SPNG_EOVERFLOW);
+        count[x]++;
     }
+}
 
-    /* Read the first filter byte, offsetting all reads by 1 byte.
-    The scanlines will be aligned with the start of the array with
-    the next scanline's filter byte at the end,
-    the last scanline will end up being 1 byte "shorter". */
-    ret = read_scanline_bytes(ctx, &ri->filter, 1);
-    if(ret) return decode_err(ctx, ret);
+/* Write the averages of an interlaced image after all passes */
+static void downscale_finish(const spng_ctx *ctx, unsigned char *out)
+{
+    const unsigned channels = ctx->out_bits / 8;
+    const unsigned alpha = downscale_alpha_channel(channels);
+    const int linear = ctx->downscale_mode & SPNG_DOWNSCALE_LINEAR;
+    const int shift = ctx->downscale_shift;
+    const size_t out_pixels = (size_t)(((ctx->crop_width - 1) >> shift) + 1) * (((ctx->crop_height - 1) >> shift) + 1);
+    const uint32_t *acc = (const uint32_t*)ctx->downscale_buf;
+    const uint8_t *count = ctx->downscale_buf + out_pixels * channels * sizeof(uint32_t);
+    uint64_t reciprocal[65];
+    size_t i;
+    unsigned c;
 
-    if(ri->filter > 4) return decode_err(ctx, SPNG_EFILTER);
+    for(i=0; i < 65; i++) reciprocal[i] = box_reciprocal((uint32_t)i);
 
-    if(flags & SPNG_DECODE_PROGRESSIVE)
+    for(i=0; i < out_pixels; i++)
     {
-        return 0;
+        for(c=0; c < channels; c++, out++, acc++)
+        {
+            *out = box_average(ctx, *acc, count[i], reciprocal[count[i]], linear && c != alpha);
+        }
     }
+}
 
-    do
+static int downscale_init(spng_ctx *ctx, int gamma_applied, uint32_t out_width, uint32_t out_height)
+{
+    const size_t channels = ctx->out_bits / 8;
+    size_t size;
+
+    if(ctx->ihdr.interlace_method)
     {
-        size_t ioffset = ri->row_num * ctx->image_width;
+        size_t out_pixels = (size_t)out_width * out_height;
 
-        ret = spng_decode_row(ctx, (unsigned char*)out + ioffset, ctx->image_width);
-    }while(!ret);
+        if(out_pixels / out_width != out_height) return SPNG_EOVERFLOW;
+        if(out_pixels > SIZE_MAX / (channels * sizeof(uint32_t) + 1)) return SPNG_EOVERFLOW;
 
-    if(ret != SPNG_EOI) return decode_err(ctx, ret);
+        size = out_pixels * (channels * sizeof(uint32_t) + 1);
+    }
+    else
+    {/* Column sums followed by box sums */
+        if(ctx->crop_width > SIZE_MAX / (channels * (sizeof(uint16_t) + sizeof(uint32_t))) - 4) return SPNG_EOVERFLOW;
 
-    return 0;
-}
+        size = ((size_t)ctx->crop_width * channels * sizeof(uint16_t) + 3) & ~(size_t)3;
+        size += (size_t)out_width * channels * sizeof(uint32_t);
+    }
 
-int spng_get_row_info(spng_ctx *ctx, struct spng_row_info *row_info)
-{
-    if(ctx == NULL || row_info == NULL || ctx->state < SPNG_STATE_DECODE_INIT) return 1;
+    ctx->downscale_buf = spng__reuse(ctx, ctx->downscale_buf, &ctx->downscale_buf_size, size);
+    if(ctx->downscale_buf == NULL) return SPNG_EMEM;
 
-    if(ctx->state >= SPNG_STATE_EOI) return SPNG_EOI;
+    memset(ctx->downscale_buf, 0, size);
 
-    *row_info = ctx->row_info;
+    if(!ctx->ihdr.interlace_method)
+    {
+        ctx->downscale_sums = (uint32_t*)(ctx->downscale_buf + (((size_t)ctx->crop_width * channels * sizeof(uint16_t) + 3) & ~(size_t)3));
+    }
 
-    return 0;
-}
+    if(!(ctx->downscale_mode & SPNG_DOWNSCALE_LINEAR)) return 0;
 
-static int write_chunks_before_idat(spng_ctx *ctx)
-{
-    if(ctx == NULL) return SPNG_EINTERNAL;
-    if(!ctx->encode_only) return SPNG_EINTERNAL;
-    if(!ctx->stored.ihdr) return SPNG_EINTERNAL;
+    /* Samples are sRGB unless there is a gAMA chunk,
+       or they were already corrected for a display gamma of 2.2 */
+    float exponent = 0.0f;
 
-    int ret;
-    uint32_t i;
-    size_t length;
-    const struct spng_ihdr *ihdr = &ctx->ihdr;
-    unsigned char *data = ctx->decode_plte.raw;
+    if(gamma_applied) exponent = 2.2f;
+    else if(ctx->stored.gama && ctx->gama) exponent = 100000.0f / (float)ctx->gama;
 
-    ret = write_data(ctx, spng_signature, 8);
-    if(ret) return ret;
+    unsigned i;
+    for(i=0; i < 256; i++)
+    {
+        float c = (float)i / 255.0f;
 
-    write_u32(data,     ihdr->width);
-    write_u32(data + 4, ihdr->height);
-    data[8]  = ihdr->bit_depth;
-    data[9]  = ihdr->color_type;
-    data[10] = ihdr->compression_method;
-    data[11] = ihdr->filter_method;
-    data[12] = ihdr->interlace_method;
+        if(exponent != 0.0f) c = pow(c, exponent);
+        else c = c <= 0.04045f ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
 
-    ret = write_chunk(ctx, type_ihdr, data, 13);
-    if(ret) return ret;
+        ctx->linear_lut[i] = (uint16_t)(c * 4095.0f + 0.5f);
+    }
 
-    if(ctx->stored.chrm)
+    for(i=0; i < 4096; i++)
     {
-        write_u32(data,      ctx->chrm_int.white_point_x);
-        write_u32(data + 4,  ctx->chrm_int.white_point_y);
-        write_u32(data + 8,  ctx->chrm_int.red_x);
-        write_u32(data + 12, ctx->chrm_int.red_y);
-        write_u32(data + 16, ctx->chrm_int.green_x);
-        write_u32(data + 20, ctx->chrm_int.green_y);
-        write_u32(data + 24, ctx->chrm_int.blue_x);
-        write_u32(data + 28, ctx->chrm_int.blue_y);
+        float c = (float)i / 4095.0f;
 
-        ret = write_chunk(ctx, type_chrm, data, 32);
-        if(ret) return ret;
+        if(exponent != 0.0f) c = pow(c, 1.0f / exponent);
+        else c = c <= 0.0031308f ? c * 12.92f : 1.055f * pow(c, 1.0f / 2.4f) - 0.055f;
+
+        if(c > 1.0f) c = 1.0f;
+
+        ctx->encode_lut[i] = (uint8_t)(c * 255.0f + 0.5f);
     }
 
-    if(ctx->stored.gama)
+    return 0;
+}
+
+/* Convert a defiltered scanline and write it to its row in the output image,
+   row_buf is used for interlaced images, cropping and non-temporal stores.
+
+   Each column block goes through conversion and deinterlacing or
+   the non-temporal copy or downscaling while it is still in the L1 cache,
+   only the blocks inside the crop rectangle are converted. */
+static void output_scanline(const spng_ctx *ctx, unsigned char *out, unsigned char *row_buf,
+                            const unsigned char *scanline, uint32_t row_num, int pass)
+{
+    const struct spng_subimage *sub = &ctx->subimage[pass];
+    const int direct = !ctx->ihdr.interlace_method || pass == 6;
+    const int crop = ctx->decode_flags.crop;
+    const int nontemporal = direct && ctx->decode_flags.nontemporal && (!crop || ctx->out_bits >= 8);
+    const int downscale = ctx->decode_flags.downscale;
+    const size_t out_bits = ctx->out_bits;
+    uint32_t x, n, first;
+
+    if(row_num < ctx->crop_y || row_num - ctx->crop_y >= ctx->crop_height) return;
+    if(sub->crop_first >= sub->crop_end) return;
+
+    const uint32_t y = row_num - ctx->crop_y;
+    unsigned char *row = out + (size_t)(y >> ctx->downscale_shift) * ctx->image_width;
+
+    if(ctx->decode_flags.zerocopy)
     {
-        write_u32(data, ctx->gama);
+        memcpy(row, scanline, sub->out_width);
+        return;
+    }
 
-        ret = write_chunk(ctx, type_gama, data, 4);
-        if(ret) return ret;
+    if(direct && !nontemporal && !crop && !downscale)
+    {
+        convert_scanline(ctx, row, scanline, pass);
+        return;
     }
 
-    if(ctx->stored.iccp)
+    for(x = sub->crop_first & ~7u; x < sub->crop_end; x += n)
     {
-        uLongf dest_len = compressBound((uLong)ctx->iccp.profile_len);
+        n = sub->crop_end - x < ctx->convert_block ? sub->crop_end - x : ctx->convert_block;
+        first = x > sub->crop_first ? x : sub->crop_first;
 
-        Bytef *buf = spng__malloc(ctx, dest_len);
-        if(buf == NULL) return SPNG_EMEM;
+        ctx->convert_row(ctx, row_buf, scanline + (size_t)x * ctx->scanline_bits / 8, n);
 
-        ret = compress2(buf, &dest_len, (void*)ctx->iccp.profile, (uLong)ctx->iccp.profile_len, Z_DEFAULT_COMPRESSION);
+        if(downscale)
+        {
+            const unsigned char *pixels = row_buf + (first - x) * out_bits / 8;
 
-        if(ret != Z_OK)
+            if(ctx->ihdr.interlace_method) downscale_pass(ctx, pixels, pass, row_num, first, x + n);
+            else downscale_accumulate(ctx, pixels, first, x + n - first);
+        }
+        else if(nontemporal)
         {
-            spng__free(ctx, buf);
-            return SPNG_EZLIB;
+            copy_nontemporal(row + (first - ctx->crop_x) * out_bits / 8, row_buf + (first - x) * out_bits / 8,
+                             ((x + n - first) * out_bits + 7) / 8);
         }
+        else deinterlace_block(ctx, row, row_buf, pass, x, first, x + n);
+    }
 
-        size_t name_len = strlen(ctx->iccp.profile_name);
+    if(nontemporal) nontemporal_fence();
 
-        length = name_len + 2;
-        length += dest_len;
+    if(downscale && !ctx->ihdr.interlace_method)
+    {
+        const uint32_t box = 1u << ctx->downscale_shift;
 
-        if(dest_len > length) return SPNG_EOVERFLOW;
+        if((y & (box - 1)) == box - 1 || y == ctx->crop_height - 1) downscale_band(ctx, row, (y & (box - 1)) + 1);
+    }
+}
 
-        unsigned char *cdata = NULL;
+/* Decode a non-interlaced image that has the same layout as the output format,
+   scanlines are inflated directly to the output buffer and defiltered in-place
+   against the previous row of the output. */
+static int decode_zerocopy(spng_ctx *ctx, unsigned char *out)
+{
+    int ret;
+    struct spng_row_info *ri = &ctx->row_info;
+    const size_t scanline_width = ctx->subimage[0].scanline_width;
+    const uint32_t last_row = ctx->subimage[0].height - 1;
+    const int swap = ctx->ihdr.bit_depth == 16 && ctx->fmt != SPNG_FMT_RAW;
+    const unsigned char *prev = ctx->prev_scanline_buf;
+    unsigned char *row;
+    uint8_t next_filter = 0;
 
-        ret = write_header(ctx, type_iccp, length, &cdata);
+    /* prev_scanline is all zeros for the first scanline */
+    memset(ctx->prev_scanline_buf, 0, scanline_width);
 
-        if(ret)
+    do
+    {
+        row = out + (size_t)ri->row_num * ctx->image_width;
+
+        ret = read_scanline_bytes(ctx, row, scanline_width - 1);
+        if(ret) return ret;
+
+        if(ri->row_num != last_row)
         {
-            spng__free(ctx, buf);
-            return ret;
-        }
+            ret = read_scanline_bytes(ctx, &next_filter, 1);
+            if(ret) return ret;
 
-        memcpy(cdata, ctx->iccp.profile_name, name_len + 1);
-        cdata[name_len + 1] = 0; /* compression method */
-        memcpy(cdata + name_len + 2, buf, dest_len);
+            if(next_filter > 4) return SPNG_EFILTER;
+        }
 
-        spng__free(ctx, buf);
+        if(swap) u16_row_to_host(row, scanline_width - 1);
 
-        ret = finish_chunk(ctx);
+        ret = defilter_scanline(prev, row, scanline_width, ctx->bytes_per_pixel, ri->filter, ctx->simd_level);
         if(ret) return ret;
-    }
 
-    if(ctx->stored.sbit)
-    {
-        switch(ctx->ihdr.color_type)
-        {
-            case SPNG_COLOR_TYPE_GRAYSCALE:
-            {
-                length = 1;
+        ri->filter = next_filter;
+        prev = row;
 
-                data[0] = ctx->sbit.grayscale_bits;
+        ret = update_row_info(ctx);
+    }while(!ret);
 
-                break;
-            }
-            case SPNG_COLOR_TYPE_TRUECOLOR:
-            case SPNG_COLOR_TYPE_INDEXED:
-            {
-                length = 3;
+    if(ret == SPNG_EOI) ret = end_of_idat(ctx);
 
-                data[0] = ctx->sbit.red_bits;
-                data[1] = ctx->sbit.green_bits;
-                data[2] = ctx->sbit.blue_bits;
+    return ret;
+}
 
-                break;
-            }
-            case SPNG_COLOR_TYPE_GRAYSCALE_ALPHA:
-            {
-                length = 2;
+/* Buffer input only: check if the current IDAT is followed by another one
+   without reading the chunk header */
+static int next_chunk_is_idat(const spng_ctx *ctx)
+{
+    if(ctx->streaming || ctx->cur_chunk_bytes_left) return 0;
 
-                data[0] = ctx->sbit.grayscale_bits;
-                data[1] = ctx->sbit.alpha_bits;
+    /* The crc of the current chunk and the next chunk header */
+    if(ctx->bytes_left < 12) return 0;
 
-                break;
-            }
-            case SPNG_COLOR_TYPE_TRUECOLOR_ALPHA:
-            {
-                length = 4;
+    const unsigned char *next = ctx->data + ctx->last_read_size;
 
-                data[0] = ctx->sbit.red_bits;
-                data[1] = ctx->sbit.green_bits;
-                data[2] = ctx->sbit.blue_bits;
-                data[3] = ctx->sbit.alpha_bits;
+    return !memcmp(next + 8, type_idat, 4);
+}
 
-                break;
-            }
-            default: return SPNG_EINTERNAL;
-        }
+/* Collect the rest of the zlib stream, starting with the unread input of the current IDAT.
+   *data points into the PNG buffer if the stream is not split across IDAT's */
+static int gather_idat(spng_ctx *ctx, const unsigned char **data, size_t *len)
+{
+    int ret;
+    z_stream *zstream = &ctx->zstream;
+    size_t size = zstream->avail_in;
 
-        ret = write_chunk(ctx, type_sbit, data, length);
-        if(ret) return ret;
-    }
+    *data = zstream->next_in;
+    *len = size;
 
-    if(ctx->stored.srgb)
+    if(!next_chunk_is_idat(ctx)) return 0;
+
+    while(next_chunk_is_idat(ctx))
     {
-        ret = write_chunk(ctx, type_srgb, &ctx->srgb_rendering_intent, 1);
+        ret = read_header(ctx);
         if(ret) return ret;
-    }
 
-    ret = write_unknown_chunks(ctx, SPNG_AFTER_IHDR);
-    if(ret) return ret;
+        uint32_t length = ctx->current_chunk.length;
 
-    if(ctx->stored.plte)
-    {
-        for(i=0; i < ctx->plte.n_entries; i++)
-        {
-            data[i * 3 + 0] = ctx->plte.entries[i].red;
-            data[i * 3 + 1] = ctx->plte.entries[i].green;
-            data[i * 3 + 2] = ctx->plte.entries[i].blue;
-        }
+        if(!length) continue;
 
-        ret = write_chunk(ctx, type_plte, data, ctx->plte.n_entries * 3);
+        ret = read_chunk_bytes(ctx, length);
         if(ret) return ret;
-    }
 
-    if(ctx->stored.bkgd)
-    {
-        switch(ctx->ihdr.color_type)
-        {
-            case SPNG_COLOR_TYPE_GRAYSCALE:
-            case SPNG_COLOR_TYPE_GRAYSCALE_ALPHA:
-            {
-                length = 2;
+        size_t required = size + length;
+        if(required < size) return SPNG_EOVERFLOW;
 
-                write_u16(data, ctx->bkgd.gray);
+        if(required > ctx->idat_buf_size)
+        {
+            size_t new_size = ctx->idat_buf_size ? ctx->idat_buf_size : (size_t)SPNG_READ_SIZE * 8;
 
-                break;
-            }
-            case SPNG_COLOR_TYPE_TRUECOLOR:
-            case SPNG_COLOR_TYPE_TRUECOLOR_ALPHA:
+            while(new_size < required)
             {
-                length = 6;
+                if(new_size > SIZE_MAX / 2) return SPNG_EOVERFLOW;
+                new_size *= 2;
+            }
 
-                write_u16(data,     ctx->bkgd.red);
-                write_u16(data + 2, ctx->bkgd.green);
-                write_u16(data + 4, ctx->bkgd.blue);
+            /* The first IDAT's data may still point into the PNG buffer */
+            unsigned char *buf = spng__malloc(ctx, new_size);
+            if(buf == NULL) return SPNG_EMEM;
 
-                break;
-            }
-            case SPNG_COLOR_TYPE_INDEXED:
-            {
-                length = 1;
+            memcpy(buf, *data, size);
 
-                data[0] = ctx->bkgd.plte_index;
+            spng__free(ctx, ctx->idat_buf);
 
-                break;
-            }
-            default: return SPNG_EINTERNAL;
+            ctx->idat_buf = buf;
+            ctx->idat_buf_size = new_size;
         }
+        else if(*data != ctx->idat_buf) memcpy(ctx->idat_buf, *data, size);
 
-        ret = write_chunk(ctx, type_bkgd, data, length);
-        if(ret) return ret;
+        memcpy(ctx->idat_buf + size, ctx->data, length);
+
+        size = required;
+
+        *data = ctx->idat_buf;
+        *len = size;
     }
 
-    if(ctx->stored.hist)
-    {
-        length = ctx->plte.n_entries * 2;
+    return 0;
+}
 
-        for(i=0; i < ctx->plte.n_entries; i++)
-        {
-            write_u16(data + i * 2, ctx->hist.frequency[i]);
-        }
+#ifdef SPNG_INFLATE_SPECULATIVE_SUPPORTED
+/* Speculative parallel inflate
 
-        ret = write_chunk(ctx, type_hist, data, length);
-        if(ret) return ret;
-    }
+   The deflate stream is split into ranges of at least SPNG_SPECULATIVE_MIN_RANGE bytes,
+   each worker searches its range for the first dynamic Huffman or stored block header
+   and inflates from there without knowing the previous 32 KiB of output.
 
-    if(ctx->stored.trns)
-    {
-        if(ctx->ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE)
-        {
-            write_u16(data, ctx->trns.gray);
+   Each range is inflated twice with preset dictionaries that encode the window position
+   in the output: bytes copied from the unknown window differ between the two,
+   their window position is recovered from both bytes and they are resolved once the
+   previous range is done. After 32 KiB of output without such bytes no back-reference
+   can reach the unknown window and the second stream is stopped.
 
-            ret = write_chunk(ctx, type_trns, data, 2);
-        }
-        else if(ctx->ihdr.color_type == SPNG_COLOR_TYPE_TRUECOLOR)
-        {
-            write_u16(data,     ctx->trns.red);
-            write_u16(data + 2, ctx->trns.green);
-            write_u16(data + 4, ctx->trns.blue);
+   Ranges are joined in order where a range ends at the block the next one starts with,
+   gaps (a false positive block header or fixed Huffman blocks) are inflated serially.
+   If the result is inconsistent the image is inflated with zlib as usual.
+*/
+struct spng__spec_range
+{
+    uint64_t first; /* bit offsets of the range in the deflate stream */
+    uint64_t last;
+
+    uint64_t start; /* bit offset of the first block */
+    uint64_t end; /* block boundary after the range, or the checksum for the final block */
+    int final;
+
+    unsigned char *out;
+    unsigned char *alt; /* second inflate, only the first prefix_len bytes are valid */
+    size_t out_len;
+    size_t out_cap;
+    size_t alt_cap;
+    size_t prefix_len; /* bytes which may come from the unknown window */
+    size_t window_len; /* known output before out */
+    int fixed; /* out is not reallocated */
+    int valid;
+};
 
-            ret = write_chunk(ctx, type_trns, data, 6);
-        }
-        else if(ctx->ihdr.color_type == SPNG_COLOR_TYPE_INDEXED)
-        {
-            ret = write_chunk(ctx, type_trns, ctx->trns.type3_alpha, ctx->trns.n_type3_entries);
-        }
+struct spng__spec_pool
+{
+    spng_ctx *ctx;
+    const unsigned char *in; /* without the zlib header */
+    size_t in_len;
+    size_t out_limit;
 
-        if(ret) return ret;
-    }
+    unsigned char *dict[2];
 
-    if(ctx->stored.phys)
-    {
-        write_u32(data,     ctx->phys.ppu_x);
-        write_u32(data + 4, ctx->phys.ppu_y);
-        data[8] = ctx->phys.unit_specifier;
+    struct spng__spec_range *ranges;
+    uint32_t n_ranges;
+    uint32_t next_range;
 
-        ret = write_chunk(ctx, type_phys, data, 9);
-        if(ret) return ret;
-    }
-
-    if(ctx->stored.splt)
-    {
-        const struct spng_splt *splt;
-        unsigned char *cdata = NULL;
-
-        uint32_t k;
-        for(i=0; i < ctx->n_splt; i++)
-        {
-            splt = &ctx->splt_list[i];
+    int error; /* SPNG_EMEM */
 
-            size_t name_len = strlen(splt->name);
-            length = name_len + 1;
-
-            if(splt->sample_depth == 8) length += splt->n_entries * 6 + 1;
-            else if(splt->sample_depth == 16) length += splt->n_entries * 10 + 1;
+    pthread_mutex_t lock;
+};
 
-            ret = write_header(ctx, type_splt, length, &cdata);
-            if(ret) return ret;
+static const uint8_t spec_clen_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
 
-            memcpy(cdata, splt->name, name_len + 1);
-            cdata += name_len + 2;
-            cdata[-1] = splt->sample_depth;
+/* Read n <= 24 bits at bit offset pos, bits past the end read as zero */
+static uint32_t spec_bits(const unsigned char *in, size_t len, uint64_t pos, int n)
+{
+    size_t i = (size_t)(pos >> 3);
+    uint32_t v = 0;
+    int k;
 
-            if(splt->sample_depth == 8)
-            {
-                for(k=0; k < splt->n_entries; k++)
-                {
-                    cdata[k * 6 + 0] = splt->entries[k].red;
-                    cdata[k * 6 + 1] = splt->entries[k].green;
-                    cdata[k * 6 + 2] = splt->entries[k].blue;
-                    cdata[k * 6 + 3] = splt->entries[k].alpha;
-                    write_u16(cdata + k * 6 + 4, splt->entries[k].frequency);
-                }
-            }
-            else if(splt->sample_depth == 16)
-            {
-                for(k=0; k < splt->n_entries; k++)
-                {
-                    write_u16(cdata + k * 10 + 0, splt->entries[k].red);
-                    write_u16(cdata + k * 10 + 2, splt->entries[k].green);
-                    write_u16(cdata + k * 10 + 4, splt->entries[k].blue);
-                    write_u16(cdata + k * 10 + 6, splt->entries[k].alpha);
-                    write_u16(cdata + k * 10 + 8, splt->entries[k].frequency);
-                }
-            }
+    for(k=0; k < 4 && i + k < len; k++) v |= (uint32_t)in[i + k] << (8 * k);
 
-            ret = finish_chunk(ctx);
-            if(ret) return ret;
-        }
-    }
+    return (v >> (pos & 7)) & ((1u << n) - 1);
+}
 
-    if(ctx->stored.time)
-    {
-        write_u16(data, ctx->time.year);
-        data[2] = ctx->time.month;
-        data[3] = ctx->time.day;
-        data[4] = ctx->time.hour;
-        data[5] = ctx->time.minute;
-        data[6] = ctx->time.second;
+/* Same rules as zlib's inflate_table(): over-subscribed codes are invalid,
+   incomplete codes are only valid for lengths and distances with a single 1-bit code */
+static int spec_code_valid(const unsigned char *lens, unsigned n, int code_lengths)
+{
+    unsigned count[16] = {0};
+    unsigned i, max = 0;
+    int left = 1;
 
-        ret = write_chunk(ctx, type_time, data, 7);
-        if(ret) return ret;
-    }
+    for(i=0; i < n; i++) count[lens[i]]++;
 
-    if(ctx->stored.text)
+    for(i=1; i <= 15; i++)
     {
-        unsigned char *cdata = NULL;
-        const struct spng_text2 *text;
-        const uint8_t *text_type_array[4] = { 0, type_text, type_ztxt, type_itxt };
+        if(count[i]) max = i;
 
-        for(i=0; i < ctx->n_text; i++)
-        {
-            text = &ctx->text_list[i];
+        left <<= 1;
+        left -= count[i];
 
-            const uint8_t *text_chunk_type = text_type_array[text->type];
-            Bytef *compressed_text = NULL;
-            size_t keyword_len = 0;
-            size_t language_tag_len = 0;
-            size_t translated_keyword_len = 0;
-            size_t compressed_length = 0;
-            size_t text_length = 0;
+        if(left < 0) return 0;
+    }
 
-            keyword_len = strlen(text->keyword);
-            text_length = strlen(text->text);
+    if(!max) return !code_lengths;
 
-            length = keyword_len + 1;
+    if(left > 0 && (code_lengths || max != 1)) return 0;
 
-            if(text->type == SPNG_ZTXT)
-            {
-                length += 1; /* compression method */
-            }
-            else if(text->type == SPNG_ITXT)
-            {
-                if(!text->language_tag || !text->translated_keyword) return SPNG_EINTERNAL;
+    return 1;
+}
 
-                language_tag_len = strlen(text->language_tag);
-                translated_keyword_len = strlen(text->translated_keyword);
+/* Check for a non-final dynamic Huffman or stored block header at bit offset pos */
+static int spec_block_header(const unsigned char *in, size_t len, uint64_t pos)
+{
+    uint32_t type = spec_bits(in, len, pos, 3);
 
-                length += language_tag_len;
-                if(length < language_tag_len) return SPNG_EOVERFLOW;
+    if(type == 0) /* stored, LEN is the one's complement of NLEN */
+    {
+        size_t p = (size_t)((pos + 10) >> 3);
 
-                length += translated_keyword_len;
-                if(length < translated_keyword_len) return SPNG_EOVERFLOW;
+        if(p + 4 > len) return 0;
 
-                length += 4; /* compression flag + method + nul for the two strings */
-                if(length < 4) return SPNG_EOVERFLOW;
-            }
+        return (read_u16(in + p) ^ read_u16(in + p + 2)) == 0xffff;
+    }
 
-            if(text->compression_flag)
-            {
-                ret = spng__deflate_init(ctx, &ctx->text_options);
-                if(ret) return ret;
+    if(type != 4) return 0; /* not BFINAL = 0, BTYPE = 2 */
 
-                z_stream *zstream = &ctx->zstream;
-                uLongf dest_len = deflateBound(zstream, (uLong)text_length);
+    unsigned hlit = spec_bits(in, len, pos + 3, 5) + 257;
+    unsigned hdist = spec_bits(in, len, pos + 8, 5) + 1;
+    unsigned hclen = spec_bits(in, len, pos + 13, 4) + 4;
+    unsigned i, n = 0;
 
-                compressed_text = spng__malloc(ctx, dest_len);
+    if(hlit > 286 || hdist > 30) return 0;
 
-                if(compressed_text == NULL) return SPNG_EMEM;
+    unsigned char clens[19] = {0};
 
-                zstream->next_in = (void*)text->text;
-                zstream->avail_in = (uInt)text_length;
+    pos += 17;
 
-                zstream->next_out = compressed_text;
-                zstream->avail_out = dest_len;
+    for(i=0; i < hclen; i++, pos += 3) clens[spec_clen_order[i]] = spec_bits(in, len, pos, 3);
 
-                ret = deflate(zstream, Z_FINISH);
+    if(!spec_code_valid(clens, 19, 1)) return 0;
 
-                if(ret != Z_STREAM_END)
-                {
-                    spng__free(ctx, compressed_text);
-                    return SPNG_EZLIB;
-                }
+    /* Lookup table for the complete code length code, indexed by the next 7 bits */
+    unsigned char sym[128], sym_len[128];
+    unsigned code = 0, l;
 
-                compressed_length = zstream->total_out;
+    for(l=1; l <= 7; l++)
+    {
+        for(i=0; i < 19; i++)
+        {
+            if(clens[i] != l) continue;
 
-                length += compressed_length;
-                if(length < compressed_length) return SPNG_EOVERFLOW;
-            }
-            else
-            {
-                text_length = strlen(text->text);
+            unsigned rev = 0, k;
 
-                length += text_length;
-                if(length < text_length) return SPNG_EOVERFLOW;
-            }
+            for(k=0; k < l; k++) rev |= ((code >> k) & 1) << (l - 1 - k);
 
-            ret = write_header(ctx, text_chunk_type, length, &cdata);
-            if(ret)
+            for(k=rev; k < 128; k += 1u << l)
             {
-                spng__free(ctx, compressed_text);
-                return ret;
+                sym[k] = (unsigned char)i;
+                sym_len[k] = (unsigned char)l;
             }
 
-            memcpy(cdata, text->keyword, keyword_len + 1);
-            cdata += keyword_len + 1;
+            code++;
+        }
 
-            if(text->type == SPNG_ITXT)
-            {
-                cdata[0] = text->compression_flag;
-                cdata[1] = 0; /* compression method */
-                cdata += 2;
+        code <<= 1;
+    }
 
-                memcpy(cdata, text->language_tag, language_tag_len + 1);
-                cdata += language_tag_len + 1;
+    unsigned char lens[286 + 30];
+    const unsigned total = hlit + hdist;
 
-                memcpy(cdata, text->translated_keyword, translated_keyword_len + 1);
-                cdata += translated_keyword_len + 1;
-            }
-            else if(text->type == SPNG_ZTXT)
-            {
-                cdata[0] = 0; /* compression method */
-                cdata++;
-            }
+    while(n < total)
+    {
+        if((pos >> 3) >= len) return 0;
 
-            if(text->compression_flag) memcpy(cdata, compressed_text, compressed_length);
-            else memcpy(cdata, text->text, text_length);
+        uint32_t peek = spec_bits(in, len, pos, 7);
+        unsigned s = sym[peek], rep;
+        unsigned char value = 0;
 
-            spng__free(ctx, compressed_text);
+        pos += sym_len[peek];
 
-            ret = finish_chunk(ctx);
-            if(ret) return ret;
+        if(s < 16)
+        {
+            lens[n++] = (unsigned char)s;
+            continue;
         }
-    }
 
-    if(ctx->stored.offs)
-    {
-        write_s32(data,     ctx->offs.x);
-        write_s32(data + 4, ctx->offs.y);
-        data[8] = ctx->offs.unit_specifier;
+        if(s == 16)
+        {
+            if(!n) return 0;
 
-        ret = write_chunk(ctx, type_offs, data, 9);
-        if(ret) return ret;
-    }
+            value = lens[n - 1];
+            rep = 3 + spec_bits(in, len, pos, 2);
+            pos += 2;
+        }
+        else if(s == 17)
+        {
+            rep = 3 + spec_bits(in, len, pos, 3);
+            pos += 3;
+        }
+        else
+        {
+            rep = 11 + spec_bits(in, len, pos, 7);
+            pos += 7;
+        }
 
-    if(ctx->stored.exif)
-    {
-        ret = write_chunk(ctx, type_exif, ctx->exif.data, ctx->exif.length);
-        if(ret) return ret;
+        if(n + rep > total) return 0;
+
+        while(rep--) lens[n++] = value;
     }
 
-    ret = write_unknown_chunks(ctx, SPNG_AFTER_PLTE);
-    if(ret) return ret;
+    if(!lens[256]) return 0; /* no end-of-block code */
 
-    return 0;
+    return spec_code_valid(lens, hlit, 0) && spec_code_valid(lens + hlit, hdist, 0);
 }
 
-static int write_chunks_after_idat(spng_ctx *ctx)
+/* Position a raw inflate stream at bit offset pos with a preset window */
+static int spec_seek(z_stream *zstream, const struct spng__spec_pool *pool, uint64_t pos,
+                     const unsigned char *window, size_t window_len)
 {
-    if(ctx == NULL) return SPNG_EINTERNAL;
-
-    int ret = write_unknown_chunks(ctx, SPNG_AFTER_IDAT);
-    if(ret) return ret;
+    const size_t byte = (size_t)(pos >> 3);
+    const int bits = pos & 7;
 
-    return write_iend(ctx);
-}
+    if(byte >= pool->in_len) return SPNG_EIDAT_TOO_SHORT;
 
-/* Compress and write scanline to IDAT stream */
-static int write_idat_bytes(spng_ctx *ctx, const void *scanline, size_t len, int flush)
-{
-    if(ctx == NULL || scanline == NULL) return SPNG_EINTERNAL;
-    if(len > UINT_MAX) return SPNG_EINTERNAL;
+    if(inflateReset(zstream) != Z_OK) return SPNG_EZLIB;
 
-    int ret = 0;
-    unsigned char *data = NULL;
-    z_stream *zstream = &ctx->zstream;
-    uint32_t idat_length = SPNG_WRITE_SIZE;
+    if(window_len && inflateSetDictionary(zstream, window, (uInt)window_len) != Z_OK) return SPNG_EZLIB;
 
-    zstream->next_in = scanline;
-    zstream->avail_in = (uInt)len;
+    zstream->next_in = pool->in + byte;
+    zstream->avail_in = (uInt)(pool->in_len - byte);
 
-    do
+    if(bits)
     {
-        ret = deflate(zstream, flush);
-
-        if(zstream->avail_out == 0)
-        {
-            ret = finish_chunk(ctx);
-            if(ret) return encode_err(ctx, ret);
-
-            ret = write_header(ctx, type_idat, idat_length, &data);
-            if(ret) return encode_err(ctx, ret);
-
-            zstream->next_out = data;
-            zstream->avail_out = idat_length;
-        }
-
-    }while(zstream->avail_in);
+        if(inflatePrime(zstream, 8 - bits, pool->in[byte] >> bits) != Z_OK) return SPNG_EZLIB;
 
-    if(ret != Z_OK) return SPNG_EZLIB;
+        zstream->next_in++;
+        zstream->avail_in--;
+    }
 
     return 0;
 }
 
-static int finish_idat(spng_ctx *ctx)
+/* Inflate from r->start until a block boundary at or after r->last or the end of the stream,
+   with speculative set the window is unknown, otherwise it's the r->window_len bytes before r->out.
+   Returns non-zero if the data is not decodable from r->start, SPNG_EMEM is the only hard error. */
+static int spec_inflate_range(struct spng__spec_pool *pool, struct spng__spec_range *r, z_stream zstream[2], int speculative)
 {
-    int ret = 0;
-    unsigned char *data = NULL;
-    z_stream *zstream = &ctx->zstream;
-    uint32_t idat_length = SPNG_WRITE_SIZE;
+    spng_ctx *ctx = pool->ctx;
+    size_t last_marker = 0;
+    int active = speculative, ret;
+    unsigned char spare;
 
-    while(ret != Z_STREAM_END)
+    r->out_len = 0;
+    r->prefix_len = 0;
+    r->final = 0;
+
+    if(speculative)
     {
-        ret = deflate(zstream, Z_FINISH);
+        ret = spec_seek(&zstream[0], pool, r->start, pool->dict[0], 32768);
+        if(!ret) ret = spec_seek(&zstream[1], pool, r->start, pool->dict[1], 32768);
+    }
+    else ret = spec_seek(&zstream[0], pool, r->start, r->out - r->window_len, r->window_len);
 
-        if(ret)
+    if(ret) return ret;
+
+    while(1)
+    {
+        if(r->out_len == r->out_cap && !r->fixed && r->out_cap < pool->out_limit)
         {
-            if(ret == Z_STREAM_END) break;
+            size_t cap = r->out_cap ? r->out_cap * 2 : SPNG_SPECULATIVE_STEP * 4;
 
-            if(ret != Z_BUF_ERROR) return SPNG_EZLIB;
+            if(cap > pool->out_limit || cap < r->out_cap) cap = pool->out_limit;
+
+            unsigned char *buf = spng__realloc(ctx, r->out, cap);
+            if(buf == NULL) return SPNG_EMEM;
+
+            r->out = buf;
+            r->out_cap = cap;
         }
 
-        if(zstream->avail_out == 0)
+        if(active && r->alt_cap < r->out_cap)
         {
-            ret = finish_chunk(ctx);
-            if(ret) return encode_err(ctx, ret);
-
-            ret = write_header(ctx, type_idat, idat_length, &data);
-            if(ret) return encode_err(ctx, ret);
+            unsigned char *buf = spng__realloc(ctx, r->alt, r->out_cap);
+            if(buf == NULL) return SPNG_EMEM;
 
-            zstream->next_out = data;
-            zstream->avail_out = idat_length;
+            r->alt = buf;
+            r->alt_cap = r->out_cap;
         }
-    }
 
-    uint32_t trimmed_length = idat_length - zstream->avail_out;
+        size_t avail = r->out_cap - r->out_len;
 
-    ret = trim_chunk(ctx, trimmed_length);
-    if(ret) return ret;
+        if(avail > SPNG_SPECULATIVE_STEP) avail = SPNG_SPECULATIVE_STEP;
 
-    return finish_chunk(ctx);
-}
+        /* The last bytes may be followed by end-of-block codes only */
+        if(avail) zstream[0].next_out = r->out + r->out_len;
+        else zstream[0].next_out = &spare;
 
-static int encode_scanline(spng_ctx *ctx, const void *scanline, size_t len)
-{
-    if(ctx == NULL || scanline == NULL) return SPNG_EINTERNAL;
+        zstream[0].avail_out = avail ? (uInt)avail : 1;
 
-    int ret, pass = ctx->row_info.pass;
-    uint8_t filter = 0;
-    struct spng_row_info *ri = &ctx->row_info;
-    const struct spng_subimage *sub = ctx->subimage;
-    struct encode_flags f = ctx->encode_flags;
-    unsigned char *filtered_scanline = ctx->filtered_scanline;
-    size_t scanline_width = sub[pass].scanline_width;
+        int zret = inflate(&zstream[0], Z_BLOCK);
 
-    if(len < scanline_width - 1) return SPNG_EINTERNAL;
+        if(zret != Z_OK && zret != Z_STREAM_END) return SPNG_EIDAT_STREAM;
 
-    /* encode_row() interlaces directly to ctx->scanline */
-    if(scanline != ctx->scanline) memcpy(ctx->scanline, scanline, scanline_width - 1);
+        if(!avail)
+        {
+            if(!zstream[0].avail_out) return SPNG_EIDAT_STREAM;
+        }
+        else if(avail - zstream[0].avail_out)
+        {
+            size_t produced = avail - zstream[0].avail_out;
 
-    if(f.to_bigendian) u16_row_to_bigendian(ctx->scanline, scanline_width - 1);
-    const int requires_previous = f.filter_choice & (SPNG_FILTER_CHOICE_UP | SPNG_FILTER_CHOICE_AVG | SPNG_FILTER_CHOICE_PAETH);
+            if(active)
+            {
+                zstream[1].next_out = r->alt + r->out_len;
+                zstream[1].avail_out = (uInt)produced;
 
-    /* XXX: exclude 'requires_previous' filters by default for first scanline? */
-    if(!ri->scanline_idx && requires_previous)
-    {
-        /* prev_scanline is all zeros for the first scanline */
-        memset(ctx->prev_scanline, 0, scanline_width);
-    }
+                while(zstream[1].avail_out)
+                {
+                    int alt_ret = inflate(&zstream[1], Z_NO_FLUSH);
 
-    filter = get_best_filter(ctx->prev_scanline, ctx->scanline, scanline_width, ctx->bytes_per_pixel, f.filter_choice);
+                    if(alt_ret == Z_STREAM_END) break;
+                    if(alt_ret != Z_OK) return SPNG_EIDAT_STREAM;
+                }
 
-    if(!filter) filtered_scanline = ctx->scanline;
+                if(zstream[1].avail_out) return SPNG_EIDAT_STREAM;
 
-    filtered_scanline[-1] = filter;
+                /* Find the last byte from the unknown window */
+                size_t i = produced;
 
-    if(filter)
-    {
-        ret = filter_scanline(filtered_scanline, ctx->prev_scanline, ctx->scanline, scanline_width, ctx->bytes_per_pixel, filter);
-        if(ret) return encode_err(ctx, ret);
-    }
+                while(i && r->out[r->out_len + i - 1] == r->alt[r->out_len + i - 1]) i--;
 
-    ret = write_idat_bytes(ctx, filtered_scanline - 1, scanline_width, Z_NO_FLUSH);
-    if(ret) return encode_err(ctx, ret);
+                if(i) last_marker = r->out_len + i;
+            }
 
-    /* The previous scanline is always unfiltered */
-    void *t = ctx->prev_scanline;
-    ctx->prev_scanline = ctx->scanline;
-    ctx->scanline = t;
+            r->out_len += produced;
 
-    ret = update_row_info(ctx);
+            if(active && r->out_len - last_marker >= 32768) active = 0;
+        }
 
-    if(ret == SPNG_EOI)
-    {
-        int error = finish_idat(ctx);
-        if(error) encode_err(ctx, error);
+        if(zret == Z_STREAM_END)
+        {
+            /* Unused bits before the checksum */
+            size_t bytes_left = (zstream[0].data_type & 63) >> 3;
 
-        if(f.finalize)
+            r->end = (uint64_t)(zstream[0].next_in - pool->in - bytes_left) * 8;
+            r->final = 1;
+            break;
+        }
+
+        if(zstream[0].data_type & 128) /* at a block boundary */
         {
-            error = spng_encode_chunks(ctx);
-            if(error) return encode_err(ctx, error);
+            uint64_t pos = (uint64_t)(zstream[0].next_in - pool->in) * 8 - (zstream[0].data_type & 7);
+
+            if(pos >= r->last)
+            {
+                r->end = pos;
+                break;
+            }
         }
+        else if(!zstream[0].avail_in) return SPNG_EIDAT_TOO_SHORT;
     }
 
-    return ret;
+    if(speculative) r->prefix_len = last_marker;
+
+    return 0;
 }
 
-static int encode_row(spng_ctx *ctx, const void *row, size_t len)
+static void *spec_worker(void *arg)
 {
-    if(ctx == NULL || row == NULL) return SPNG_EINTERNAL;
+    struct spng__spec_pool *pool = arg;
+    spng_ctx *ctx = pool->ctx;
+    z_stream zstream[2] = {{0}};
+    int i, ret = 0, n_init = 0;
 
-    const int pass = ctx->row_info.pass;
+    for(i=0; i < 2; i++)
+    {
+        zstream[i].zalloc = spng__zalloc;
+        zstream[i].zfree = spng__zfree;
+        zstream[i].opaque = ctx;
 
-    if(!ctx->ihdr.interlace_method || pass == 6) return encode_scanline(ctx, row, len);
+        if(inflateInit2(&zstream[i], -15) != Z_OK) break;
 
-    uint32_t k;
-    const unsigned pixel_size = ctx->pixel_size;
-    const unsigned bit_depth = ctx->ihdr.bit_depth;
+        n_init++;
+    }
 
-    if(bit_depth < 8)
+    while(n_init == 2)
     {
-        const unsigned samples_per_byte = 8 / bit_depth;
-        const uint8_t mask = (1 << bit_depth) - 1;
-        const unsigned initial_shift = 8 - bit_depth;
-        unsigned shift_amount = initial_shift;
-
-        unsigned char *scanline = ctx->scanline;
-        const unsigned char *row_uc = row;
-        uint8_t sample;
-
-        memset(scanline, 0, ctx->subimage[pass].scanline_width);
+        pthread_mutex_lock(&pool->lock);
 
-        for(k=0; k < ctx->subimage[pass].width; k++)
+        if(pool->error || pool->next_range >= pool->n_ranges)
         {
-            size_t ioffset = adam7_x_start[pass] + k * adam7_x_delta[pass];
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
 
-            sample = row_uc[ioffset / samples_per_byte];
+        struct spng__spec_range *r = &pool->ranges[pool->next_range++];
 
-            sample = sample >> (initial_shift - ioffset * bit_depth % 8);
-            sample = sample & mask;
-            sample = sample << shift_amount;
+        pthread_mutex_unlock(&pool->lock);
 
-            scanline[0] |= sample;
+        /* Try every block header candidate in the range until one can be inflated */
+        for(r->start = r->first; r->start < r->last; r->start++)
+        {
+            if(!spec_block_header(pool->in, pool->in_len, r->start)) continue;
 
-            shift_amount -= bit_depth;
+            ret = spec_inflate_range(pool, r, zstream, 1);
 
-            if(shift_amount > 7)
+            if(!ret)
             {
-                shift_amount = initial_shift;
-                scanline++;
+                r->valid = 1;
+                break;
             }
+
+            if(ret == SPNG_EMEM) break;
         }
 
-        return encode_scanline(ctx, ctx->scanline, len);
+        if(ret == SPNG_EMEM)
+        {
+            pthread_mutex_lock(&pool->lock);
+            pool->error = ret;
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
     }
 
-    for(k=0; k < ctx->subimage[pass].width; k++)
-    {
-        size_t ioffset = (adam7_x_start[pass] + (size_t) k * adam7_x_delta[pass]) * pixel_size;
-
-        memcpy(ctx->scanline + k * pixel_size, (unsigned char*)row + ioffset, pixel_size);
-    }
+    for(i=0; i < n_init; i++) inflateEnd(&zstream[i]);
 
-    return encode_scanline(ctx, ctx->scanline, len);
+    return NULL;
 }
 
-int spng_encode_scanline(spng_ctx *ctx, const void *scanline, size_t len)
+/* Inflate a zlib stream from memory in parallel, *decoded is set to zero if it has to be inflated serially */
+static int inflate_speculative(spng_ctx *ctx, const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len, int *decoded)
 {
-    if(ctx == NULL || scanline == NULL) return SPNG_EINVAL;
-    if(ctx->state >= SPNG_STATE_EOI) return SPNG_EOI;
-    if(len < (ctx->subimage[ctx->row_info.pass].scanline_width -1) ) return SPNG_EBUFSIZ;
+    struct spng__spec_pool pool = { .ctx = ctx, .in = in + 2, .in_len = in_len - 2, .out_limit = out_len };
+    pthread_t *threads = NULL;
+    z_stream zstream[2] = {{0}};
+    uint32_t k, n_workers = 0;
+    uint64_t pos;
+    size_t written;
+    int final, ret = 0, n_init = 0;
 
-    return encode_scanline(ctx, scanline, len);
-}
-
-int spng_encode_row(spng_ctx *ctx, const void *row, size_t len)
-{
-    if(ctx == NULL || row == NULL) return SPNG_EINVAL;
-    if(ctx->state >= SPNG_STATE_EOI) return SPNG_EOI;
-    if(len < ctx->image_width) return SPNG_EBUFSIZ;
+    *decoded = 0;
 
-    return encode_row(ctx, row, len);
-}
+    /* deflate, valid window size, no preset dictionary */
+    if(in_len < 6 || (in[0] & 0x0f) != 8 || (in[0] >> 4) > 7 || read_u16(in) % 31 || (in[1] & 0x20)) return 0;
 
-int spng_encode_chunks(spng_ctx *ctx)
-{
-    if(ctx == NULL) return 1;
-    if(!ctx->state) return SPNG_EBADSTATE;
-    if(ctx->state < SPNG_STATE_OUTPUT) return SPNG_ENODST;
-    if(!ctx->encode_only) return SPNG_ECTXTYPE;
+    if(!ctx->decode_threads || pool.in_len > UINT_MAX || pool.in_len / SPNG_SPECULATIVE_MIN_RANGE < 2) return 0;
 
-    int ret = 0;
+    pool.n_ranges = (uint32_t)(pool.in_len / SPNG_SPECULATIVE_MIN_RANGE);
 
-    if(ctx->state < SPNG_STATE_FIRST_IDAT)
-    {
-        if(!ctx->stored.ihdr) return SPNG_ENOIHDR;
+    if(pool.n_ranges - 1 > ctx->decode_threads) pool.n_ranges = ctx->decode_threads + 1;
 
-        ret = write_chunks_before_idat(ctx);
-        if(ret) return encode_err(ctx, ret);
+    pool.ranges = spng__calloc(ctx, pool.n_ranges, sizeof(struct spng__spec_range));
+    pool.dict[0] = spng__malloc(ctx, 32768);
+    pool.dict[1] = spng__malloc(ctx, 32768);
+    threads = spng__malloc(ctx, (pool.n_ranges - 1) * sizeof(pthread_t));
 
-        ctx->state = SPNG_STATE_FIRST_IDAT;
-    }
-    else if(ctx->state == SPNG_STATE_FIRST_IDAT)
+    if(pool.ranges == NULL || pool.dict[0] == NULL || pool.dict[1] == NULL || threads == NULL)
     {
-        return 0;
+        ret = SPNG_EMEM;
+        goto cleanup;
     }
-    else if(ctx->state == SPNG_STATE_EOI)
+
+    /* Window position m is stored as (m & 0xff) and (m >> 8) with the inverse of bit 7 of the first byte,
+       bytes copied from the window always differ in bit 7 */
+    for(k=0; k < 32768; k++)
     {
-        ret = write_chunks_after_idat(ctx);
-        if(ret) return encode_err(ctx, ret);
+        pool.dict[0][k] = k & 0xff;
+        pool.dict[1][k] = (k >> 8) | (~k & 0x80);
+    }
 
-        ctx->state = SPNG_STATE_IEND;
+    for(k=0; k < pool.n_ranges; k++)
+    {
+        pool.ranges[k].first = (uint64_t)(pool.in_len / pool.n_ranges) * k * 8;
+        if(k) pool.ranges[k - 1].last = pool.ranges[k].first;
     }
-    else return SPNG_EOPSTATE;
 
-    return 0;
-}
+    pool.ranges[pool.n_ranges - 1].last = (uint64_t)pool.in_len * 8;
 
-int spng_encode_image(spng_ctx *ctx, const void *img, size_t len, int fmt, int flags)
-{
-    if(ctx == NULL) return 1;
-    if(!ctx->state) return SPNG_EBADSTATE;
-    if(!ctx->encode_only) return SPNG_ECTXTYPE;
-    if(!ctx->stored.ihdr) return SPNG_ENOIHDR;
-    if( !(fmt == SPNG_FMT_PNG || fmt == SPNG_FMT_RAW) ) return SPNG_EFMT;
+    for(k=0; k < 2; k++)
+    {
+        zstream[k].zalloc = spng__zalloc;
+        zstream[k].zfree = spng__zfree;
+        zstream[k].opaque = ctx;
 
-    int ret = 0;
-    const struct spng_ihdr *ihdr = &ctx->ihdr;
-    struct encode_flags *encode_flags = &ctx->encode_flags;
+        if(inflateInit2(&zstream[k], -15) != Z_OK) goto cleanup;
 
-    if(ihdr->color_type == SPNG_COLOR_TYPE_INDEXED && !ctx->stored.plte) return SPNG_ENOPLTE;
+        n_init++;
+    }
 
-    ret = calculate_image_width(ihdr, fmt, &ctx->image_width);
-    if(ret) return encode_err(ctx, ret);
+    if(pthread_mutex_init(&pool.lock, NULL)) goto cleanup;
 
-    if(ctx->image_width > SIZE_MAX / ihdr->height) ctx->image_size = 0; /* overflow */
-    else ctx->image_size = ctx->image_width * ihdr->height;
+    pool.next_range = 1;
 
-    if( !(flags & SPNG_ENCODE_PROGRESSIVE) )
+    for(n_workers=0; n_workers < pool.n_ranges - 1; n_workers++)
     {
-        if(img == NULL) return 1;
-        if(!ctx->image_size) return SPNG_EOVERFLOW;
-        if(len != ctx->image_size) return SPNG_EBUFSIZ;
+        if(pthread_create(&threads[n_workers], NULL, spec_worker, &pool)) break;
     }
 
-    ret = spng_encode_chunks(ctx);
-    if(ret) return encode_err(ctx, ret);
-
-    ret = calculate_subimages(ctx);
-    if(ret) return encode_err(ctx, ret);
+    /* The first range is inflated straight to the output by the calling thread */
+    struct spng__spec_range *first = &pool.ranges[0];
 
-    if(ihdr->bit_depth < 8) ctx->bytes_per_pixel = 1;
-    else ctx->bytes_per_pixel = num_channels(ihdr) * (ihdr->bit_depth / 8);
+    first->out = out;
+    first->out_cap = out_len;
+    first->fixed = 1;
+    first->valid = !spec_inflate_range(&pool, first, zstream, 0);
 
-    if(spng__optimize(SPNG_FILTER_CHOICE))
+    if(first->valid) spec_worker(&pool);
+    else
     {
-        /* Filtering would make no difference */
-        if(!ctx->image_options.compression_level)
-        {
-            encode_flags->filter_choice = SPNG_DISABLE_FILTERING;
-        }
-
-        /* Palette indices and low bit-depth images do not benefit from filtering */
-        if(ihdr->color_type == SPNG_COLOR_TYPE_INDEXED || ihdr->bit_depth < 8)
-        {
-            encode_flags->filter_choice = SPNG_DISABLE_FILTERING;
-        }
+        pthread_mutex_lock(&pool.lock);
+        pool.next_range = pool.n_ranges;
+        pthread_mutex_unlock(&pool.lock);
     }
 
-    /* This is technically the same as disabling filtering */
-    if(encode_flags->filter_choice == SPNG_FILTER_CHOICE_NONE)
-    {
-        encode_flags->filter_choice = SPNG_DISABLE_FILTERING;
-    }
+    for(k=0; k < n_workers; k++) pthread_join(threads[k], NULL);
 
-    if(!encode_flags->filter_choice && spng__optimize(SPNG_IMG_COMPRESSION_STRATEGY))
+    pthread_mutex_destroy(&pool.lock);
+
+    if(pool.error)
     {
-        ctx->image_options.strategy = Z_DEFAULT_STRATEGY;
+        ret = pool.error;
+        goto cleanup;
     }
 
-    ret = spng__deflate_init(ctx, &ctx->image_options);
-    if(ret) return encode_err(ctx, ret);
-
-    size_t scanline_buf_size = ctx->subimage[ctx->widest_pass].scanline_width;
+    if(!first->valid) goto cleanup;
 
-    scanline_buf_size += 32;
+    written = first->out_len;
+    pos = first->end;
+    final = first->final;
 
-    if(scanline_buf_size < 32) return SPNG_EOVERFLOW;
+    for(k=1; k < pool.n_ranges && !final; k++)
+    {
+        struct spng__spec_range *r = &pool.ranges[k];
 
-    ctx->scanline_buf = spng__malloc(ctx, scanline_buf_size);
-    ctx->prev_scanline_buf = spng__malloc(ctx, scanline_buf_size);
+        if(!r->valid || r->start < pos) continue;
 
-    if(ctx->scanline_buf == NULL || ctx->prev_scanline_buf == NULL) return encode_err(ctx, SPNG_EMEM);
+        if(pos < r->start)
+        {/* Fill the gap with the known window */
+            struct spng__spec_range gap = { .start = pos, .last = r->start, .out = out + written,
+                                            .out_cap = out_len - written, .fixed = 1,
+                                            .window_len = written > 32768 ? 32768 : written };
 
-    /* Maintain alignment for pixels, filter at [-1] */
-    ctx->scanline = ctx->scanline_buf + 16;
-    ctx->prev_scanline = ctx->prev_scanline_buf + 16;
+            ret = spec_inflate_range(&pool, &gap, zstream, 0);
+            if(ret == SPNG_EMEM) goto cleanup;
+            if(ret)
+            {
+                ret = 0;
+                goto cleanup;
+            }
 
-    if(encode_flags->filter_choice)
-    {
-        ctx->filtered_scanline_buf = spng__malloc(ctx, scanline_buf_size);
-        if(ctx->filtered_scanline_buf == NULL) return encode_err(ctx, SPNG_EMEM);
+            written += gap.out_len;
+            pos = gap.end;
+            final = gap.final;
 
-        ctx->filtered_scanline = ctx->filtered_scanline_buf + 16;
-    }
+            if(final || pos != r->start) continue;
+        }
 
-    struct spng_subimage *sub = ctx->subimage;
-    struct spng_row_info *ri = &ctx->row_info;
+        if(r->out_len > out_len - written) goto cleanup;
 
-    ctx->fmt = fmt;
+        memcpy(out + written, r->out, r->out_len);
 
-    z_stream *zstream = &ctx->zstream;
-    zstream->avail_out = SPNG_WRITE_SIZE;
+        size_t i;
 
-    ret = write_header(ctx, type_idat, zstream->avail_out, &zstream->next_out);
-    if(ret) return encode_err(ctx, ret);
+        for(i=0; i < r->prefix_len; i++)
+        {
+            if(r->out[i] == r->alt[i]) continue;
 
-    if(ihdr->interlace_method) encode_flags->interlace = 1;
+            size_t m = r->out[i] | (size_t)(r->alt[i] & 0x7f) << 8;
 
-    if(fmt & (SPNG_FMT_PNG | SPNG_FMT_RAW) ) encode_flags->same_layout = 1;
+            if(written + m < 32768) goto cleanup; /* before the start of the stream */
 
-    if(ihdr->bit_depth == 16 && fmt != SPNG_FMT_RAW) encode_flags->to_bigendian = 1;
+            out[written + i] = out[written + m - 32768];
+        }
 
-    if(flags & SPNG_ENCODE_FINALIZE) encode_flags->finalize = 1;
+        written += r->out_len;
+        pos = r->end;
+        final = r->final;
+    }
 
-    while(!sub[ri->pass].width || !sub[ri->pass].height) ri->pass++;
+    if(!final)
+    {
+        struct spng__spec_range gap = { .start = pos, .last = UINT64_MAX, .out = out + written,
+                                        .out_cap = out_len - written, .fixed = 1,
+                                        .window_len = written > 32768 ? 32768 : written };
 
-    if(encode_flags->interlace) ri->row_num = adam7_y_start[ri->pass];
+        ret = spec_inflate_range(&pool, &gap, zstream, 0);
+        if(ret == SPNG_EMEM) goto cleanup;
+        if(ret)
+        {
+            ret = 0;
+            goto cleanup;
+        }
 
-    ctx->pixel_size = 4; /* SPNG_FMT_RGBA8 */
+        written += gap.out_len;
+        pos = gap.end;
+    }
 
-    if(fmt == SPNG_FMT_RGBA16) ctx->pixel_size = 8;
-    else if(fmt == SPNG_FMT_RGB8) ctx->pixel_size = 3;
-    else if(fmt == SPNG_FMT_G8) ctx->pixel_size = 1;
-    else if(fmt == SPNG_FMT_GA8) ctx->pixel_size = 2;
-    else if(fmt & (SPNG_FMT_PNG | SPNG_FMT_RAW)) ctx->pixel_size = ctx->bytes_per_pixel;
+    if(written != out_len) goto cleanup;
 
-    ctx->state = SPNG_STATE_ENCODE_INIT;
+    int validate = !(ctx->flags & SPNG_CTX_IGNORE_ADLER32) && ctx->crc_action_critical != SPNG_CRC_USE;
 
-    if(flags & SPNG_ENCODE_PROGRESSIVE)
+    if(validate)
     {
-        encode_flags->progressive = 1;
+        uint32_t adler = adler32(0, Z_NULL, 0);
+        size_t trailer = (size_t)(pos >> 3);
 
-        return 0;
+        for(written=0; written < out_len; written += UINT_MAX)
+        {
+            size_t len = out_len - written > UINT_MAX ? UINT_MAX : out_len - written;
+
+            adler = adler32(adler, out + written, (uInt)len);
+        }
+
+        if(trailer + 4 > pool.in_len || read_u32(pool.in + trailer) != adler) goto cleanup;
     }
 
-    do
-    {
-        size_t ioffset = ri->row_num * ctx->image_width;
+    *decoded = 1;
 
-        ret = encode_row(ctx, (unsigned char*)img + ioffset, ctx->image_width);
+cleanup:
+    if(pool.ranges != NULL)
+    {
+        for(k=1; k < pool.n_ranges; k++)
+        {
+            spng__free(ctx, pool.ranges[k].out);
+            spng__free(ctx, pool.ranges[k].alt);
+        }
+    }
 
-    }while(!ret);
+    for(k=0; k < (uint32_t)n_init; k++) inflateEnd(&zstream[k]);
 
-    if(ret != SPNG_EOI) return encode_err(ctx, ret);
+    spng__free(ctx, pool.ranges);
+    spng__free(ctx, pool.dict[0]);
+    spng__free(ctx, pool.dict[1]);
+    spng__free(ctx, threads);
 
-    return 0;
+    return ret;
 }
+#endif
 
-spng_ctx *spng_ctx_new(int flags)
+/* Inflate a complete zlib stream from memory */
+static int inflate_buffer(spng_ctx *ctx, const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len)
 {
-    struct spng_alloc alloc =
+#if defined(SPNG_USE_LIBDEFLATE) && !defined(SPNG_USE_MINIZ)
+    if(ctx->inflate_backend == SPNG_INFLATE_LIBDEFLATE)
     {
-        .malloc_fn = malloc,
-        .realloc_fn = realloc,
-        .calloc_fn = calloc,
-        .free_fn = free
-    };
+        if(ctx->decompressor == NULL) ctx->decompressor = libdeflate_alloc_decompressor();
+        if(ctx->decompressor == NULL) return SPNG_EMEM;
 
-    return spng_ctx_new2(&alloc, flags);
-}
+        int validate = 1;
 
-spng_ctx *spng_ctx_new2(struct spng_alloc *alloc, int flags)
-{
-    if(alloc == NULL) return NULL;
-    if(flags != (flags & SPNG__CTX_FLAGS_ALL)) return NULL;
+        if(ctx->flags & SPNG_CTX_IGNORE_ADLER32) validate = 0;
+        if(ctx->crc_action_critical == SPNG_CRC_USE) validate = 0;
 
-    if(alloc->malloc_fn == NULL) return NULL;
-    if(alloc->realloc_fn == NULL) return NULL;
-    if(alloc->calloc_fn == NULL) return NULL;
-    if(alloc->free_fn == NULL) return NULL;
+        size_t in_used, out_used;
+        unsigned cmf = in_len > 2 ? in[0] : 0;
 
-    spng_ctx *ctx = alloc->calloc_fn(1, sizeof(spng_ctx));
-    if(ctx == NULL) return NULL;
+        /* deflate, valid window size, no preset dictionary */
+        if(in_len > 6 && (cmf & 0x0f) == 8 && (cmf >> 4) <= 7 && !(read_u16(in) % 31) && !(in[1] & 0x20))
+        {
+            enum libdeflate_result res = libdeflate_deflate_decompress_ex(ctx->decompressor, in + 2, in_len - 2,
+                                                                          out, out_len, &in_used, &out_used);
 
-    ctx->alloc = *alloc;
+            if(res == LIBDEFLATE_SUCCESS && out_used == out_len && (in_len - 2 - in_used) >= 4)
+            {
+                if(!validate) return 0;
 
-    ctx->max_width = spng_u32max;
-    ctx->max_height = spng_u32max;
+                if(read_u32(in + 2 + in_used) == libdeflate_adler32(1, out, out_len)) return 0;
+            }
+        }
 
-    ctx->max_chunk_size = spng_u32max;
-    ctx->chunk_cache_limit = SIZE_MAX;
-    ctx->chunk_count_limit = SPNG_MAX_CHUNK_COUNT;
+        /* Let zlib handle streams that are invalid or have extra data for consistent errors */
+    }
+#endif
 
-    ctx->state = SPNG_STATE_INIT;
+#ifdef SPNG_INFLATE_SPECULATIVE_SUPPORTED
+    if(ctx->inflate_backend == SPNG_INFLATE_SPECULATIVE)
+    {
+        int decoded;
 
-    ctx->crc_action_critical = SPNG_CRC_ERROR;
-    ctx->crc_action_ancillary = SPNG_CRC_DISCARD;
+        int ret = inflate_speculative(ctx, in, in_len, out, out_len, &decoded);
+        if(ret || decoded) return ret;
 
-    const struct spng__zlib_options image_defaults =
-    {
-        .compression_level = Z_DEFAULT_COMPRESSION,
-        .window_bits = 15,
-        .mem_level = 8,
-        .strategy = Z_FILTERED,
-        .data_type = 0 /* Z_BINARY */
-    };
+        /* Inflate serially with zlib */
+    }
+#endif
 
-    const struct spng__zlib_options text_defaults =
-    {
-        .compression_level = Z_DEFAULT_COMPRESSION,
-        .window_bits = 15,
-        .mem_level = 8,
-        .strategy = Z_DEFAULT_STRATEGY,
-        .data_type = 1 /* Z_TEXT */
-    };
+    z_stream *zstream = &ctx->zstream;
 
-    ctx->image_options = image_defaults;
-    ctx->text_options = text_defaults;
+    if(in_len > UINT_MAX) return SPNG_EOVERFLOW;
 
-    ctx->optimize_option = ~0;
-    ctx->encode_flags.filter_choice = SPNG_FILTER_CHOICE_ALL;
+    zstream->next_in = in;
+    zstream->avail_in = (uInt)in_len;
 
-    ctx->flags = flags;
+    while(out_len)
+    {
+        size_t len = out_len > UINT_MAX ? UINT_MAX : out_len;
 
-    if(flags & SPNG_CTX_ENCODER) ctx->encode_only = 1;
+        int ret = read_scanline_bytes(ctx, out, len);
+        if(ret) return ret;
 
-    return ctx;
+        out += len;
+        out_len -= len;
+    }
+
+    return 0;
 }
 
-void spng_ctx_free(spng_ctx *ctx)
+/* Interlaced images decoded to 8-bit or wider pixels
+
+   The passes are defiltered separately, each output row is then put together from
+   the converted rows of the passes that cover it: odd rows are a row of the last pass,
+   even rows interleave the pass with the widest column spacing with each finer pass.
+   With SPNG_DECODE_THREADS set the passes are defiltered in parallel
+   followed by the output rows in bands.
+*/
+#define SPNG_PASS_ROWS (64) /* output rows per task */
+
+/* Passes of the even rows by row_num % 8, from the widest to the finest column spacing */
+static const int8_t even_row_passes[4][4] =
 {
-    if(ctx == NULL) return;
+    { 0, 1, 3, 5 },
+    { 4, 5, -1, -1 },
+    { 2, 3, 5, -1 },
+    { 4, 5, -1, -1 }
+};
 
-    if(ctx->streaming && ctx->stream_buf != NULL) spng__free(ctx, ctx->stream_buf);
+struct spng__pass_pool
+{
+    spng_ctx *ctx;
+    unsigned char *out;
+    unsigned char *scanlines[7]; /* first scanline of each pass, NULL for empty passes */
+    const unsigned char *zeros;
 
-    if(!ctx->user.exif) spng__free(ctx, ctx->exif.data);
+    uint32_t next_task;
+    uint32_t n_tasks;
+    int defilter; /* tasks are passes, otherwise bands of output rows */
 
-    if(!ctx->user.iccp) spng__free(ctx, ctx->iccp.profile);
+    int error;
 
+#ifdef SPNG_MULTITHREADING
+    pthread_mutex_t lock;
+#endif
+};
+
+static int defilter_pass(const spng_ctx *ctx, unsigned char *scanline, int pass, const unsigned char *zeros)
+{
+    const struct spng_subimage *sub = &ctx->subimage[pass];
+    const int swap = ctx->ihdr.bit_depth == 16 && ctx->fmt != SPNG_FMT_RAW;
+    const unsigned char *prev = zeros;
     uint32_t i;
+    int ret;
 
-    if(ctx->splt_list != NULL && !ctx->user.splt)
+    for(i=0; i < sub->height; i++, scanline += sub->scanline_width)
     {
-        for(i=0; i < ctx->n_splt; i++)
-        {
-            spng__free(ctx, ctx->splt_list[i].entries);
-        }
-        spng__free(ctx, ctx->splt_list);
-    }
+        unsigned filter = scanline[0];
 
-    if(ctx->text_list != NULL)
-    {
-        for(i=0; i< ctx->n_text; i++)
-        {
-            if(ctx->user.text) break;
+        if(filter > 4) return SPNG_EFILTER;
 
-            spng__free(ctx, ctx->text_list[i].keyword);
-            if(ctx->text_list[i].compression_flag) spng__free(ctx, ctx->text_list[i].text);
-        }
-        spng__free(ctx, ctx->text_list);
-    }
+        if(swap) u16_row_to_host(scanline + 1, sub->scanline_width - 1);
 
-    if(ctx->chunk_list != NULL && !ctx->user.unknown)
-    {
-        for(i=0; i< ctx->n_chunks; i++)
-        {
-            spng__free(ctx, ctx->chunk_list[i].data);
-        }
-        spng__free(ctx, ctx->chunk_list);
+        ret = defilter_scanline(prev, scanline + 1, sub->scanline_width, ctx->bytes_per_pixel, filter, ctx->simd_level);
+        if(ret) return ret;
+
+        prev = scanline + 1;
     }
 
-    if(ctx->deflate) deflateEnd(&ctx->zstream);
-    else inflateEnd(&ctx->zstream);
+    return 0;
+}
 
-    if(!ctx->user_owns_out_png) spng__free(ctx, ctx->out_png);
+/* Pixels of pass row row_num, converted to buf if the output format is different */
+static const unsigned char *pass_pixels(const spng_ctx *ctx, unsigned char *const scanlines[7], int pass,
+                                        uint32_t row_num, unsigned char *buf)
+{
+    const struct spng_subimage *sub = &ctx->subimage[pass];
+    const unsigned char *scanline = scanlines[pass];
 
-    spng__free(ctx, ctx->gamma_lut16);
+    if(scanline == NULL) return buf; /* no pixels */
 
-    spng__free(ctx, ctx->row_buf);
-    spng__free(ctx, ctx->scanline_buf);
-    spng__free(ctx, ctx->prev_scanline_buf);
-    spng__free(ctx, ctx->filtered_scanline_buf);
+    scanline += (size_t)((row_num - adam7_y_start[pass]) / adam7_y_delta[pass]) * sub->scanline_width + 1;
 
-    spng_free_fn *free_fn = ctx->alloc.free_fn;
+    if(ctx->fmt & (SPNG_FMT_PNG | SPNG_FMT_RAW)) return scanline;
 
-    memset(ctx, 0, sizeof(spng_ctx));
+    convert_scanline(ctx, buf, scanline, pass);
 
-    free_fn(ctx);
+    return buf;
 }
 
-static int buffer_read_fn(spng_ctx *ctx, void *user, void *data, size_t n)
+/* Output rows [y, end), buf holds 6 rows */
+static void deinterlace_rows(const spng_ctx *ctx, unsigned char *out, unsigned char *const scanlines[7],
+                             uint32_t y, uint32_t end, unsigned char *buf)
 {
-    if(n > ctx->bytes_left) return SPNG_IO_EOF;
+    const size_t pixel_size = ctx->out_bits / 8;
+    const size_t row_size = ctx->image_width;
+    unsigned char *merged[2] = { buf + 4 * row_size, buf + 5 * row_size };
 
-    (void)user;
-    (void)data;
-    ctx->data = ctx->data + ctx->last_read_size;
+    for(; y < end; y++)
+    {
+        unsigned char *row = out + (size_t)y * row_size;
 
-    ctx->last_read_size = n;
-    ctx->bytes_left -= n;
+        if(y & 1)
+        {
+            const unsigned char *pixels = pass_pixels(ctx, scanlines, 6, y, row);
 
-    return 0;
+            if(pixels != row) memcpy(row, pixels, ctx->subimage[6].out_width);
+
+            continue;
+        }
+
+        const int8_t *passes = even_row_passes[(y >> 1) & 3];
+        const unsigned char *cur = pass_pixels(ctx, scanlines, passes[0], y, buf);
+        uint32_t n = ctx->subimage[passes[0]].width;
+        int k;
+
+        for(k=1; k < 4 && passes[k] >= 0; k++)
+        {
+            const int pass = passes[k];
+            const uint32_t width = ctx->subimage[pass].width;
+            const unsigned char *pixels = pass_pixels(ctx, scanlines, pass, y, buf + k * row_size);
+            unsigned char *dst = pass == 5 ? row : merged[k & 1];
+
+            interleave_pixels(dst, cur, pixels, width, n > width, pixel_size, ctx->simd_level);
+
+            cur = dst;
+            n += width;
+        }
+    }
 }
 
-static int file_read_fn(spng_ctx *ctx, void *user, void *data, size_t n)
+#ifdef SPNG_MULTITHREADING
+static const uint8_t pass_order[7] = { 6, 5, 4, 3, 2, 1, 0 }; /* largest first */
+
+static void *pass_worker(void *arg)
 {
-    FILE *file = user;
-    (void)ctx;
+    struct spng__pass_pool *pool = arg;
+    spng_ctx *ctx = pool->ctx;
+    unsigned char *buf = NULL;
+    uint32_t k;
+    int ret = 0;
 
-    if(fread(data, n, 1, file) != 1)
+    const int defilter = pool->defilter;
+
+    if(!defilter)
     {
-        if(feof(file)) return SPNG_IO_EOF;
-        else return SPNG_IO_ERROR;
+        buf = spng__malloc(ctx, 6 * ctx->image_width);
+        if(buf == NULL) ret = SPNG_EMEM;
     }
 
-    return 0;
-}
+    while(!ret)
+    {
+        pthread_mutex_lock(&pool->lock);
 
-static int file_write_fn(spng_ctx *ctx, void *user, void *data, size_t n)
-{
-    FILE *file = user;
-    (void)ctx;
+        if(pool->error || pool->next_task >= pool->n_tasks)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
 
-    if(fwrite(data, n, 1, file) != 1) return SPNG_IO_ERROR;
+        k = pool->next_task++;
 
-    return 0;
-}
+        pthread_mutex_unlock(&pool->lock);
 
-int spng_set_png_buffer(spng_ctx *ctx, const void *buf, size_t size)
-{
-    if(ctx == NULL || buf == NULL) return 1;
-    if(!ctx->state) return SPNG_EBADSTATE;
-    if(ctx->encode_only) return SPNG_ECTXTYPE; /* not supported */
+        if(defilter)
+        {
+            int pass = pass_order[k];
 
-    if(ctx->data != NULL) return SPNG_EBUF_SET;
+            if(pool->scanlines[pass] != NULL) ret = defilter_pass(ctx, pool->scanlines[pass], pass, pool->zeros);
+        }
+        else
+        {
+            uint32_t y = k * SPNG_PASS_ROWS;
+            uint32_t end = ctx->ihdr.height - y < SPNG_PASS_ROWS ? ctx->ihdr.height : y + SPNG_PASS_ROWS;
 
-    ctx->data = buf;
-    ctx->png_base = buf;
-    ctx->data_size = size;
-    ctx->bytes_left = size;
+            deinterlace_rows(ctx, pool->out, pool->scanlines, y, end, buf);
+        }
+    }
 
-    ctx->read_fn = buffer_read_fn;
+    if(ret)
+    {
+        pthread_mutex_lock(&pool->lock);
+        if(!pool->error) pool->error = ret;
+        pthread_mutex_unlock(&pool->lock);
+    }
 
-    ctx->state = SPNG_STATE_INPUT;
+    spng__free(ctx, buf);
 
-    return 0;
+    return NULL;
 }
 
-int spng_set_png_stream(spng_ctx *ctx, spng_rw_fn *rw_func, void *user)
+/* Run the tasks on the calling thread and up to SPNG_DECODE_THREADS workers */
+static int run_pass_tasks(struct spng__pass_pool *pool, int defilter, uint32_t n_tasks)
 {
-    if(ctx == NULL || rw_func == NULL) return 1;
-    if(!ctx->state) return SPNG_EBADSTATE;
+    spng_ctx *ctx = pool->ctx;
+    uint32_t k, n_workers = 0, n_threads = ctx->decode_threads;
+    pthread_t *threads;
 
-    /* SPNG_STATE_OUTPUT shares the same value */
-    if(ctx->state >= SPNG_STATE_INPUT) return SPNG_EBUF_SET;
+    if(n_threads > n_tasks - 1) n_threads = n_tasks - 1;
 
-    if(ctx->encode_only)
-    {
-        if(ctx->out_png != NULL) return SPNG_EBUF_SET;
+    threads = n_threads ? spng__malloc(ctx, n_threads * sizeof(pthread_t)) : NULL;
+    if(n_threads && threads == NULL) return SPNG_EMEM;
 
-        ctx->write_fn = rw_func;
-        ctx->write_ptr = ctx->stream_buf;
+    pool->next_task = 0;
+    pool->n_tasks = n_tasks;
+    pool->defilter = defilter;
 
-        ctx->state = SPNG_STATE_OUTPUT;
-    }
-    else
+    for(n_workers=0; n_workers < n_threads; n_workers++)
     {
-        ctx->stream_buf = spng__malloc(ctx, SPNG_READ_SIZE);
-        if(ctx->stream_buf == NULL) return SPNG_EMEM;
-
-        ctx->read_fn = rw_func;
-        ctx->data = ctx->stream_buf;
-        ctx->data_size = SPNG_READ_SIZE;
-
-        ctx->state = SPNG_STATE_INPUT;
+        if(pthread_create(&threads[n_workers], NULL, pass_worker, pool)) break;
     }
 
-    ctx->stream_user_ptr = user;
+    pass_worker(pool);
 
-    ctx->streaming = 1;
+    for(k=0; k < n_workers; k++) pthread_join(threads[k], NULL);
 
-    return 0;
+    spng__free(ctx, threads);
+
+    return pool->error;
 }
+#endif
 
-int spng_set_png_file(spng_ctx *ctx, FILE *file)
+/* Defilter and deinterlace the passes in filtered */
+static int decode_passes(spng_ctx *ctx, unsigned char *out, unsigned char *filtered)
 {
-    if(file == NULL) return 1;
+    const struct spng_subimage *sub = ctx->subimage;
+    struct spng__pass_pool pool = { .ctx = ctx, .out = out };
+    unsigned char *zeros;
+    size_t max_width = 0;
+    int i, ret = 0;
 
-    if(ctx->encode_only) return spng_set_png_stream(ctx, file_write_fn, file);
+    for(i=0; i < 7; i++)
+    {
+        if(!sub[i].width || !sub[i].height) continue;
 
-    return spng_set_png_stream(ctx, file_read_fn, file);
-}
+        pool.scanlines[i] = filtered;
+        filtered += sub[i].scanline_width * sub[i].height;
 
-void *spng_get_png_buffer(spng_ctx *ctx, size_t *len, int *error)
-{
-    int tmp = 0;
-    error = error ? error : &tmp;
-    *error = 0;
+        if(sub[i].scanline_width > max_width) max_width = sub[i].scanline_width;
+    }
 
-    if(ctx == NULL || !len) *error = SPNG_EINVAL;
+    zeros = spng__calloc(ctx, 1, max_width);
+    if(zeros == NULL) return SPNG_EMEM;
 
-    if(*error) return NULL;
+    pool.zeros = zeros;
 
-    if(!ctx->encode_only) *error = SPNG_ECTXTYPE;
-    else if(!ctx->state) *error = SPNG_EBADSTATE;
-    else if(!ctx->internal_buffer) *error = SPNG_EOPSTATE;
-    else if(ctx->state < SPNG_STATE_EOI) *error = SPNG_EOPSTATE;
-    else if(ctx->state != SPNG_STATE_IEND) *error = SPNG_ENOTFINAL;
+#ifdef SPNG_MULTITHREADING
+    if(ctx->decode_threads)
+    {
+        if(pthread_mutex_init(&pool.lock, NULL))
+        {
+            spng__free(ctx, zeros);
+            return SPNG_EINTERNAL;
+        }
 
-    if(*error) return NULL;
+        ret = run_pass_tasks(&pool, 1, 7);
 
-    ctx->user_owns_out_png = 1;
+        if(!ret) ret = run_pass_tasks(&pool, 0, (ctx->ihdr.height + SPNG_PASS_ROWS - 1) / SPNG_PASS_ROWS);
 
-    *len = ctx->bytes_encoded;
+        pthread_mutex_destroy(&pool.lock);
+        spng__free(ctx, zeros);
 
-    return ctx->out_png;
-}
+        return ret;
+    }
+#endif
 
-int spng_set_image_limits(spng_ctx *ctx, uint32_t width, uint32_t height)
-{
-    if(ctx == NULL) return 1;
+    for(i=0; i < 7 && !ret; i++)
+    {
+        if(pool.scanlines[i] != NULL) ret = defilter_pass(ctx, pool.scanlines[i], i, zeros);
+    }
 
-    if(width > spng_u32max || height > spng_u32max) return 1;
+    spng__free(ctx, zeros);
 
-    ctx->max_width = width;
-    ctx->max_height = height;
+    if(ret) return ret;
 
-    return 0;
-}
+    unsigned char *buf = spng__malloc(ctx, 6 * ctx->image_width);
+    if(buf == NULL) return SPNG_EMEM;
 
-int spng_get_image_limits(spng_ctx *ctx, uint32_t *width, uint32_t *height)
-{
-    if(ctx == NULL || width == NULL || height == NULL) return 1;
+    deinterlace_rows(ctx, out, pool.scanlines, 0, ctx->ihdr.height, buf);
 
-    *width = ctx->max_width;
-    *height = ctx->max_height;
+    spng__free(ctx, buf);
 
     return 0;
 }
 
-int spng_set_chunk_limits(spng_ctx *ctx, size_t chunk_size, size_t cache_limit)
+/* Inflate the whole image to a buffer before defiltering, this requires the PNG to be in memory
+   and uses an additional buffer of about the same size as the decoded image. */
+static int decode_buffered(spng_ctx *ctx, unsigned char *out)
 {
-    if(ctx == NULL || chunk_size > spng_u32max || chunk_size > cache_limit) return 1;
-
-    ctx->max_chunk_size = chunk_size;
+    int ret = 0;
+    struct spng_row_info *ri = &ctx->row_info;
+    const struct spng_subimage *sub = ctx->subimage;
+    const int swap = ctx->ihdr.bit_depth == 16 && ctx->fmt != SPNG_FMT_RAW;
+    unsigned char *filtered, *scanline;
+    const unsigned char *prev = NULL;
+    size_t filtered_size = 0;
+    int i;
 
-    ctx->chunk_cache_limit = cache_limit;
+    for(i=0; i <= ctx->last_pass; i++)
+    {
+        if(!sub[i].width || !sub[i].height) continue;
 
-    return 0;
-}
+        if(sub[i].scanline_width > SIZE_MAX / sub[i].height) return SPNG_EOVERFLOW;
 
-int spng_get_chunk_limits(spng_ctx *ctx, size_t *chunk_size, size_t *cache_limit)
-{
-    if(ctx == NULL || chunk_size == NULL || cache_limit == NULL) return 1;
+        size_t pass_size = sub[i].scanline_width * sub[i].height;
 
-    *chunk_size = ctx->max_chunk_size;
+        if(filtered_size + pass_size < filtered_size) return SPNG_EOVERFLOW;
 
-    *cache_limit = ctx->chunk_cache_limit;
+        filtered_size += pass_size;
+    }
 
-    return 0;
-}
+    filtered = spng__malloc(ctx, filtered_size);
+    if(filtered == NULL) return SPNG_EMEM;
 
-int spng_set_crc_action(spng_ctx *ctx, int critical, int ancillary)
-{
-    if(ctx == NULL) return 1;
-    if(ctx->encode_only) return SPNG_ECTXTYPE;
+    if(ctx->inflate_backend != SPNG_INFLATE_ZLIB)
+    {
+        const unsigned char *data;
+        size_t len;
 
-    if(critical > 2 || critical < 0) return 1;
-    if(ancillary > 2 || ancillary < 0) return 1;
+        ret = gather_idat(ctx, &data, &len);
+        if(!ret) ret = inflate_buffer(ctx, data, len, filtered, filtered_size);
+    }
+    else /* SPNG_INFLATE_ZLIB */
+    {
+        size_t bytes_left = filtered_size;
+        scanline = filtered;
 
-    if(critical == SPNG_CRC_DISCARD) return 1;
+        while(bytes_left && !ret)
+        {
+            size_t len = bytes_left > UINT_MAX ? UINT_MAX : bytes_left;
 
-    ctx->crc_action_critical = critical;
-    ctx->crc_action_ancillary = ancillary;
+            ret = read_scanline_bytes(ctx, scanline, len);
 
-    return 0;
-}
+            scanline += len;
+            bytes_left -= len;
+        }
+    }
 
-int spng_set_option(spng_ctx *ctx, enum spng_option option, int value)
-{
-    if(ctx == NULL) return 1;
-    if(!ctx->state) return SPNG_EBADSTATE;
+    if(ret) goto cleanup;
 
-    switch(option)
+    if(ctx->ihdr.interlace_method && ctx->out_bits >= 8)
     {
-        case SPNG_KEEP_UNKNOWN_CHUNKS:
-        {
-            ctx->keep_unknown = value ? 1 : 0;
-            break;
-        }
-        case SPNG_IMG_COMPRESSION_LEVEL:
-        {
-            ctx->image_options.compression_level = value;
-            break;
-        }
-        case SPNG_IMG_WINDOW_BITS:
-        {
-            ctx->image_options.window_bits = value;
-            break;
-        }
-        case SPNG_IMG_MEM_LEVEL:
-        {
-            ctx->image_options.mem_level = value;
-            break;
-        }
-        case SPNG_IMG_COMPRESSION_STRATEGY:
-        {
-            ctx->image_options.strategy = value;
-            break;
-        }
-        case SPNG_TEXT_COMPRESSION_LEVEL:
-        {
-            ctx->text_options.compression_level = value;
-            break;
-        }
-        case SPNG_TEXT_WINDOW_BITS:
-        {
-            ctx->text_options.window_bits = value;
-            break;
-        }
-        case SPNG_TEXT_MEM_LEVEL:
-        {
-            ctx->text_options.mem_level = value;
-            break;
-        }
-        case SPNG_TEXT_COMPRESSION_STRATEGY:
-        {
-            ctx->text_options.strategy = value;
-            break;
-        }
-        case SPNG_FILTER_CHOICE:
-        {
-            if(value & ~SPNG_FILTER_CHOICE_ALL) return 1;
-            ctx->encode_flags.filter_choice = value;
-            break;
-        }
-        case SPNG_CHUNK_COUNT_LIMIT:
-        {
-            if(value < 0) return 1;
-            if(value > (int)ctx->chunk_count_total) return 1;
-            ctx->chunk_count_limit = value;
-            break;
-        }
-        case SPNG_ENCODE_TO_BUFFER:
-        {
-            if(value < 0) return 1;
-            if(!ctx->encode_only) return SPNG_ECTXTYPE;
-            if(ctx->state >= SPNG_STATE_OUTPUT) return SPNG_EOPSTATE;
-
-            if(!value) break;
+        ret = decode_passes(ctx, out, filtered);
+        if(ret) goto cleanup;
 
-            ctx->internal_buffer = 1;
-            ctx->state = SPNG_STATE_OUTPUT;
+        ctx->state = SPNG_STATE_EOI;
 
-            break;
-        }
-        default: return 1;
+        ret = end_of_idat(ctx);
+        goto cleanup;
     }
 
-    /* Option can no longer be overriden by the library */
-    if(option < 32) ctx->optimize_option &= ~(1 << option);
-
-    return 0;
-}
-
-int spng_get_option(spng_ctx *ctx, enum spng_option option, int *value)
-{
-    if(ctx == NULL || value == NULL) return 1;
-    if(!ctx->state) return SPNG_EBADSTATE;
+    scanline = filtered;
 
-    switch(option)
+    do
     {
-        case SPNG_KEEP_UNKNOWN_CHUNKS:
-        {
-            *value = ctx->keep_unknown;
-            break;
-        }
-        case SPNG_IMG_COMPRESSION_LEVEL:
-        {
-            *value = ctx->image_options.compression_level;
-            break;
-        }
-            case SPNG_IMG_WINDOW_BITS:
-        {
-            *value = ctx->image_options.window_bits;
-            break;
-        }
-        case SPNG_IMG_MEM_LEVEL:
-        {
-            *value = ctx->image_options.mem_level;
-            break;
-        }
-        case SPNG_IMG_COMPRESSION_STRATEGY:
-        {
-            *value = ctx->image_options.strategy;
-            break;
-        }
-        case SPNG_TEXT_COMPRESSION_LEVEL:
-        {
-            *value = ctx->text_options.compression_level;
-            break;
-        }
-            case SPNG_TEXT_WINDOW_BITS:
-        {
-            *value = ctx->text_options.window_bits;
-            break;
-        }
-        case SPNG_TEXT_MEM_LEVEL:
-        {
-            *value = ctx->text_options.mem_level;
-            break;
-        }
-        case SPNG_TEXT_COMPRESSION_STRATEGY:
-        {
-            *value = ctx->text_options.strategy;
-            break;
-        }
-        case SPNG_FILTER_CHOICE:
-        {
-            *value = ctx->encode_flags.filter_choice;
-            break;
-        }
-        case SPNG_CHUNK_COUNT_LIMIT:
+        size_t scanline_width = sub[ri->pass].scanline_width;
+        unsigned filter = scanline[0];
+
+        if(filter > 4)
         {
-            *value = ctx->chunk_count_limit;
-            break;
+            ret = SPNG_EFILTER;
+            goto cleanup;
         }
-        case SPNG_ENCODE_TO_BUFFER:
-        {
-            if(ctx->internal_buffer) *value = 1;
-            else *value = 0;
 
-            break;
+        if(!ri->scanline_idx)
+        {/* prev_scanline is all zeros for the first scanline */
+            memset(ctx->prev_scanline_buf, 0, scanline_width);
+            prev = ctx->prev_scanline_buf;
         }
-        default: return 1;
-    }
 
-    return 0;
-}
+        if(swap) u16_row_to_host(scanline + 1, scanline_width - 1);
 
-int spng_decoded_image_size(spng_ctx *ctx, int fmt, size_t *len)
-{
-    if(ctx == NULL || len == NULL) return 1;
+        ret = defilter_scanline(prev, scanline + 1, scanline_width, ctx->bytes_per_pixel, filter, ctx->simd_level);
+        if(ret) goto cleanup;
 
-    int ret = read_chunks(ctx, 1);
-    if(ret) return ret;
+        output_scanline(ctx, out, ctx->row, scanline + 1, ri->row_num, ri->pass);
 
-    ret = check_decode_fmt(&ctx->ihdr, fmt);
-    if(ret) return ret;
+        prev = scanline + 1;
+        scanline += scanline_width;
 
-    return calculate_image_size(&ctx->ihdr, fmt, len);
-}
+        ret = update_row_info(ctx);
+    }while(!ret);
 
-int spng_get_ihdr(spng_ctx *ctx, struct spng_ihdr *ihdr)
-{
-    if(ctx == NULL) return 1;
-    int ret = read_chunks(ctx, 1);
-    if(ret) return ret;
-    if(ihdr == NULL) return 1;
+    if(ret == SPNG_EOI) ret = end_of_idat(ctx);
 
-    *ihdr = ctx->ihdr;
+cleanup:
+    spng__free(ctx, filtered);
 
-    return 0;
+    return ret;
 }
 
-int spng_get_plte(spng_ctx *ctx, struct spng_plte *plte)
-{
-    SPNG_GET_CHUNK_BOILERPLATE(plte);
-
-    *plte = ctx->plte;
+#ifdef SPNG_MULTITHREADING
+/* Pipelined decoding
 
-    return 0;
-}
+   The calling thread inflates and defilters scanlines into a ring buffer,
+   worker threads convert them and write (deinterlace) the pixels to the output image.
+   Every scanline is written to distinct output bytes except for
+   interlaced images with less than 8-bit samples which are not decoded this way.
+*/
+#define SPNG_RING_SLOTS_PER_THREAD (8)
 
-int spng_get_trns(spng_ctx *ctx, struct spng_trns *trns)
+struct spng__ring_slot
 {
-    SPNG_GET_CHUNK_BOILERPLATE(trns);
+    unsigned char *scanline;
+    uint32_t row_num;
+    int pass;
+    int busy;
+};
 
-    *trns = ctx->trns;
+struct spng__decode_pool
+{
+    spng_ctx *ctx;
+    unsigned char *out;
 
-    return 0;
-}
+    struct spng__ring_slot *slots;
+    size_t n_slots;
 
-int spng_get_chrm(spng_ctx *ctx, struct spng_chrm *chrm)
-{
-    SPNG_GET_CHUNK_BOILERPLATE(chrm);
+    size_t produced; /* scanlines written to the ring */
+    size_t next; /* next scanline to be converted */
 
-    chrm->white_point_x = (double)ctx->chrm_int.white_point_x / 100000.0;
-    chrm->white_point_y = (double)ctx->chrm_int.white_point_y / 100000.0;
-    chrm->red_x = (double)ctx->chrm_int.red_x / 100000.0;
-    chrm->red_y = (double)ctx->chrm_int.red_y / 100000.0;
-    chrm->blue_y = (double)ctx->chrm_int.blue_y / 100000.0;
-    chrm->blue_x = (double)ctx->chrm_int.blue_x / 100000.0;
-    chrm->green_x = (double)ctx->chrm_int.green_x / 100000.0;
-    chrm->green_y = (double)ctx->chrm_int.green_y / 100000.0;
+    int done;
+    int error;
 
-    return 0;
-}
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
 
-int spng_get_chrm_int(spng_ctx *ctx, struct spng_chrm_int *chrm)
+static void *decode_worker(void *arg)
 {
-    SPNG_GET_CHUNK_BOILERPLATE(chrm);
+    struct spng__decode_pool *pool = arg;
+    spng_ctx *ctx = pool->ctx;
+    struct spng__ring_slot *slot;
+    unsigned char *row_buf = NULL;
 
-    *chrm = ctx->chrm_int;
+    if(ctx->row != NULL)
+    {
+        row_buf = spng__malloc(ctx, ctx->row_buf_size);
 
-    return 0;
-}
+        if(row_buf == NULL)
+        {
+            pthread_mutex_lock(&pool->lock);
+            if(!pool->error) pool->error = SPNG_EMEM;
+            pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->lock);
 
-int spng_get_gama(spng_ctx *ctx, double *gamma)
-{
-    double *gama = gamma;
-    SPNG_GET_CHUNK_BOILERPLATE(gama);
+            return NULL;
+        }
+    }
 
-    *gama = (double)ctx->gama / 100000.0;
+    pthread_mutex_lock(&pool->lock);
 
-    return 0;
-}
+    while(1)
+    {
+        while(pool->next == pool->produced && !pool->done && !pool->error) pthread_cond_wait(&pool->cond, &pool->lock);
 
-int spng_get_gama_int(spng_ctx *ctx, uint32_t *gama_int)
-{
-    uint32_t *gama = gama_int;
-    SPNG_GET_CHUNK_BOILERPLATE(gama);
+        if(pool->next == pool->produced || pool->error) break;
 
-    *gama_int = ctx->gama;
+        slot = &pool->slots[pool->next % pool->n_slots];
+        pool->next++;
 
-    return 0;
-}
+        pthread_mutex_unlock(&pool->lock);
 
-int spng_get_iccp(spng_ctx *ctx, struct spng_iccp *iccp)
-{
-    SPNG_GET_CHUNK_BOILERPLATE(iccp);
+        output_scanline(ctx, pool->out, row_buf, slot->scanline, slot->row_num, slot->pass);
 
-    *iccp = ctx->iccp;
+        pthread_mutex_lock(&pool->lock);
 
-    return 0;
-}
+        slot->busy = 0;
+        pthread_cond_broadcast(&pool->cond);
+    }
 
-int spng_get_sbit(spng_ctx *ctx, struct spng_sbit *sbit)
-{
-    SPNG_GET_CHUNK_BOILERPLATE(sbit);
+    pthread_mutex_unlock(&pool->lock);
 
-    *sbit = ctx->sbit;
+    spng__free(ctx, row_buf);
 
-    return 0;
+    return NULL;
 }
 
-int spng_get_srgb(spng_ctx *ctx, uint8_t *rendering_intent)
+static int decode_threaded(spng_ctx *ctx, unsigned char *out)
 {
-    uint8_t *srgb = rendering_intent;
-    SPNG_GET_CHUNK_BOILERPLATE(srgb);
+    struct spng_row_info *ri = &ctx->row_info;
+    struct spng__decode_pool pool = { .ctx = ctx, .out = out };
+    struct spng__ring_slot *slot;
+    pthread_t *threads = NULL;
+    unsigned char *ring = NULL;
+    uint32_t k, n_workers = 0;
+    int ret = 0;
 
-    *srgb = ctx->srgb_rendering_intent;
+    /* Keep slots aligned */
+    size_t slot_size = ctx->subimage[ctx->widest_pass].scanline_width + 32;
+    slot_size = (slot_size + 15) & ~(size_t)15;
 
-    return 0;
-}
+    pool.n_slots = (size_t)ctx->decode_threads * SPNG_RING_SLOTS_PER_THREAD;
 
-int spng_get_text(spng_ctx *ctx, struct spng_text *text, uint32_t *n_text)
-{
-    if(ctx == NULL) return 1;
-    int ret = read_chunks(ctx, 0);
-    if(ret) return ret;
-    if(!ctx->stored.text) return SPNG_ECHUNKAVAIL;
-    if(n_text == NULL) return 1;
+    if(pool.n_slots / SPNG_RING_SLOTS_PER_THREAD != ctx->decode_threads) return SPNG_EOVERFLOW;
+    if(pool.n_slots > SIZE_MAX / slot_size) return SPNG_EOVERFLOW;
 
-    if(text == NULL)
+    pool.slots = spng__calloc(ctx, pool.n_slots, sizeof(struct spng__ring_slot));
+    ring = spng__malloc(ctx, pool.n_slots * slot_size);
+    threads = spng__malloc(ctx, ctx->decode_threads * sizeof(pthread_t));
+
+    if(pool.slots == NULL || ring == NULL || threads == NULL)
     {
-        *n_text = ctx->n_text;
-        return 0;
+        ret = SPNG_EMEM;
+        goto cleanup;
     }
 
-    if(*n_text < ctx->n_text) return 1;
+    size_t i;
+    for(i=0; i < pool.n_slots; i++) pool.slots[i].scanline = ring + i * slot_size;
 
-    uint32_t i;
-    for(i=0; i< ctx->n_text; i++)
+    if(pthread_mutex_init(&pool.lock, NULL))
     {
-        text[i].type = ctx->text_list[i].type;
-        memcpy(&text[i].keyword, ctx->text_list[i].keyword, strlen(ctx->text_list[i].keyword) + 1);
-        text[i].compression_method = 0;
-        text[i].compression_flag = ctx->text_list[i].compression_flag;
-        text[i].language_tag = ctx->text_list[i].language_tag;
-        text[i].translated_keyword = ctx->text_list[i].translated_keyword;
-        text[i].length = ctx->text_list[i].text_length;
-        text[i].text = ctx->text_list[i].text;
+        ret = SPNG_EINTERNAL;
+        goto cleanup;
     }
 
-    return ret;
-}
+    if(pthread_cond_init(&pool.cond, NULL))
+    {
+        pthread_mutex_destroy(&pool.lock);
+        ret = SPNG_EINTERNAL;
+        goto cleanup;
+    }
 
-int spng_get_bkgd(spng_ctx *ctx, struct spng_bkgd *bkgd)
-{
-    SPNG_GET_CHUNK_BOILERPLATE(bkgd);
+    for(n_workers=0; n_workers < ctx->decode_threads; n_workers++)
+    {
+        if(pthread_create(&threads[n_workers], NULL, decode_worker, &pool)) break;
+    }
 
-    *bkgd = ctx->bkgd;
+    size_t n;
+    for(n=0; !ret; n++)
+    {
+        slot = &pool.slots[n % pool.n_slots];
 
-    return 0;
-}
+        pthread_mutex_lock(&pool.lock);
 
-int spng_get_hist(spng_ctx *ctx, struct spng_hist *hist)
-{
-    SPNG_GET_CHUNK_BOILERPLATE(hist);
+        while(slot->busy && !pool.error) pthread_cond_wait(&pool.cond, &pool.lock);
 
-    *hist = ctx->hist;
+        ret = pool.error;
 
-    return 0;
-}
+        pthread_mutex_unlock(&pool.lock);
 
-int spng_get_phys(spng_ctx *ctx, struct spng_phys *phys)
-{
-    SPNG_GET_CHUNK_BOILERPLATE(phys);
+        if(ret) break;
 
-    *phys = ctx->phys;
+        /* The first scanline of each pass is defiltered against prev_scanline_buf,
+           which read_scanline() clears, the previous slot may still be in use */
+        ctx->scanline = slot->scanline;
+        if(ri->scanline_idx) ctx->prev_scanline = pool.slots[(n - 1) % pool.n_slots].scanline;
+        else ctx->prev_scanline = ctx->prev_scanline_buf;
 
-    return 0;
-}
+        slot->row_num = ri->row_num;
+        slot->pass = ri->pass;
 
-int spng_get_splt(spng_ctx *ctx, struct spng_splt *splt, uint32_t *n_splt)
-{
-    if(ctx == NULL) return 1;
-    int ret = read_chunks(ctx, 0);
-    if(ret) return ret;
-    if(!ctx->stored.splt) return SPNG_ECHUNKAVAIL;
-    if(n_splt == NULL) return 1;
+        ret = read_scanline(ctx);
+        if(ret) break;
 
-    if(splt == NULL)
-    {
-        *n_splt = ctx->n_splt;
-        return 0;
-    }
+        if(n_workers)
+        {
+            pthread_mutex_lock(&pool.lock);
 
-    if(*n_splt < ctx->n_splt) return 1;
+            slot->busy = 1;
+            pool.produced++;
 
-    memcpy(splt, ctx->splt_list, ctx->n_splt * sizeof(struct spng_splt));
+            pthread_cond_broadcast(&pool.cond);
+            pthread_mutex_unlock(&pool.lock);
+        }
+        else output_scanline(ctx, out, ctx->row, slot->scanline, slot->row_num, slot->pass);
 
-    return 0;
-}
+        ret = update_row_info(ctx);
+    }
 
-int spng_get_time(spng_ctx *ctx, struct spng_time *time)
-{
-    SPNG_GET_CHUNK_BOILERPLATE(time);
+    if(n_workers)
+    {
+        pthread_mutex_lock(&pool.lock);
 
-    *time = ctx->time;
+        if(ret != SPNG_EOI && !pool.error) pool.error = ret;
+        pool.done = 1;
 
-    return 0;
-}
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
 
-int spng_get_unknown_chunks(spng_ctx *ctx, struct spng_unknown_chunk *chunks, uint32_t *n_chunks)
-{
-    if(ctx == NULL) return 1;
-    int ret = read_chunks(ctx, 0);
-    if(ret) return ret;
-    if(!ctx->stored.unknown) return SPNG_ECHUNKAVAIL;
-    if(n_chunks == NULL) return 1;
+        for(k=0; k < n_workers; k++) pthread_join(threads[k], NULL);
 
-    if(chunks == NULL)
-    {
-        *n_chunks = ctx->n_chunks;
-        return 0;
+        if(ret == SPNG_EOI && pool.error) ret = pool.error;
     }
 
-    if(*n_chunks < ctx->n_chunks) return 1;
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
 
-    memcpy(chunks, ctx->chunk_list, sizeof(struct spng_unknown_chunk));
+    if(ret == SPNG_EOI) ret = end_of_idat(ctx);
 
-    return 0;
+cleanup:
+    /* Don't leave pointers to the ring buffer */
+    ctx->scanline = ctx->scanline_buf;
+    ctx->prev_scanline = ctx->prev_scanline_buf;
+
+    spng__free(ctx, threads);
+    spng__free(ctx, ring);
+    spng__free(ctx, pool.slots);
+
+    return ret;
 }
+#endif
 
-int spng_get_offs(spng_ctx *ctx, struct spng_offs *offs)
+#ifdef SPNG_MULTITHREADING
+/* Restart strip decoding
+
+   Images encoded with SPNG_RESTART_STRIPS have an spRS chunk after the image data
+   with the offset of each strip in the zlib stream, strips are inflated,
+   defiltered and converted in parallel straight from the PNG buffer.
+   If any strip is not decodable on its own the image is decoded serially.
+*/
+struct spng__idat_extent
 {
-    SPNG_GET_CHUNK_BOILERPLATE(offs);
+    const unsigned char *data;
+    uint64_t start; /* offset in the zlib stream */
+    uint32_t length;
+};
 
-    *offs = ctx->offs;
+struct spng__restart_pool
+{
+    spng_ctx *ctx;
+    unsigned char *out;
 
-    return 0;
-}
+    const struct spng__idat_extent *extents;
+    uint32_t n_extents;
+    uint64_t stream_len;
 
-int spng_get_exif(spng_ctx *ctx, struct spng_exif *exif)
+    const unsigned char *offsets;
+    uint32_t rows_per_strip;
+    uint32_t n_strips;
+    uint32_t next_strip;
+
+    uint32_t *adler; /* of each strip's filtered data */
+    uint64_t trailer; /* offset of the zlib checksum */
+
+    int error;
+
+    pthread_mutex_t lock;
+};
+
+static uint64_t restart_offset(const struct spng__restart_pool *pool, uint32_t k)
 {
-    SPNG_GET_CHUNK_BOILERPLATE(exif);
+    if(k == pool->n_strips) return pool->stream_len;
 
-    *exif = ctx->exif;
+    const unsigned char *p = pool->offsets + (size_t)k * 8;
 
-    return 0;
+    return (uint64_t)read_u32(p) << 32 | read_u32(p + 4);
 }
 
-int spng_set_ihdr(spng_ctx *ctx, struct spng_ihdr *ihdr)
+/* Locate the spRS chunk and the IDAT chunks with buffer input, chunk CRC's are checked by the regular reader */
+static int find_restart_table(spng_ctx *ctx, struct spng__restart_pool *pool, struct spng__idat_extent **extents)
 {
-    SPNG_SET_CHUNK_BOILERPLATE(ihdr);
+    const unsigned char *base = ctx->png_base;
+    const size_t size = ctx->data_size;
+    const unsigned char *table = NULL;
+    uint32_t length = 0, n_extents = 0;
+    uint64_t stream_len = 0;
+    size_t pos;
+    int pass;
 
-    if(ctx->stored.ihdr) return 1;
+    *extents = NULL;
 
-    ret = check_ihdr(ihdr, ctx->max_width, ctx->max_height);
-    if(ret) return ret;
+    /* Count the IDAT chunks, then fill in the extents */
+    for(pass=0; pass < 2; pass++)
+    {
+        int idat_done = 0;
 
-    ctx->ihdr = *ihdr;
+        n_extents = 0;
+        stream_len = 0;
 
-    ctx->stored.ihdr = 1;
-    ctx->user.ihdr = 1;
+        for(pos = ctx->first_idat.offset; pos <= size && size - pos >= 12; pos += (size_t)12 + length)
+        {
+            const unsigned char *chunk = base + pos;
 
-    return 0;
-}
+            length = read_u32(chunk);
 
-int spng_set_plte(spng_ctx *ctx, struct spng_plte *plte)
-{
-    SPNG_SET_CHUNK_BOILERPLATE(plte);
+            if(length > spng_u32max || length > size - pos - 12) return 0;
 
-    if(!ctx->stored.ihdr) return 1;
+            if(!memcmp(chunk + 4, type_idat, 4))
+            {
+                if(idat_done) return 0;
 
-    if(check_plte(plte, &ctx->ihdr)) return 1;
+                if(pass) (*extents)[n_extents] = (struct spng__idat_extent){ chunk + 8, stream_len, length };
 
-    ctx->plte.n_entries = plte->n_entries;
+                n_extents++;
+                stream_len += length;
 
-    memcpy(ctx->plte.entries, plte->entries, plte->n_entries * sizeof(struct spng_plte_entry));
+                continue;
+            }
 
-    ctx->stored.plte = 1;
-    ctx->user.plte = 1;
+            idat_done = 1;
 
-    return 0;
-}
+            if(!memcmp(chunk + 4, type_iend, 4)) break;
 
-int spng_set_trns(spng_ctx *ctx, struct spng_trns *trns)
-{
-    SPNG_SET_CHUNK_BOILERPLATE(trns);
+            if(!memcmp(chunk + 4, type_sprs, 4))
+            {
+                if(chunk_crc(ctx, crc32(0, Z_NULL, 0), NULL, chunk + 4, length + 4) != read_u32(chunk + 8 + length)) return 0;
 
-    if(!ctx->stored.ihdr) return SPNG_ENOIHDR;
+                table = chunk + 8;
+                break;
+            }
+        }
 
-    if(ctx->ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE)
-    {
-        ctx->trns.gray = trns->gray;
-    }
-    else if(ctx->ihdr.color_type == SPNG_COLOR_TYPE_TRUECOLOR)
-    {
-        ctx->trns.red = trns->red;
-        ctx->trns.green = trns->green;
-        ctx->trns.blue = trns->blue;
+        if(table == NULL || length < 8 || !n_extents) return 0;
+
+        if(!pass)
+        {
+            *extents = spng__malloc(ctx, (size_t)n_extents * sizeof(struct spng__idat_extent));
+            if(*extents == NULL) return SPNG_EMEM;
+        }
     }
-    else if(ctx->ihdr.color_type == SPNG_COLOR_TYPE_INDEXED)
-    {
-        if(!ctx->stored.plte) return SPNG_ETRNS_NO_PLTE;
-        if(trns->n_type3_entries > ctx->plte.n_entries) return 1;
 
-        ctx->trns.n_type3_entries = trns->n_type3_entries;
-        memcpy(ctx->trns.type3_alpha, trns->type3_alpha, trns->n_type3_entries);
+    const size_t scanline_width = ctx->subimage[0].scanline_width;
+    uint32_t rows_per_strip = read_u32(table);
+    uint32_t n_strips = read_u32(table + 4);
+    uint32_t k;
+
+    if(!rows_per_strip || rows_per_strip > ctx->ihdr.height) return 0;
+    if(n_strips != ctx->ihdr.height / rows_per_strip + (ctx->ihdr.height % rows_per_strip ? 1 : 0)) return 0;
+    if(length != 8 + (uint64_t)n_strips * 8) return 0;
+    if(scanline_width > UINT_MAX / rows_per_strip) return 0;
+
+    /* Strips are only used if the table is valid */
+    pool->extents = *extents;
+    pool->n_extents = n_extents;
+    pool->stream_len = stream_len;
+    pool->offsets = table + 8;
+    pool->rows_per_strip = rows_per_strip;
+    pool->n_strips = n_strips;
+
+    /* The first strip starts after the zlib header */
+    int valid = restart_offset(pool, 0) == 2;
+
+    for(k=1; k <= n_strips && valid; k++)
+    {
+        if(restart_offset(pool, k) <= restart_offset(pool, k - 1)) valid = 0;
     }
-    else return SPNG_ETRNS_COLOR_TYPE;
 
-    ctx->stored.trns = 1;
-    ctx->user.trns = 1;
+    if(!valid) pool->n_strips = 0;
 
     return 0;
 }
 
-int spng_set_chrm(spng_ctx *ctx, struct spng_chrm *chrm)
+/* Point the stream at the next part of the strip's input when it's empty */
+static int inflate_restart_input(z_stream *zstream, const struct spng__idat_extent **extent, uint64_t *pos, uint64_t end)
 {
-    SPNG_SET_CHUNK_BOILERPLATE(chrm);
+    if(zstream->avail_in) return 0;
+    if(*pos >= end) return SPNG_EIDAT_TOO_SHORT;
 
-    struct spng_chrm_int chrm_int;
+    while(*pos >= (*extent)->start + (*extent)->length) (*extent)++;
 
-    chrm_int.white_point_x = (uint32_t)(chrm->white_point_x * 100000.0);
-    chrm_int.white_point_y = (uint32_t)(chrm->white_point_y * 100000.0);
-    chrm_int.red_x = (uint32_t)(chrm->red_x * 100000.0);
-    chrm_int.red_y = (uint32_t)(chrm->red_y * 100000.0);
-    chrm_int.green_x = (uint32_t)(chrm->green_x * 100000.0);
-    chrm_int.green_y = (uint32_t)(chrm->green_y * 100000.0);
-    chrm_int.blue_x = (uint32_t)(chrm->blue_x * 100000.0);
-    chrm_int.blue_y = (uint32_t)(chrm->blue_y * 100000.0);
+    uint64_t len = (*extent)->start + (*extent)->length - *pos;
 
-    if(check_chrm_int(&chrm_int)) return SPNG_ECHRM;
+    if(len > end - *pos) len = end - *pos;
 
-    ctx->chrm_int = chrm_int;
+    zstream->next_in = (*extent)->data + (*pos - (*extent)->start);
+    zstream->avail_in = (uInt)len;
 
-    ctx->stored.chrm = 1;
-    ctx->user.chrm = 1;
+    *pos += len;
 
     return 0;
 }
 
-int spng_set_chrm_int(spng_ctx *ctx, struct spng_chrm_int *chrm_int)
-{
-    SPNG_SET_CHUNK_BOILERPLATE(chrm_int);
+/* Inflate, defilter and convert strip k, returns non-zero if it can't be decoded on its own */
+static int decode_restart_strip(struct spng__restart_pool *pool, uint32_t k, z_stream *zstream,
+                                unsigned char *filtered, const unsigned char *zeros, unsigned char *row_buf)
+{
+    spng_ctx *ctx = pool->ctx;
+    const size_t scanline_width = ctx->subimage[0].scanline_width;
+    const int swap = ctx->ihdr.bit_depth == 16 && ctx->fmt != SPNG_FMT_RAW;
+    const uint32_t first_row = k * pool->rows_per_strip;
+    uint32_t n_rows = pool->rows_per_strip;
+    uint64_t pos = restart_offset(pool, k);
+    const uint64_t end = restart_offset(pool, k + 1);
+    const struct spng__idat_extent *extent = pool->extents;
+    uint32_t lo = 0, hi = pool->n_extents, i;
+    unsigned char spare;
+    int ret;
 
-    if(check_chrm_int(chrm_int)) return SPNG_ECHRM;
+    if(n_rows > ctx->ihdr.height - first_row) n_rows = ctx->ihdr.height - first_row;
 
-    ctx->chrm_int = *chrm_int;
+    /* Last extent starting at or before pos */
+    while(hi - lo > 1)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
 
-    ctx->stored.chrm = 1;
-    ctx->user.chrm = 1;
+        if(pool->extents[mid].start <= pos) lo = mid;
+        else hi = mid;
+    }
 
-    return 0;
-}
+    extent += lo;
 
-int spng_set_gama(spng_ctx *ctx, double gamma)
-{
-    SPNG_SET_CHUNK_BOILERPLATE(ctx);
+    if(inflateReset(zstream) != Z_OK) return SPNG_EZLIB;
 
-    uint32_t gama = gamma * 100000.0;
+    zstream->avail_in = 0;
+    zstream->next_out = filtered;
+    zstream->avail_out = (uInt)(n_rows * scanline_width);
 
-    if(!gama) return 1;
-    if(gama > spng_u32max) return 1;
+    ret = Z_OK;
 
-    ctx->gama = gama;
+    while(zstream->avail_out)
+    {
+        ret = inflate_restart_input(zstream, &extent, &pos, end);
+        if(ret) return ret;
 
-    ctx->stored.gama = 1;
-    ctx->user.gama = 1;
+        ret = inflate(zstream, Z_NO_FLUSH);
 
-    return 0;
-}
+        if(ret == Z_STREAM_END)
+        {
+            if(zstream->avail_out) return SPNG_EIDAT_TOO_SHORT;
+        }
+        else if(ret != Z_OK && (ret != Z_BUF_ERROR || zstream->avail_in)) return SPNG_EIDAT_STREAM;
+    }
 
-int spng_set_gama_int(spng_ctx *ctx, uint32_t gamma)
-{
-    SPNG_SET_CHUNK_BOILERPLATE(ctx);
+    if(k == pool->n_strips - 1)
+    {/* Find the end of the stream with one byte of output space */
+        zstream->next_out = &spare;
+        zstream->avail_out = 1;
 
-    if(!gamma) return 1;
-    if(gamma > spng_u32max) return 1;
+        while(ret != Z_STREAM_END)
+        {
+            ret = inflate_restart_input(zstream, &extent, &pos, end);
+            if(ret) return ret;
 
-    ctx->gama = gamma;
+            ret = inflate(zstream, Z_NO_FLUSH);
 
-    ctx->stored.gama = 1;
-    ctx->user.gama = 1;
+            if(!zstream->avail_out) return SPNG_EIDAT_STREAM;
+            if(ret != Z_OK && ret != Z_STREAM_END && (ret != Z_BUF_ERROR || zstream->avail_in)) return SPNG_EIDAT_STREAM;
+        }
 
-    return 0;
-}
+        pool->trailer = pos - zstream->avail_in;
+    }
+    else if(ret == Z_STREAM_END) return SPNG_EIDAT_STREAM;
 
-int spng_set_iccp(spng_ctx *ctx, struct spng_iccp *iccp)
-{
-    SPNG_SET_CHUNK_BOILERPLATE(iccp);
+    pool->adler[k] = adler32(adler32(0, Z_NULL, 0), filtered, (uInt)(n_rows * scanline_width));
 
-    if(check_png_keyword(iccp->profile_name)) return SPNG_EICCP_NAME;
-    if(!iccp->profile_len) return SPNG_ECHUNK_SIZE;
-    if(iccp->profile_len > spng_u32max) return SPNG_ECHUNK_STDLEN;
-
-    if(ctx->iccp.profile && !ctx->user.iccp) spng__free(ctx, ctx->iccp.profile);
-
-    ctx->iccp = *iccp;
-
-    ctx->stored.iccp = 1;
-    ctx->user.iccp = 1;
+    const unsigned char *prev = zeros;
 
-    return 0;
-}
+    for(i=0; i < n_rows; i++)
+    {
+        unsigned char *scanline = filtered + i * scanline_width;
+        unsigned filter = scanline[0];
 
-int spng_set_sbit(spng_ctx *ctx, struct spng_sbit *sbit)
-{
-    SPNG_SET_CHUNK_BOILERPLATE(sbit);
+        /* None and Sub don't reference the previous strip */
+        if(filter > 4 || (!i && filter > 1)) return SPNG_EFILTER;
 
-    if(check_sbit(sbit, &ctx->ihdr)) return 1;
+        if(swap) u16_row_to_host(scanline + 1, scanline_width - 1);
 
-    if(!ctx->stored.ihdr) return 1;
+        ret = defilter_scanline(prev, scanline + 1, scanline_width, ctx->bytes_per_pixel, filter, ctx->simd_level);
+        if(ret) return ret;
 
-    ctx->sbit = *sbit;
+        output_scanline(ctx, pool->out, row_buf, scanline + 1, first_row + i, 0);
 
-    ctx->stored.sbit = 1;
-    ctx->user.sbit = 1;
+        prev = scanline + 1;
+    }
 
     return 0;
 }
 
-int spng_set_srgb(spng_ctx *ctx, uint8_t rendering_intent)
+static void *restart_worker(void *arg)
 {
-    SPNG_SET_CHUNK_BOILERPLATE(ctx);
-
-    if(rendering_intent > 3) return 1;
-
-    ctx->srgb_rendering_intent = rendering_intent;
+    struct spng__restart_pool *pool = arg;
+    spng_ctx *ctx = pool->ctx;
+    const size_t scanline_width = ctx->subimage[0].scanline_width;
+    unsigned char *filtered = spng__malloc(ctx, pool->rows_per_strip * scanline_width);
+    unsigned char *zeros = spng__calloc(ctx, 1, scanline_width);
+    unsigned char *row_buf = NULL;
+    z_stream zstream = {0};
+    uint32_t k;
+    int ret = 0;
 
-    ctx->stored.srgb = 1;
-    ctx->user.srgb = 1;
+    zstream.zalloc = spng__zalloc;
+    zstream.zfree = spng__zfree;
+    zstream.opaque = ctx;
 
-    return 0;
-}
+    if(ctx->row != NULL) row_buf = spng__malloc(ctx, ctx->row_buf_size);
 
-int spng_set_text(spng_ctx *ctx, struct spng_text *text, uint32_t n_text)
-{
-    if(!n_text) return 1;
-    SPNG_SET_CHUNK_BOILERPLATE(text);
+    if(filtered == NULL || zeros == NULL || (ctx->row != NULL && row_buf == NULL)) ret = SPNG_EMEM;
+    else if(inflateInit2(&zstream, -15) != Z_OK) ret = SPNG_EZLIB_INIT;
 
-    uint32_t i;
-    for(i=0; i < n_text; i++)
+    while(!ret)
     {
-        if(check_png_keyword(text[i].keyword)) return SPNG_ETEXT_KEYWORD;
-        if(!text[i].length) return 1;
-        if(text[i].length > UINT_MAX) return 1;
-        if(text[i].text == NULL) return 1;
-
-        if(text[i].type == SPNG_TEXT)
-        {
-            if(ctx->strict && check_png_text(text[i].text, text[i].length)) return 1;
-        }
-        else if(text[i].type == SPNG_ZTXT)
-        {
-            if(ctx->strict && check_png_text(text[i].text, text[i].length)) return 1;
+        pthread_mutex_lock(&pool->lock);
 
-            if(text[i].compression_method != 0) return SPNG_EZTXT_COMPRESSION_METHOD;
-        }
-        else if(text[i].type == SPNG_ITXT)
+        if(pool->error || pool->next_strip >= pool->n_strips)
         {
-            if(text[i].compression_flag > 1) return SPNG_EITXT_COMPRESSION_FLAG;
-            if(text[i].compression_method != 0) return SPNG_EITXT_COMPRESSION_METHOD;
-            if(text[i].language_tag == NULL) return SPNG_EITXT_LANG_TAG;
-            if(text[i].translated_keyword == NULL) return SPNG_EITXT_TRANSLATED_KEY;
+            pthread_mutex_unlock(&pool->lock);
+            break;
         }
-        else return 1;
-
-    }
 
-    struct spng_text2 *text_list = spng__calloc(ctx, sizeof(struct spng_text2), n_text);
-
-    if(!text_list) return SPNG_EMEM;
+        k = pool->next_strip++;
 
-    if(ctx->text_list != NULL)
-    {
-        for(i=0; i < ctx->n_text; i++)
-        {
-            if(ctx->user.text) break;
+        pthread_mutex_unlock(&pool->lock);
 
-            spng__free(ctx, ctx->text_list[i].keyword);
-            if(ctx->text_list[i].compression_flag) spng__free(ctx, ctx->text_list[i].text);
-        }
-        spng__free(ctx, ctx->text_list);
+        ret = decode_restart_strip(pool, k, &zstream, filtered, zeros, row_buf);
     }
 
-    for(i=0; i < n_text; i++)
+    if(ret)
     {
-        text_list[i].type = text[i].type;
-        /* Prevent issues with spng_text.keyword[80] going out of scope */
-        text_list[i].keyword = text_list[i].user_keyword_storage;
-        memcpy(text_list[i].user_keyword_storage, text[i].keyword, strlen(text[i].keyword));
-        text_list[i].text = text[i].text;
-        text_list[i].text_length = text[i].length;
-
-        if(text[i].type == SPNG_ZTXT)
-        {
-            text_list[i].compression_flag = 1;
-        }
-        else if(text[i].type == SPNG_ITXT)
-        {
-            text_list[i].compression_flag = text[i].compression_flag;
-            text_list[i].language_tag = text[i].language_tag;
-            text_list[i].translated_keyword = text[i].translated_keyword;
-        }
+        pthread_mutex_lock(&pool->lock);
+        if(!pool->error) pool->error = ret;
+        pthread_mutex_unlock(&pool->lock);
     }
 
-    ctx->text_list = text_list;
-    ctx->n_text = n_text;
+    inflateEnd(&zstream);
 
-    ctx->stored.text = 1;
-    ctx->user.text = 1;
+    spng__free(ctx, filtered);
+    spng__free(ctx, zeros);
+    spng__free(ctx, row_buf);
 
-    return 0;
+    return NULL;
 }
 
-int spng_set_bkgd(spng_ctx *ctx, struct spng_bkgd *bkgd)
+/* Buffer input only, *decoded is set to zero if the image has to be decoded serially */
+static int decode_restart_strips(spng_ctx *ctx, unsigned char *out, int *decoded)
 {
-    SPNG_SET_CHUNK_BOILERPLATE(bkgd);
+    struct spng__restart_pool pool = { .ctx = ctx, .out = out };
+    struct spng__idat_extent *extents = NULL;
+    pthread_t *threads = NULL;
+    uint32_t k, n_workers = 0, n_threads = ctx->decode_threads;
+    int ret;
 
-    if(!ctx->stored.ihdr)  return 1;
+    *decoded = 0;
 
-    if(ctx->ihdr.color_type == 0 || ctx->ihdr.color_type == 4)
+    ret = find_restart_table(ctx, &pool, &extents);
+    if(ret || !pool.n_strips) goto cleanup;
+
+    pool.adler = spng__malloc(ctx, (size_t)pool.n_strips * sizeof(uint32_t));
+
+    if(n_threads > pool.n_strips - 1) n_threads = pool.n_strips - 1;
+    if(n_threads) threads = spng__malloc(ctx, n_threads * sizeof(pthread_t));
+
+    if(pool.adler == NULL || (n_threads && threads == NULL))
     {
-        ctx->bkgd.gray = bkgd->gray;
+        ret = SPNG_EMEM;
+        goto cleanup;
     }
-    else if(ctx->ihdr.color_type == 2 || ctx->ihdr.color_type == 6)
+
+    if(pthread_mutex_init(&pool.lock, NULL))
     {
-        ctx->bkgd.red = bkgd->red;
-        ctx->bkgd.green = bkgd->green;
-        ctx->bkgd.blue = bkgd->blue;
+        ret = SPNG_EINTERNAL;
+        goto cleanup;
     }
-    else if(ctx->ihdr.color_type == 3)
-    {
-        if(!ctx->stored.plte) return SPNG_EBKGD_NO_PLTE;
-        if(bkgd->plte_index >= ctx->plte.n_entries) return SPNG_EBKGD_PLTE_IDX;
 
-        ctx->bkgd.plte_index = bkgd->plte_index;
+    for(n_workers=0; n_workers < n_threads; n_workers++)
+    {
+        if(pthread_create(&threads[n_workers], NULL, restart_worker, &pool)) break;
     }
 
-    ctx->stored.bkgd = 1;
-    ctx->user.bkgd = 1;
+    /* The calling thread decodes strips too */
+    restart_worker(&pool);
 
-    return 0;
-}
+    for(k=0; k < n_workers; k++) pthread_join(threads[k], NULL);
 
-int spng_set_hist(spng_ctx *ctx, struct spng_hist *hist)
-{
-    SPNG_SET_CHUNK_BOILERPLATE(hist);
+    pthread_mutex_destroy(&pool.lock);
 
-    if(!ctx->stored.plte) return SPNG_EHIST_NO_PLTE;
+    if(pool.error == SPNG_EMEM)
+    {
+        ret = SPNG_EMEM;
+        goto cleanup;
+    }
 
-    ctx->hist = *hist;
+    if(pool.error) goto cleanup;
 
-    ctx->stored.hist = 1;
-    ctx->user.hist = 1;
+    int validate = !(ctx->flags & SPNG_CTX_IGNORE_ADLER32) && ctx->crc_action_critical != SPNG_CRC_USE;
 
-    return 0;
-}
+    if(validate)
+    {
+        const size_t scanline_width = ctx->subimage[0].scanline_width;
+        const uint32_t height = ctx->ihdr.height;
+        uint32_t adler = adler32(0, Z_NULL, 0);
+        unsigned char trailer[4];
+        const struct spng__idat_extent *extent = extents;
 
-int spng_set_phys(spng_ctx *ctx, struct spng_phys *phys)
-{
-    SPNG_SET_CHUNK_BOILERPLATE(phys);
+        for(k=0; k < pool.n_strips; k++)
+        {
+            uint32_t n_rows = k == pool.n_strips - 1 ? height - k * pool.rows_per_strip : pool.rows_per_strip;
 
-    if(check_phys(phys)) return SPNG_EPHYS;
+            adler = adler32_combine(adler, pool.adler[k], (z_off_t)(n_rows * scanline_width));
+        }
 
-    ctx->phys = *phys;
+        /* The checksum may be split across IDAT's */
+        for(k=0; k < 4; k++)
+        {
+            uint64_t pos = pool.trailer + k;
 
-    ctx->stored.phys = 1;
-    ctx->user.phys = 1;
+            if(pos >= pool.stream_len) goto cleanup;
 
-    return 0;
-}
+            while(pos >= extent->start + extent->length) extent++;
 
-int spng_set_splt(spng_ctx *ctx, struct spng_splt *splt, uint32_t n_splt)
-{
-    if(!n_splt) return 1;
-    SPNG_SET_CHUNK_BOILERPLATE(splt);
+            trailer[k] = extent->data[pos - extent->start];
+        }
 
-    uint32_t i;
-    for(i=0; i < n_splt; i++)
-    {
-        if(check_png_keyword(splt[i].name)) return SPNG_ESPLT_NAME;
-        if( !(splt[i].sample_depth == 8 || splt[i].sample_depth == 16) ) return SPNG_ESPLT_DEPTH;
+        if(read_u32(trailer) != adler) goto cleanup;
     }
 
-    if(ctx->stored.splt && !ctx->user.splt)
+    /* Skip the image data, the chunk CRC's are still checked */
+    while(next_chunk_is_idat(ctx))
     {
-        for(i=0; i < ctx->n_splt; i++)
-        {
-            if(ctx->splt_list[i].entries != NULL) spng__free(ctx, ctx->splt_list[i].entries);
-        }
-        spng__free(ctx, ctx->splt_list);
-    }
-
-    ctx->splt_list = splt;
-    ctx->n_splt = n_splt;
-
-    ctx->stored.splt = 1;
-    ctx->user.splt = 1;
+        ret = read_header(ctx);
+        if(ret) goto cleanup;
 
-    return 0;
-}
+        ret = discard_chunk_bytes(ctx, ctx->current_chunk.length);
+        if(ret) goto cleanup;
+    }
 
-int spng_set_time(spng_ctx *ctx, struct spng_time *time)
-{
-    SPNG_SET_CHUNK_BOILERPLATE(time);
+    ctx->state = SPNG_STATE_EOI;
 
-    if(check_time(time)) return SPNG_ETIME;
+    ret = end_of_idat(ctx);
 
-    ctx->time = *time;
+    *decoded = 1;
 
-    ctx->stored.time = 1;
-    ctx->user.time = 1;
+cleanup:
+    spng__free(ctx, threads);
+    spng__free(ctx, pool.adler);
+    spng__free(ctx, extents);
 
-    return 0;
+    return ret;
 }
+#endif
 
-int spng_set_unknown_chunks(spng_ctx *ctx, struct spng_unknown_chunk *chunks, uint32_t n_chunks)
+/* Decode the remaining rows, with fed input this is called again after SPNG_EAGAIN */
+static int decode_rows(spng_ctx *ctx, unsigned char *out)
 {
-    if(!n_chunks) return 1;
-    SPNG_SET_CHUNK_BOILERPLATE(chunks);
+    int ret;
+    struct spng_row_info *ri = &ctx->row_info;
 
-    uint32_t i;
-    for(i=0; i < n_chunks; i++)
+    do
     {
-        if(chunks[i].length > spng_u32max) return SPNG_ECHUNK_STDLEN;
-        if(chunks[i].length && chunks[i].data == NULL) return 1;
+        ret = read_scanline(ctx);
+        if(ret) return decode_err(ctx, ret);
 
-        switch(chunks[i].location)
-        {
-            case SPNG_AFTER_IHDR:
-            case SPNG_AFTER_PLTE:
-            case SPNG_AFTER_IDAT:
-            break;
-            default: return SPNG_ECHUNK_POS;
-        }
-    }
+        output_scanline(ctx, out, ctx->row, ctx->scanline, ri->row_num, ri->pass);
 
-    if(ctx->stored.unknown && !ctx->user.unknown)
-    {
-        for(i=0; i < ctx->n_chunks; i++)
-        {
-            spng__free(ctx, ctx->chunk_list[i].data);
-        }
-        spng__free(ctx, ctx->chunk_list);
-    }
+        void *t = ctx->prev_scanline;
+        ctx->prev_scanline = ctx->scanline;
+        ctx->scanline = t;
 
-    ctx->chunk_list = chunks;
-    ctx->n_chunks = n_chunks;
+        ret = update_row_info(ctx);
+    }while(!ret);
 
-    ctx->stored.unknown = 1;
-    ctx->user.unknown = 1;
+    if(ret != SPNG_EOI) return decode_err(ctx, ret);
+
+    ret = end_of_idat(ctx);
+    if(ret) return decode_err(ctx, ret);
+
+    if(ctx->decode_flags.downscale && ctx->decode_flags.interlaced) downscale_finish(ctx, out);
 
     return 0;
 }
 
-int spng_set_offs(spng_ctx *ctx, struct spng_offs *offs)
+static int decode_image(spng_ctx *ctx, void *out, size_t len, int fmt, int flags)
 {
-    SPNG_SET_CHUNK_BOILERPLATE(offs);
+    if(ctx->encode_only) return SPNG_ECTXTYPE;
+    if(ctx->state >= SPNG_STATE_EOI) return SPNG_EOI;
 
-    if(check_offs(offs)) return SPNG_EOFFS;
+    if(ctx->feed && ctx->state == SPNG_STATE_DECODE_INIT && !ctx->decode_flags.progressive)
+    {/* Continue where the previous call returned SPNG_EAGAIN */
+        if(out == NULL) return 1;
+        if(fmt != (int)ctx->fmt) return SPNG_EOPSTATE;
+        if(len < ctx->image_size) return SPNG_EBUFSIZ;
 
-    ctx->offs = *offs;
+        return decode_rows(ctx, out);
+    }
 
-    ctx->stored.offs = 1;
-    ctx->user.offs = 1;
+    const struct spng_ihdr *ihdr = &ctx->ihdr;
 
-    return 0;
-}
+    int ret = read_chunks(ctx, 0);
+    if(ret) return decode_err(ctx, ret);
 
-int spng_set_exif(spng_ctx *ctx, struct spng_exif *exif)
-{
-    SPNG_SET_CHUNK_BOILERPLATE(exif);
+    ret = check_decode_fmt(ihdr, fmt);
+    if(ret) return ret;
 
-    if(check_exif(exif)) return SPNG_EEXIF;
+    struct spng_ihdr out_ihdr;
 
-    if(ctx->exif.data != NULL && !ctx->user.exif) spng__free(ctx, ctx->exif.data);
+    ret = output_ihdr(ctx, fmt, &out_ihdr);
+    if(ret) return ret;
 
-    ctx->exif = *exif;
+    if((ctx->crop_width || ctx->downscale_shift) && (flags & SPNG_DECODE_PROGRESSIVE)) return SPNG_EOPSTATE;
 
-    ctx->stored.exif = 1;
-    ctx->user.exif = 1;
+    ret = calculate_image_width(&out_ihdr, fmt, &ctx->image_width);
+    if(ret) return decode_err(ctx, ret);
 
-    return 0;
-}
+    if(ctx->image_width > SIZE_MAX / out_ihdr.height) ctx->image_size = 0; /* overflow */
+    else ctx->image_size = ctx->image_width * out_ihdr.height;
 
-const char *spng_strerror(int err)
-{
-    switch(err)
+    if( !(flags & SPNG_DECODE_PROGRESSIVE) )
+    {
+        if(out == NULL) return 1;
+        if(!ctx->image_size) return SPNG_EOVERFLOW;
+        if(len < ctx->image_size) return SPNG_EBUFSIZ;
+    }
+
+    uint32_t bytes_read = 0;
+
+    ret = read_idat_bytes(ctx, &bytes_read);
+    if(ret) return decode_err(ctx, ret);
+
+    if(bytes_read > 1)
+    {
+        int valid = read_u16(ctx->data) % 31 ? 0 : 1;
+
+        unsigned flg = ctx->data[1];
+        unsigned flevel = flg >> 6;
+        int compression_level = Z_DEFAULT_COMPRESSION;
+
+        if(flevel == 0) compression_level = 0; /* fastest */
+        else if(flevel == 1) compression_level = 1; /* fast */
+        else if(flevel == 2) compression_level = 6; /* default */
+        else if(flevel == 3) compression_level = 9; /* slowest, max compression */
+
+        if(valid) ctx->image_options.compression_level = compression_level;
+    }
+
+    ret = spng__inflate_init(ctx, ctx->image_options.window_bits);
+    if(ret) return decode_err(ctx, ret);
+
+    ctx->zstream.avail_in = bytes_read;
+    ctx->zstream.next_in = ctx->data;
+
+    size_t scanline_buf_size = ctx->subimage[ctx->widest_pass].scanline_width;
+
+    scanline_buf_size += 32;
+
+    if(scanline_buf_size < 32) return SPNG_EOVERFLOW;
+
+    ctx->scanline_buf = spng__reuse(ctx, ctx->scanline_buf, &ctx->scanline_buf_size, scanline_buf_size);
+    ctx->prev_scanline_buf = spng__reuse(ctx, ctx->prev_scanline_buf, &ctx->prev_scanline_buf_size, scanline_buf_size);
+
+    ctx->scanline = ctx->scanline_buf;
+    ctx->prev_scanline = ctx->prev_scanline_buf;
+
+    struct decode_flags f = {0};
+
+    ctx->fmt = fmt;
+
+    if(ihdr->color_type == SPNG_COLOR_TYPE_INDEXED) f.indexed = 1;
+
+    unsigned processing_depth = ihdr->bit_depth;
+
+    if(f.indexed) processing_depth = 8;
+
+    if(ihdr->interlace_method) f.interlaced = 1;
+
+    if(ctx->scanline == NULL || ctx->prev_scanline == NULL)
+    {
+        return decode_err(ctx, SPNG_EMEM);
+    }
+
+    f.do_scaling = 1;
+    if(f.indexed) f.do_scaling = 0;
+
+    unsigned depth_target = 8; /* FMT_RGBA8, G8 */
+    if(fmt == SPNG_FMT_RGBA16) depth_target = 16;
+
+    if(flags & SPNG_DECODE_TRNS && ctx->stored.trns) f.apply_trns = 1;
+    else flags &= ~SPNG_DECODE_TRNS;
+
+    if(ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE_ALPHA ||
+       ihdr->color_type == SPNG_COLOR_TYPE_TRUECOLOR_ALPHA) flags &= ~SPNG_DECODE_TRNS;
+
+    if(flags & SPNG_DECODE_GAMMA && ctx->stored.gama) f.apply_gamma = 1;
+    else flags &= ~SPNG_DECODE_GAMMA;
+
+    if(flags & SPNG_DECODE_USE_SBIT && ctx->stored.sbit) f.use_sbit = 1;
+    else flags &= ~SPNG_DECODE_USE_SBIT;
+
+    if(fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGBA16))
+    {
+        if(ihdr->color_type == SPNG_COLOR_TYPE_TRUECOLOR_ALPHA &&
+           ihdr->bit_depth == depth_target) f.same_layout = 1;
+    }
+    else if(fmt == SPNG_FMT_RGB8)
+    {
+        if(ihdr->color_type == SPNG_COLOR_TYPE_TRUECOLOR &&
+           ihdr->bit_depth == depth_target) f.same_layout = 1;
+
+        f.apply_trns = 0; /* not applicable */
+    }
+    else if(fmt & (SPNG_FMT_PNG | SPNG_FMT_RAW))
+    {
+        f.same_layout = 1;
+        f.do_scaling = 0;
+        f.apply_gamma = 0; /* for now */
+        f.apply_trns = 0;
+    }
+    else if(fmt == SPNG_FMT_G8 && ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr->bit_depth <= 8)
+    {
+        if(ihdr->bit_depth == depth_target) f.same_layout = 1;
+        else if(ihdr->bit_depth < 8) f.unpack = 1;
+
+        f.apply_trns = 0;
+    }
+    else if(fmt == SPNG_FMT_GA8 && ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr->bit_depth <= 8)
+    {
+        if(ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE_ALPHA &&
+           ihdr->bit_depth == depth_target) f.same_layout = 1;
+        else if(ihdr->bit_depth <= 8) f.unpack = 1;
+    }
+    else if(fmt == SPNG_FMT_GA16 && ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr->bit_depth == 16)
+    {
+        if(ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE_ALPHA &&
+           ihdr->bit_depth == depth_target) f.same_layout = 1;
+        else if(ihdr->bit_depth == 16) f.unpack = 1;
+    }
+
+    uint16_t *gamma_lut = NULL;
+
+    if(f.apply_gamma)
+    {
+        float file_gamma = (float)ctx->gama / 100000.0f;
+        float max;
+
+        unsigned lut_entries;
+
+        if(fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGB8))
+        {
+            lut_entries = 256;
+            max = 255.0f;
+
+            gamma_lut = ctx->gamma_lut8;
+            ctx->gamma_lut = ctx->gamma_lut8;
+        }
+        else /* SPNG_FMT_RGBA16 */
+        {
+            lut_entries = 65536;
+            max = 65535.0f;
+
+            if(ctx->gamma_lut16 == NULL) ctx->gamma_lut16 = spng__malloc(ctx, lut_entries * sizeof(uint16_t));
+            if(ctx->gamma_lut16 == NULL) return decode_err(ctx, SPNG_EMEM);
+
+            gamma_lut = ctx->gamma_lut16;
+            ctx->gamma_lut = ctx->gamma_lut16;
+        }
+
+        float screen_gamma = 2.2f;
+        float exponent = file_gamma * screen_gamma;
+
+        if(FP_ZERO == fpclassify(exponent)) return decode_err(ctx, SPNG_EGAMA);
+
+        exponent = 1.0f / exponent;
+
+        unsigned i;
+        for(i=0; i < lut_entries; i++)
+        {
+            float c = pow((float)i / max, exponent) * max;
+            if(c > max) c = max;
+
+            gamma_lut[i] = (uint16_t)c;
+        }
+    }
+
+    struct spng_sbit *sb = &ctx->decode_sb;
+
+    sb->red_bits = processing_depth;
+    sb->green_bits = processing_depth;
+    sb->blue_bits = processing_depth;
+    sb->alpha_bits = processing_depth;
+    sb->grayscale_bits = processing_depth;
+
+    if(f.use_sbit)
+    {
+        if(ihdr->color_type == 0)
+        {
+            sb->grayscale_bits = ctx->sbit.grayscale_bits;
+            sb->alpha_bits = ihdr->bit_depth;
+        }
+        else if(ihdr->color_type == 2 || ihdr->color_type == 3)
+        {
+            sb->red_bits = ctx->sbit.red_bits;
+            sb->green_bits = ctx->sbit.green_bits;
+            sb->blue_bits = ctx->sbit.blue_bits;
+            sb->alpha_bits = ihdr->bit_depth;
+        }
+        else if(ihdr->color_type == 4)
+        {
+            sb->grayscale_bits = ctx->sbit.grayscale_bits;
+            sb->alpha_bits = ctx->sbit.alpha_bits;
+        }
+        else /* == 6 */
+        {
+            sb->red_bits = ctx->sbit.red_bits;
+            sb->green_bits = ctx->sbit.green_bits;
+            sb->blue_bits = ctx->sbit.blue_bits;
+            sb->alpha_bits = ctx->sbit.alpha_bits;
+        }
+    }
+
+    if(ihdr->bit_depth == 16 && fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGB8))
+    {/* samples are scaled down by 8 bits in the decode loop */
+        sb->red_bits -= 8;
+        sb->green_bits -= 8;
+        sb->blue_bits -= 8;
+        sb->alpha_bits -= 8;
+        sb->grayscale_bits -= 8;
+
+        processing_depth = 8;
+    }
+
+    /* Prevent infinite loops in sample_to_target() */
+    if(!depth_target || depth_target > 16 ||
+       !processing_depth || processing_depth > 16 ||
+       !sb->grayscale_bits || sb->grayscale_bits > processing_depth ||
+       !sb->alpha_bits || sb->alpha_bits > processing_depth ||
+       !sb->red_bits || sb->red_bits > processing_depth ||
+       !sb->green_bits || sb->green_bits > processing_depth ||
+       !sb->blue_bits || sb->blue_bits > processing_depth)
+    {
+        return decode_err(ctx, SPNG_ESBIT);
+    }
+
+    if(sb->red_bits == sb->green_bits &&
+       sb->green_bits == sb->blue_bits &&
+       sb->blue_bits == sb->alpha_bits &&
+       sb->alpha_bits == processing_depth &&
+       processing_depth == depth_target) f.do_scaling = 0;
+
+    struct spng_plte_entry *plte = ctx->decode_plte.rgba;
+
+    /* 1/2/4/8-bit grayscale to RGBA8/RGB8 goes through a palette with the same steps as the per-pixel path */
+    const int gray_plte = ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr->bit_depth <= 8 &&
+                          fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGB8);
+
+    /* Pre-process palette entries */
+    if(f.indexed || gray_plte)
+    {
+        uint8_t red, green, blue, alpha;
+        const int plte_gamma = f.apply_gamma && fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGB8);
+
+        uint32_t i;
+        for(i=0; i < 256; i++)
+        {
+            if(gray_plte)
+            {
+                unsigned gray = i < (1u << ihdr->bit_depth) ? i : 0;
+
+                alpha = f.apply_trns && ctx->trns.gray == gray ? 0 : 255;
+
+                red   = sample_to_target(gray, processing_depth, sb->red_bits, 8);
+                green = sample_to_target(gray, processing_depth, sb->green_bits, 8);
+                blue  = sample_to_target(gray, processing_depth, sb->blue_bits, 8);
+                alpha = sample_to_target(alpha, processing_depth, sb->alpha_bits, 8);
+            }
+            else
+            {
+                if(f.apply_trns && i < ctx->trns.n_type3_entries)
+                    ctx->plte.entries[i].alpha = ctx->trns.type3_alpha[i];
+                else
+                    ctx->plte.entries[i].alpha = 255;
+
+                red   = sample_to_target(ctx->plte.entries[i].red, 8, sb->red_bits, 8);
+                green = sample_to_target(ctx->plte.entries[i].green, 8, sb->green_bits, 8);
+                blue  = sample_to_target(ctx->plte.entries[i].blue, 8, sb->blue_bits, 8);
+                alpha = sample_to_target(ctx->plte.entries[i].alpha, 8, sb->alpha_bits, 8);
+            }
+
+            if(plte_gamma)
+            {
+                red = gamma_lut[red];
+                green = gamma_lut[green];
+                blue = gamma_lut[blue];
+            }
+
+#if defined(SPNG_ARM)
+            if(fmt == SPNG_FMT_RGB8)
+            {/* Working with 3 bytes at a time is more of an ARM thing */
+                ctx->decode_plte.rgb[i * 3 + 0] = red;
+                ctx->decode_plte.rgb[i * 3 + 1] = green;
+                ctx->decode_plte.rgb[i * 3 + 2] = blue;
+                continue;
+            }
+#endif
+            plte[i].red = red;
+            plte[i].green = green;
+            plte[i].blue = blue;
+            plte[i].alpha = alpha;
+        }
+
+        if(f.indexed) f.apply_trns = 0;
+    }
+
+    unsigned char *trns_px = ctx->trns_px;
+
+    if(f.apply_trns)
+    {
+        uint16_t mask = ~0;
+        if(ctx->ihdr.bit_depth < 16) mask = (1 << ctx->ihdr.bit_depth) - 1;
+
+        if(fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGBA16))
+        {
+            if(ihdr->color_type == SPNG_COLOR_TYPE_TRUECOLOR)
+            {
+                if(ihdr->bit_depth == 16)
+                {
+                    memcpy(trns_px, &ctx->trns.red, 2);
+                    memcpy(trns_px + 2, &ctx->trns.green, 2);
+                    memcpy(trns_px + 4, &ctx->trns.blue, 2);
+                }
+                else
+                {
+                    trns_px[0] = ctx->trns.red & mask;
+                    trns_px[1] = ctx->trns.green & mask;
+                    trns_px[2] = ctx->trns.blue & mask;
+                }
+            }
+        }
+        else if(ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE) // fmt == SPNG_FMT_GA8 &&
+        {
+            if(ihdr->bit_depth == 16)
+            {
+                memcpy(trns_px, &ctx->trns.gray, 2);
+            }
+            else
+            {
+                trns_px[0] = ctx->trns.gray & mask;
+            }
+        }
+    }
+
+    if(ctx->crop_width) f.crop = 1;
+    if(ctx->downscale_shift) f.downscale = 1;
+
+    if(!f.crop)
+    {
+        ctx->crop_x = 0;
+        ctx->crop_y = 0;
+        ctx->crop_width = ihdr->width;
+        ctx->crop_height = ihdr->height;
+    }
+
+    /* Rows are decoded directly to the output buffer */
+    if(flags & SPNG_DECODE_PROGRESSIVE) f.progressive = 1;
+
+    if(ctx->index_interval && !ctx->index_loaded && !f.interlaced && !ctx->fdat)
+    {
+        f.build_index = 1;
+
+        ctx->index_len = 0;
+        ctx->index_count = 0;
+        ctx->index_span = ctx->index_interval;
+        ctx->index_next_row = ctx->index_interval;
+    }
+
+    if(f.same_layout && !f.apply_trns && !f.do_scaling && !f.apply_gamma &&
+       !f.interlaced && !f.crop && !f.downscale && !f.progressive && !f.build_index && !ctx->feed) f.zerocopy = 1;
+
+#if defined(SPNG_X86)
+    /* Keep the output from evicting the working set when it won't fit in the cache anyway */
+    if(!f.zerocopy && !f.downscale && !f.progressive)
+    {
+        if(ctx->nontemporal_stores == SPNG_NONTEMPORAL_ALWAYS) f.nontemporal = 1;
+        else if(ctx->nontemporal_stores == SPNG_NONTEMPORAL_AUTO && ctx->image_size > llc_size()) f.nontemporal = 1;
+    }
+#endif
+
+    unsigned pixel_size = 4; /* SPNG_FMT_RGBA8 */
+
+    if(fmt == SPNG_FMT_RGBA16) pixel_size = 8;
+    else if(fmt == SPNG_FMT_RGB8) pixel_size = 3;
+    else if(fmt == SPNG_FMT_G8) pixel_size = 1;
+    else if(fmt == SPNG_FMT_GA8) pixel_size = 2;
+
+    ctx->scanline_bits = ihdr->bit_depth * num_channels(ihdr);
+
+    if(fmt & (SPNG_FMT_PNG | SPNG_FMT_RAW)) ctx->out_bits = ctx->scanline_bits;
+    else ctx->out_bits = pixel_size * 8;
+
+    unsigned block_bits = ctx->scanline_bits > ctx->out_bits ? ctx->scanline_bits : ctx->out_bits;
+
+    ctx->convert_block = (SPNG_CONVERT_BLOCK_SIZE * 8 / block_bits) & ~7u;
+
+    struct spng_subimage *sub = ctx->subimage;
+    int i, max_pass = ctx->last_pass;
+
+    /* Every box has a pixel from the first passes if the boxes are aligned to the Adam7 grid */
+    if(f.interlaced && f.downscale && (ctx->downscale_mode & SPNG_DOWNSCALE_PARTIAL_ADAM7) &&
+       !(ctx->crop_x & ((1u << ctx->downscale_shift) - 1)) && !(ctx->crop_y & ((1u << ctx->downscale_shift) - 1)))
+    {
+        static const int partial_last_pass[4] = { 6, 4, 2, 0 };
+
+        max_pass = partial_last_pass[ctx->downscale_shift];
+    }
+
+    /* Find the pixels of each pass and the last scanline inside the crop rectangle */
+    for(i=0; i <= ctx->last_pass; i++)
+    {
+        uint32_t x0 = 0, dx = 1, y0 = 0, dy = 1;
+        uint32_t crop_right = ctx->crop_x + ctx->crop_width;
+        uint32_t crop_bottom = ctx->crop_y + ctx->crop_height - 1;
+
+        sub[i].crop_first = 0;
+        sub[i].crop_end = 0;
+
+        if(!sub[i].width || !sub[i].height || i > max_pass) continue;
+
+        if(f.interlaced)
+        {
+            x0 = adam7_x_start[i];
+            dx = adam7_x_delta[i];
+            y0 = adam7_y_start[i];
+            dy = adam7_y_delta[i];
+        }
+
+        if(ctx->crop_x > x0) sub[i].crop_first = (ctx->crop_x - x0 + dx - 1) / dx;
+        if(crop_right > x0) sub[i].crop_end = (crop_right - x0 + dx - 1) / dx;
+        if(sub[i].crop_end > sub[i].width) sub[i].crop_end = sub[i].width;
+
+        if(sub[i].crop_first >= sub[i].crop_end || crop_bottom < y0) continue;
+
+        uint32_t first_scanline = ctx->crop_y > y0 ? (ctx->crop_y - y0 + dy - 1) / dy : 0;
+        uint32_t last_scanline = (crop_bottom - y0) / dy;
+
+        if(last_scanline >= sub[i].height) last_scanline = sub[i].height - 1;
+        if(first_scanline > last_scanline) continue;
+
+        ctx->stop_pass = i;
+        ctx->stop_scanline = last_scanline;
+    }
+
+    if(ctx->stop_pass != ctx->last_pass || ctx->stop_scanline != sub[ctx->last_pass].height - 1) f.stop_early = 1;
+
+    if(f.interlaced || f.nontemporal || f.crop || f.downscale)
+    {/* Conversion buffer for one block, or a whole pass for spng_decode_row() */
+        size_t row_buf_size = ctx->image_width;
+
+        if(f.crop || f.downscale) row_buf_size = ((size_t)ctx->convert_block * ctx->out_bits + 7) / 8;
+
+        ctx->row_buf = spng__reuse(ctx, ctx->row_buf, &ctx->row_buf_size, row_buf_size);
+        ctx->row = ctx->row_buf;
+
+        if(ctx->row == NULL) return decode_err(ctx, SPNG_EMEM);
+    }
+
+    if(f.downscale)
+    {
+        ret = downscale_init(ctx, f.apply_gamma, out_ihdr.width, out_ihdr.height);
+        if(ret) return decode_err(ctx, ret);
+    }
+
+    ctx->decode_flags = f;
+    ctx->convert_row = select_convert_row(ctx);
+
+    ctx->state = SPNG_STATE_DECODE_INIT;
+
+    struct spng_row_info *ri = &ctx->row_info;
+
+    while(!sub[ri->pass].width || !sub[ri->pass].height) ri->pass++;
+
+    if(f.interlaced) ri->row_num = adam7_y_start[ri->pass];
+
+    for(i=ri->pass; i <= ctx->last_pass; i++)
+    {
+        if(!sub[i].scanline_width) continue;
+
+        if(fmt & (SPNG_FMT_PNG | SPNG_FMT_RAW)) sub[i].out_width = sub[i].scanline_width - 1;
+        else sub[i].out_width = (size_t)sub[i].width * pixel_size;
+
+        if(sub[i].out_width > UINT32_MAX) return decode_err(ctx, SPNG_EOVERFLOW);
+    }
+
+    int restored = 0;
+
+    if(ctx->index_loaded && ctx->index_count && !f.interlaced && ctx->crop_y)
+    {
+        ret = restore_checkpoint(ctx, &restored);
+        if(ret) return decode_err(ctx, ret);
+    }
+
+#ifdef SPNG_MULTITHREADING
+    if(ctx->decode_threads && !ctx->streaming && !ctx->feed && !f.interlaced && !f.crop && !f.downscale &&
+       !f.progressive && !f.build_index && !ctx->fdat)
+    {
+        int decoded;
+
+        ret = decode_restart_strips(ctx, out, &decoded);
+        if(ret) return decode_err(ctx, ret);
+
+        if(decoded) return 0;
+    }
+#endif
+
+    if(ctx->inflate_backend && !ctx->streaming && !ctx->feed && !f.crop && !f.downscale && !f.progressive &&
+       !f.build_index && !ctx->fdat)
+    {
+        ret = decode_buffered(ctx, out);
+        if(ret) return decode_err(ctx, ret);
+
+        return 0;
+    }
+
+    /* Read the first filter byte, offsetting all reads by 1 byte.
+    The scanlines will be aligned with the start of the array with
+    the next scanline's filter byte at the end,
+    the last scanline will end up being 1 byte "shorter".
+    With fed input it is read along with the first scanline. */
+    if(ctx->feed) ctx->filter_pending = 1;
+    else if(!restored)
+    {
+        ret = read_scanline_bytes(ctx, &ri->filter, 1);
+        if(ret) return decode_err(ctx, ret);
+
+        if(ri->filter > 4) return decode_err(ctx, SPNG_EFILTER);
+    }
+
+    if(f.progressive)
+    {
+        return 0;
+    }
+
+    if(f.zerocopy)
+    {
+        ret = decode_zerocopy(ctx, out);
+        if(ret) return decode_err(ctx, ret);
+
+        return 0;
+    }
+
+#ifdef SPNG_MULTITHREADING
+    if(ctx->decode_threads && !ctx->feed && !f.downscale && !f.build_index && !restored && !(f.interlaced && (fmt & (SPNG_FMT_PNG | SPNG_FMT_RAW)) && ihdr->bit_depth < 8))
+    {
+        ret = decode_threaded(ctx, out);
+        if(ret) return decode_err(ctx, ret);
+
+        return 0;
+    }
+#endif
+
+    return decode_rows(ctx, out);
+}
+
+int spng_decode_image(spng_ctx *ctx, void *out, size_t len, int fmt, int flags)
+{
+    if(ctx == NULL) return 1;
+    if(ctx->apng_frames) return SPNG_EOPSTATE; /* spng_decode_frame() was called */
+
+    return decode_image(ctx, out, len, fmt, flags);
+}
+
+/* Image data is decoded as an image of width x height pixels */
+static int set_image_size(spng_ctx *ctx, uint32_t width, uint32_t height)
+{
+    ctx->ihdr.width = width;
+    ctx->ihdr.height = height;
+
+    memset(ctx->subimage, 0, sizeof(ctx->subimage));
+    ctx->widest_pass = 0;
+    ctx->last_pass = 0;
+
+    return calculate_subimages(ctx);
+}
+
+/* Straight alpha "over" operator from the APNG specification */
+static void blend_over_rgba8(unsigned char *dst, const unsigned char *src, uint32_t width)
+{
+    uint32_t i;
+
+    for(i=0; i < width; i++, dst += 4, src += 4)
+    {
+        uint32_t sa = src[3];
+
+        if(sa == 255) memcpy(dst, src, 4);
+        else if(sa)
+        {
+            uint32_t u = sa * 255;
+            uint32_t v = (255 - sa) * dst[3];
+            uint32_t a = u + v;
+            int c;
+
+            for(c=0; c < 3; c++) dst[c] = (unsigned char)((src[c] * u + dst[c] * v + a / 2) / a);
+
+            dst[3] = (unsigned char)((a + 127) / 255);
+        }
+    }
+}
+
+static void blend_over_rgba16(unsigned char *dst, const unsigned char *src, uint32_t width)
+{
+    uint32_t i;
+    uint16_t s[4], d[4];
+
+    for(i=0; i < width; i++, dst += 8, src += 8)
+    {
+        memcpy(s, src, 8);
+
+        if(s[3] == 65535) memcpy(dst, src, 8);
+        else if(s[3])
+        {
+            memcpy(d, dst, 8);
+
+            uint64_t u = (uint64_t)s[3] * 65535;
+            uint64_t v = (uint64_t)(65535 - s[3]) * d[3];
+            uint64_t a = u + v;
+            int c;
+
+            for(c=0; c < 3; c++) d[c] = (uint16_t)((s[c] * u + d[c] * v + a / 2) / a);
+
+            d[3] = (uint16_t)((a + 32767) / 65535);
+
+            memcpy(dst, d, 8);
+        }
+    }
+}
+
+int spng_decode_frame(spng_ctx *ctx, void *out, size_t len, int fmt, int flags)
+{
+    if(ctx == NULL || out == NULL) return 1;
+    if(ctx->encode_only) return SPNG_ECTXTYPE;
+    if(fmt != SPNG_FMT_RGBA8 && fmt != SPNG_FMT_RGBA16) return SPNG_EFMT;
+    if(flags & SPNG_DECODE_PROGRESSIVE) return SPNG_EFLAGS;
+
+    if(!ctx->apng_frames)
+    {
+        if(ctx->state >= SPNG_STATE_DECODE_INIT) return SPNG_EOPSTATE;
+        if(ctx->feed || ctx->crop_width || ctx->downscale_shift) return SPNG_EOPSTATE;
+    }
+    else if(ctx->frame_index && fmt != (int)ctx->fmt) return SPNG_EOPSTATE;
+
+    int ret = read_chunks(ctx, 0);
+    if(ret) return ret;
+
+    size_t canvas_size;
+
+    ret = calculate_image_size(&ctx->ihdr, fmt, &canvas_size);
+    if(ret) return ret;
+
+    if(len < canvas_size) return SPNG_EBUFSIZ;
+
+    ctx->apng_frames = 1;
+
+    int idat_frame = 0;
+
+    if(ctx->state == SPNG_STATE_FIRST_IDAT)
+    {
+        if(!ctx->stored.actl || ctx->fctl_pending) idat_frame = 1;
+        else
+        {/* The default image is not part of the animation, skip its IDAT's */
+            ctx->state = SPNG_STATE_EOI;
+
+            ret = read_chunks(ctx, 0);
+            if(ret) return ret;
+        }
+    }
+
+    if(!idat_frame && !ctx->next_frame) return SPNG_EOI;
+
+    if(idat_frame)
+    {
+        if(!ctx->stored.actl)
+        {/* A static image is a single frame */
+            struct spng_fctl fctl = { .width = ctx->ihdr.width, .height = ctx->ihdr.height };
+
+            ctx->next_fctl = fctl;
+        }
+
+        ctx->fctl_pending = 0;
+    }
+    else
+    {
+        ctx->next_frame = 0;
+        ctx->fdat = 1;
+    }
+
+    unsigned char *canvas = out;
+    const struct spng_fctl *fctl = &ctx->fctl;
+    const size_t pixel_size = fmt == SPNG_FMT_RGBA16 ? 8 : 4;
+    const size_t stride = (size_t)ctx->ihdr.width * pixel_size;
+    uint32_t y;
+
+    if(ctx->frame_index)
+    {/* Dispose of the previous frame's area */
+        size_t row_size = (size_t)fctl->width * pixel_size;
+        unsigned char *row = canvas + fctl->y_offset * stride + fctl->x_offset * pixel_size;
+
+        for(y=0; y < fctl->height && fctl->dispose_op; y++, row += stride)
+        {
+            if(fctl->dispose_op == SPNG_DISPOSE_OP_BACKGROUND) memset(row, 0, row_size);
+            else memcpy(row, ctx->dispose_buf + y * row_size, row_size);
+        }
+    }
+    else memset(canvas, 0, canvas_size);
+
+    ctx->fctl = ctx->next_fctl;
+
+    const size_t row_size = (size_t)fctl->width * pixel_size;
+    const size_t frame_size = row_size * fctl->height;
+    unsigned char *area = canvas + fctl->y_offset * stride + fctl->x_offset * pixel_size;
+
+    /* Blending onto the fully transparent canvas is the same as replacing it */
+    int blend_op = ctx->frame_index ? fctl->blend_op : SPNG_BLEND_OP_SOURCE;
+
+    if(fctl->dispose_op == SPNG_DISPOSE_OP_PREVIOUS)
+    {
+        ctx->dispose_buf = spng__reuse(ctx, ctx->dispose_buf, &ctx->dispose_buf_size, frame_size);
+        if(ctx->dispose_buf == NULL) return decode_err(ctx, SPNG_EMEM);
+
+        for(y=0; y < fctl->height; y++) memcpy(ctx->dispose_buf + y * row_size, area + y * stride, row_size);
+    }
+
+    /* Full-width frames that replace the canvas are decoded in place */
+    int in_place = blend_op == SPNG_BLEND_OP_SOURCE && row_size == stride;
+    unsigned char *frame = area;
+
+    if(!in_place)
+    {
+        ctx->frame_buf = spng__reuse(ctx, ctx->frame_buf, &ctx->frame_buf_size, frame_size);
+        if(ctx->frame_buf == NULL) return decode_err(ctx, SPNG_EMEM);
+
+        frame = ctx->frame_buf;
+    }
+
+    struct spng_ihdr ihdr = ctx->ihdr;
+
+    ret = set_image_size(ctx, fctl->width, fctl->height);
+
+    memset(&ctx->row_info, 0, sizeof(struct spng_row_info));
+    ctx->crop_width = 0;
+    ctx->crop_height = 0;
+
+    ctx->state = SPNG_STATE_FIRST_IDAT;
+
+    if(!ret) ret = decode_image(ctx, frame, frame_size, fmt, flags);
+
+    ctx->ihdr = ihdr;
+    set_image_size(ctx, ihdr.width, ihdr.height);
+
+    ctx->crop_width = 0;
+    ctx->crop_height = 0;
+    ctx->fdat = 0;
+
+    if(ret) return decode_err(ctx, ret);
+
+    for(y=0; y < fctl->height && !in_place; y++)
+    {
+        unsigned char *row = area + y * stride;
+        const unsigned char *src = frame + y * row_size;
+
+        if(blend_op == SPNG_BLEND_OP_SOURCE) memcpy(row, src, row_size);
+        else if(fmt == SPNG_FMT_RGBA8) blend_over_rgba8(row, src, fctl->width);
+        else blend_over_rgba16(row, src, fctl->width);
+    }
+
+    ctx->frame_index++;
+
+    return 0;
+}
+
+int spng_get_row_info(spng_ctx *ctx, struct spng_row_info *row_info)
+{
+    if(ctx == NULL || row_info == NULL || ctx->state < SPNG_STATE_DECODE_INIT) return 1;
+
+    if(ctx->state >= SPNG_STATE_EOI) return SPNG_EOI;
+
+    *row_info = ctx->row_info;
+
+    return 0;
+}
+
+static int write_chunks_before_idat(spng_ctx *ctx)
+{
+    if(ctx == NULL) return SPNG_EINTERNAL;
+    if(!ctx->encode_only) return SPNG_EINTERNAL;
+    if(!ctx->stored.ihdr) return SPNG_EINTERNAL;
+
+    int ret;
+    uint32_t i;
+    size_t length;
+    const struct spng_ihdr *ihdr = &ctx->ihdr;
+    unsigned char *data = ctx->decode_plte.raw;
+
+    ret = write_data(ctx, spng_signature, 8);
+    if(ret) return ret;
+
+    write_u32(data,     ihdr->width);
+    write_u32(data + 4, ihdr->height);
+    data[8]  = ihdr->bit_depth;
+    data[9]  = ihdr->color_type;
+    data[10] = ihdr->compression_method;
+    data[11] = ihdr->filter_method;
+    data[12] = ihdr->interlace_method;
+
+    ret = write_chunk(ctx, type_ihdr, data, 13);
+    if(ret) return ret;
+
+    if(ctx->stored.chrm)
+    {
+        write_u32(data,      ctx->chrm_int.white_point_x);
+        write_u32(data + 4,  ctx->chrm_int.white_point_y);
+        write_u32(data + 8,  ctx->chrm_int.red_x);
+        write_u32(data + 12, ctx->chrm_int.red_y);
+        write_u32(data + 16, ctx->chrm_int.green_x);
+        write_u32(data + 20, ctx->chrm_int.green_y);
+        write_u32(data + 24, ctx->chrm_int.blue_x);
+        write_u32(data + 28, ctx->chrm_int.blue_y);
+
+        ret = write_chunk(ctx, type_chrm, data, 32);
+        if(ret) return ret;
+    }
+
+    if(ctx->stored.gama)
+    {
+        write_u32(data, ctx->gama);
+
+        ret = write_chunk(ctx, type_gama, data, 4);
+        if(ret) return ret;
+    }
+
+    if(ctx->stored.iccp)
+    {
+        uLongf dest_len = compressBound((uLong)ctx->iccp.profile_len);
+
+        Bytef *buf = spng__malloc(ctx, dest_len);
+        if(buf == NULL) return SPNG_EMEM;
+
+        ret = compress2(buf, &dest_len, (void*)ctx->iccp.profile, (uLong)ctx->iccp.profile_len, Z_DEFAULT_COMPRESSION);
+
+        if(ret != Z_OK)
+        {
+            spng__free(ctx, buf);
+            return SPNG_EZLIB;
+        }
+
+        size_t name_len = strlen(ctx->iccp.profile_name);
+
+        length = name_len + 2;
+        length += dest_len;
+
+        if(dest_len > length) return SPNG_EOVERFLOW;
+
+        unsigned char *cdata = NULL;
+
+        ret = write_header(ctx, type_iccp, length, &cdata);
+
+        if(ret)
+        {
+            spng__free(ctx, buf);
+            return ret;
+        }
+
+        memcpy(cdata, ctx->iccp.profile_name, name_len + 1);
+        cdata[name_len + 1] = 0; /* compression method */
+        memcpy(cdata + name_len + 2, buf, dest_len);
+
+        spng__free(ctx, buf);
+
+        ret = finish_chunk(ctx);
+        if(ret) return ret;
+    }
+
+    if(ctx->stored.sbit)
+    {
+        switch(ctx->ihdr.color_type)
+        {
+            case SPNG_COLOR_TYPE_GRAYSCALE:
+            {
+                length = 1;
+
+                data[0] = ctx->sbit.grayscale_bits;
+
+                break;
+            }
+            case SPNG_COLOR_TYPE_TRUECOLOR:
+            case SPNG_COLOR_TYPE_INDEXED:
+            {
+                length = 3;
+
+                data[0] = ctx->sbit.red_bits;
+                data[1] = ctx->sbit.green_bits;
+                data[2] = ctx->sbit.blue_bits;
+
+                break;
+            }
+            case SPNG_COLOR_TYPE_GRAYSCALE_ALPHA:
+            {
+                length = 2;
+
+                data[0] = ctx->sbit.grayscale_bits;
+                data[1] = ctx->sbit.alpha_bits;
+
+                break;
+            }
+            case SPNG_COLOR_TYPE_TRUECOLOR_ALPHA:
+            {
+                length = 4;
+
+                data[0] = ctx->sbit.red_bits;
+                data[1] = ctx->sbit.green_bits;
+                data[2] = ctx->sbit.blue_bits;
+                data[3] = ctx->sbit.alpha_bits;
+
+                break;
+            }
+            default: return SPNG_EINTERNAL;
+        }
+
+        ret = write_chunk(ctx, type_sbit, data, length);
+        if(ret) return ret;
+    }
+
+    if(ctx->stored.srgb)
+    {
+        ret = write_chunk(ctx, type_srgb, &ctx->srgb_rendering_intent, 1);
+        if(ret) return ret;
+    }
+
+    ret = write_unknown_chunks(ctx, SPNG_AFTER_IHDR);
+    if(ret) return ret;
+
+    if(ctx->stored.plte)
+    {
+        for(i=0; i < ctx->plte.n_entries; i++)
+        {
+            data[i * 3 + 0] = ctx->plte.entries[i].red;
+            data[i * 3 + 1] = ctx->plte.entries[i].green;
+            data[i * 3 + 2] = ctx->plte.entries[i].blue;
+        }
+
+        ret = write_chunk(ctx, type_plte, data, ctx->plte.n_entries * 3);
+        if(ret) return ret;
+    }
+
+    if(ctx->stored.bkgd)
+    {
+        switch(ctx->ihdr.color_type)
+        {
+            case SPNG_COLOR_TYPE_GRAYSCALE:
+            case SPNG_COLOR_TYPE_GRAYSCALE_ALPHA:
+            {
+                length = 2;
+
+                write_u16(data, ctx->bkgd.gray);
+
+                break;
+            }
+            case SPNG_COLOR_TYPE_TRUECOLOR:
+            case SPNG_COLOR_TYPE_TRUECOLOR_ALPHA:
+            {
+                length = 6;
+
+                write_u16(data,     ctx->bkgd.red);
+                write_u16(data + 2, ctx->bkgd.green);
+                write_u16(data + 4, ctx->bkgd.blue);
+
+                break;
+            }
+            case SPNG_COLOR_TYPE_INDEXED:
+            {
+                length = 1;
+
+                data[0] = ctx->bkgd.plte_index;
+
+                break;
+            }
+            default: return SPNG_EINTERNAL;
+        }
+
+        ret = write_chunk(ctx, type_bkgd, data, length);
+        if(ret) return ret;
+    }
+
+    if(ctx->stored.hist)
+    {
+        length = ctx->plte.n_entries * 2;
+
+        for(i=0; i < ctx->plte.n_entries; i++)
+        {
+            write_u16(data + i * 2, ctx->hist.frequency[i]);
+        }
+
+        ret = write_chunk(ctx, type_hist, data, length);
+        if(ret) return ret;
+    }
+
+    if(ctx->stored.trns)
+    {
+        if(ctx->ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE)
+        {
+            write_u16(data, ctx->trns.gray);
+
+            ret = write_chunk(ctx, type_trns, data, 2);
+        }
+        else if(ctx->ihdr.color_type == SPNG_COLOR_TYPE_TRUECOLOR)
+        {
+            write_u16(data,     ctx->trns.red);
+            write_u16(data + 2, ctx->trns.green);
+            write_u16(data + 4, ctx->trns.blue);
+
+            ret = write_chunk(ctx, type_trns, data, 6);
+        }
+        else if(ctx->ihdr.color_type == SPNG_COLOR_TYPE_INDEXED)
+        {
+            ret = write_chunk(ctx, type_trns, ctx->trns.type3_alpha, ctx->trns.n_type3_entries);
+        }
+
+        if(ret) return ret;
+    }
+
+    if(ctx->stored.phys)
+    {
+        write_u32(data,     ctx->phys.ppu_x);
+        write_u32(data + 4, ctx->phys.ppu_y);
+        data[8] = ctx->phys.unit_specifier;
+
+        ret = write_chunk(ctx, type_phys, data, 9);
+        if(ret) return ret;
+    }
+
+    if(ctx->stored.splt)
+    {
+        const struct spng_splt *splt;
+        unsigned char *cdata = NULL;
+
+        uint32_t k;
+        for(i=0; i < ctx->n_splt; i++)
+        {
+            splt = &ctx->splt_list[i];
+
+            size_t name_len = strlen(splt->name);
+            length = name_len + 1;
+
+            if(splt->sample_depth == 8) length += splt->n_entries * 6 + 1;
+            else if(splt->sample_depth == 16) length += splt->n_entries * 10 + 1;
+
+            ret = write_header(ctx, type_splt, length, &cdata);
+            if(ret) return ret;
+
+            memcpy(cdata, splt->name, name_len + 1);
+            cdata += name_len + 2;
+            cdata[-1] = splt->sample_depth;
+
+            if(splt->sample_depth == 8)
+            {
+                for(k=0; k < splt->n_entries; k++)
+                {
+                    cdata[k * 6 + 0] = splt->entries[k].red;
+                    cdata[k * 6 + 1] = splt->entries[k].green;
+                    cdata[k * 6 + 2] = splt->entries[k].blue;
+                    cdata[k * 6 + 3] = splt->entries[k].alpha;
+                    write_u16(cdata + k * 6 + 4, splt->entries[k].frequency);
+                }
+            }
+            else if(splt->sample_depth == 16)
+            {
+                for(k=0; k < splt->n_entries; k++)
+                {
+                    write_u16(cdata + k * 10 + 0, splt->entries[k].red);
+                    write_u16(cdata + k * 10 + 2, splt->entries[k].green);
+                    write_u16(cdata + k * 10 + 4, splt->entries[k].blue);
+                    write_u16(cdata + k * 10 + 6, splt->entries[k].alpha);
+                    write_u16(cdata + k * 10 + 8, splt->entries[k].frequency);
+                }
+            }
+
+            ret = finish_chunk(ctx);
+            if(ret) return ret;
+        }
+    }
+
+    if(ctx->stored.time)
+    {
+        write_u16(data, ctx->time.year);
+        data[2] = ctx->time.month;
+        data[3] = ctx->time.day;
+        data[4] = ctx->time.hour;
+        data[5] = ctx->time.minute;
+        data[6] = ctx->time.second;
+
+        ret = write_chunk(ctx, type_time, data, 7);
+        if(ret) return ret;
+    }
+
+    if(ctx->stored.text)
+    {
+        unsigned char *cdata = NULL;
+        const struct spng_text2 *text;
+        const uint8_t *text_type_array[4] = { 0, type_text, type_ztxt, type_itxt };
+
+        for(i=0; i < ctx->n_text; i++)
+        {
+            text = &ctx->text_list[i];
+
+            const uint8_t *text_chunk_type = text_type_array[text->type];
+            Bytef *compressed_text = NULL;
+            size_t keyword_len = 0;
+            size_t language_tag_len = 0;
+            size_t translated_keyword_len = 0;
+            size_t compressed_length = 0;
+            size_t text_length = 0;
+
+            keyword_len = strlen(text->keyword);
+            text_length = strlen(text->text);
+
+            length = keyword_len + 1;
+
+            if(text->type == SPNG_ZTXT)
+            {
+                length += 1; /* compression method */
+            }
+            else if(text->type == SPNG_ITXT)
+            {
+                if(!text->language_tag || !text->translated_keyword) return SPNG_EINTERNAL;
+
+                language_tag_len = strlen(text->language_tag);
+                translated_keyword_len = strlen(text->translated_keyword);
+
+                length += language_tag_len;
+                if(length < language_tag_len) return SPNG_EOVERFLOW;
+
+                length += translated_keyword_len;
+                if(length < translated_keyword_len) return SPNG_EOVERFLOW;
+
+                length += 4; /* compression flag + method + nul for the two strings */
+                if(length < 4) return SPNG_EOVERFLOW;
+            }
+
+            if(text->compression_flag)
+            {
+                ret = spng__deflate_init(ctx, &ctx->text_options);
+                if(ret) return ret;
+
+                z_stream *zstream = &ctx->zstream;
+                uLongf dest_len = deflateBound(zstream, (uLong)text_length);
+
+                compressed_text = spng__malloc(ctx, dest_len);
+
+                if(compressed_text == NULL) return SPNG_EMEM;
+
+                zstream->next_in = (void*)text->text;
+                zstream->avail_in = (uInt)text_length;
+
+                zstream->next_out = compressed_text;
+                zstream->avail_out = dest_len;
+
+                ret = deflate(zstream, Z_FINISH);
+
+                if(ret != Z_STREAM_END)
+                {
+                    spng__free(ctx, compressed_text);
+                    return SPNG_EZLIB;
+                }
+
+                compressed_length = zstream->total_out;
+
+                length += compressed_length;
+                if(length < compressed_length) return SPNG_EOVERFLOW;
+            }
+            else
+            {
+                text_length = strlen(text->text);
+
+                length += text_length;
+                if(length < text_length) return SPNG_EOVERFLOW;
+            }
+
+            ret = write_header(ctx, text_chunk_type, length, &cdata);
+            if(ret)
+            {
+                spng__free(ctx, compressed_text);
+                return ret;
+            }
+
+            memcpy(cdata, text->keyword, keyword_len + 1);
+            cdata += keyword_len + 1;
+
+            if(text->type == SPNG_ITXT)
+            {
+                cdata[0] = text->compression_flag;
+                cdata[1] = 0; /* compression method */
+                cdata += 2;
+
+                memcpy(cdata, text->language_tag, language_tag_len + 1);
+                cdata += language_tag_len + 1;
+
+                memcpy(cdata, text->translated_keyword, translated_keyword_len + 1);
+                cdata += translated_keyword_len + 1;
+            }
+            else if(text->type == SPNG_ZTXT)
+            {
+                cdata[0] = 0; /* compression method */
+                cdata++;
+            }
+
+            if(text->compression_flag) memcpy(cdata, compressed_text, compressed_length);
+            else memcpy(cdata, text->text, text_length);
+
+            spng__free(ctx, compressed_text);
+
+            ret = finish_chunk(ctx);
+            if(ret) return ret;
+        }
+    }
+
+    if(ctx->stored.offs)
+    {
+        write_s32(data,     ctx->offs.x);
+        write_s32(data + 4, ctx->offs.y);
+        data[8] = ctx->offs.unit_specifier;
+
+        ret = write_chunk(ctx, type_offs, data, 9);
+        if(ret) return ret;
+    }
+
+    if(ctx->stored.exif)
+    {
+        ret = write_chunk(ctx, type_exif, ctx->exif.data, ctx->exif.length);
+        if(ret) return ret;
+    }
+
+    if(ctx->stored.actl)
+    {
+        write_u32(data,     ctx->actl.num_frames);
+        write_u32(data + 4, ctx->actl.num_plays);
+
+        ret = write_chunk(ctx, type_actl, data, 8);
+        if(ret) return ret;
+    }
+
+    ret = write_unknown_chunks(ctx, SPNG_AFTER_PLTE);
+    if(ret) return ret;
+
+    return 0;
+}
+
+static int write_chunks_after_idat(spng_ctx *ctx)
+{
+    if(ctx == NULL) return SPNG_EINTERNAL;
+
+    int ret = write_unknown_chunks(ctx, SPNG_AFTER_IDAT);
+    if(ret) return ret;
+
+    return write_iend(ctx);
+}
+
+/* Compress and write scanline to IDAT stream */
+static int write_idat_bytes(spng_ctx *ctx, const void *scanline, size_t len, int flush)
+{
+    if(ctx == NULL || scanline == NULL) return SPNG_EINTERNAL;
+    if(len > UINT_MAX) return SPNG_EINTERNAL;
+
+    int ret = 0;
+    unsigned char *data = NULL;
+    z_stream *zstream = &ctx->zstream;
+    uint32_t idat_length = SPNG_WRITE_SIZE;
+
+    zstream->next_in = scanline;
+    zstream->avail_in = (uInt)len;
+
+    do
+    {
+        ret = deflate(zstream, flush);
+
+        if(zstream->avail_out == 0)
+        {
+            ret = finish_chunk(ctx);
+            if(ret) return encode_err(ctx, ret);
+
+            ret = write_header(ctx, type_idat, idat_length, &data);
+            if(ret) return encode_err(ctx, ret);
+
+            zstream->next_out = data;
+            zstream->avail_out = idat_length;
+        }
+
+    }while(zstream->avail_in);
+
+    if(ret != Z_OK) return SPNG_EZLIB;
+
+    return 0;
+}
+
+static int finish_idat(spng_ctx *ctx)
+{
+    int ret = 0;
+    unsigned char *data = NULL;
+    z_stream *zstream = &ctx->zstream;
+    uint32_t idat_length = SPNG_WRITE_SIZE;
+
+    while(ret != Z_STREAM_END)
+    {
+        ret = deflate(zstream, Z_FINISH);
+
+        if(ret)
+        {
+            if(ret == Z_STREAM_END) break;
+
+            if(ret != Z_BUF_ERROR) return SPNG_EZLIB;
+        }
+
+        if(zstream->avail_out == 0)
+        {
+            ret = finish_chunk(ctx);
+            if(ret) return encode_err(ctx, ret);
+
+            ret = write_header(ctx, type_idat, idat_length, &data);
+            if(ret) return encode_err(ctx, ret);
+
+            zstream->next_out = data;
+            zstream->avail_out = idat_length;
+        }
+    }
+
+    uint32_t trimmed_length = idat_length - zstream->avail_out;
+
+    ret = trim_chunk(ctx, trimmed_length);
+    if(ret) return ret;
+
+    return finish_chunk(ctx);
+}
+
+static int encode_scanline(spng_ctx *ctx, const void *scanline, size_t len)
+{
+    if(ctx == NULL || scanline == NULL) return SPNG_EINTERNAL;
+
+    int ret, pass = ctx->row_info.pass;
+    unsigned filter = 0;
+    struct spng_row_info *ri = &ctx->row_info;
+    const struct spng_subimage *sub = ctx->subimage;
+    struct encode_flags f = ctx->encode_flags;
+    unsigned char *filtered_scanline;
+    size_t scanline_width = sub[pass].scanline_width;
+
+    if(len < scanline_width - 1) return SPNG_EINTERNAL;
+
+    /* encode_row() interlaces directly to ctx->scanline */
+    if(scanline != ctx->scanline) memcpy(ctx->scanline, scanline, scanline_width - 1);
+
+    if(f.to_bigendian) u16_row_to_bigendian(ctx->scanline, scanline_width - 1);
+    const int requires_previous = f.filter_choice & (SPNG_FILTER_CHOICE_UP | SPNG_FILTER_CHOICE_AVG | SPNG_FILTER_CHOICE_PAETH);
+
+    /* XXX: exclude 'requires_previous' filters by default for first scanline? */
+    if(!ri->scanline_idx && requires_previous)
+    {
+        /* prev_scanline is all zeros for the first scanline */
+        memset(ctx->prev_scanline, 0, scanline_width);
+    }
+
+    /* filtered_scanline is not allocated without filtering */
+    if(f.filter_choice)
+    {
+        ret = filter_scanline_best(ctx, f.filter_choice, ctx->filtered_scanline - 1, ctx->prev_scanline, ctx->scanline,
+                                   scanline_width, &filter, &filtered_scanline);
+        if(ret) return encode_err(ctx, ret);
+    }
+
+    if(!filter) filtered_scanline = ctx->scanline;
+
+    filtered_scanline[-1] = filter;
+
+    ret = write_idat_bytes(ctx, filtered_scanline - 1, scanline_width, Z_NO_FLUSH);
+    if(ret) return encode_err(ctx, ret);
+
+    /* The previous scanline is always unfiltered */
+    void *t = ctx->prev_scanline;
+    ctx->prev_scanline = ctx->scanline;
+    ctx->scanline = t;
+
+    ret = update_row_info(ctx);
+
+    if(ret == SPNG_EOI)
+    {
+        int error = finish_idat(ctx);
+        if(error) encode_err(ctx, error);
+
+        if(f.finalize)
+        {
+            error = spng_encode_chunks(ctx);
+            if(error) return encode_err(ctx, error);
+        }
+    }
+
+    return ret;
+}
+
+static int encode_row(spng_ctx *ctx, const void *row, size_t len)
+{
+    if(ctx == NULL || row == NULL) return SPNG_EINTERNAL;
+
+    const int pass = ctx->row_info.pass;
+
+    if(!ctx->ihdr.interlace_method || pass == 6) return encode_scanline(ctx, row, len);
+
+    uint32_t k;
+    const unsigned pixel_size = ctx->pixel_size;
+    const unsigned bit_depth = ctx->ihdr.bit_depth;
+
+    if(bit_depth < 8)
+    {
+        const unsigned samples_per_byte = 8 / bit_depth;
+        const uint8_t mask = (1 << bit_depth) - 1;
+        const unsigned initial_shift = 8 - bit_depth;
+        unsigned shift_amount = initial_shift;
+
+        unsigned char *scanline = ctx->scanline;
+        const unsigned char *row_uc = row;
+        uint8_t sample;
+
+        memset(scanline, 0, ctx->subimage[pass].scanline_width);
+
+        for(k=0; k < ctx->subimage[pass].width; k++)
+        {
+            size_t ioffset = adam7_x_start[pass] + k * adam7_x_delta[pass];
+
+            sample = row_uc[ioffset / samples_per_byte];
+
+            sample = sample >> (initial_shift - ioffset * bit_depth % 8);
+            sample = sample & mask;
+            sample = sample << shift_amount;
+
+            scanline[0] |= sample;
+
+            shift_amount -= bit_depth;
+
+            if(shift_amount > 7)
+            {
+                shift_amount = initial_shift;
+                scanline++;
+            }
+        }
+
+        return encode_scanline(ctx, ctx->scanline, len);
+    }
+
+    for(k=0; k < ctx->subimage[pass].width; k++)
+    {
+        size_t ioffset = (adam7_x_start[pass] + (size_t) k * adam7_x_delta[pass]) * pixel_size;
+
+        memcpy(ctx->scanline + k * pixel_size, (unsigned char*)row + ioffset, pixel_size);
+    }
+
+    return encode_scanline(ctx, ctx->scanline, len);
+}
+
+int spng_encode_scanline(spng_ctx *ctx, const void *scanline, size_t len)
+{
+    if(ctx == NULL || scanline == NULL) return SPNG_EINVAL;
+    if(ctx->state >= SPNG_STATE_EOI) return SPNG_EOI;
+    if(len < (ctx->subimage[ctx->row_info.pass].scanline_width -1) ) return SPNG_EBUFSIZ;
+
+    return encode_scanline(ctx, scanline, len);
+}
+
+int spng_encode_row(spng_ctx *ctx, const void *row, size_t len)
+{
+    if(ctx == NULL || row == NULL) return SPNG_EINVAL;
+    if(ctx->state >= SPNG_STATE_EOI) return SPNG_EOI;
+    if(len < ctx->image_width) return SPNG_EBUFSIZ;
+
+    return encode_row(ctx, row, len);
+}
+
+int spng_encode_chunks(spng_ctx *ctx)
+{
+    if(ctx == NULL) return 1;
+    if(!ctx->state) return SPNG_EBADSTATE;
+    if(ctx->state < SPNG_STATE_OUTPUT) return SPNG_ENODST;
+    if(!ctx->encode_only) return SPNG_ECTXTYPE;
+
+    int ret = 0;
+
+    if(ctx->state < SPNG_STATE_FIRST_IDAT)
+    {
+        if(!ctx->stored.ihdr) return SPNG_ENOIHDR;
+
+        ret = write_chunks_before_idat(ctx);
+        if(ret) return encode_err(ctx, ret);
+
+        ctx->state = SPNG_STATE_FIRST_IDAT;
+    }
+    else if(ctx->state == SPNG_STATE_FIRST_IDAT)
+    {
+        return 0;
+    }
+    else if(ctx->state == SPNG_STATE_EOI)
+    {
+        ret = write_chunks_after_idat(ctx);
+        if(ret) return encode_err(ctx, ret);
+
+        ctx->state = SPNG_STATE_IEND;
+    }
+    else return SPNG_EOPSTATE;
+
+    return 0;
+}
+
+/* Strip-parallel image compression
+
+   The image is split into strips of at least SPNG_STRIP_SIZE filtered bytes,
+   each strip is filtered and deflated independently into a raw deflate stream
+   primed with the tail of the previous strip as the dictionary.
+   All but the last strip end on a byte boundary (Z_SYNC_FLUSH) so they can be
+   concatenated into a single zlib stream with a combined checksum.
+
+   With SPNG_RESTART_STRIPS strips are compressed without a dictionary and end with
+   Z_FULL_FLUSH, the first row of each strip is filtered with None or Sub.
+   Each strip can be decompressed and defiltered on its own,
+   their offsets in the zlib stream are written to an spRS chunk after the image data.
+
+   Strip boundaries only depend on the image, the output is identical
+   for any number of threads. Workers stay at most SPNG_STRIPS_AHEAD strips per thread
+   ahead of the strip being written so memory use does not grow with the image.
+*/
+#define SPNG_STRIP_SIZE (128 * 1024)
+#define SPNG_STRIPS_AHEAD 2
+
+struct spng__strip
+{
+    uint32_t first_row;
+    uint32_t n_rows;
+
+    unsigned char *filtered;
+    size_t filtered_len;
+
+    unsigned char *out;
+    size_t out_len;
+
+    uint32_t adler;
+
+    int filtered_done;
+    int done;
+};
+
+struct spng__strip_pool
+{
+    spng_ctx *ctx;
+    const unsigned char *img;
+    size_t image_width; /* bytes per row of img */
+    size_t scanline_width;
+
+    struct spng__strip *strips;
+    uint32_t n_strips;
+    uint32_t next_strip;
+    uint32_t n_written;
+    uint32_t max_pending;
+
+    int error;
+
+#ifdef SPNG_MULTITHREADING
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+};
+
+/* An APNG frame is a single strip of its area of the image */
+struct spng__frame
+{
+    spng_ctx *ctx;
+    struct spng_fctl fctl;
+
+    unsigned char *pixels;
+    size_t row_width;
+
+    struct spng__strip strip;
+    int ret;
+
+#ifdef SPNG_MULTITHREADING
+    pthread_t thread;
+    int started;
+#endif
+};
+
+/* Same header deflate() would write for these options */
+static void write_zlib_header(unsigned char header[2], const struct spng__zlib_options *options, int window_bits)
+{
+    int level = options->compression_level;
+    unsigned level_flags = 3;
+
+    if(level == Z_DEFAULT_COMPRESSION) level = 6;
+
+    if(options->strategy >= Z_HUFFMAN_ONLY || level < 2) level_flags = 0;
+    else if(level < 6) level_flags = 1;
+    else if(level == 6) level_flags = 2;
+
+    unsigned cmf_flg = (Z_DEFLATED + ((window_bits - 8) << 4)) << 8;
+
+    cmf_flg |= level_flags << 6;
+    cmf_flg += 31 - (cmf_flg % 31);
+
+    write_u16(header, cmf_flg);
+}
+
+static int filter_strip(const struct spng__strip_pool *pool, struct spng__strip *strip)
+{
+    spng_ctx *ctx = pool->ctx;
+    const struct encode_flags f = ctx->encode_flags;
+    const int choices = f.filter_choice;
+    const int restart_choices = SPNG_FILTER_CHOICE_NONE | SPNG_FILTER_CHOICE_SUB;
+    const int restart = ctx->restart_strips && strip->first_row; /* doesn't reference the previous strip */
+    const size_t scanline_width = pool->scanline_width;
+    const size_t image_width = pool->image_width;
+    const unsigned char *scanline, *prev_scanline;
+    unsigned char *out, *t, *filtered;
+    unsigned filter;
+    uint32_t i;
+    int ret = 0;
+
+    if(scanline_width > SIZE_MAX - 15) return SPNG_EOVERFLOW;
+
+    /* Keeps every row 16-byte aligned */
+    const size_t stride = (scanline_width + 15) & ~(size_t)15;
+
+    strip->filtered_len = strip->n_rows * scanline_width;
+    strip->filtered = spng__malloc(ctx, strip->filtered_len);
+
+    /* Zeroed previous scanline for the first row, two scanlines for byte swapping
+       and four for filter_scanline_best() */
+    unsigned char *buf = spng__calloc(ctx, 7, stride);
+
+    if(strip->filtered == NULL || buf == NULL)
+    {
+        spng__free(ctx, buf);
+        return SPNG_EMEM;
+    }
+
+    unsigned char *row_be = buf + stride;
+    unsigned char *prev_be = row_be + stride;
+    unsigned char *scratch = prev_be + stride;
+
+    if(strip->first_row)
+    {
+        prev_scanline = pool->img + (strip->first_row - 1) * image_width;
+
+        if(f.to_bigendian)
+        {
+            memcpy(prev_be, prev_scanline, image_width);
+            u16_row_to_bigendian(prev_be, image_width);
+            prev_scanline = prev_be;
+        }
+    }
+    else prev_scanline = buf;
+
+    out = strip->filtered;
+
+    for(i=0; i < strip->n_rows; i++, out += scanline_width)
+    {
+        scanline = pool->img + (strip->first_row + i) * image_width;
+
+        if(f.to_bigendian)
+        {
+            memcpy(row_be, scanline, image_width);
+            u16_row_to_bigendian(row_be, image_width);
+            scanline = row_be;
+        }
+
+        ret = filter_scanline_best(ctx, i || !restart ? choices : choices & restart_choices, scratch,
+                                   prev_scanline, scanline, scanline_width, &filter, &filtered);
+        if(ret) break;
+
+        out[0] = filter;
+
+        memcpy(out + 1, filter ? filtered : scanline, image_width);
+
+        prev_scanline = scanline;
+
+        if(f.to_bigendian)
+        {
+            t = prev_be;
+            prev_be = row_be;
+            row_be = t;
+        }
+    }
+
+    spng__free(ctx, buf);
+
+    return ret;
+}
+
+#if defined(SPNG_USE_LIBDEFLATE) && !defined(SPNG_USE_MINIZ)
+/* Whole image only, libdeflate always ends the stream */
+static int compress_strip_libdeflate(spng_ctx *ctx, struct spng__strip *strip)
+{
+    int level = ctx->image_options.compression_level;
+
+    if(level == Z_DEFAULT_COMPRESSION) level = 6;
+    if(level < 0 || level > 12) return SPNG_EZLIB_INIT;
+
+    struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(level);
+    if(compressor == NULL) return SPNG_EMEM;
+
+    size_t size = libdeflate_deflate_compress_bound(compressor, strip->filtered_len);
+
+    strip->out = spng__malloc(ctx, size);
+
+    if(strip->out == NULL)
+    {
+        libdeflate_free_compressor(compressor);
+        return SPNG_EMEM;
+    }
+
+    strip->out_len = libdeflate_deflate_compress(compressor, strip->filtered, strip->filtered_len, strip->out, size);
+    strip->adler = libdeflate_adler32(1, strip->filtered, strip->filtered_len);
+
+    libdeflate_free_compressor(compressor);
+
+    if(!strip->out_len) return SPNG_EZLIB;
+
+    return 0;
+}
+#endif
+
+/* SPNG_DEFLATE_FAST: a deflate encoder for filtered scanlines of screenshots and similar images.
+   Each strip is parsed greedily for matches at the pixel distance and one scanline up,
+   which catch runs left by filtering and repeated rows, and at the last position with the same hash,
+   then written as one dynamic Huffman block built from the strip's own statistics.
+   Strips never reference each other so they also work as restart strips.
+   A token is a literal byte or the flag, the distance code (bits 25-29),
+   the length (bits 16-24) and the distance (bits 0-15). */
+#define SPNG_FAST_MATCH_FLAG (1u << 31)
+#define SPNG_FAST_HASH_BITS 14
+
+static inline uint32_t read_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+struct spng__bit_writer
+{
+    unsigned char *out;
+    uint64_t bits;
+    unsigned n;
+};
+
+/* Writes 8 bytes and keeps the last partial byte, the output needs 8 bytes of slack */
+static inline void put_bits(struct spng__bit_writer *w, uint32_t value, unsigned n)
+{
+    w->bits |= (uint64_t)value << w->n;
+    w->n += n;
+
+    w->out[0] = (unsigned char)w->bits;
+    w->out[1] = (unsigned char)(w->bits >> 8);
+    w->out[2] = (unsigned char)(w->bits >> 16);
+    w->out[3] = (unsigned char)(w->bits >> 24);
+    w->out[4] = (unsigned char)(w->bits >> 32);
+    w->out[5] = (unsigned char)(w->bits >> 40);
+    w->out[6] = (unsigned char)(w->bits >> 48);
+    w->out[7] = (unsigned char)(w->bits >> 56);
+
+    w->out += w->n >> 3;
+    w->bits >>= w->n & ~7u;
+    w->n &= 7;
+}
+
+/* Pads to a byte boundary */
+static inline void flush_bits(struct spng__bit_writer *w)
+{
+    while(w->n)
+    {
+        *w->out++ = (unsigned char)w->bits;
+
+        w->bits >>= 8;
+        w->n = w->n > 8 ? w->n - 8 : 0;
+    }
+
+    w->bits = 0;
+}
+
+static const uint16_t deflate_length_base[29] =
+{
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t deflate_length_extra[29] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint8_t code_length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static unsigned distance_code(uint32_t distance)
+{
+    uint32_t d = distance - 1;
+    unsigned log2 = 0;
+
+    if(d < 4) return d;
+
+    while((d >> log2) > 1) log2++;
+
+    return 2 * log2 + ((d >> (log2 - 1)) & 1);
+}
+
+/* Length-limited Huffman code lengths from symbol frequencies,
+   minimum-redundancy code lengths computed in place (Moffat and Katajainen)
+   and then limited by moving the excess codes to max_bits and fixing up the Kraft sum. */
+static void huffman_code_lengths(const uint32_t *freq, unsigned n_symbols, unsigned max_bits, uint8_t *lengths)
+{
+    uint32_t key[288];
+    uint16_t sym[288];
+    unsigned count[32] = {0};
+    unsigned i, j, n = 0;
+
+    memset(lengths, 0, n_symbols);
+
+    /* Symbols sorted by frequency */
+    for(i=0; i < n_symbols; i++)
+    {
+        if(!freq[i]) continue;
+
+        for(j=n; j > 0 && key[j - 1] > freq[i]; j--)
+        {
+            key[j] = key[j - 1];
+            sym[j] = sym[j - 1];
+        }
+
+        key[j] = freq[i];
+        sym[j] = (uint16_t)i;
+        n++;
+    }
+
+    if(!n) return;
+
+    if(n == 1)
+    {
+        lengths[sym[0]] = 1;
+        return;
+    }
+
+    unsigned root = 0, leaf = 2, next;
+
+    key[0] += key[1];
+
+    for(next=1; next < n - 1; next++)
+    {
+        if(leaf >= n || key[root] < key[leaf])
+        {
+            key[next] = key[root];
+            key[root++] = next;
+        }
+        else key[next] = key[leaf++];
+
+        if(leaf >= n || (root < next && key[root] < key[leaf]))
+        {
+            key[next] += key[root];
+            key[root++] = next;
+        }
+        else key[next] += key[leaf++];
+    }
+
+    key[n - 2] = 0;
+
+    for(i=n - 2; i-- > 0;) key[i] = key[key[i]] + 1;
+
+    unsigned avail = 1, used = 0, depth = 0;
+    int r = (int)n - 2;
+
+    next = n;
+
+    while(avail)
+    {
+        while(r >= 0 && key[r] == depth)
+        {
+            used++;
+            r--;
+        }
+
+        while(avail > used)
+        {
+            count[depth < max_bits ? depth : max_bits]++;
+            next--;
+            avail--;
+        }
+
+        avail = 2 * used;
+        depth++;
+        used = 0;
+    }
+
+    uint32_t total = 0;
+
+    for(i=1; i <= max_bits; i++) total += count[i] << (max_bits - i);
+
+    while(total != (1u << max_bits))
+    {
+        count[max_bits]--;
+
+        for(i=max_bits - 1; i > 0; i--)
+        {
+            if(count[i])
+            {
+                count[i]--;
+                count[i + 1] += 2;
+                break;
+            }
+        }
+
+        total--;
+    }
+
+    /* The most frequent symbols get the shortest codes */
+    for(i=1, j=n; i <= max_bits; i++)
+    {
+        unsigned k;
+        for(k=count[i]; k > 0; k--) lengths[sym[--j]] = (uint8_t)i;
+    }
+}
+
+/* Canonical codes, bit-reversed since deflate writes Huffman codes starting with the most significant bit */
+static void huffman_codes(const uint8_t *lengths, unsigned n_symbols, uint16_t *codes)
+{
+    unsigned count[16] = {0}, next[16];
+    unsigned i, code = 0;
+
+    for(i=0; i < n_symbols; i++) count[lengths[i]]++;
+
+    count[0] = 0;
+
+    for(i=1; i < 16; i++)
+    {
+        code = (code + count[i - 1]) << 1;
+        next[i] = code;
+    }
+
+    for(i=0; i < n_symbols; i++)
+    {
+        unsigned len = lengths[i], c, rev = 0, k;
+
+        if(!len) continue;
+
+        c = next[len]++;
+
+        for(k=0; k < len; k++) rev |= ((c >> k) & 1) << (len - 1 - k);
+
+        codes[i] = (uint16_t)rev;
+    }
+}
+
+/* Run-length encodes the code lengths of both trees with symbols 16-18 */
+static unsigned rle_code_lengths(const uint8_t *lengths, unsigned n, uint8_t *rle, uint32_t *freq)
+{
+    unsigned i = 0, out = 0;
+
+    while(i < n)
+    {
+        unsigned len = lengths[i], run = 1;
+
+        while(i + run < n && lengths[i + run] == len) run++;
+
+        i += run;
+
+        if(!len && run >= 3)
+        {
+            while(run >= 3)
+            {
+                unsigned r = run > 138 ? 138 : run;
+
+                if(r <= 10)
+                {
+                    rle[out++] = 17;
+                    rle[out++] = (uint8_t)(r - 3);
+                }
+                else
+                {
+                    rle[out++] = 18;
+                    rle[out++] = (uint8_t)(r - 11);
+                }
+
+                freq[rle[out - 2]]++;
+                run -= r;
+            }
+        }
+        else if(len && run >= 4)
+        {
+            rle[out++] = (uint8_t)len;
+            freq[len]++;
+            run--;
+
+            while(run >= 3)
+            {
+                unsigned r = run > 6 ? 6 : run;
+
+                rle[out++] = 16;
+                rle[out++] = (uint8_t)(r - 3);
+                freq[16]++;
+                run -= r;
+            }
+        }
+
+        while(run)
+        {
+            rle[out++] = (uint8_t)len;
+            freq[len]++;
+            run--;
+        }
+    }
+
+    return out;
+}
+
+/* Match length at p against p - distance, up to max bytes */
+static inline size_t match_length(const unsigned char *p, size_t distance, size_t max)
+{
+    size_t len = 0;
+
+    while(len + 8 <= max)
+    {
+        uint64_t a, b;
+
+        memcpy(&a, p + len, 8);
+        memcpy(&b, p + len - distance, 8);
+
+        if(a != b)
+        {
+#if defined(SPNG_LITTLE_ENDIAN) && (defined(__GNUC__) || defined(__clang__))
+            return len + (size_t)(__builtin_ctzll(a ^ b) >> 3);
+#else
+            break;
+#endif
+        }
+
+        len += 8;
+    }
+
+    while(len < max && p[len] == p[len - distance]) len++;
+
+    return len;
+}
+
+struct spng__fast_parser
+{
+    const unsigned char *in;
+    size_t n;
+    size_t bpp;
+    size_t up; /* 0 if out of the window */
+    size_t window;
+
+    uint32_t *hash; /* position + 1 */
+    uint32_t *tokens;
+    size_t n_tokens;
+    unsigned misses;
+
+    uint32_t litlen_freq[286];
+    uint32_t dist_freq[30];
+    uint8_t length_symbol[259];
+    uint8_t dist_symbol[512]; /* distance - 1 below 256, then (distance - 1) >> 7 from 256, same as zlib */
+};
+
+static inline uint32_t fast_hash(uint32_t x)
+{
+    return (x * 2654435761u) >> (32 - SPNG_FAST_HASH_BITS);
+}
+
+static inline void fast_add_match(struct spng__fast_parser *p, size_t len, size_t distance)
+{
+    size_t dist = distance - 1;
+    unsigned d = p->dist_symbol[dist < 256 ? dist : 256 + (dist >> 7)];
+
+    p->tokens[p->n_tokens++] = SPNG_FAST_MATCH_FLAG | ((uint32_t)d << 25) | ((uint32_t)len << 16) | (uint32_t)distance;
+
+    p->litlen_freq[257 + p->length_symbol[len]]++;
+    p->dist_freq[d]++;
+
+    p->misses = 0;
+}
+
+/* Search less often in incompressible data */
+static inline size_t fast_add_literals(struct spng__fast_parser *p, size_t i)
+{
+    size_t end = i + 1 + (p->misses++ >> 4);
+
+    if(end > p->n) end = p->n;
+
+    for(; i < end; i++)
+    {
+        p->tokens[p->n_tokens++] = p->in[i];
+        p->litlen_freq[p->in[i]]++;
+    }
+
+    return i;
+}
+
+/* Greedy parse from i until end is reached, a match is stored as its length and distance.
+   Candidates are the previous pixel, the previous scanline and the last position with the same hash. */
+static size_t fast_parse(struct spng__fast_parser *p, size_t i, size_t end)
+{
+    const unsigned char *in = p->in;
+    const size_t n = p->n, bpp = p->bpp, up = p->up;
+
+    if(end > n) end = n;
+
+    while(i < end)
+    {
+        size_t max = n - i, len = 0, distance = 0;
+
+        if(max > 258) max = 258;
+
+        if(max >= 4)
+        {
+            uint32_t cur = read_le32(in + i);
+            uint32_t h = fast_hash(cur);
+            size_t candidate = p->hash[h];
+
+            p->hash[h] = (uint32_t)(i + 1);
+
+            if(i >= bpp && !((cur ^ read_le32(in + i - bpp)) & 0xFFFFFF))
+            {
+                len = match_length(in + i, bpp, max);
+                distance = bpp;
+            }
+
+            if(len < max && up && i >= up && !((cur ^ read_le32(in + i - up)) & 0xFFFFFF))
+            {
+                size_t l = match_length(in + i, up, max);
+
+                if(l > len)
+                {
+                    len = l;
+                    distance = up;
+                }
+            }
+
+            if(len < max && candidate-- && i - candidate <= p->window && i - candidate != distance &&
+               read_le32(in + candidate) == cur)
+            {
+                size_t l = match_length(in + i, i - candidate, max);
+
+                if(l > len + 1)
+                {
+                    len = l;
+                    distance = i - candidate;
+                }
+            }
+        }
+
+        if(len >= 3)
+        {
+            fast_add_match(p, len, distance);
+            i += len;
+        }
+        else i = fast_add_literals(p, i);
+    }
+
+    return i;
+}
+
+static int compress_strip_fast(spng_ctx *ctx, struct spng__strip *strip, size_t scanline_width, int last)
+{
+    const unsigned char *in = strip->filtered;
+    const size_t n = strip->filtered_len;
+    uint32_t cl_freq[19] = {0};
+    uint8_t litlen_bits[286], dist_bits[30], cl_bits[19], lengths[286 + 30], rle[2 * (286 + 30)];
+    uint16_t litlen_codes[286], dist_codes[30], cl_codes[19];
+    size_t i;
+    unsigned k;
+
+    struct spng__fast_parser *p = spng__calloc(ctx, 1, sizeof(struct spng__fast_parser));
+    if(p == NULL) return SPNG_EMEM;
+
+    uint32_t *litlen_freq = p->litlen_freq, *dist_freq = p->dist_freq;
+    const uint8_t *length_symbol = p->length_symbol;
+
+    p->in = in;
+    p->n = n;
+    p->bpp = ctx->bytes_per_pixel ? ctx->bytes_per_pixel : 1;
+    p->up = scanline_width;
+    p->window = (size_t)1 << ctx->image_options.window_bits;
+
+    if(p->window > 32768) p->window = 32768;
+    if(p->up > p->window || p->up <= p->bpp) p->up = 0;
+
+    for(k=0; k < 29; k++)
+    {
+        unsigned len, end = k == 28 ? 259 : deflate_length_base[k + 1];
+        for(len=deflate_length_base[k]; len < end; len++) p->length_symbol[len] = (uint8_t)k;
+    }
+
+    for(k=0; k < 256; k++)
+    {
+        p->dist_symbol[k] = (uint8_t)distance_code(k + 1);
+        p->dist_symbol[256 + k] = (uint8_t)distance_code((k << 7) + 1);
+    }
+
+    p->hash = spng__calloc(ctx, (size_t)1 << SPNG_FAST_HASH_BITS, sizeof(uint32_t));
+    p->tokens = spng__malloc(ctx, (n + 1) * sizeof(uint32_t));
+
+    if(p->hash == NULL || p->tokens == NULL)
+    {
+        spng__free(ctx, p->hash);
+        spng__free(ctx, p->tokens);
+        spng__free(ctx, p);
+        return SPNG_EMEM;
+    }
+
+    /* The first scanline has no match one scanline up */
+    i = fast_parse(p, 0, p->up + p->bpp);
+
+#if defined(SPNG_X86_AVX)
+    if(ctx->simd_level >= SPNG__SIMD_AVX2) i = fast_parse_avx2(p, i);
+#endif
+
+    fast_parse(p, i, n);
+
+    const uint32_t *tokens = p->tokens;
+    const size_t n_tokens = p->n_tokens;
+
+    litlen_freq[256] = 1;
+
+    huffman_code_lengths(litlen_freq, 286, 15, litlen_bits);
+    huffman_code_lengths(dist_freq, 30, 15, dist_bits);
+
+    /* At least one distance code */
+    for(k=0; k < 30 && !dist_freq[k]; k++);
+    if(k == 30) dist_bits[0] = 1;
+
+    unsigned n_litlen = 286, n_dist = 30, n_cl = 19;
+
+    while(n_litlen > 257 && !litlen_bits[n_litlen - 1]) n_litlen--;
+    while(n_dist > 1 && !dist_bits[n_dist - 1]) n_dist--;
+
+    memcpy(lengths, litlen_bits, n_litlen);
+    memcpy(lengths + n_litlen, dist_bits, n_dist);
+
+    unsigned n_rle = rle_code_lengths(lengths, n_litlen + n_dist, rle, cl_freq);
+
+    huffman_code_lengths(cl_freq, 19, 7, cl_bits);
+
+    while(n_cl > 4 && !cl_bits[code_length_order[n_cl - 1]]) n_cl--;
+
+    /* Exact size of the block */
+    uint64_t bits = 3 + 14 + 3 * n_cl;
+
+    for(k=0; k < 19; k++) bits += (uint64_t)cl_freq[k] * cl_bits[k];
+
+    bits += 2 * (uint64_t)cl_freq[16] + 3 * (uint64_t)cl_freq[17] + 7 * (uint64_t)cl_freq[18];
+
+    for(k=0; k < 286; k++) bits += (uint64_t)litlen_freq[k] * litlen_bits[k];
+    for(k=0; k < 29; k++) bits += (uint64_t)litlen_freq[257 + k] * deflate_length_extra[k];
+    for(k=0; k < 30; k++) bits += (uint64_t)dist_freq[k] * (dist_bits[k] + (k < 4 ? 0 : k / 2 - 1));
+
+    size_t stored_size = n + 5 * (n / 65535 + 1);
+    size_t size = (size_t)(bits / 8) + 16;
+    int stored = size >= stored_size;
+
+    if(stored) size = stored_size + 16;
+
+    spng__free(ctx, p->hash);
+
+    strip->out = spng__malloc(ctx, size);
+    if(strip->out == NULL)
+    {
+        spng__free(ctx, p->tokens);
+        spng__free(ctx, p);
+        return SPNG_EMEM;
+    }
+
+    struct spng__bit_writer w = { .out = strip->out };
+
+    if(stored)
+    {
+        for(i=0; i < n;)
+        {
+            size_t len = n - i > 65535 ? 65535 : n - i;
+
+            put_bits(&w, last && i + len == n, 3);
+            flush_bits(&w);
+
+            w.out[0] = (unsigned char)len;
+            w.out[1] = (unsigned char)(len >> 8);
+            w.out[2] = (unsigned char)~len;
+            w.out[3] = (unsigned char)(~len >> 8);
+
+            memcpy(w.out + 4, in + i, len);
+
+            w.out += 4 + len;
+            i += len;
+        }
+    }
+    else
+    {
+        huffman_codes(litlen_bits, n_litlen, litlen_codes);
+        huffman_codes(dist_bits, n_dist, dist_codes);
+        huffman_codes(cl_bits, 19, cl_codes);
+
+        put_bits(&w, last ? 5 : 4, 3); /* BFINAL, dynamic Huffman */
+        put_bits(&w, n_litlen - 257, 5);
+        put_bits(&w, n_dist - 1, 5);
+        put_bits(&w, n_cl - 4, 4);
+
+        for(k=0; k < n_cl; k++) put_bits(&w, cl_bits[code_length_order[k]], 3);
+
+        for(k=0; k < n_rle; k++)
+        {
+            unsigned s = rle[k];
+
+            put_bits(&w, cl_codes[s], cl_bits[s]);
+
+            if(s == 16) put_bits(&w, rle[++k], 2);
+            else if(s == 17) put_bits(&w, rle[++k], 3);
+            else if(s == 18) put_bits(&w, rle[++k], 7);
+        }
+
+        for(i=0; i < n_tokens; i++)
+        {
+            uint32_t t = tokens[i];
+
+            if(!(t & SPNG_FAST_MATCH_FLAG))
+            {
+                put_bits(&w, litlen_codes[t], litlen_bits[t]);
+                continue;
+            }
+
+            unsigned len = (t >> 16) & 0x1FF, distance = t & 0xFFFF;
+            unsigned s = length_symbol[len], d = (t >> 25) & 0x1F;
+            unsigned d_extra = d < 4 ? 0 : d / 2 - 1;
+
+            put_bits(&w, litlen_codes[257 + s] | ((len - deflate_length_base[s]) << litlen_bits[257 + s]),
+                     litlen_bits[257 + s] + deflate_length_extra[s]);
+
+            put_bits(&w, dist_codes[d], dist_bits[d]);
+            if(d_extra) put_bits(&w, (distance - 1) & ((1u << d_extra) - 1), d_extra);
+        }
+
+        put_bits(&w, litlen_codes[256], litlen_bits[256]);
+
+        /* Empty stored block to end on a byte boundary, same as Z_SYNC_FLUSH */
+        if(!last)
+        {
+            put_bits(&w, 0, 3);
+            flush_bits(&w);
+            put_bits(&w, 0xFFFF0000, 32);
+        }
+
+        flush_bits(&w);
+    }
+
+    strip->out_len = w.out - strip->out;
+
+    spng__free(ctx, p->tokens);
+    spng__free(ctx, p);
+
+    strip->adler = adler32(0, NULL, 0);
+    i = 0;
+
+#if defined(SPNG_X86_AVX)
+    if(ctx->simd_level >= SPNG__SIMD_AVX2) i = adler32_avx2(&strip->adler, in, n);
+#endif
+
+    while(i < n)
+    {
+        uInt len = n - i > UINT_MAX ? UINT_MAX : (uInt)(n - i);
+
+        strip->adler = adler32(strip->adler, in + i, len);
+        i += len;
+    }
+
+    return 0;
+}
+
+static int compress_strip(const struct spng__strip_pool *pool, struct spng__strip *strip, const struct spng__strip *prev, int last)
+{
+    spng_ctx *ctx = pool->ctx;
+    const struct spng__zlib_options *options = &ctx->image_options;
+    int window_bits = options->window_bits;
+    const int flush = last ? Z_FINISH : ctx->restart_strips ? Z_FULL_FLUSH : Z_SYNC_FLUSH;
+    int ret = Z_OK;
+
+#if defined(SPNG_USE_LIBDEFLATE) && !defined(SPNG_USE_MINIZ)
+    if(ctx->deflate_backend == SPNG_DEFLATE_LIBDEFLATE && !ctx->restart_strips) return compress_strip_libdeflate(ctx, strip);
+#endif
+
+    if(ctx->deflate_backend == SPNG_DEFLATE_FAST) return compress_strip_fast(ctx, strip, pool->scanline_width, last);
+
+    /* raw deflate does not support 256-byte windows, zlib does the same substitution */
+    if(window_bits == 8) window_bits = 9;
+
+    z_stream zstream = {0};
+    zstream.zalloc = spng__zalloc;
+    zstream.zfree = spng__zfree;
+    zstream.opaque = ctx;
+    zstream.data_type = options->data_type;
+
+    if(deflateInit2(&zstream, options->compression_level, Z_DEFLATED, -window_bits, options->mem_level, options->strategy) != Z_OK)
+    {
+        return SPNG_EZLIB_INIT;
+    }
+
+    if(prev != NULL && !ctx->restart_strips)
+    {
+        size_t dict_len = (size_t)1 << window_bits;
+
+        if(dict_len > prev->filtered_len) dict_len = prev->filtered_len;
+
+        if(deflateSetDictionary(&zstream, prev->filtered + prev->filtered_len - dict_len, (uInt)dict_len) != Z_OK)
+        {
+            ret = SPNG_EZLIB;
+            goto err;
+        }
+    }
+
+    const unsigned char *in = strip->filtered;
+    size_t in_left = strip->filtered_len;
+    size_t size = SPNG_WRITE_SIZE;
+    size_t total = 0;
+    void *t;
+
+    if(in_left < UINT_MAX) size = deflateBound(&zstream, (uLong)in_left) + 16; /* + sync flush marker */
+
+    strip->out = spng__malloc(ctx, size);
+    if(strip->out == NULL) goto mem;
+
+    strip->adler = adler32(0, NULL, 0);
+
+    while(1)
+    {
+        if(!zstream.avail_in && in_left)
+        {
+            uInt len = in_left > UINT_MAX ? UINT_MAX : (uInt)in_left;
+
+            strip->adler = adler32(strip->adler, in, len);
+
+            zstream.next_in = in;
+            zstream.avail_in = len;
+
+            in += len;
+            in_left -= len;
+        }
+
+        if(total == size)
+        {
+            if(size > SIZE_MAX / 2) goto mem;
+
+            t = spng__realloc(ctx, strip->out, size * 2);
+            if(t == NULL) goto mem;
+
+            strip->out = t;
+            size *= 2;
+        }
+
+        if(!zstream.avail_out)
+        {
+            size_t len = size - total;
+
+            zstream.next_out = strip->out + total;
+            zstream.avail_out = len > UINT_MAX ? UINT_MAX : (uInt)len;
+        }
+
+        uInt avail_out = zstream.avail_out;
+
+        ret = deflate(&zstream, in_left ? Z_NO_FLUSH : flush);
+
+        total += avail_out - zstream.avail_out;
+
+        if(ret == Z_STREAM_END) break;
+        if(ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            ret = SPNG_EZLIB;
+            goto err;
+        }
+
+        /* Z_SYNC_FLUSH and Z_FULL_FLUSH are complete when there's output space left */
+        if(!last && !in_left && !zstream.avail_in && zstream.avail_out) break;
+    }
+
+    strip->out_len = total;
+
+    deflateEnd(&zstream);
+
+    return 0;
+
+mem:
+    ret = SPNG_EMEM;
+err:
+    deflateEnd(&zstream);
+    return ret;
+}
+
+#ifdef SPNG_MULTITHREADING
+static void *strip_worker(void *arg)
+{
+    struct spng__strip_pool *pool = arg;
+    struct spng__strip *strip;
+    uint32_t k;
+    int ret;
+
+    while(1)
+    {
+        pthread_mutex_lock(&pool->lock);
+
+        while(!pool->error && pool->next_strip < pool->n_strips &&
+              pool->next_strip - pool->n_written >= pool->max_pending) pthread_cond_wait(&pool->cond, &pool->lock);
+
+        if(pool->error || pool->next_strip >= pool->n_strips)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        k = pool->next_strip++;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        strip = &pool->strips[k];
+
+        ret = filter_strip(pool, strip);
+
+        pthread_mutex_lock(&pool->lock);
+
+        strip->filtered_done = 1;
+        if(ret && !pool->error) pool->error = ret;
+
+        pthread_cond_broadcast(&pool->cond);
+
+        /* The previous strip's tail is the dictionary */
+        while(k && !pool->ctx->restart_strips && !pool->strips[k - 1].filtered_done && !pool->error) pthread_cond_wait(&pool->cond, &pool->lock);
+
+        ret = pool->error;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        if(!ret) ret = compress_strip(pool, strip, k ? &pool->strips[k - 1] : NULL, k == (pool->n_strips - 1));
+
+        pthread_mutex_lock(&pool->lock);
+
+        strip->done = 1;
+        if(ret && !pool->error) pool->error = ret;
+
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+#endif
+
+/* Window size of the zlib header for the output of compress_strip() */
+static int strip_window_bits(const spng_ctx *ctx)
+{
+    int window_bits = ctx->image_options.window_bits;
+
+    if(window_bits == 8) window_bits = 9;
+
+    /* libdeflate always uses a 32K window */
+    if(ctx->deflate_backend == SPNG_DEFLATE_LIBDEFLATE && !ctx->restart_strips) window_bits = 15;
+
+    return window_bits;
+}
+
+/* Write to the IDAT stream started by spng_encode_image() */
+static int write_idat_data(spng_ctx *ctx, const unsigned char *data, size_t len)
+{
+    int ret;
+    z_stream *zstream = &ctx->zstream;
+    uint32_t idat_length = SPNG_WRITE_SIZE;
+
+    while(len)
+    {
+        if(zstream->avail_out == 0)
+        {
+            ret = finish_chunk(ctx);
+            if(ret) return ret;
+
+            ret = write_header(ctx, type_idat, idat_length, &zstream->next_out);
+            if(ret) return ret;
+
+            zstream->avail_out = idat_length;
+        }
+
+        size_t n = zstream->avail_out;
+        if(n > len) n = len;
+
+        memcpy(zstream->next_out, data, n);
+
+        zstream->next_out += n;
+        zstream->avail_out -= (uInt)n;
+
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int encode_strips(spng_ctx *ctx, const void *img)
+{
+    const size_t scanline_width = ctx->subimage[0].scanline_width;
+    const uint32_t height = ctx->ihdr.height;
+    unsigned char buf[4];
+    unsigned char *restart_table = NULL;
+    size_t restart_table_len = 0;
+    uint64_t stream_offset = 2; /* zlib header */
+    uint32_t adler = adler32(0, NULL, 0);
+    uint32_t k, n_workers = 0;
+    int ret = 0;
+
+    struct spng__strip_pool pool =
+    {
+        .ctx = ctx,
+        .img = img,
+        .image_width = ctx->image_width,
+        .scanline_width = scanline_width
+    };
+
+    uint32_t rows_per_strip = 1;
+    if(scanline_width < SPNG_STRIP_SIZE) rows_per_strip = (SPNG_STRIP_SIZE + scanline_width - 1) / scanline_width;
+
+    /* One-shot backends compress the whole image at once */
+    if(ctx->deflate_backend && ctx->deflate_backend != SPNG_DEFLATE_FAST && !ctx->restart_strips) rows_per_strip = height;
+
+    pool.n_strips = height / rows_per_strip + (height % rows_per_strip ? 1 : 0);
+
+    /* Rows per strip, the number of strips and the 64-bit offset of each one */
+    if(ctx->restart_strips && pool.n_strips <= (spng_u32max - 8) / 8)
+    {
+        restart_table_len = 8 + (size_t)pool.n_strips * 8;
+        restart_table = spng__malloc(ctx, restart_table_len);
+        if(restart_table == NULL) return SPNG_EMEM;
+
+        write_u32(restart_table, rows_per_strip);
+        write_u32(restart_table + 4, pool.n_strips);
+    }
+
+    pool.strips = spng__calloc(ctx, pool.n_strips, sizeof(struct spng__strip));
+    if(pool.strips == NULL)
+    {
+        spng__free(ctx, restart_table);
+        return SPNG_EMEM;
+    }
+
+    for(k=0; k < pool.n_strips; k++)
+    {
+        pool.strips[k].first_row = k * rows_per_strip;
+        pool.strips[k].n_rows = rows_per_strip;
+
+        if(k == (pool.n_strips - 1)) pool.strips[k].n_rows = height - pool.strips[k].first_row;
+    }
+
+#ifdef SPNG_MULTITHREADING
+    pthread_t *threads = NULL;
+    uint32_t n_threads = ctx->encode_threads;
+
+    if(n_threads > pool.n_strips) n_threads = pool.n_strips;
+
+    if(n_threads > 1)
+    {
+        pool.max_pending = n_threads * SPNG_STRIPS_AHEAD;
+
+        threads = spng__malloc(ctx, n_threads * sizeof(pthread_t));
+
+        if(threads != NULL && !pthread_mutex_init(&pool.lock, NULL))
+        {
+            if(pthread_cond_init(&pool.cond, NULL)) pthread_mutex_destroy(&pool.lock);
+            else
+            {/* Strips are compressed on the calling thread if no workers could be created */
+                for(n_workers=0; n_workers < n_threads; n_workers++)
+                {
+                    if(pthread_create(&threads[n_workers], NULL, strip_worker, &pool)) break;
+                }
+
+                if(!n_workers)
+                {
+                    pthread_cond_destroy(&pool.cond);
+                    pthread_mutex_destroy(&pool.lock);
+                }
+            }
+        }
+    }
+#endif
+
+    write_zlib_header(buf, &ctx->image_options, strip_window_bits(ctx));
+
+    ret = write_idat_data(ctx, buf, 2);
+    if(ret) goto cleanup;
+
+    for(k=0; k < pool.n_strips; k++)
+    {
+        struct spng__strip *strip = &pool.strips[k];
+
+        if(!n_workers)
+        {
+            ret = filter_strip(&pool, strip);
+            if(!ret) ret = compress_strip(&pool, strip, k ? &pool.strips[k - 1] : NULL, k == (pool.n_strips - 1));
+        }
+#ifdef SPNG_MULTITHREADING
+        else
+        {
+            pthread_mutex_lock(&pool.lock);
+
+            while(!strip->done && !pool.error) pthread_cond_wait(&pool.cond, &pool.lock);
+
+            ret = pool.error;
+
+            pthread_mutex_unlock(&pool.lock);
+        }
+#endif
+        if(ret) goto cleanup;
+
+        if(k)
+        {
+            spng__free(ctx, pool.strips[k - 1].filtered);
+            pool.strips[k - 1].filtered = NULL;
+        }
+
+        adler = adler32_combine(adler, strip->adler, (z_off_t)strip->filtered_len);
+
+        if(restart_table != NULL)
+        {
+            write_u32(restart_table + 8 + k * 8, (uint32_t)(stream_offset >> 32));
+            write_u32(restart_table + 12 + k * 8, (uint32_t)stream_offset);
+        }
+
+        stream_offset += strip->out_len;
+
+        ret = write_idat_data(ctx, strip->out, strip->out_len);
+        if(ret) goto cleanup;
+
+        spng__free(ctx, strip->out);
+        strip->out = NULL;
+
+#ifdef SPNG_MULTITHREADING
+        if(n_workers)
+        {
+            pthread_mutex_lock(&pool.lock);
+
+            pool.n_written = k + 1;
+
+            pthread_cond_broadcast(&pool.cond);
+            pthread_mutex_unlock(&pool.lock);
+        }
+#endif
+    }
+
+    write_u32(buf, adler);
+
+    ret = write_idat_data(ctx, buf, 4);
+    if(ret) goto cleanup;
+
+    ret = trim_chunk(ctx, SPNG_WRITE_SIZE - ctx->zstream.avail_out);
+    if(ret) goto cleanup;
+
+    ret = finish_chunk(ctx);
+    if(ret) goto cleanup;
+
+    if(restart_table != NULL) ret = write_chunk(ctx, type_sprs, restart_table, restart_table_len);
+
+cleanup:
+
+#ifdef SPNG_MULTITHREADING
+    if(n_workers)
+    {
+        pthread_mutex_lock(&pool.lock);
+        if(ret && !pool.error) pool.error = ret;
+        pthread_mutex_unlock(&pool.lock);
+
+        for(k=0; k < n_workers; k++) pthread_join(threads[k], NULL);
+
+        pthread_cond_destroy(&pool.cond);
+        pthread_mutex_destroy(&pool.lock);
+    }
+
+    spng__free(ctx, threads);
+#endif
+
+    for(k=0; k < pool.n_strips; k++)
+    {
+        spng__free(ctx, pool.strips[k].filtered);
+        spng__free(ctx, pool.strips[k].out);
+    }
+
+    spng__free(ctx, pool.strips);
+    spng__free(ctx, restart_table);
+
+    return ret;
+}
+
+/* APNG encoding
+
+   Each frame is compared to the previous one and only the bounding box of the
+   changed pixels is encoded. For images with an alpha channel the previous frame
+   can be cleared (SPNG_DISPOSE_OP_BACKGROUND) if that yields a smaller area,
+   and unchanged pixels inside the area are made transparent (SPNG_BLEND_OP_OVER)
+   which compresses better.
+
+   Frames are independent zlib streams, with SPNG_ENCODE_THREADS they are
+   filtered and compressed on a thread each while the next frames are compared.
+   The previous frame's dispose_op is only known when the next frame arrives,
+   frames are written in order once they are compressed and the next one was queued.
+*/
+static int has_alpha(const struct spng_ihdr *ihdr)
+{
+    return ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE_ALPHA ||
+           ihdr->color_type == SPNG_COLOR_TYPE_TRUECOLOR_ALPHA;
+}
+
+/* Bounding box of the pixels that differ from the previous frame,
+   the area of clear is compared to transparent black instead. */
+static void diff_frame(const spng_ctx *ctx, const unsigned char *img, const struct spng_fctl *clear, struct spng_fctl *area)
+{
+    const size_t image_width = ctx->image_width;
+    const unsigned bits = ctx->ihdr.bit_depth * num_channels(&ctx->ihdr);
+    size_t x0 = image_width, x1 = 0;
+    uint32_t y, y0 = 0, y1 = 0;
+
+    for(y=0; y < ctx->ihdr.height; y++)
+    {
+        const unsigned char *row = img + y * image_width;
+        const unsigned char *prev = ctx->frame_buf + y * image_width;
+        size_t first = 0, last = image_width, clear_start = 0, clear_end = 0;
+
+        if(clear != NULL && y >= clear->y_offset && y - clear->y_offset < clear->height)
+        {
+            clear_start = (size_t)clear->x_offset * ctx->bytes_per_pixel;
+            clear_end = clear_start + (size_t)clear->width * ctx->bytes_per_pixel;
+        }
+        else if(!memcmp(row, prev, image_width)) continue;
+
+        while(first < image_width && row[first] == (first >= clear_start && first < clear_end ? 0 : prev[first])) first++;
+
+        if(first == image_width) continue;
+
+        while(row[last - 1] == (last - 1 >= clear_start && last - 1 < clear_end ? 0 : prev[last - 1])) last--;
+
+        if(first < x0) x0 = first;
+        if(last > x1) x1 = last;
+
+        if(!y1) y0 = y;
+        y1 = y + 1;
+    }
+
+    memset(area, 0, sizeof(struct spng_fctl));
+
+    if(!y1) return;
+
+    /* Byte-aligned for bit depths below 8 */
+    if(bits >= 8)
+    {
+        x0 /= bits / 8;
+        x1 = (x1 + bits / 8 - 1) / (bits / 8);
+    }
+    else
+    {
+        x0 *= 8 / bits;
+        x1 *= 8 / bits;
+
+        if(x1 > ctx->ihdr.width) x1 = ctx->ihdr.width;
+    }
+
+    area->x_offset = (uint32_t)x0;
+    area->y_offset = y0;
+    area->width = (uint32_t)(x1 - x0);
+    area->height = y1 - y0;
+}
+
+/* Pixels that don't change are transparent black, returns non-zero if the
+   blended result would differ from the image. */
+static int make_over_frame(const spng_ctx *ctx, const unsigned char *img, const struct spng_fctl *clear, struct spng__frame *frame)
+{
+    const struct spng_fctl *fctl = &frame->fctl;
+    const size_t pixel_size = ctx->bytes_per_pixel;
+    const size_t alpha_size = ctx->ihdr.bit_depth / 8;
+    static const unsigned char zero[8] = {0};
+    uint32_t x, y;
+
+    for(y=0; y < fctl->height; y++)
+    {
+        const size_t offset = (size_t)(fctl->y_offset + y) * ctx->image_width + (size_t)fctl->x_offset * pixel_size;
+        const int clear_row = clear != NULL && fctl->y_offset + y >= clear->y_offset && fctl->y_offset + y - clear->y_offset < clear->height;
+        const unsigned char *px = img + offset;
+        const unsigned char *prev = ctx->frame_buf + offset;
+        unsigned char *out = frame->pixels + y * frame->row_width;
+
+        for(x=0; x < fctl->width; x++, px += pixel_size, prev += pixel_size, out += pixel_size)
+        {
+            const unsigned char *under = prev;
+
+            if(clear_row && fctl->x_offset + x >= clear->x_offset && fctl->x_offset + x - clear->x_offset < clear->width) under = zero;
+
+            if(!memcmp(px, under, pixel_size))
+            {
+                memset(out, 0, pixel_size);
+                continue;
+            }
+
+            /* Opaque pixels and visible pixels over transparent ones are copied exactly */
+            if(memcmp(px + pixel_size - alpha_size, "\xff\xff", alpha_size) &&
+               (memcmp(under + pixel_size - alpha_size, zero, alpha_size) ||
+                !memcmp(px + pixel_size - alpha_size, zero, alpha_size))) return 1;
+
+            memcpy(out, px, pixel_size);
+        }
+    }
+
+    return 0;
+}
+
+static int compress_frame(spng_ctx *ctx, struct spng__frame *frame)
+{
+    struct spng__strip_pool pool =
+    {
+        .ctx = ctx,
+        .img = frame->pixels,
+        .image_width = frame->row_width,
+        .scanline_width = frame->row_width + 1
+    };
+
+    frame->strip.n_rows = frame->fctl.height;
+
+    int ret = filter_strip(&pool, &frame->strip);
+
+    if(!ret) ret = compress_strip(&pool, &frame->strip, NULL, 1);
+
+    spng__free(ctx, frame->strip.filtered);
+    frame->strip.filtered = NULL;
+
+    spng__free(ctx, frame->pixels);
+    frame->pixels = NULL;
+
+    return ret;
+}
+
+#ifdef SPNG_MULTITHREADING
+static void *frame_worker(void *arg)
+{
+    struct spng__frame *frame = arg;
+
+    frame->ret = compress_frame(frame->ctx, frame);
+
+    return NULL;
+}
+#endif
+
+/* fcTL and the frame's zlib stream in IDAT or fdAT chunks */
+static int write_frame(spng_ctx *ctx, const struct spng__frame *frame)
+{
+    int ret;
+    unsigned char data[26];
+    const struct spng_fctl *fctl = &frame->fctl;
+
+    write_u32(data, ctx->apng_seq++);
+    write_u32(data + 4, fctl->width);
+    write_u32(data + 8, fctl->height);
+    write_u32(data + 12, fctl->x_offset);
+    write_u32(data + 16, fctl->y_offset);
+    write_u16(data + 20, fctl->delay_num);
+    write_u16(data + 22, fctl->delay_den);
+    data[24] = fctl->dispose_op;
+    data[25] = fctl->blend_op;
+
+    ret = write_chunk(ctx, type_fctl, data, 26);
+    if(ret) return ret;
+
+    /* The first frame is the default image */
+    const int fdat = ctx->apng_seq > 1;
+    unsigned char header[2], adler[4];
+
+    write_zlib_header(header, &ctx->image_options, strip_window_bits(ctx));
+    write_u32(adler, frame->strip.adler);
+
+    const unsigned char *src[3] = { header, frame->strip.out, adler };
+    const size_t src_len[3] = { 2, frame->strip.out_len, 4 };
+    size_t left = 6 + frame->strip.out_len, pos = 0;
+    int k = 0;
+
+    while(left)
+    {
+        size_t n = left > SPNG_WRITE_SIZE ? SPNG_WRITE_SIZE : left;
+        unsigned char *out;
+
+        ret = write_header(ctx, fdat ? type_fdat : type_idat, n + (fdat ? 4 : 0), &out);
+        if(ret) return ret;
+
+        if(fdat)
+        {
+            write_u32(out, ctx->apng_seq++);
+            out += 4;
+        }
+
+        left -= n;
+
+        while(n)
+        {
+            size_t len = src_len[k] - pos;
+            if(len > n) len = n;
+
+            memcpy(out, src[k] + pos, len);
+
+            out += len;
+            n -= len;
+            pos += len;
+
+            if(pos == src_len[k])
+            {
+                k++;
+                pos = 0;
+            }
+        }
+
+        ret = finish_chunk(ctx);
+        if(ret) return ret;
+    }
+
+    return 0;
+}
+
+static void free_frame(spng_ctx *ctx, struct spng__frame *frame)
+{
+#ifdef SPNG_MULTITHREADING
+    if(frame->started) pthread_join(frame->thread, NULL);
+#endif
+
+    spng__free(ctx, frame->pixels);
+    spng__free(ctx, frame->strip.filtered);
+    spng__free(ctx, frame->strip.out);
+
+    memset(frame, 0, sizeof(struct spng__frame));
+}
+
+/* Waits for the oldest frame and writes it */
+static int write_next_frame(spng_ctx *ctx)
+{
+    struct spng__frame *frame = &ctx->frame_queue[ctx->frame_queue_head];
+
+#ifdef SPNG_MULTITHREADING
+    if(frame->started)
+    {
+        pthread_join(frame->thread, NULL);
+        frame->started = 0;
+    }
+#endif
+
+    int ret = frame->ret;
+
+    if(!ret) ret = write_frame(ctx, frame);
+
+    free_frame(ctx, frame);
+
+    ctx->frame_queue_head = (ctx->frame_queue_head + 1) % ctx->frame_queue_size;
+    ctx->frame_queue_len--;
+
+    return ret;
+}
+
+static int queue_frame(spng_ctx *ctx, const struct spng__frame *frame)
+{
+    int ret;
+
+    if(ctx->frame_queue_len == ctx->frame_queue_size)
+    {
+        ret = write_next_frame(ctx);
+        if(ret) return ret;
+    }
+
+    struct spng__frame *queued = &ctx->frame_queue[(ctx->frame_queue_head + ctx->frame_queue_len) % ctx->frame_queue_size];
+
+    *queued = *frame;
+    ctx->frame_queue_len++;
+
+#ifdef SPNG_MULTITHREADING
+    if(ctx->frame_queue_size > 1 && !pthread_create(&queued->thread, NULL, frame_worker, queued))
+    {
+        queued->started = 1;
+        return 0;
+    }
+#endif
+
+    queued->ret = compress_frame(ctx, queued);
+
+    return queued->ret;
+}
+
+static void free_frame_queue(spng_ctx *ctx)
+{
+    uint32_t i;
+
+    for(i=0; i < ctx->frame_queue_size; i++) free_frame(ctx, &ctx->frame_queue[i]);
+
+    spng__free(ctx, ctx->frame_queue);
+
+    ctx->frame_queue = NULL;
+    ctx->frame_queue_head = 0;
+    ctx->frame_queue_len = 0;
+    ctx->frame_queue_size = 0;
+}
+
+/* Chooses the frame's area and blend_op and the previous frame's dispose_op */
+static int make_frame(spng_ctx *ctx, const unsigned char *img, struct spng__frame *frame)
+{
+    const struct spng_ihdr *ihdr = &ctx->ihdr;
+    struct spng_fctl *fctl = &frame->fctl;
+    struct spng_fctl *prev = NULL;
+    const struct spng_fctl *clear = NULL;
+    uint32_t y;
+
+    frame->ctx = ctx;
+
+    fctl->delay_num = ctx->next_fctl.delay_num;
+    fctl->delay_den = ctx->next_fctl.delay_den;
+
+    if(ctx->frame_index)
+    {
+        prev = &ctx->frame_queue[(ctx->frame_queue_head + ctx->frame_queue_len - 1) % ctx->frame_queue_size].fctl;
+
+        struct spng_fctl area, cleared;
+
+        diff_frame(ctx, img, NULL, &area);
+
+        if(has_alpha(ihdr) && area.height)
+        {
+            diff_frame(ctx, img, prev, &cleared);
+
+            if((uint64_t)cleared.width * cleared.height < (uint64_t)area.width * area.height)
+            {
+                prev->dispose_op = SPNG_DISPOSE_OP_BACKGROUND;
+                clear = prev;
+                area = cleared;
+            }
+        }
+
+        /* Unchanged frames still need a pixel */
+        if(!area.height)
+        {
+            area.width = 1;
+            area.height = 1;
+        }
+
+        fctl->x_offset = area.x_offset;
+        fctl->y_offset = area.y_offset;
+        fctl->width = area.width;
+        fctl->height = area.height;
+    }
+    else
+    {
+        fctl->width = ihdr->width;
+        fctl->height = ihdr->height;
+    }
+
+    const size_t x_bytes = (size_t)fctl->x_offset * ctx->bytes_per_pixel;
+    const unsigned bits = ihdr->bit_depth * num_channels(ihdr);
+    const size_t image_offset = (size_t)fctl->y_offset * ctx->image_width + (bits >= 8 ? x_bytes : fctl->x_offset / (8 / bits));
+
+    frame->row_width = ((size_t)fctl->width * bits + 7) / 8;
+    frame->pixels = spng__malloc(ctx, frame->row_width * fctl->height);
+    if(frame->pixels == NULL) return SPNG_EMEM;
+
+    if(ctx->frame_index && has_alpha(ihdr))
+    {
+        fctl->blend_op = SPNG_BLEND_OP_OVER;
+
+        if(make_over_frame(ctx, img, clear, frame)) fctl->blend_op = SPNG_BLEND_OP_SOURCE;
+    }
+
+    for(y=0; y < fctl->height && fctl->blend_op == SPNG_BLEND_OP_SOURCE; y++)
+    {
+        memcpy(frame->pixels + y * frame->row_width, img + image_offset + y * ctx->image_width, frame->row_width);
+    }
+
+    /* The canvas after this frame is the image */
+    if(clear != NULL)
+    {
+        for(y=clear->y_offset; y < clear->y_offset + clear->height; y++)
+        {
+            memset(ctx->frame_buf + y * ctx->image_width + (size_t)clear->x_offset * ctx->bytes_per_pixel, 0, (size_t)clear->width * ctx->bytes_per_pixel);
+        }
+    }
+
+    for(y=0; y < fctl->height; y++)
+    {
+        size_t offset = image_offset + y * ctx->image_width;
+
+        memcpy(ctx->frame_buf + offset, img + offset, frame->row_width);
+    }
+
+    return 0;
+}
+
+/* Filter and compression options that depend on the image */
+static void init_filter_choice(spng_ctx *ctx)
+{
+    const struct spng_ihdr *ihdr = &ctx->ihdr;
+    struct encode_flags *encode_flags = &ctx->encode_flags;
+
+    if(ihdr->bit_depth < 8) ctx->bytes_per_pixel = 1;
+    else ctx->bytes_per_pixel = num_channels(ihdr) * (ihdr->bit_depth / 8);
+
+    if(spng__optimize(SPNG_FILTER_CHOICE))
+    {
+        /* Filtering would make no difference */
+        if(!ctx->image_options.compression_level)
+        {
+            encode_flags->filter_choice = SPNG_DISABLE_FILTERING;
+        }
+
+        /* The fast backend is tuned for Sub and Up, also the cheapest pair to evaluate */
+        if(ctx->deflate_backend == SPNG_DEFLATE_FAST)
+        {
+            encode_flags->filter_choice = SPNG_FILTER_CHOICE_SUB | SPNG_FILTER_CHOICE_UP;
+        }
+
+        /* Palette indices and low bit-depth images do not benefit from filtering */
+        if(ihdr->color_type == SPNG_COLOR_TYPE_INDEXED || ihdr->bit_depth < 8)
+        {
+            encode_flags->filter_choice = SPNG_DISABLE_FILTERING;
+        }
+    }
+
+    /* This is technically the same as disabling filtering */
+    if(encode_flags->filter_choice == SPNG_FILTER_CHOICE_NONE)
+    {
+        encode_flags->filter_choice = SPNG_DISABLE_FILTERING;
+    }
+
+    if(!encode_flags->filter_choice && spng__optimize(SPNG_IMG_COMPRESSION_STRATEGY))
+    {
+        ctx->image_options.strategy = Z_DEFAULT_STRATEGY;
+    }
+}
+
+int spng_encode_image(spng_ctx *ctx, const void *img, size_t len, int fmt, int flags)
+{
+    if(ctx == NULL) return 1;
+    if(!ctx->state) return SPNG_EBADSTATE;
+    if(!ctx->encode_only) return SPNG_ECTXTYPE;
+    if(!ctx->stored.ihdr) return SPNG_ENOIHDR;
+    if( !(fmt == SPNG_FMT_PNG || fmt == SPNG_FMT_RAW) ) return SPNG_EFMT;
+    if(ctx->stored.actl) return SPNG_EOPSTATE; /* use spng_encode_frame() */
+
+    int ret = 0;
+    const struct spng_ihdr *ihdr = &ctx->ihdr;
+    struct encode_flags *encode_flags = &ctx->encode_flags;
+
+    if(ihdr->color_type == SPNG_COLOR_TYPE_INDEXED && !ctx->stored.plte) return SPNG_ENOPLTE;
+
+    ret = calculate_image_width(ihdr, fmt, &ctx->image_width);
+    if(ret) return encode_err(ctx, ret);
+
+    if(ctx->image_width > SIZE_MAX / ihdr->height) ctx->image_size = 0; /* overflow */
+    else ctx->image_size = ctx->image_width * ihdr->height;
+
+    if( !(flags & SPNG_ENCODE_PROGRESSIVE) )
+    {
+        if(img == NULL) return 1;
+        if(!ctx->image_size) return SPNG_EOVERFLOW;
+        if(len != ctx->image_size) return SPNG_EBUFSIZ;
+    }
+
+    ret = spng_encode_chunks(ctx);
+    if(ret) return encode_err(ctx, ret);
+
+    ret = calculate_subimages(ctx);
+    if(ret) return encode_err(ctx, ret);
+
+    init_filter_choice(ctx);
+
+    int use_strips = 0;
+
+#if !defined(SPNG_USE_MINIZ)
+    if((ctx->encode_threads || ctx->deflate_backend || ctx->restart_strips) &&
+       !ihdr->interlace_method && !(flags & SPNG_ENCODE_PROGRESSIVE)) use_strips = 1;
+#endif
+
+    if(!use_strips)
+    {
+        ret = spng__deflate_init(ctx, &ctx->image_options);
+        if(ret) return encode_err(ctx, ret);
+    }
+
+    size_t scanline_buf_size = ctx->subimage[ctx->widest_pass].scanline_width;
+
+    scanline_buf_size += 32;
+
+    if(scanline_buf_size < 32) return SPNG_EOVERFLOW;
+
+    ctx->scanline_buf = spng__reuse(ctx, ctx->scanline_buf, &ctx->scanline_buf_size, scanline_buf_size);
+    ctx->prev_scanline_buf = spng__reuse(ctx, ctx->prev_scanline_buf, &ctx->prev_scanline_buf_size, scanline_buf_size);
+
+    if(ctx->scanline_buf == NULL || ctx->prev_scanline_buf == NULL) return encode_err(ctx, SPNG_EMEM);
+
+    /* Maintain alignment for pixels, filter at [-1] */
+    ctx->scanline = ctx->scanline_buf + 16;
+    ctx->prev_scanline = ctx->prev_scanline_buf + 16;
+
+    if(encode_flags->filter_choice)
+    {/* Holds a scanline for each filter type */
+        if(scanline_buf_size > SIZE_MAX / 4) return SPNG_EOVERFLOW;
+
+        ctx->filtered_scanline_buf = spng__reuse(ctx, ctx->filtered_scanline_buf, &ctx->filtered_scanline_buf_size, scanline_buf_size * 4);
+        if(ctx->filtered_scanline_buf == NULL) return encode_err(ctx, SPNG_EMEM);
+
+        ctx->filtered_scanline = ctx->filtered_scanline_buf + 16;
+    }
+
+    struct spng_subimage *sub = ctx->subimage;
+    struct spng_row_info *ri = &ctx->row_info;
+
+    ctx->fmt = fmt;
+
+    z_stream *zstream = &ctx->zstream;
+    zstream->avail_out = SPNG_WRITE_SIZE;
+
+    ret = write_header(ctx, type_idat, zstream->avail_out, &zstream->next_out);
+    if(ret) return encode_err(ctx, ret);
+
+    if(ihdr->interlace_method) encode_flags->interlace = 1;
+
+    if(fmt & (SPNG_FMT_PNG | SPNG_FMT_RAW) ) encode_flags->same_layout = 1;
+
+    if(ihdr->bit_depth == 16 && fmt != SPNG_FMT_RAW) encode_flags->to_bigendian = 1;
+
+    if(flags & SPNG_ENCODE_FINALIZE) encode_flags->finalize = 1;
+
+    while(!sub[ri->pass].width || !sub[ri->pass].height) ri->pass++;
+
+    if(encode_flags->interlace) ri->row_num = adam7_y_start[ri->pass];
+
+    ctx->pixel_size = 4; /* SPNG_FMT_RGBA8 */
+
+    if(fmt == SPNG_FMT_RGBA16) ctx->pixel_size = 8;
+    else if(fmt == SPNG_FMT_RGB8) ctx->pixel_size = 3;
+    else if(fmt == SPNG_FMT_G8) ctx->pixel_size = 1;
+    else if(fmt == SPNG_FMT_GA8) ctx->pixel_size = 2;
+    else if(fmt & (SPNG_FMT_PNG | SPNG_FMT_RAW)) ctx->pixel_size = ctx->bytes_per_pixel;
+
+    ctx->state = SPNG_STATE_ENCODE_INIT;
+
+    if(flags & SPNG_ENCODE_PROGRESSIVE)
+    {
+        encode_flags->progressive = 1;
+
+        return 0;
+    }
+
+    if(use_strips)
+    {
+        ret = encode_strips(ctx, img);
+        if(ret) return encode_err(ctx, ret);
+
+        ctx->state = SPNG_STATE_EOI;
+
+        if(encode_flags->finalize)
+        {
+            ret = spng_encode_chunks(ctx);
+            if(ret) return encode_err(ctx, ret);
+        }
+
+        return 0;
+    }
+
+    do
+    {
+        size_t ioffset = ri->row_num * ctx->image_width;
+
+        ret = encode_row(ctx, (unsigned char*)img + ioffset, ctx->image_width);
+
+    }while(!ret);
+
+    if(ret != SPNG_EOI) return encode_err(ctx, ret);
+
+    return 0;
+}
+
+int spng_encode_frame(spng_ctx *ctx, const void *img, size_t len, int fmt, int flags)
+{
+    if(ctx == NULL || img == NULL) return 1;
+    if(!ctx->state) return SPNG_EBADSTATE;
+    if(!ctx->encode_only) return SPNG_ECTXTYPE;
+    if(!ctx->stored.ihdr) return SPNG_ENOIHDR;
+    if( !(fmt == SPNG_FMT_PNG || fmt == SPNG_FMT_RAW) ) return SPNG_EFMT;
+    if(flags & SPNG_ENCODE_PROGRESSIVE) return SPNG_EFLAGS;
+    if(!ctx->stored.actl || ctx->ihdr.interlace_method) return SPNG_EOPSTATE;
+
+    int ret;
+    const struct spng_ihdr *ihdr = &ctx->ihdr;
+
+    if(!ctx->frame_index)
+    {
+        if(ctx->state >= SPNG_STATE_ENCODE_INIT) return SPNG_EOPSTATE;
+        if(ihdr->color_type == SPNG_COLOR_TYPE_INDEXED && !ctx->stored.plte) return SPNG_ENOPLTE;
+
+        ret = calculate_image_width(ihdr, fmt, &ctx->image_width);
+        if(ret) return encode_err(ctx, ret);
+
+        if(ctx->image_width > SIZE_MAX / ihdr->height) ctx->image_size = 0; /* overflow */
+        else ctx->image_size = ctx->image_width * ihdr->height;
+
+        if(!ctx->image_size) return SPNG_EOVERFLOW;
+        if(len != ctx->image_size) return SPNG_EBUFSIZ;
+
+        ret = spng_encode_chunks(ctx);
+        if(ret) return encode_err(ctx, ret);
+
+        ret = calculate_subimages(ctx);
+        if(ret) return encode_err(ctx, ret);
+
+        init_filter_choice(ctx);
+
+        if(ihdr->bit_depth == 16 && fmt != SPNG_FMT_RAW) ctx->encode_flags.to_bigendian = 1;
+
+        ctx->frame_queue_size = 1;
+
+#ifdef SPNG_MULTITHREADING
+        if(ctx->encode_threads > 1) ctx->frame_queue_size = ctx->encode_threads + 1;
+#endif
+
+        ctx->frame_queue = spng__calloc(ctx, ctx->frame_queue_size, sizeof(struct spng__frame));
+        ctx->frame_buf = spng__reuse(ctx, ctx->frame_buf, &ctx->frame_buf_size, ctx->image_size);
+
+        if(ctx->frame_queue == NULL || ctx->frame_buf == NULL) return encode_err(ctx, SPNG_EMEM);
+
+        ctx->fmt = fmt;
+        ctx->state = SPNG_STATE_ENCODE_INIT;
+    }
+    else
+    {
+        if(ctx->state != SPNG_STATE_ENCODE_INIT) return SPNG_EOPSTATE;
+        if(fmt != (int)ctx->fmt) return SPNG_EOPSTATE;
+        if(len != ctx->image_size) return SPNG_EBUFSIZ;
+    }
+
+    struct spng__frame frame = {0};
+
+    ret = make_frame(ctx, img, &frame);
+    if(ret)
+    {
+        spng__free(ctx, frame.pixels);
+        return encode_err(ctx, ret);
+    }
+
+    ret = queue_frame(ctx, &frame);
+    if(ret) return encode_err(ctx, ret);
+
+    ctx->frame_index++;
+
+    if(ctx->frame_index < ctx->actl.num_frames) return 0;
+
+    while(ctx->frame_queue_len)
+    {
+        ret = write_next_frame(ctx);
+        if(ret) return encode_err(ctx, ret);
+    }
+
+    ctx->state = SPNG_STATE_EOI;
+
+    if(flags & SPNG_ENCODE_FINALIZE)
+    {
+        ret = spng_encode_chunks(ctx);
+        if(ret) return encode_err(ctx, ret);
+    }
+
+    return 0;
+}
+
+static const struct spng__zlib_options image_defaults =
+{
+    .compression_level = Z_DEFAULT_COMPRESSION,
+    .window_bits = 15,
+    .mem_level = 8,
+    .strategy = Z_FILTERED,
+    .data_type = 0 /* Z_BINARY */
+};
+
+static const struct spng__zlib_options text_defaults =
+{
+    .compression_level = Z_DEFAULT_COMPRESSION,
+    .window_bits = 15,
+    .mem_level = 8,
+    .strategy = Z_DEFAULT_STRATEGY,
+    .data_type = 1 /* Z_TEXT */
+};
+
+spng_ctx *spng_ctx_new(int flags)
+{
+    struct spng_alloc alloc =
+    {
+        .malloc_fn = malloc,
+        .realloc_fn = realloc,
+        .calloc_fn = calloc,
+        .free_fn = free
+    };
+
+    return spng_ctx_new2(&alloc, flags);
+}
+
+/* Returns the highest SIMD level supported by the CPU,
+   the SPNG_SIMD environment variable can lower it to compare code paths. */
+static int get_simd_level(void)
+{
+#if defined(SPNG_DISABLE_OPT)
+    return SPNG__SIMD_NONE;
+#else
+    int level = SPNG__SIMD_BASE;
+
+#if defined(SPNG_X86_AVX)
+    level = get_x86_simd_level();
+#endif
+
+    const char *env = getenv("SPNG_SIMD");
+    if(env == NULL) return level;
+
+    int max_level = level;
+
+    if(!strcmp(env, "none")) max_level = SPNG__SIMD_NONE;
+    else if(!strcmp(env, "sse") || !strcmp(env, "neon")) max_level = SPNG__SIMD_BASE;
+    else if(!strcmp(env, "avx2")) max_level = SPNG__SIMD_AVX2;
+    else if(!strcmp(env, "avx512")) max_level = SPNG__SIMD_AVX512;
+
+    return level < max_level ? level : max_level;
+#endif
+}
+
+/* Hardware CRC32 follows the SIMD level, SPNG_SIMD=none selects zlib's crc32() */
+static int get_crc_level(int simd_level)
+{
+#if defined(SPNG_X86_AVX)
+    if(simd_level == SPNG__SIMD_NONE) return SPNG__CRC_ZLIB;
+
+    return get_x86_crc_level(simd_level);
+#elif defined(SPNG_ARM_CRC32)
+    return simd_level ? SPNG__CRC_HW : SPNG__CRC_ZLIB;
+#else
+    (void)simd_level;
+    return SPNG__CRC_ZLIB;
+#endif
+}
+
+spng_ctx *spng_ctx_new2(struct spng_alloc *alloc, int flags)
+{
+    if(alloc == NULL) return NULL;
+    if(flags != (flags & SPNG__CTX_FLAGS_ALL)) return NULL;
+
+    if(alloc->malloc_fn == NULL) return NULL;
+    if(alloc->realloc_fn == NULL) return NULL;
+    if(alloc->calloc_fn == NULL) return NULL;
+    if(alloc->free_fn == NULL) return NULL;
+
+    spng_ctx *ctx = alloc->calloc_fn(1, sizeof(spng_ctx));
+    if(ctx == NULL) return NULL;
+
+    ctx->alloc = *alloc;
+
+    ctx->max_width = spng_u32max;
+    ctx->max_height = spng_u32max;
+
+    ctx->max_chunk_size = spng_u32max;
+    ctx->chunk_cache_limit = SIZE_MAX;
+    ctx->chunk_count_limit = SPNG_MAX_CHUNK_COUNT;
+
+    ctx->state = SPNG_STATE_INIT;
+
+    ctx->crc_action_critical = SPNG_CRC_ERROR;
+    ctx->crc_action_ancillary = SPNG_CRC_DISCARD;
+
+    ctx->image_options = image_defaults;
+    ctx->text_options = text_defaults;
+
+    ctx->optimize_option = ~0;
+    ctx->encode_flags.filter_choice = SPNG_FILTER_CHOICE_ALL;
+
+    ctx->flags = flags;
+
+    if(flags & SPNG_CTX_ENCODER) ctx->encode_only = 1;
+
+    ctx->simd_level = get_simd_level();
+    ctx->crc_level = get_crc_level(ctx->simd_level);
+
+    return ctx;
+}
+
+/* Free chunk data owned by the context */
+static void free_chunk_data(spng_ctx *ctx)
+{
+    if(!ctx->user.exif) spng__free(ctx, ctx->exif.data);
+
+    if(!ctx->user.iccp) spng__free(ctx, ctx->iccp.profile);
+    spng__free(ctx, ctx->iccp_zdata.copy);
+
+    uint32_t i;
+
+    if(ctx->splt_list != NULL && !ctx->user.splt)
+    {
+        for(i=0; i < ctx->n_splt; i++)
+        {
+            spng__free(ctx, ctx->splt_list[i].entries);
+        }
+        spng__free(ctx, ctx->splt_list);
+    }
+
+    if(ctx->text_list != NULL)
+    {
+        for(i=0; i< ctx->n_text; i++)
+        {
+            if(ctx->user.text) break;
+
+            spng__free(ctx, ctx->text_list[i].keyword);
+            if(ctx->text_list[i].compression_flag) spng__free(ctx, ctx->text_list[i].text);
+            spng__free(ctx, ctx->text_list[i].zdata.copy);
+        }
+        spng__free(ctx, ctx->text_list);
+    }
+
+    if(ctx->chunk_list != NULL && !ctx->user.unknown)
+    {
+        for(i=0; i< ctx->n_chunks; i++)
+        {
+            spng__free(ctx, ctx->chunk_list[i].data);
+        }
+        spng__free(ctx, ctx->chunk_list);
+    }
+}
+
+void spng_ctx_free(spng_ctx *ctx)
+{
+    if(ctx == NULL) return;
+
+    spng__free(ctx, ctx->stream_buf);
+    spng__free(ctx, ctx->feed_buf);
+
+    free_chunk_data(ctx);
+
+    if(ctx->deflate) deflateEnd(&ctx->zstream);
+    else inflateEnd(&ctx->zstream);
+
+    inflateEnd(&ctx->text_zstream);
+
+    if(!ctx->user_owns_out_png) spng__free(ctx, ctx->out_png);
+
+    spng__free(ctx, ctx->gamma_lut16);
+
+    spng__free(ctx, ctx->row_buf);
+    spng__free(ctx, ctx->scanline_buf);
+    spng__free(ctx, ctx->prev_scanline_buf);
+    spng__free(ctx, ctx->filtered_scanline_buf);
+    spng__free(ctx, ctx->idat_buf);
+    spng__free(ctx, ctx->downscale_buf);
+    spng__free(ctx, ctx->index_buf);
+    spng__free(ctx, ctx->frame_buf);
+    spng__free(ctx, ctx->dispose_buf);
+    spng__free(ctx, ctx->keep_chunks);
+
+    free_frame_queue(ctx);
+
+#if defined(SPNG_USE_LIBDEFLATE) && !defined(SPNG_USE_MINIZ)
+    if(ctx->decompressor != NULL) libdeflate_free_decompressor(ctx->decompressor);
+#endif
+
+    spng_free_fn *free_fn = ctx->alloc.free_fn;
+
+    memset(ctx, 0, sizeof(spng_ctx));
+
+    free_fn(ctx);
+}
+
+int spng_ctx_reset(spng_ctx *ctx)
+{
+    if(ctx == NULL) return 1;
+
+    free_chunk_data(ctx);
+    free_frame_queue(ctx);
+
+    /* Only the inflate state is reused */
+    if(ctx->deflate)
+    {
+        deflateEnd(&ctx->zstream);
+        memset(&ctx->zstream, 0, sizeof(z_stream));
+        ctx->deflate = 0;
+    }
+
+    if(ctx->user_owns_out_png)
+    {
+        ctx->out_png = NULL;
+        ctx->out_png_size = 0;
+    }
+
+    /* Options that weren't set explicitly revert to their defaults */
+    struct spng__zlib_options image_options = ctx->image_options;
+    struct spng__zlib_options text_options = ctx->text_options;
+    uint32_t optimize_option = ctx->optimize_option;
+
+    if(spng__optimize(SPNG_IMG_COMPRESSION_LEVEL)) image_options.compression_level = image_defaults.compression_level;
+    if(spng__optimize(SPNG_IMG_WINDOW_BITS)) image_options.window_bits = image_defaults.window_bits;
+    if(spng__optimize(SPNG_IMG_MEM_LEVEL)) image_options.mem_level = image_defaults.mem_level;
+    if(spng__optimize(SPNG_IMG_COMPRESSION_STRATEGY)) image_options.strategy = image_defaults.strategy;
+
+    if(spng__optimize(SPNG_TEXT_COMPRESSION_LEVEL)) text_options.compression_level = text_defaults.compression_level;
+    if(spng__optimize(SPNG_TEXT_WINDOW_BITS)) text_options.window_bits = text_defaults.window_bits;
+    if(spng__optimize(SPNG_TEXT_MEM_LEVEL)) text_options.mem_level = text_defaults.mem_level;
+    if(spng__optimize(SPNG_TEXT_COMPRESSION_STRATEGY)) text_options.strategy = text_defaults.strategy;
+
+    int filter_choice = ctx->encode_flags.filter_choice;
+    if(spng__optimize(SPNG_FILTER_CHOICE)) filter_choice = SPNG_FILTER_CHOICE_ALL;
+
+    /* Everything else is reset to the state after spng_ctx_new2() */
+    spng_ctx old = *ctx;
+
+    memset(ctx, 0, sizeof(spng_ctx));
+
+    ctx->alloc = old.alloc;
+    ctx->flags = old.flags;
+    ctx->encode_only = old.encode_only;
+
+    ctx->max_width = old.max_width;
+    ctx->max_height = old.max_height;
+
+    ctx->max_chunk_size = old.max_chunk_size;
+    ctx->chunk_cache_limit = old.chunk_cache_limit;
+    ctx->chunk_count_limit = old.chunk_count_limit;
+
+    ctx->crc_action_critical = old.crc_action_critical;
+    ctx->crc_action_ancillary = old.crc_action_ancillary;
+
+    ctx->image_options = image_options;
+    ctx->text_options = text_options;
+    ctx->optimize_option = optimize_option;
+    ctx->encode_flags.filter_choice = filter_choice;
+
+    ctx->keep_unknown = old.keep_unknown;
+    ctx->filter_chunks = old.filter_chunks;
+    ctx->keep_chunks = old.keep_chunks;
+    ctx->n_keep_chunks = old.n_keep_chunks;
+    ctx->encode_threads = old.encode_threads;
+    ctx->decode_threads = old.decode_threads;
+    ctx->restart_strips = old.restart_strips;
+    ctx->inflate_backend = old.inflate_backend;
+    ctx->deflate_backend = old.deflate_backend;
+    ctx->nontemporal_stores = old.nontemporal_stores;
+    ctx->downscale_shift = old.downscale_shift;
+    ctx->downscale_mode = old.downscale_mode;
+    ctx->index_interval = old.index_interval;
+    ctx->simd_level = old.simd_level;
+    ctx->crc_level = old.crc_level;
+
+    /* Buffers */
+    ctx->zstream = old.zstream;
+    ctx->inflate = old.inflate;
+    ctx->text_zstream = old.text_zstream;
+
+    ctx->stream_buf = old.stream_buf;
+    ctx->stream_buf_size = old.stream_buf_size;
+    ctx->feed_buf = old.feed_buf;
+    ctx->feed_buf_size = old.feed_buf_size;
+
+    ctx->out_png = old.out_png;
+    ctx->out_png_size = old.out_png_size;
+
+    ctx->gamma_lut16 = old.gamma_lut16;
+
+    ctx->scanline_buf = old.scanline_buf;
+    ctx->scanline_buf_size = old.scanline_buf_size;
+    ctx->prev_scanline_buf = old.prev_scanline_buf;
+    ctx->prev_scanline_buf_size = old.prev_scanline_buf_size;
+    ctx->row_buf = old.row_buf;
+    ctx->row_buf_size = old.row_buf_size;
+    ctx->filtered_scanline_buf = old.filtered_scanline_buf;
+    ctx->filtered_scanline_buf_size = old.filtered_scanline_buf_size;
+
+    ctx->idat_buf = old.idat_buf;
+    ctx->idat_buf_size = old.idat_buf_size;
+    ctx->downscale_buf = old.downscale_buf;
+    ctx->downscale_buf_size = old.downscale_buf_size;
+    ctx->index_buf = old.index_buf;
+    ctx->index_buf_size = old.index_buf_size;
+    ctx->frame_buf = old.frame_buf;
+    ctx->frame_buf_size = old.frame_buf_size;
+    ctx->dispose_buf = old.dispose_buf;
+    ctx->dispose_buf_size = old.dispose_buf_size;
+#if defined(SPNG_USE_LIBDEFLATE) && !defined(SPNG_USE_MINIZ)
+    ctx->decompressor = old.decompressor;
+#endif
+
+    ctx->state = SPNG_STATE_INIT;
+
+    if(old.internal_buffer)
+    {
+        ctx->internal_buffer = 1;
+        ctx->write_ptr = ctx->out_png;
+        ctx->state = SPNG_STATE_OUTPUT;
+    }
+
+    return 0;
+}
+
+static int buffer_read_fn(spng_ctx *ctx, void *user, void *data, size_t n)
+{
+    if(n > ctx->bytes_left) return SPNG_IO_EOF;
+
+    (void)user;
+    (void)data;
+    ctx->data = ctx->data + ctx->last_read_size;
+
+    ctx->last_read_size = n;
+    ctx->bytes_left -= n;
+
+    return 0;
+}
+
+static int feed_read_fn(spng_ctx *ctx, void *user, void *data, size_t n)
+{
+    if(n > ctx->bytes_left) return ctx->feed_eof ? SPNG_IO_EOF : SPNG_EAGAIN;
+
+    return buffer_read_fn(ctx, user, data, n);
+}
+
+static int file_read_fn(spng_ctx *ctx, void *user, void *data, size_t n)
+{
+    FILE *file = user;
+    (void)ctx;
+
+    if(fread(data, n, 1, file) != 1)
+    {
+        if(feof(file)) return SPNG_IO_EOF;
+        else return SPNG_IO_ERROR;
+    }
+
+    return 0;
+}
+
+static int file_write_fn(spng_ctx *ctx, void *user, void *data, size_t n)
+{
+    FILE *file = user;
+    (void)ctx;
+
+    if(fwrite(data, n, 1, file) != 1) return SPNG_IO_ERROR;
+
+    return 0;
+}
+
+int spng_set_png_buffer(spng_ctx *ctx, const void *buf, size_t size)
+{
+    if(ctx == NULL || buf == NULL) return 1;
+    if(!ctx->state) return SPNG_EBADSTATE;
+    if(ctx->encode_only) return SPNG_ECTXTYPE; /* not supported */
+
+    if(ctx->data != NULL) return SPNG_EBUF_SET;
+
+    ctx->data = buf;
+    ctx->png_base = buf;
+    ctx->data_size = size;
+    ctx->bytes_left = size;
+
+    ctx->read_fn = buffer_read_fn;
+
+    ctx->state = SPNG_STATE_INPUT;
+
+    return 0;
+}
+
+int spng_feed(spng_ctx *ctx, const void *data, size_t len)
+{
+    if(ctx == NULL || (data == NULL && len)) return 1;
+    if(!ctx->state) return SPNG_EBADSTATE;
+    if(ctx->encode_only) return SPNG_ECTXTYPE;
+
+    if(!ctx->feed)
+    {
+        if(ctx->data != NULL) return SPNG_EBUF_SET;
+
+        ctx->feed_buf = spng__reuse(ctx, ctx->feed_buf, &ctx->feed_buf_size, SPNG_READ_SIZE);
+        if(ctx->feed_buf == NULL) return SPNG_EMEM;
+
+        ctx->data = ctx->feed_buf;
+        ctx->read_fn = feed_read_fn;
+        ctx->feed = 1;
+
+        ctx->state = SPNG_STATE_INPUT;
+    }
+
+    if(ctx->feed_eof) return SPNG_EOPSTATE;
+
+    if(data == NULL) /* End of input */
+    {
+        ctx->feed_eof = 1;
+        return 0;
+    }
+
+    if(!len) return 0;
+
+    /* Unread image data given to zlib is kept along with the unread bytes */
+    const int inflate_input = ctx->state >= SPNG_STATE_DECODE_INIT && ctx->state < SPNG_STATE_EOI && ctx->zstream.avail_in;
+
+    size_t next = ctx->data + ctx->last_read_size - ctx->feed_buf;
+    size_t keep = inflate_input ? (size_t)(ctx->zstream.next_in - ctx->feed_buf) : next;
+    size_t used = next + ctx->bytes_left;
+
+    if(len > SIZE_MAX - used) return SPNG_EOVERFLOW;
+
+    /* Move the kept bytes to the start when that frees up at least half of the buffer */
+    if(keep && (keep >= used / 2 || ctx->feed_buf_size - used < len))
+    {
+        memmove(ctx->feed_buf, ctx->feed_buf + keep, used - keep);
+
+        next -= keep;
+        used -= keep;
+        keep = 0;
+    }
+
+    if(ctx->feed_buf_size - used < len)
+    {
+        size_t size = ctx->feed_buf_size > SIZE_MAX / 2 ? SIZE_MAX : ctx->feed_buf_size * 2;
+        if(size < used + len) size = used + len;
+
+        void *t = spng__realloc(ctx, ctx->feed_buf, size);
+        if(t == NULL) return SPNG_EMEM;
+
+        ctx->feed_buf = t;
+        ctx->feed_buf_size = size;
+    }
+
+    memcpy(ctx->feed_buf + used, data, len);
+
+    if(inflate_input) ctx->zstream.next_in = ctx->feed_buf + keep;
+
+    ctx->data = ctx->feed_buf + next;
+    ctx->last_read_size = 0;
+    ctx->bytes_left += len;
+
+    return 0;
+}
+
+int spng_set_png_stream(spng_ctx *ctx, spng_rw_fn *rw_func, void *user)
+{
+    if(ctx == NULL || rw_func == NULL) return 1;
+    if(!ctx->state) return SPNG_EBADSTATE;
+
+    /* SPNG_STATE_OUTPUT shares the same value */
+    if(ctx->state >= SPNG_STATE_INPUT) return SPNG_EBUF_SET;
+
+    if(ctx->encode_only)
+    {
+        if(ctx->out_png != NULL) return SPNG_EBUF_SET;
+
+        ctx->write_fn = rw_func;
+        ctx->write_ptr = ctx->stream_buf;
+
+        ctx->state = SPNG_STATE_OUTPUT;
+    }
+    else
+    {
+        if(ctx->stream_buf == NULL) ctx->stream_buf = spng__malloc(ctx, SPNG_READ_SIZE);
+        if(ctx->stream_buf == NULL) return SPNG_EMEM;
+
+        ctx->read_fn = rw_func;
+        ctx->data = ctx->stream_buf;
+        ctx->data_size = SPNG_READ_SIZE;
+
+        ctx->state = SPNG_STATE_INPUT;
+    }
+
+    ctx->stream_user_ptr = user;
+
+    ctx->streaming = 1;
+
+    return 0;
+}
+
+int spng_set_png_file(spng_ctx *ctx, FILE *file)
+{
+    if(file == NULL) return 1;
+
+    if(ctx->encode_only) return spng_set_png_stream(ctx, file_write_fn, file);
+
+    return spng_set_png_stream(ctx, file_read_fn, file);
+}
+
+void *spng_get_png_buffer(spng_ctx *ctx, size_t *len, int *error)
+{
+    int tmp = 0;
+    error = error ? error : &tmp;
+    *error = 0;
+
+    if(ctx == NULL || !len) *error = SPNG_EINVAL;
+
+    if(*error) return NULL;
+
+    if(!ctx->encode_only) *error = SPNG_ECTXTYPE;
+    else if(!ctx->state) *error = SPNG_EBADSTATE;
+    else if(!ctx->internal_buffer) *error = SPNG_EOPSTATE;
+    else if(ctx->state < SPNG_STATE_EOI) *error = SPNG_EOPSTATE;
+    else if(ctx->state != SPNG_STATE_IEND) *error = SPNG_ENOTFINAL;
+
+    if(*error) return NULL;
+
+    ctx->user_owns_out_png = 1;
+
+    *len = ctx->bytes_encoded;
+
+    return ctx->out_png;
+}
+
+int spng_set_image_limits(spng_ctx *ctx, uint32_t width, uint32_t height)
+{
+    if(ctx == NULL) return 1;
+
+    if(width > spng_u32max || height > spng_u32max) return 1;
+
+    ctx->max_width = width;
+    ctx->max_height = height;
+
+    return 0;
+}
+
+int spng_get_image_limits(spng_ctx *ctx, uint32_t *width, uint32_t *height)
+{
+    if(ctx == NULL || width == NULL || height == NULL) return 1;
+
+    *width = ctx->max_width;
+    *height = ctx->max_height;
+
+    return 0;
+}
+
+int spng_set_crop(spng_ctx *ctx, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    if(ctx == NULL) return 1;
+    if(ctx->encode_only) return SPNG_ECTXTYPE;
+    if(ctx->state >= SPNG_STATE_DECODE_INIT) return SPNG_EOPSTATE;
+
+    if(!width != !height) return 1;
+    if(x > spng_u32max || y > spng_u32max || width > spng_u32max || height > spng_u32max) return 1;
+
+    ctx->crop_x = x;
+    ctx->crop_y = y;
+    ctx->crop_width = width;
+    ctx->crop_height = height;
+
+    return 0;
+}
+
+int spng_get_crop(spng_ctx *ctx, uint32_t *x, uint32_t *y, uint32_t *width, uint32_t *height)
+{
+    if(ctx == NULL || x == NULL || y == NULL || width == NULL || height == NULL) return 1;
+    if(ctx->encode_only) return SPNG_ECTXTYPE;
+
+    *x = ctx->crop_x;
+    *y = ctx->crop_y;
+    *width = ctx->crop_width;
+    *height = ctx->crop_height;
+
+    return 0;
+}
+
+int spng_set_chunk_limits(spng_ctx *ctx, size_t chunk_size, size_t cache_limit)
+{
+    if(ctx == NULL || chunk_size > spng_u32max || chunk_size > cache_limit) return 1;
+
+    ctx->max_chunk_size = chunk_size;
+
+    ctx->chunk_cache_limit = cache_limit;
+
+    return 0;
+}
+
+int spng_get_chunk_limits(spng_ctx *ctx, size_t *chunk_size, size_t *cache_limit)
+{
+    if(ctx == NULL || chunk_size == NULL || cache_limit == NULL) return 1;
+
+    *chunk_size = ctx->max_chunk_size;
+
+    *cache_limit = ctx->chunk_cache_limit;
+
+    return 0;
+}
+
+int spng_set_crc_action(spng_ctx *ctx, int critical, int ancillary)
+{
+    if(ctx == NULL) return 1;
+    if(ctx->encode_only) return SPNG_ECTXTYPE;
+
+    if(critical > 2 || critical < 0) return 1;
+    if(ancillary > 2 || ancillary < 0) return 1;
+
+    if(critical == SPNG_CRC_DISCARD) return 1;
+
+    ctx->crc_action_critical = critical;
+    ctx->crc_action_ancillary = ancillary;
+
+    return 0;
+}
+
+int spng_set_chunk_filter(spng_ctx *ctx, const char *const *types, uint32_t n_types)
+{
+    if(ctx == NULL) return 1;
+    if(ctx->encode_only) return SPNG_ECTXTYPE;
+    if(!ctx->state) return SPNG_EBADSTATE;
+    if(ctx->state > SPNG_STATE_INPUT) return SPNG_EOPSTATE; /* chunks were read */
+
+    uint32_t i, *keep_chunks = NULL;
+
+    if(types != NULL)
+    {
+        for(i=0; i < n_types; i++)
+        {
+            if(types[i] == NULL || strlen(types[i]) != 4) return SPNG_ECHUNK_TYPE;
+        }
+
+        if(n_types)
+        {
+            if(sizeof(uint32_t) > SIZE_MAX / n_types) return SPNG_EOVERFLOW;
+
+            keep_chunks = spng__malloc(ctx, n_types * sizeof(uint32_t));
+            if(keep_chunks == NULL) return SPNG_EMEM;
+
+            for(i=0; i < n_types; i++) keep_chunks[i] = read_u32(types[i]);
+        }
+    }
+    else n_types = 0;
+
+    spng__free(ctx, ctx->keep_chunks);
+
+    ctx->keep_chunks = keep_chunks;
+    ctx->n_keep_chunks = n_types;
+    ctx->filter_chunks = types != NULL;
+
+    return 0;
+}
+
+int spng_set_option(spng_ctx *ctx, enum spng_option option, int value)
+{
+    if(ctx == NULL) return 1;
+    if(!ctx->state) return SPNG_EBADSTATE;
+
+    switch(option)
+    {
+        case SPNG_KEEP_UNKNOWN_CHUNKS:
+        {
+            ctx->keep_unknown = value ? 1 : 0;
+            break;
+        }
+        case SPNG_IMG_COMPRESSION_LEVEL:
+        {
+            ctx->image_options.compression_level = value;
+            break;
+        }
+        case SPNG_IMG_WINDOW_BITS:
+        {
+            ctx->image_options.window_bits = value;
+            break;
+        }
+        case SPNG_IMG_MEM_LEVEL:
+        {
+            ctx->image_options.mem_level = value;
+            break;
+        }
+        case SPNG_IMG_COMPRESSION_STRATEGY:
+        {
+            ctx->image_options.strategy = value;
+            break;
+        }
+        case SPNG_TEXT_COMPRESSION_LEVEL:
+        {
+            ctx->text_options.compression_level = value;
+            break;
+        }
+        case SPNG_TEXT_WINDOW_BITS:
+        {
+            ctx->text_options.window_bits = value;
+            break;
+        }
+        case SPNG_TEXT_MEM_LEVEL:
+        {
+            ctx->text_options.mem_level = value;
+            break;
+        }
+        case SPNG_TEXT_COMPRESSION_STRATEGY:
+        {
+            ctx->text_options.strategy = value;
+            break;
+        }
+        case SPNG_FILTER_CHOICE:
+        {
+            if(value & ~SPNG_FILTER_CHOICE_ALL) return 1;
+            ctx->encode_flags.filter_choice = value;
+            break;
+        }
+        case SPNG_CHUNK_COUNT_LIMIT:
+        {
+            if(value < 0) return 1;
+            if(value > (int)ctx->chunk_count_total) return 1;
+            ctx->chunk_count_limit = value;
+            break;
+        }
+        case SPNG_ENCODE_TO_BUFFER:
+        {
+            if(value < 0) return 1;
+            if(!ctx->encode_only) return SPNG_ECTXTYPE;
+            if(ctx->state >= SPNG_STATE_OUTPUT) return SPNG_EOPSTATE;
+
+            if(!value) break;
+
+            ctx->internal_buffer = 1;
+            ctx->state = SPNG_STATE_OUTPUT;
+
+            break;
+        }
+        case SPNG_DECODE_THREADS:
+        {
+            if(value < 0 || value > SPNG_MAX_THREADS) return SPNG_EINVAL;
+            if(ctx->encode_only) return SPNG_ECTXTYPE;
+
+            ctx->decode_threads = value;
+            break;
+        }
+        case SPNG_INFLATE_BACKEND:
+        {
+            if(ctx->encode_only) return SPNG_ECTXTYPE;
+            if(ctx->state >= SPNG_STATE_DECODE_INIT) return SPNG_EOPSTATE;
+
+            if(value == SPNG_INFLATE_STREAM || value == SPNG_INFLATE_ZLIB) ctx->inflate_backend = value;
+#if defined(SPNG_USE_LIBDEFLATE) && !defined(SPNG_USE_MINIZ)
+            else if(value == SPNG_INFLATE_LIBDEFLATE) ctx->inflate_backend = value;
+#endif
+#ifdef SPNG_INFLATE_SPECULATIVE_SUPPORTED
+            else if(value == SPNG_INFLATE_SPECULATIVE) ctx->inflate_backend = value;
+#endif
+            else return 1;
+
+            break;
+        }
+        case SPNG_NONTEMPORAL_STORES:
+        {
+            if(value < SPNG_NONTEMPORAL_OFF || value > SPNG_NONTEMPORAL_ALWAYS) return 1;
+            if(ctx->encode_only) return SPNG_ECTXTYPE;
+            if(ctx->state >= SPNG_STATE_DECODE_INIT) return SPNG_EOPSTATE;
+
+            ctx->nontemporal_stores = value;
+            break;
+        }
+        case SPNG_DOWNSCALE:
+        {
+            if(value != 1 && value != 2 && value != 4 && value != 8) return 1;
+            if(ctx->encode_only) return SPNG_ECTXTYPE;
+            if(ctx->state >= SPNG_STATE_DECODE_INIT) return SPNG_EOPSTATE;
+
+            ctx->downscale_shift = value == 8 ? 3 : value / 2;
+            break;
+        }
+        case SPNG_DOWNSCALE_MODE:
+        {
+            if(value & ~(SPNG_DOWNSCALE_LINEAR | SPNG_DOWNSCALE_PARTIAL_ADAM7)) return 1;
+            if(ctx->encode_only) return SPNG_ECTXTYPE;
+            if(ctx->state >= SPNG_STATE_DECODE_INIT) return SPNG_EOPSTATE;
+
+            ctx->downscale_mode = value;
+            break;
+        }
+        case SPNG_INDEX_INTERVAL:
+        {
+            if(value < 0) return 1;
+            if(ctx->encode_only) return SPNG_ECTXTYPE;
+            if(ctx->state >= SPNG_STATE_DECODE_INIT) return SPNG_EOPSTATE;
+#if !defined(SPNG_INFLATE_INDEX)
+            if(value) return 1;
+#endif
+            ctx->index_interval = value;
+            break;
+        }
+        case SPNG_ENCODE_THREADS:
+        {
+            if(value < 0 || value > SPNG_MAX_THREADS) return SPNG_EINVAL;
+            if(!ctx->encode_only) return SPNG_ECTXTYPE;
+            if(ctx->state >= SPNG_STATE_ENCODE_INIT) return SPNG_EOPSTATE;
+
+            ctx->encode_threads = value;
+            break;
+        }
+        case SPNG_RESTART_STRIPS:
+        {
+            if(value != 0 && value != 1) return 1;
+            if(!ctx->encode_only) return SPNG_ECTXTYPE;
+            if(ctx->state >= SPNG_STATE_ENCODE_INIT) return SPNG_EOPSTATE;
+#if defined(SPNG_USE_MINIZ)
+            if(value) return 1;
+#endif
+            ctx->restart_strips = value;
+            break;
+        }
+        case SPNG_DEFLATE_BACKEND:
+        {
+            if(!ctx->encode_only) return SPNG_ECTXTYPE;
+            if(ctx->state >= SPNG_STATE_ENCODE_INIT) return SPNG_EOPSTATE;
+
+            if(value == SPNG_DEFLATE_STREAM) ctx->deflate_backend = value;
+#if !defined(SPNG_USE_MINIZ)
+            else if(value == SPNG_DEFLATE_ZLIB) ctx->deflate_backend = value;
+#endif
+#if defined(SPNG_USE_LIBDEFLATE) && !defined(SPNG_USE_MINIZ)
+            else if(value == SPNG_DEFLATE_LIBDEFLATE) ctx->deflate_backend = value;
+#endif
+#if !defined(SPNG_USE_MINIZ)
+            else if(value == SPNG_DEFLATE_FAST) ctx->deflate_backend = value;
+#endif
+            else return 1;
+
+            break;
+        }
+        default: return 1;
+    }
+
+    /* Option can no longer be overriden by the library */
+    if(option < 32) ctx->optimize_option &= ~(1 << option);
+
+    return 0;
+}
+
+int spng_get_option(spng_ctx *ctx, enum spng_option option, int *value)
+{
+    if(ctx == NULL || value == NULL) return 1;
+    if(!ctx->state) return SPNG_EBADSTATE;
+
+    switch(option)
+    {
+        case SPNG_KEEP_UNKNOWN_CHUNKS:
+        {
+            *value = ctx->keep_unknown;
+            break;
+        }
+        case SPNG_IMG_COMPRESSION_LEVEL:
+        {
+            *value = ctx->image_options.compression_level;
+            break;
+        }
+            case SPNG_IMG_WINDOW_BITS:
+        {
+            *value = ctx->image_options.window_bits;
+            break;
+        }
+        case SPNG_IMG_MEM_LEVEL:
+        {
+            *value = ctx->image_options.mem_level;
+            break;
+        }
+        case SPNG_IMG_COMPRESSION_STRATEGY:
+        {
+            *value = ctx->image_options.strategy;
+            break;
+        }
+        case SPNG_TEXT_COMPRESSION_LEVEL:
+        {
+            *value = ctx->text_options.compression_level;
+            break;
+        }
+            case SPNG_TEXT_WINDOW_BITS:
+        {
+            *value = ctx->text_options.window_bits;
+            break;
+        }
+        case SPNG_TEXT_MEM_LEVEL:
+        {
+            *value = ctx->text_options.mem_level;
+            break;
+        }
+        case SPNG_TEXT_COMPRESSION_STRATEGY:
+        {
+            *value = ctx->text_options.strategy;
+            break;
+        }
+        case SPNG_FILTER_CHOICE:
+        {
+            *value = ctx->encode_flags.filter_choice;
+            break;
+        }
+        case SPNG_CHUNK_COUNT_LIMIT:
+        {
+            *value = ctx->chunk_count_limit;
+            break;
+        }
+        case SPNG_ENCODE_TO_BUFFER:
+        {
+            if(ctx->internal_buffer) *value = 1;
+            else *value = 0;
+
+            break;
+        }
+        case SPNG_ENCODE_THREADS:
+        {
+            *value = ctx->encode_threads;
+            break;
+        }
+        case SPNG_RESTART_STRIPS:
+        {
+            *value = ctx->restart_strips;
+            break;
+        }
+        case SPNG_DECODE_THREADS:
+        {
+            *value = ctx->decode_threads;
+            break;
+        }
+        case SPNG_INFLATE_BACKEND:
+        {
+            *value = ctx->inflate_backend;
+            break;
+        }
+        case SPNG_DEFLATE_BACKEND:
+        {
+            *value = ctx->deflate_backend;
+            break;
+        }
+        case SPNG_NONTEMPORAL_STORES:
+        {
+            *value = ctx->nontemporal_stores;
+            break;
+        }
+        case SPNG_DOWNSCALE:
+        {
+            *value = 1 << ctx->downscale_shift;
+            break;
+        }
+        case SPNG_DOWNSCALE_MODE:
+        {
+            *value = ctx->downscale_mode;
+            break;
+        }
+        case SPNG_INDEX_INTERVAL:
+        {
+            *value = ctx->index_interval;
+            break;
+        }
+        default: return 1;
+    }
+
+    return 0;
+}
+
+int spng_decoded_image_size(spng_ctx *ctx, int fmt, size_t *len)
+{
+    if(ctx == NULL || len == NULL) return 1;
+
+    int ret = read_chunks(ctx, 1);
+    if(ret) return ret;
+
+    ret = check_decode_fmt(&ctx->ihdr, fmt);
+    if(ret) return ret;
+
+    struct spng_ihdr out;
+
+    ret = output_ihdr(ctx, fmt, &out);
+    if(ret) return ret;
+
+    return calculate_image_size(&out, fmt, len);
+}
+
+int spng_get_index(spng_ctx *ctx, void *buf, size_t *len)
+{
+    if(ctx == NULL || len == NULL) return 1;
+    if(ctx->encode_only) return SPNG_ECTXTYPE;
+
+    /* Checkpoints are complete after the image is decoded */
+    if(!ctx->index_loaded && (!ctx->index_interval || ctx->state < SPNG_STATE_EOI)) return SPNG_EOPSTATE;
+
+    if(ctx->index_len > SIZE_MAX - SPNG_INDEX_HEADER_SIZE) return SPNG_EOVERFLOW;
+
+    size_t size = SPNG_INDEX_HEADER_SIZE + ctx->index_len;
+
+    if(buf == NULL)
+    {
+        *len = size;
+        return 0;
+    }
+
+    if(*len < size) return SPNG_EBUFSIZ;
+
+    unsigned char *data = buf;
+
+    data[0] = 1; /* version */
+    data[1] = ctx->ihdr.bit_depth;
+    data[2] = ctx->ihdr.color_type;
+    data[3] = 0;
+    write_u32(data + 4, ctx->ihdr.width);
+    write_u32(data + 8, ctx->ihdr.height);
+    write_u32(data + 12, ctx->index_span);
+    write_u32(data + 16, ctx->index_count);
+
+    if(ctx->index_len) memcpy(data + SPNG_INDEX_HEADER_SIZE, ctx->index_buf, ctx->index_len);
+
+    *len = size;
+
+    return 0;
+}
+
+int spng_set_index(spng_ctx *ctx, const void *buf, size_t len)
+{
+    if(ctx == NULL || buf == NULL) return 1;
+    if(ctx->encode_only) return SPNG_ECTXTYPE;
+
+    int ret = read_chunks(ctx, 1);
+    if(ret) return ret;
+
+    if(ctx->state >= SPNG_STATE_DECODE_INIT) return SPNG_EOPSTATE;
+
+    const unsigned char *data = buf;
+    const struct spng_ihdr *ihdr = &ctx->ihdr;
+
+    if(len < SPNG_INDEX_HEADER_SIZE || data[0] != 1 || data[1] != ihdr->bit_depth || data[2] != ihdr->color_type ||
+       data[3] || read_u32(data + 4) != ihdr->width || read_u32(data + 8) != ihdr->height) return SPNG_EINDEX;
+
+    uint32_t span = read_u32(data + 12);
+    uint32_t count = read_u32(data + 16);
+
+    if(count && ihdr->interlace_method) return SPNG_EINDEX;
+
+    /* Validate every checkpoint, restore_checkpoint() relies on the sizes */
+    const size_t scanline_width = ctx->subimage[0].scanline_width;
+    const unsigned char *p = data + SPNG_INDEX_HEADER_SIZE;
+    size_t left = len - SPNG_INDEX_HEADER_SIZE;
+    uint32_t i, prev_row = 0;
+
+    for(i=0; i < count; i++)
+    {
+        if(left < SPNG_CHECKPOINT_SIZE) return SPNG_EINDEX;
+
+        uint32_t row = read_u32(p);
+        uint32_t row_offset = read_u32(p + 4);
+        uint32_t window_len = read_u32(p + 24);
+        size_t max_offset = row == ihdr->height - 1 ? scanline_width - 1 : scanline_width;
+        size_t prev_size = row ? scanline_width - 1 : 0;
+
+        if(row >= ihdr->height || row < prev_row || row_offset > max_offset) return SPNG_EINDEX;
+        if(p[20] > 4 || p[21] > 7 || p[23] || window_len > 32768) return SPNG_EINDEX;
+
+        size_t size = SPNG_CHECKPOINT_SIZE + window_len;
+
+        if(prev_size > SIZE_MAX - size - row_offset) return SPNG_EINDEX;
+
+        size += prev_size + row_offset;
+
+        if(size > left) return SPNG_EINDEX;
+
+        p += size;
+        left -= size;
+        prev_row = row;
+    }
+
+    if(left) return SPNG_EINDEX;
+
+    size_t index_len = len - SPNG_INDEX_HEADER_SIZE;
+
+    if(index_len)
+    {
+        ctx->index_buf = spng__reuse(ctx, ctx->index_buf, &ctx->index_buf_size, index_len);
+        if(ctx->index_buf == NULL) return SPNG_EMEM;
+
+        memcpy(ctx->index_buf, data + SPNG_INDEX_HEADER_SIZE, index_len);
+    }
+
+    ctx->index_len = index_len;
+    ctx->index_count = count;
+    ctx->index_span = span;
+    ctx->index_loaded = 1;
+
+    return 0;
+}
+
+int spng_get_ihdr(spng_ctx *ctx, struct spng_ihdr *ihdr)
+{
+    if(ctx == NULL) return 1;
+    int ret = read_chunks(ctx, 1);
+    if(ret) return ret;
+    if(ihdr == NULL) return 1;
+
+    *ihdr = ctx->ihdr;
+
+    return 0;
+}
+
+int spng_get_plte(spng_ctx *ctx, struct spng_plte *plte)
+{
+    SPNG_GET_CHUNK_BOILERPLATE(plte);
+
+    *plte = ctx->plte;
+
+    return 0;
+}
+
+int spng_get_trns(spng_ctx *ctx, struct spng_trns *trns)
+{
+    SPNG_GET_CHUNK_BOILERPLATE(trns);
+
+    *trns = ctx->trns;
+
+    return 0;
+}
+
+int spng_get_chrm(spng_ctx *ctx, struct spng_chrm *chrm)
+{
+    SPNG_GET_CHUNK_BOILERPLATE(chrm);
+
+    chrm->white_point_x = (double)ctx->chrm_int.white_point_x / 100000.0;
+    chrm->white_point_y = (double)ctx->chrm_int.white_point_y / 100000.0;
+    chrm->red_x = (double)ctx->chrm_int.red_x / 100000.0;
+    chrm->red_y = (double)ctx->chrm_int.red_y / 100000.0;
+    chrm->blue_y = (double)ctx->chrm_int.blue_y / 100000.0;
+    chrm->blue_x = (double)ctx->chrm_int.blue_x / 100000.0;
+    chrm->green_x = (double)ctx->chrm_int.green_x / 100000.0;
+    chrm->green_y = (double)ctx->chrm_int.green_y / 100000.0;
+
+    return 0;
+}
+
+int spng_get_chrm_int(spng_ctx *ctx, struct spng_chrm_int *chrm)
+{
+    SPNG_GET_CHUNK_BOILERPLATE(chrm);
+
+    *chrm = ctx->chrm_int;
+
+    return 0;
+}
+
+int spng_get_gama(spng_ctx *ctx, double *gamma)
+{
+    double *gama = gamma;
+    SPNG_GET_CHUNK_BOILERPLATE(gama);
+
+    *gama = (double)ctx->gama / 100000.0;
+
+    return 0;
+}
+
+int spng_get_gama_int(spng_ctx *ctx, uint32_t *gama_int)
+{
+    uint32_t *gama = gama_int;
+    SPNG_GET_CHUNK_BOILERPLATE(gama);
+
+    *gama_int = ctx->gama;
+
+    return 0;
+}
+
+int spng_get_iccp(spng_ctx *ctx, struct spng_iccp *iccp)
+{
+    SPNG_GET_CHUNK_BOILERPLATE(iccp);
+
+    ret = inflate_iccp(ctx);
+    if(ret == SPNG_EZLIB && !ctx->strict) return SPNG_ECHUNKAVAIL;
+    if(ret) return ret;
+
+    *iccp = ctx->iccp;
+
+    return 0;
+}
+
+int spng_get_sbit(spng_ctx *ctx, struct spng_sbit *sbit)
+{
+    SPNG_GET_CHUNK_BOILERPLATE(sbit);
+
+    *sbit = ctx->sbit;
+
+    return 0;
+}
+
+int spng_get_srgb(spng_ctx *ctx, uint8_t *rendering_intent)
+{
+    uint8_t *srgb = rendering_intent;
+    SPNG_GET_CHUNK_BOILERPLATE(srgb);
+
+    *srgb = ctx->srgb_rendering_intent;
+
+    return 0;
+}
+
+int spng_get_text(spng_ctx *ctx, struct spng_text *text, uint32_t *n_text)
+{
+    if(ctx == NULL) return 1;
+    int ret = read_chunks(ctx, 0);
+    if(ret) return ret;
+    if(!ctx->stored.text) return SPNG_ECHUNKAVAIL;
+    if(n_text == NULL) return 1;
+
+    /* The count excludes text chunks that fail to inflate */
+    ret = inflate_text_list(ctx);
+    if(ret) return ret;
+
+    if(!ctx->stored.text) return SPNG_ECHUNKAVAIL;
+
+    if(text == NULL)
+    {
+        *n_text = ctx->n_text;
+        return 0;
+    }
+
+    if(*n_text < ctx->n_text) return 1;
+
+    uint32_t i;
+    for(i=0; i< ctx->n_text; i++)
+    {
+        text[i].type = ctx->text_list[i].type;
+        memcpy(&text[i].keyword, ctx->text_list[i].keyword, strlen(ctx->text_list[i].keyword) + 1);
+        text[i].compression_method = 0;
+        text[i].compression_flag = ctx->text_list[i].compression_flag;
+        text[i].language_tag = ctx->text_list[i].language_tag;
+        text[i].translated_keyword = ctx->text_list[i].translated_keyword;
+        text[i].length = ctx->text_list[i].text_length;
+        text[i].text = ctx->text_list[i].text;
+    }
+
+    return ret;
+}
+
+int spng_get_bkgd(spng_ctx *ctx, struct spng_bkgd *bkgd)
+{
+    SPNG_GET_CHUNK_BOILERPLATE(bkgd);
+
+    *bkgd = ctx->bkgd;
+
+    return 0;
+}
+
+int spng_get_hist(spng_ctx *ctx, struct spng_hist *hist)
+{
+    SPNG_GET_CHUNK_BOILERPLATE(hist);
+
+    *hist = ctx->hist;
+
+    return 0;
+}
+
+int spng_get_phys(spng_ctx *ctx, struct spng_phys *phys)
+{
+    SPNG_GET_CHUNK_BOILERPLATE(phys);
+
+    *phys = ctx->phys;
+
+    return 0;
+}
+
+int spng_get_splt(spng_ctx *ctx, struct spng_splt *splt, uint32_t *n_splt)
+{
+    if(ctx == NULL) return 1;
+    int ret = read_chunks(ctx, 0);
+    if(ret) return ret;
+    if(!ctx->stored.splt) return SPNG_ECHUNKAVAIL;
+    if(n_splt == NULL) return 1;
+
+    if(splt == NULL)
+    {
+        *n_splt = ctx->n_splt;
+        return 0;
+    }
+
+    if(*n_splt < ctx->n_splt) return 1;
+
+    memcpy(splt, ctx->splt_list, ctx->n_splt * sizeof(struct spng_splt));
+
+    return 0;
+}
+
+int spng_get_time(spng_ctx *ctx, struct spng_time *time)
+{
+    SPNG_GET_CHUNK_BOILERPLATE(time);
+
+    *time = ctx->time;
+
+    return 0;
+}
+
+int spng_get_unknown_chunks(spng_ctx *ctx, struct spng_unknown_chunk *chunks, uint32_t *n_chunks)
+{
+    if(ctx == NULL) return 1;
+    int ret = read_chunks(ctx, 0);
+    if(ret) return ret;
+    if(!ctx->stored.unknown) return SPNG_ECHUNKAVAIL;
+    if(n_chunks == NULL) return 1;
+
+    if(chunks == NULL)
+    {
+        *n_chunks = ctx->n_chunks;
+        return 0;
+    }
+
+    if(*n_chunks < ctx->n_chunks) return 1;
+
+    memcpy(chunks, ctx->chunk_list, ctx->n_chunks * sizeof(struct spng_unknown_chunk));
+    *n_chunks = ctx->n_chunks;
+
+    return 0;
+}
+
+int spng_get_offs(spng_ctx *ctx, struct spng_offs *offs)
+{
+    SPNG_GET_CHUNK_BOILERPLATE(offs);
+
+    *offs = ctx->offs;
+
+    return 0;
+}
+
+int spng_get_exif(spng_ctx *ctx, struct spng_exif *exif)
+{
+    SPNG_GET_CHUNK_BOILERPLATE(exif);
+
+    *exif = ctx->exif;
+
+    return 0;
+}
+
+int spng_get_actl(spng_ctx *ctx, struct spng_actl *actl)
+{
+    SPNG_GET_CHUNK_BOILERPLATE(actl);
+
+    *actl = ctx->actl;
+
+    return 0;
+}
+
+int spng_get_fctl(spng_ctx *ctx, struct spng_fctl *fctl)
+{
+    SPNG_GET_CHUNK_BOILERPLATE(fctl);
+
+    /* The next frame's fcTL until the first frame is decoded */
+    *fctl = ctx->frame_index ? ctx->fctl : ctx->next_fctl;
+
+    return 0;
+}
+
+int spng_set_ihdr(spng_ctx *ctx, struct spng_ihdr *ihdr)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(ihdr);
+
+    if(ctx->stored.ihdr) return 1;
+
+    ret = check_ihdr(ihdr, ctx->max_width, ctx->max_height);
+    if(ret) return ret;
+
+    ctx->ihdr = *ihdr;
+
+    ctx->stored.ihdr = 1;
+    ctx->user.ihdr = 1;
+
+    return 0;
+}
+
+int spng_set_plte(spng_ctx *ctx, struct spng_plte *plte)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(plte);
+
+    if(!ctx->stored.ihdr) return 1;
+
+    if(check_plte(plte, &ctx->ihdr)) return 1;
+
+    ctx->plte.n_entries = plte->n_entries;
+
+    memcpy(ctx->plte.entries, plte->entries, plte->n_entries * sizeof(struct spng_plte_entry));
+
+    ctx->stored.plte = 1;
+    ctx->user.plte = 1;
+
+    return 0;
+}
+
+int spng_set_trns(spng_ctx *ctx, struct spng_trns *trns)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(trns);
+
+    if(!ctx->stored.ihdr) return SPNG_ENOIHDR;
+
+    if(ctx->ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE)
+    {
+        ctx->trns.gray = trns->gray;
+    }
+    else if(ctx->ihdr.color_type == SPNG_COLOR_TYPE_TRUECOLOR)
+    {
+        ctx->trns.red = trns->red;
+        ctx->trns.green = trns->green;
+        ctx->trns.blue = trns->blue;
+    }
+    else if(ctx->ihdr.color_type == SPNG_COLOR_TYPE_INDEXED)
+    {
+        if(!ctx->stored.plte) return SPNG_ETRNS_NO_PLTE;
+        if(trns->n_type3_entries > ctx->plte.n_entries) return 1;
+
+        ctx->trns.n_type3_entries = trns->n_type3_entries;
+        memcpy(ctx->trns.type3_alpha, trns->type3_alpha, trns->n_type3_entries);
+    }
+    else return SPNG_ETRNS_COLOR_TYPE;
+
+    ctx->stored.trns = 1;
+    ctx->user.trns = 1;
+
+    return 0;
+}
+
+int spng_set_chrm(spng_ctx *ctx, struct spng_chrm *chrm)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(chrm);
+
+    struct spng_chrm_int chrm_int;
+
+    chrm_int.white_point_x = (uint32_t)(chrm->white_point_x * 100000.0);
+    chrm_int.white_point_y = (uint32_t)(chrm->white_point_y * 100000.0);
+    chrm_int.red_x = (uint32_t)(chrm->red_x * 100000.0);
+    chrm_int.red_y = (uint32_t)(chrm->red_y * 100000.0);
+    chrm_int.green_x = (uint32_t)(chrm->green_x * 100000.0);
+    chrm_int.green_y = (uint32_t)(chrm->green_y * 100000.0);
+    chrm_int.blue_x = (uint32_t)(chrm->blue_x * 100000.0);
+    chrm_int.blue_y = (uint32_t)(chrm->blue_y * 100000.0);
+
+    if(check_chrm_int(&chrm_int)) return SPNG_ECHRM;
+
+    ctx->chrm_int = chrm_int;
+
+    ctx->stored.chrm = 1;
+    ctx->user.chrm = 1;
+
+    return 0;
+}
+
+int spng_set_chrm_int(spng_ctx *ctx, struct spng_chrm_int *chrm_int)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(chrm_int);
+
+    if(check_chrm_int(chrm_int)) return SPNG_ECHRM;
+
+    ctx->chrm_int = *chrm_int;
+
+    ctx->stored.chrm = 1;
+    ctx->user.chrm = 1;
+
+    return 0;
+}
+
+int spng_set_gama(spng_ctx *ctx, double gamma)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(ctx);
+
+    uint32_t gama = gamma * 100000.0;
+
+    if(!gama) return 1;
+    if(gama > spng_u32max) return 1;
+
+    ctx->gama = gama;
+
+    ctx->stored.gama = 1;
+    ctx->user.gama = 1;
+
+    return 0;
+}
+
+int spng_set_gama_int(spng_ctx *ctx, uint32_t gamma)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(ctx);
+
+    if(!gamma) return 1;
+    if(gamma > spng_u32max) return 1;
+
+    ctx->gama = gamma;
+
+    ctx->stored.gama = 1;
+    ctx->user.gama = 1;
+
+    return 0;
+}
+
+int spng_set_iccp(spng_ctx *ctx, struct spng_iccp *iccp)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(iccp);
+
+    if(check_png_keyword(iccp->profile_name)) return SPNG_EICCP_NAME;
+    if(!iccp->profile_len) return SPNG_ECHUNK_SIZE;
+    if(iccp->profile_len > spng_u32max) return SPNG_ECHUNK_STDLEN;
+
+    if(ctx->iccp.profile && !ctx->user.iccp) spng__free(ctx, ctx->iccp.profile);
+
+    ctx->iccp = *iccp;
+
+    ctx->stored.iccp = 1;
+    ctx->user.iccp = 1;
+
+    return 0;
+}
+
+int spng_set_sbit(spng_ctx *ctx, struct spng_sbit *sbit)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(sbit);
+
+    if(check_sbit(sbit, &ctx->ihdr)) return 1;
+
+    if(!ctx->stored.ihdr) return 1;
+
+    ctx->sbit = *sbit;
+
+    ctx->stored.sbit = 1;
+    ctx->user.sbit = 1;
+
+    return 0;
+}
+
+int spng_set_srgb(spng_ctx *ctx, uint8_t rendering_intent)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(ctx);
+
+    if(rendering_intent > 3) return 1;
+
+    ctx->srgb_rendering_intent = rendering_intent;
+
+    ctx->stored.srgb = 1;
+    ctx->user.srgb = 1;
+
+    return 0;
+}
+
+int spng_set_text(spng_ctx *ctx, struct spng_text *text, uint32_t n_text)
+{
+    if(!n_text) return 1;
+    SPNG_SET_CHUNK_BOILERPLATE(text);
+
+    uint32_t i;
+    for(i=0; i < n_text; i++)
+    {
+        if(check_png_keyword(text[i].keyword)) return SPNG_ETEXT_KEYWORD;
+        if(!text[i].length) return 1;
+        if(text[i].length > UINT_MAX) return 1;
+        if(text[i].text == NULL) return 1;
+
+        if(text[i].type == SPNG_TEXT)
+        {
+            if(ctx->strict && check_png_text(text[i].text, text[i].length)) return 1;
+        }
+        else if(text[i].type == SPNG_ZTXT)
+        {
+            if(ctx->strict && check_png_text(text[i].text, text[i].length)) return 1;
+
+            if(text[i].compression_method != 0) return SPNG_EZTXT_COMPRESSION_METHOD;
+        }
+        else if(text[i].type == SPNG_ITXT)
+        {
+            if(text[i].compression_flag > 1) return SPNG_EITXT_COMPRESSION_FLAG;
+            if(text[i].compression_method != 0) return SPNG_EITXT_COMPRESSION_METHOD;
+            if(text[i].language_tag == NULL) return SPNG_EITXT_LANG_TAG;
+            if(text[i].translated_keyword == NULL) return SPNG_EITXT_TRANSLATED_KEY;
+        }
+        else return 1;
+
+    }
+
+    struct spng_text2 *text_list = spng__calloc(ctx, sizeof(struct spng_text2), n_text);
+
+    if(!text_list) return SPNG_EMEM;
+
+    if(ctx->text_list != NULL)
+    {
+        for(i=0; i < ctx->n_text; i++)
+        {
+            if(ctx->user.text) break;
+
+            spng__free(ctx, ctx->text_list[i].keyword);
+            if(ctx->text_list[i].compression_flag) spng__free(ctx, ctx->text_list[i].text);
+            spng__free(ctx, ctx->text_list[i].zdata.copy);
+        }
+        spng__free(ctx, ctx->text_list);
+    }
+
+    for(i=0; i < n_text; i++)
+    {
+        text_list[i].type = text[i].type;
+        /* Prevent issues with spng_text.keyword[80] going out of scope */
+        text_list[i].keyword = text_list[i].user_keyword_storage;
+        memcpy(text_list[i].user_keyword_storage, text[i].keyword, strlen(text[i].keyword));
+        text_list[i].text = text[i].text;
+        text_list[i].text_length = text[i].length;
+
+        if(text[i].type == SPNG_ZTXT)
+        {
+            text_list[i].compression_flag = 1;
+        }
+        else if(text[i].type == SPNG_ITXT)
+        {
+            text_list[i].compression_flag = text[i].compression_flag;
+            text_list[i].language_tag = text[i].language_tag;
+            text_list[i].translated_keyword = text[i].translated_keyword;
+        }
+    }
+
+    ctx->text_list = text_list;
+    ctx->n_text = n_text;
+
+    ctx->stored.text = 1;
+    ctx->user.text = 1;
+
+    return 0;
+}
+
+int spng_set_bkgd(spng_ctx *ctx, struct spng_bkgd *bkgd)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(bkgd);
+
+    if(!ctx->stored.ihdr)  return 1;
+
+    if(ctx->ihdr.color_type == 0 || ctx->ihdr.color_type == 4)
+    {
+        ctx->bkgd.gray = bkgd->gray;
+    }
+    else if(ctx->ihdr.color_type == 2 || ctx->ihdr.color_type == 6)
+    {
+        ctx->bkgd.red = bkgd->red;
+        ctx->bkgd.green = bkgd->green;
+        ctx->bkgd.blue = bkgd->blue;
+    }
+    else if(ctx->ihdr.color_type == 3)
+    {
+        if(!ctx->stored.plte) return SPNG_EBKGD_NO_PLTE;
+        if(bkgd->plte_index >= ctx->plte.n_entries) return SPNG_EBKGD_PLTE_IDX;
+
+        ctx->bkgd.plte_index = bkgd->plte_index;
+    }
+
+    ctx->stored.bkgd = 1;
+    ctx->user.bkgd = 1;
+
+    return 0;
+}
+
+int spng_set_hist(spng_ctx *ctx, struct spng_hist *hist)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(hist);
+
+    if(!ctx->stored.plte) return SPNG_EHIST_NO_PLTE;
+
+    ctx->hist = *hist;
+
+    ctx->stored.hist = 1;
+    ctx->user.hist = 1;
+
+    return 0;
+}
+
+int spng_set_phys(spng_ctx *ctx, struct spng_phys *phys)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(phys);
+
+    if(check_phys(phys)) return SPNG_EPHYS;
+
+    ctx->phys = *phys;
+
+    ctx->stored.phys = 1;
+    ctx->user.phys = 1;
+
+    return 0;
+}
+
+int spng_set_splt(spng_ctx *ctx, struct spng_splt *splt, uint32_t n_splt)
+{
+    if(!n_splt) return 1;
+    SPNG_SET_CHUNK_BOILERPLATE(splt);
+
+    uint32_t i;
+    for(i=0; i < n_splt; i++)
+    {
+        if(check_png_keyword(splt[i].name)) return SPNG_ESPLT_NAME;
+        if( !(splt[i].sample_depth == 8 || splt[i].sample_depth == 16) ) return SPNG_ESPLT_DEPTH;
+    }
+
+    if(ctx->stored.splt && !ctx->user.splt)
+    {
+        for(i=0; i < ctx->n_splt; i++)
+        {
+            if(ctx->splt_list[i].entries != NULL) spng__free(ctx, ctx->splt_list[i].entries);
+        }
+        spng__free(ctx, ctx->splt_list);
+    }
+
+    ctx->splt_list = splt;
+    ctx->n_splt = n_splt;
+
+    ctx->stored.splt = 1;
+    ctx->user.splt = 1;
+
+    return 0;
+}
+
+int spng_set_time(spng_ctx *ctx, struct spng_time *time)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(time);
+
+    if(check_time(time)) return SPNG_ETIME;
+
+    ctx->time = *time;
+
+    ctx->stored.time = 1;
+    ctx->user.time = 1;
+
+    return 0;
+}
+
+int spng_set_unknown_chunks(spng_ctx *ctx, struct spng_unknown_chunk *chunks, uint32_t n_chunks)
+{
+    if(!n_chunks) return 1;
+    SPNG_SET_CHUNK_BOILERPLATE(chunks);
+
+    uint32_t i;
+    for(i=0; i < n_chunks; i++)
+    {
+        if(chunks[i].length > spng_u32max) return SPNG_ECHUNK_STDLEN;
+        if(chunks[i].length && chunks[i].data == NULL) return 1;
+
+        switch(chunks[i].location)
+        {
+            case SPNG_AFTER_IHDR:
+            case SPNG_AFTER_PLTE:
+            case SPNG_AFTER_IDAT:
+            break;
+            default: return SPNG_ECHUNK_POS;
+        }
+    }
+
+    if(ctx->stored.unknown && !ctx->user.unknown)
+    {
+        for(i=0; i < ctx->n_chunks; i++)
+        {
+            spng__free(ctx, ctx->chunk_list[i].data);
+        }
+        spng__free(ctx, ctx->chunk_list);
+    }
+
+    ctx->chunk_list = chunks;
+    ctx->n_chunks = n_chunks;
+
+    ctx->stored.unknown = 1;
+    ctx->user.unknown = 1;
+
+    return 0;
+}
+
+int spng_set_offs(spng_ctx *ctx, struct spng_offs *offs)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(offs);
+
+    if(check_offs(offs)) return SPNG_EOFFS;
+
+    ctx->offs = *offs;
+
+    ctx->stored.offs = 1;
+    ctx->user.offs = 1;
+
+    return 0;
+}
+
+int spng_set_exif(spng_ctx *ctx, struct spng_exif *exif)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(exif);
+
+    if(check_exif(exif)) return SPNG_EEXIF;
+
+    if(ctx->exif.data != NULL && !ctx->user.exif) spng__free(ctx, ctx->exif.data);
+
+    ctx->exif = *exif;
+
+    ctx->stored.exif = 1;
+    ctx->user.exif = 1;
+
+    return 0;
+}
+
+int spng_set_actl(spng_ctx *ctx, struct spng_actl *actl)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(actl);
+
+    if(!actl->num_frames || actl->num_frames > spng_u32max || actl->num_plays > spng_u32max) return SPNG_EACTL;
+
+    ctx->actl = *actl;
+
+    ctx->stored.actl = 1;
+    ctx->user.actl = 1;
+
+    return 0;
+}
+
+int spng_set_fctl(spng_ctx *ctx, struct spng_fctl *fctl)
+{
+    SPNG_SET_CHUNK_BOILERPLATE(fctl);
+
+    /* The area and operations are chosen by spng_encode_frame() */
+    ctx->next_fctl.delay_num = fctl->delay_num;
+    ctx->next_fctl.delay_den = fctl->delay_den;
+
+    return 0;
+}
+
+const char *spng_strerror(int err)
+{
+    switch(err)
     {
         case SPNG_IO_EOF: return "end of stream";
         case SPNG_IO_ERROR: return "stream error";
@@ -6130,441 +12798,1739 @@ const char *spng_strerror(int err)
         case SPNG_ENODST: return "PNG output not set";
         case SPNG_EOPSTATE: return "invalid operation for state";
         case SPNG_ENOTFINAL: return "PNG not finalized";
+        case SPNG_ECROP: return "crop rectangle outside of image";
+        case SPNG_EAGAIN: return "more input data is needed";
+        case SPNG_EINDEX: return "invalid or mismatched index";
+        case SPNG_EACTL: return "invalid acTL chunk";
+        case SPNG_EFCTL: return "invalid fcTL chunk";
+        case SPNG_EFDAT: return "invalid fdAT chunk";
         default: return "unknown error";
     }
 }
 
-const char *spng_version_string(void)
+const char *spng_version_string(void)
+{
+    return SPNG_VERSION_STRING;
+}
+
+#if defined(_MSC_VER)
+    #pragma warning(pop)
+#endif
+
+/* The following SIMD optimizations are derived from libpng source code. */
+
+/*
+* PNG Reference Library License version 2
+*
+* Copyright (c) 1995-2019 The PNG Reference Library Authors.
+* Copyright (c) 2018-2019 Cosmin Truta.
+* Copyright (c) 2000-2002, 2004, 2006-2018 Glenn Randers-Pehrson.
+* Copyright (c) 1996-1997 Andreas Dilger.
+* Copyright (c) 1995-1996 Guy Eric Schalnat, Group 42, Inc.
+*
+* The software is supplied "as is", without warranty of any kind,
+* express or implied, including, without limitation, the warranties
+* of merchantability, fitness for a particular purpose, title, and
+* non-infringement.  In no event shall the Copyright owners, or
+* anyone distributing the software, be liable for any damages or
+* other liability, whether in contract, tort or otherwise, arising
+* from, out of, or in connection with the software, or the use or
+* other dealings in the software, even if advised of the possibility
+* of such damage.
+*
+* Permission is hereby granted to use, copy, modify, and distribute
+* this software, or portions hereof, for any purpose, without fee,
+* subject to the following restrictions:
+*
+*  1. The origin of this software must not be misrepresented; you
+*     must not claim that you wrote the original software.  If you
+*     use this software in a product, an acknowledgment in the product
+*     documentation would be appreciated, but is not required.
+*
+*  2. Altered source versions must be plainly marked as such, and must
+*     not be misrepresented as being the original software.
+*
+*  3. This Copyright notice may not be removed or altered from any
+*     source or altered source distribution.
+*/
+
+#if defined(SPNG_X86)
+
+#ifndef SPNG_SSE
+    #define SPNG_SSE 1
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+    #if SPNG_SSE == 3
+        #pragma GCC target("ssse3")
+    #elif SPNG_SSE == 4
+        #pragma GCC target("sse4.1")
+    #else
+        #pragma GCC target("sse2")
+    #endif
+#endif
+
+/* SSE2 optimised filter functions
+ * Derived from filter_neon_intrinsics.c
+ *
+ * Copyright (c) 2018 Cosmin Truta
+ * Copyright (c) 2016-2017 Glenn Randers-Pehrson
+ * Written by Mike Klein and Matt Sarett
+ * Derived from arm/filter_neon_intrinsics.c
+ *
+ * This code is derived from libpng source code.
+ * For conditions of distribution and use, see the disclaimer
+ * and license above.
+ */
+
+#include <immintrin.h>
+#include <inttypes.h>
+#include <string.h>
+
+/* Functions in this file look at most 3 pixels (a,b,c) to predict the 4th (d).
+ * They're positioned like this:
+ *    prev:  c b
+ *    row:   a d
+ * The Sub filter predicts d=a, Avg d=(a+b)/2, and Paeth predicts d to be
+ * whichever of a, b, or c is closest to p=a+b-c.
+ */
+
+static __m128i load4(const void* p)
+{
+    int tmp;
+    memcpy(&tmp, p, sizeof(tmp));
+    return _mm_cvtsi32_si128(tmp);
+}
+
+static void store4(void* p, __m128i v)
+{
+    int tmp = _mm_cvtsi128_si32(v);
+    memcpy(p, &tmp, sizeof(int));
+}
+
+static __m128i load3(const void* p)
+{
+    uint32_t tmp = 0;
+    memcpy(&tmp, p, 3);
+    return _mm_cvtsi32_si128(tmp);
+}
+
+static void store3(void* p, __m128i v)
+{
+    int tmp = _mm_cvtsi128_si32(v);
+    memcpy(p, &tmp, 3);
+}
+
+static void defilter_sub3(size_t rowbytes, unsigned char *row)
+{
+    /* The Sub filter predicts each pixel as the previous pixel, a.
+     * There is no pixel to the left of the first pixel.  It's encoded directly.
+     * That works with our main loop if we just say that left pixel was zero.
+     */
+    size_t rb = rowbytes;
+
+    __m128i a, d = _mm_setzero_si128();
+
+    while(rb >= 4)
+    {
+        a = d; d = load4(row);
+        d = _mm_add_epi8(d, a);
+        store3(row, d);
+
+        row += 3;
+        rb  -= 3;
+    }
+
+    if(rb > 0)
+    {
+        a = d; d = load3(row);
+        d = _mm_add_epi8(d, a);
+        store3(row, d);
+    }
+}
+
+static void defilter_sub4(size_t rowbytes, unsigned char *row)
+{
+    /* The Sub filter predicts each pixel as the previous pixel, a.
+     * There is no pixel to the left of the first pixel.  It's encoded directly.
+     * That works with our main loop if we just say that left pixel was zero.
+     */
+    size_t rb = rowbytes+4;
+
+    __m128i a, d = _mm_setzero_si128();
+
+    while(rb > 4)
+    {
+        a = d; d = load4(row);
+        d = _mm_add_epi8(d, a);
+        store4(row, d);
+
+        row += 4;
+        rb  -= 4;
+    }
+}
+
+static void defilter_avg3(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+{
+    /* The Avg filter predicts each pixel as the (truncated) average of a and b.
+     * There's no pixel to the left of the first pixel.  Luckily, it's
+     * predicted to be half of the pixel above it.  So again, this works
+     * perfectly with our loop if we make sure a starts at zero.
+     */
+
+    size_t rb = rowbytes;
+
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i b;
+    __m128i a, d = zero;
+
+    while(rb >= 4)
+    {
+        __m128i avg;
+               b = load4(prev);
+        a = d; d = load4(row );
+
+        /* PNG requires a truncating average, so we can't just use _mm_avg_epu8 */
+        avg = _mm_avg_epu8(a,b);
+        /* ...but we can fix it up by subtracting off 1 if it rounded up. */
+        avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b),
+                                            _mm_set1_epi8(1)));
+        d = _mm_add_epi8(d, avg);
+        store3(row, d);
+
+        prev += 3;
+        row  += 3;
+        rb   -= 3;
+    }
+
+    if(rb > 0)
+    {
+        __m128i avg;
+               b = load3(prev);
+        a = d; d = load3(row );
+
+        /* PNG requires a truncating average, so we can't just use _mm_avg_epu8 */
+        avg = _mm_avg_epu8(a, b);
+        /* ...but we can fix it up by subtracting off 1 if it rounded up. */
+        avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b),
+                                            _mm_set1_epi8(1)));
+
+        d = _mm_add_epi8(d, avg);
+        store3(row, d);
+    }
+}
+
+static void defilter_avg4(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+{
+    /* The Avg filter predicts each pixel as the (truncated) average of a and b.
+     * There's no pixel to the left of the first pixel.  Luckily, it's
+     * predicted to be half of the pixel above it.  So again, this works
+     * perfectly with our loop if we make sure a starts at zero.
+     */
+    size_t rb = rowbytes+4;
+
+    const __m128i zero = _mm_setzero_si128();
+    __m128i    b;
+    __m128i a, d = zero;
+
+    while(rb > 4)
+    {
+        __m128i avg;
+               b = load4(prev);
+        a = d; d = load4(row );
+
+        /* PNG requires a truncating average, so we can't just use _mm_avg_epu8 */
+        avg = _mm_avg_epu8(a,b);
+        /* ...but we can fix it up by subtracting off 1 if it rounded up. */
+        avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b),
+                                            _mm_set1_epi8(1)));
+
+        d = _mm_add_epi8(d, avg);
+        store4(row, d);
+
+        prev += 4;
+        row  += 4;
+        rb   -= 4;
+    }
+}
+
+/* Returns |x| for 16-bit lanes. */
+#if (SPNG_SSE >= 3) && !defined(_MSC_VER)
+__attribute__((target("ssse3")))
+#endif
+static __m128i abs_i16(__m128i x)
+{
+#if SPNG_SSE >= 3
+    return _mm_abs_epi16(x);
+#else
+    /* Read this all as, return x<0 ? -x : x.
+     * To negate two's complement, you flip all the bits then add 1.
+     */
+    __m128i is_negative = _mm_cmplt_epi16(x, _mm_setzero_si128());
+
+    /* Flip negative lanes. */
+    x = _mm_xor_si128(x, is_negative);
+
+    /* +1 to negative lanes, else +0. */
+    x = _mm_sub_epi16(x, is_negative);
+    return x;
+#endif
+}
+
+/* Bytewise c ? t : e. */
+static __m128i if_then_else(__m128i c, __m128i t, __m128i e)
+{
+#if SPNG_SSE >= 4
+    return _mm_blendv_epi8(e, t, c);
+#else
+    return _mm_or_si128(_mm_and_si128(c, t), _mm_andnot_si128(c, e));
+#endif
+}
+
+static void defilter_paeth3(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+{
+    /* Paeth tries to predict pixel d using the pixel to the left of it, a,
+     * and two pixels from the previous row, b and c:
+     *   prev: c b
+     *   row:  a d
+     * The Paeth function predicts d to be whichever of a, b, or c is nearest to
+     * p=a+b-c.
+     *
+     * The first pixel has no left context, and so uses an Up filter, p = b.
+     * This works naturally with our main loop's p = a+b-c if we force a and c
+     * to zero.
+     * Here we zero b and d, which become c and a respectively at the start of
+     * the loop.
+     */
+    size_t rb = rowbytes;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i c, b = zero,
+            a, d = zero;
+
+    while(rb >= 4)
+    {
+        /* It's easiest to do this math (particularly, deal with pc) with 16-bit
+         * intermediates.
+         */
+        __m128i pa,pb,pc,smallest,nearest;
+        c = b; b = _mm_unpacklo_epi8(load4(prev), zero);
+        a = d; d = _mm_unpacklo_epi8(load4(row ), zero);
+
+        /* (p-a) == (a+b-c - a) == (b-c) */
+
+        pa = _mm_sub_epi16(b, c);
+
+        /* (p-b) == (a+b-c - b) == (a-c) */
+        pb = _mm_sub_epi16(a, c);
+
+        /* (p-c) == (a+b-c - c) == (a+b-c-c) == (b-c)+(a-c) */
+        pc = _mm_add_epi16(pa, pb);
+
+        pa = abs_i16(pa);  /* |p-a| */
+        pb = abs_i16(pb);  /* |p-b| */
+        pc = abs_i16(pc);  /* |p-c| */
+
+        smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+        /* Paeth breaks ties favoring a over b over c. */
+        nearest  = if_then_else(_mm_cmpeq_epi16(smallest, pa), a,
+                            if_then_else(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+        /* Note `_epi8`: we need addition to wrap modulo 255. */
+        d = _mm_add_epi8(d, nearest);
+        store3(row, _mm_packus_epi16(d, d));
+
+        prev += 3;
+        row  += 3;
+        rb   -= 3;
+    }
+
+    if(rb > 0)
+    {
+        /* It's easiest to do this math (particularly, deal with pc) with 16-bit
+         * intermediates.
+         */
+        __m128i pa, pb, pc, smallest, nearest;
+        c = b; b = _mm_unpacklo_epi8(load3(prev), zero);
+        a = d; d = _mm_unpacklo_epi8(load3(row ), zero);
+
+        /* (p-a) == (a+b-c - a) == (b-c) */
+        pa = _mm_sub_epi16(b, c);
+
+        /* (p-b) == (a+b-c - b) == (a-c) */
+        pb = _mm_sub_epi16(a, c);
+
+        /* (p-c) == (a+b-c - c) == (a+b-c-c) == (b-c)+(a-c) */
+        pc = _mm_add_epi16(pa, pb);
+
+        pa = abs_i16(pa);  /* |p-a| */
+        pb = abs_i16(pb);  /* |p-b| */
+        pc = abs_i16(pc);  /* |p-c| */
+
+        smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+        /* Paeth breaks ties favoring a over b over c. */
+        nearest  = if_then_else(_mm_cmpeq_epi16(smallest, pa), a,
+                            if_then_else(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+        /* Note `_epi8`: we need addition to wrap modulo 255. */
+        d = _mm_add_epi8(d, nearest);
+        store3(row, _mm_packus_epi16(d, d));
+    }
+}
+
+static void defilter_paeth4(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+{
+    /* Paeth tries to predict pixel d using the pixel to the left of it, a,
+     * and two pixels from the previous row, b and c:
+     *   prev: c b
+     *   row:  a d
+     * The Paeth function predicts d to be whichever of a, b, or c is nearest to
+     * p=a+b-c.
+     *
+     * The first pixel has no left context, and so uses an Up filter, p = b.
+     * This works naturally with our main loop's p = a+b-c if we force a and c
+     * to zero.
+     * Here we zero b and d, which become c and a respectively at the start of
+     * the loop.
+     */
+    size_t rb = rowbytes+4;
+
+    const __m128i zero = _mm_setzero_si128();
+    __m128i pa, pb, pc, smallest, nearest;
+    __m128i c, b = zero,
+            a, d = zero;
+
+    while(rb > 4)
+    {
+        /* It's easiest to do this math (particularly, deal with pc) with 16-bit
+         * intermediates.
+         */
+        c = b; b = _mm_unpacklo_epi8(load4(prev), zero);
+        a = d; d = _mm_unpacklo_epi8(load4(row ), zero);
+
+        /* (p-a) == (a+b-c - a) == (b-c) */
+        pa = _mm_sub_epi16(b, c);
+
+        /* (p-b) == (a+b-c - b) == (a-c) */
+        pb = _mm_sub_epi16(a, c);
+
+        /* (p-c) == (a+b-c - c) == (a+b-c-c) == (b-c)+(a-c) */
+        pc = _mm_add_epi16(pa, pb);
+
+        pa = abs_i16(pa);  /* |p-a| */
+        pb = abs_i16(pb);  /* |p-b| */
+        pc = abs_i16(pc);  /* |p-c| */
+
+        smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+        /* Paeth breaks ties favoring a over b over c. */
+        nearest  = if_then_else(_mm_cmpeq_epi16(smallest, pa), a,
+                            if_then_else(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+        /* Note `_epi8`: we need addition to wrap modulo 255. */
+        d = _mm_add_epi8(d, nearest);
+        store4(row, _mm_packus_epi16(d, d));
+
+        prev += 4;
+        row  += 4;
+        rb   -= 4;
+    }
+}
+
+static __m128i load8(const void* p)
+{
+    return _mm_loadl_epi64((const __m128i*)p);
+}
+
+static void store8(void* p, __m128i v)
+{
+    _mm_storel_epi64((__m128i*)p, v);
+}
+
+static __m128i load6(const void* p)
+{
+    unsigned char tmp[8] = {0};
+    memcpy(tmp, p, 6);
+    return _mm_loadl_epi64((const __m128i*)tmp);
+}
+
+static void store6(void* p, __m128i v)
+{
+    unsigned char tmp[8];
+    _mm_storel_epi64((__m128i*)tmp, v);
+    memcpy(p, tmp, 6);
+}
+
+/* Broadcasts the last byte / 16-bit lane of v */
+static __m128i broadcast_last1(__m128i v)
+{
+    v = _mm_unpackhi_epi8(v, v);
+    v = _mm_shufflehi_epi16(v, 0xFF);
+    return _mm_shuffle_epi32(v, 0xFF);
+}
+
+static __m128i broadcast_last2(__m128i v)
+{
+    v = _mm_shufflehi_epi16(v, 0xFF);
+    return _mm_shuffle_epi32(v, 0xFF);
+}
+
+static void defilter_up_simd(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+{
+    size_t i;
+    for(i=0; i + 16 <= rowbytes; i += 16)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+
+        _mm_storeu_si128((__m128i*)(row + i), _mm_add_epi8(d, b));
+    }
+
+    for(; i < rowbytes; i++) row[i] += prev[i];
+}
+
+static void defilter_sub1(size_t rowbytes, unsigned char *row)
+{
+    /* With one byte per pixel every byte depends on the one before it,
+     * 16 bytes are summed at a time with a log-step prefix sum:
+     * each step adds the vector shifted left by 1, 2, 4 and 8 bytes.
+     */
+    size_t i = 0;
+    __m128i d, carry = _mm_setzero_si128();
+
+    for(; i + 16 <= rowbytes; i += 16)
+    {
+        d = _mm_loadu_si128((const __m128i*)(row + i));
+
+        d = _mm_add_epi8(d, _mm_slli_si128(d, 1));
+        d = _mm_add_epi8(d, _mm_slli_si128(d, 2));
+        d = _mm_add_epi8(d, _mm_slli_si128(d, 4));
+        d = _mm_add_epi8(d, _mm_slli_si128(d, 8));
+
+        _mm_storeu_si128((__m128i*)(row + i), _mm_add_epi8(d, carry));
+
+        /* Keeps the dependency between blocks to a single add */
+        carry = _mm_add_epi8(carry, broadcast_last1(d));
+    }
+
+    if(!i) i = 1;
+
+    for(; i < rowbytes; i++) row[i] += row[i - 1];
+}
+
+static void defilter_sub2(size_t rowbytes, unsigned char *row)
+{
+    size_t i = 0;
+    __m128i d, carry = _mm_setzero_si128();
+
+    for(; i + 16 <= rowbytes; i += 16)
+    {
+        d = _mm_loadu_si128((const __m128i*)(row + i));
+
+        d = _mm_add_epi8(d, _mm_slli_si128(d, 2));
+        d = _mm_add_epi8(d, _mm_slli_si128(d, 4));
+        d = _mm_add_epi8(d, _mm_slli_si128(d, 8));
+
+        _mm_storeu_si128((__m128i*)(row + i), _mm_add_epi8(d, carry));
+
+        carry = _mm_add_epi8(carry, broadcast_last2(d));
+    }
+
+    if(!i) i = 2;
+
+    for(; i < rowbytes; i++) row[i] += row[i - 2];
+}
+
+static void defilter_sub6(size_t rowbytes, unsigned char *row)
+{
+    size_t rb = rowbytes;
+
+    __m128i a, d = _mm_setzero_si128();
+
+    while(rb >= 8)
+    {
+        a = d; d = load8(row);
+        d = _mm_add_epi8(d, a);
+        store6(row, d);
+
+        row += 6;
+        rb  -= 6;
+    }
+
+    if(rb > 0)
+    {
+        a = d; d = load6(row);
+        d = _mm_add_epi8(d, a);
+        store6(row, d);
+    }
+}
+
+static void defilter_sub8(size_t rowbytes, unsigned char *row)
+{
+    size_t rb = rowbytes+8;
+
+    __m128i a, d = _mm_setzero_si128();
+
+    while(rb > 8)
+    {
+        a = d; d = load8(row);
+        d = _mm_add_epi8(d, a);
+        store8(row, d);
+
+        row += 8;
+        rb  -= 8;
+    }
+}
+
+/* Truncating average of a and b */
+static __m128i avg_trunc(__m128i a, __m128i b)
+{
+    __m128i avg = _mm_avg_epu8(a, b);
+    return _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+static void defilter_avg6(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+{
+    size_t rb = rowbytes;
+
+    __m128i b;
+    __m128i a, d = _mm_setzero_si128();
+
+    while(rb >= 8)
+    {
+               b = load8(prev);
+        a = d; d = load8(row );
+
+        d = _mm_add_epi8(d, avg_trunc(a, b));
+        store6(row, d);
+
+        prev += 6;
+        row  += 6;
+        rb   -= 6;
+    }
+
+    if(rb > 0)
+    {
+               b = load6(prev);
+        a = d; d = load6(row );
+
+        d = _mm_add_epi8(d, avg_trunc(a, b));
+        store6(row, d);
+    }
+}
+
+static void defilter_avg8(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+{
+    size_t rb = rowbytes+8;
+
+    __m128i b;
+    __m128i a, d = _mm_setzero_si128();
+
+    while(rb > 8)
+    {
+               b = load8(prev);
+        a = d; d = load8(row );
+
+        d = _mm_add_epi8(d, avg_trunc(a, b));
+        store8(row, d);
+
+        prev += 8;
+        row  += 8;
+        rb   -= 8;
+    }
+}
+
+/* Paeth predictor for up to 8 bytes held in 16-bit lanes */
+static __m128i paeth_epi16(__m128i a, __m128i b, __m128i c)
+{
+    __m128i pa, pb, pc, smallest;
+
+    pa = _mm_sub_epi16(b, c); /* (p-a) == (b-c) */
+    pb = _mm_sub_epi16(a, c); /* (p-b) == (a-c) */
+    pc = _mm_add_epi16(pa, pb); /* (p-c) == (b-c)+(a-c) */
+
+    pa = abs_i16(pa);
+    pb = abs_i16(pb);
+    pc = abs_i16(pc);
+
+    smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+    /* Paeth breaks ties favoring a over b over c. */
+    return if_then_else(_mm_cmpeq_epi16(smallest, pa), a,
+                        if_then_else(_mm_cmpeq_epi16(smallest, pb), b, c));
+}
+
+static void defilter_paeth6(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+{
+    size_t rb = rowbytes;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i c, b = zero,
+            a, d = zero;
+
+    while(rb >= 8)
+    {
+        c = b; b = _mm_unpacklo_epi8(load8(prev), zero);
+        a = d; d = _mm_unpacklo_epi8(load8(row ), zero);
+
+        d = _mm_add_epi8(d, paeth_epi16(a, b, c));
+        store6(row, _mm_packus_epi16(d, d));
+
+        prev += 6;
+        row  += 6;
+        rb   -= 6;
+    }
+
+    if(rb > 0)
+    {
+        c = b; b = _mm_unpacklo_epi8(load6(prev), zero);
+        a = d; d = _mm_unpacklo_epi8(load6(row ), zero);
+
+        d = _mm_add_epi8(d, paeth_epi16(a, b, c));
+        store6(row, _mm_packus_epi16(d, d));
+    }
+}
+
+static void defilter_paeth8(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+{
+    size_t rb = rowbytes+8;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i c, b = zero,
+            a, d = zero;
+
+    while(rb > 8)
+    {
+        c = b; b = _mm_unpacklo_epi8(load8(prev), zero);
+        a = d; d = _mm_unpacklo_epi8(load8(row ), zero);
+
+        d = _mm_add_epi8(d, paeth_epi16(a, b, c));
+        store8(row, _mm_packus_epi16(d, d));
+
+        prev += 8;
+        row  += 8;
+        rb   -= 8;
+    }
+}
+
+/* Sum of filter_cost() for each 8-byte half */
+static __m128i filter_cost_sse2(__m128i v)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i cost = _mm_min_epu8(v, _mm_sub_epi8(zero, v));
+
+    return _mm_sad_epu8(cost, zero);
+}
+
+static uint64_t sum_epi64(__m128i v)
+{
+    uint64_t tmp[2];
+    _mm_storeu_si128((__m128i*)tmp, v);
+
+    return tmp[0] + tmp[1];
+}
+
+/* Filtering only reads unfiltered bytes, 16 bytes of each filter type are computed at a time */
+static size_t filter_candidates_sse2(unsigned char *rows, size_t stride, const unsigned char *prev, const unsigned char *row,
+                                     size_t i, size_t rowbytes, unsigned bpp, uint64_t scores[5])
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum[5] = { zero, zero, zero, zero, zero };
+    int k;
+
+    for(; i + 16 <= rowbytes; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i a = _mm_loadu_si128((const __m128i*)(row + i - bpp));
+        __m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+        __m128i c = _mm_loadu_si128((const __m128i*)(prev + i - bpp));
+
+        __m128i pred_lo = paeth_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+        __m128i pred_hi = paeth_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+
+        __m128i sub = _mm_sub_epi8(x, a);
+        __m128i up = _mm_sub_epi8(x, b);
+        __m128i avg = _mm_sub_epi8(x, avg_trunc(a, b));
+        __m128i pae = _mm_sub_epi8(x, _mm_packus_epi16(pred_lo, pred_hi));
+
+        _mm_storeu_si128((__m128i*)(rows + i), sub);
+        _mm_storeu_si128((__m128i*)(rows + stride + i), up);
+        _mm_storeu_si128((__m128i*)(rows + stride * 2 + i), avg);
+        _mm_storeu_si128((__m128i*)(rows + stride * 3 + i), pae);
+
+        sum[0] = _mm_add_epi64(sum[0], filter_cost_sse2(x));
+        sum[1] = _mm_add_epi64(sum[1], filter_cost_sse2(sub));
+        sum[2] = _mm_add_epi64(sum[2], filter_cost_sse2(up));
+        sum[3] = _mm_add_epi64(sum[3], filter_cost_sse2(avg));
+        sum[4] = _mm_add_epi64(sum[4], filter_cost_sse2(pae));
+    }
+
+    for(k=0; k < 5; k++) scores[k] += sum_epi64(sum[k]);
+
+    return i;
+}
+
+#if SPNG_SSE >= 3
+
+/* Transposes the first 16 RGBA palette entries into one vector per channel */
+#if !defined(_MSC_VER)
+__attribute__((target("ssse3")))
+#endif
+static void palette16_planes(const unsigned char *plte, __m128i planes[4])
 {
-    return SPNG_VERSION_STRING;
+    const __m128i deinterleave = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    __m128i v[4], lo[2], hi[2];
+    int k;
+
+    for(k=0; k < 4; k++) v[k] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(plte + k * 16)), deinterleave);
+
+    lo[0] = _mm_unpacklo_epi32(v[0], v[1]);
+    hi[0] = _mm_unpackhi_epi32(v[0], v[1]);
+    lo[1] = _mm_unpacklo_epi32(v[2], v[3]);
+    hi[1] = _mm_unpackhi_epi32(v[2], v[3]);
+
+    planes[0] = _mm_unpacklo_epi64(lo[0], lo[1]);
+    planes[1] = _mm_unpackhi_epi64(lo[0], lo[1]);
+    planes[2] = _mm_unpacklo_epi64(hi[0], hi[1]);
+    planes[3] = _mm_unpackhi_epi64(hi[0], hi[1]);
 }
 
-#if defined(_MSC_VER)
-    #pragma warning(pop)
+/* Looks up 16 indices below 16 and interleaves them into 4 vectors of RGBA8 */
+#if !defined(_MSC_VER)
+__attribute__((target("ssse3")))
 #endif
+static void palette16_lookup(const __m128i planes[4], __m128i idx, __m128i px[4])
+{
+    __m128i r = _mm_shuffle_epi8(planes[0], idx);
+    __m128i g = _mm_shuffle_epi8(planes[1], idx);
+    __m128i b = _mm_shuffle_epi8(planes[2], idx);
+    __m128i a = _mm_shuffle_epi8(planes[3], idx);
 
-/* The following SIMD optimizations are derived from libpng source code. */
+    __m128i rg_lo = _mm_unpacklo_epi8(r, g);
+    __m128i rg_hi = _mm_unpackhi_epi8(r, g);
+    __m128i ba_lo = _mm_unpacklo_epi8(b, a);
+    __m128i ba_hi = _mm_unpackhi_epi8(b, a);
 
-/*
-* PNG Reference Library License version 2
-*
-* Copyright (c) 1995-2019 The PNG Reference Library Authors.
-* Copyright (c) 2018-2019 Cosmin Truta.
-* Copyright (c) 2000-2002, 2004, 2006-2018 Glenn Randers-Pehrson.
-* Copyright (c) 1996-1997 Andreas Dilger.
-* Copyright (c) 1995-1996 Guy Eric Schalnat, Group 42, Inc.
-*
-* The software is supplied "as is", without warranty of any kind,
-* express or implied, including, without limitation, the warranties
-* of merchantability, fitness for a particular purpose, title, and
-* non-infringement.  In no event shall the Copyright owners, or
-* anyone distributing the software, be liable for any damages or
-* other liability, whether in contract, tort or otherwise, arising
-* from, out of, or in connection with the software, or the use or
-* other dealings in the software, even if advised of the possibility
-* of such damage.
-*
-* Permission is hereby granted to use, copy, modify, and distribute
-* this software, or portions hereof, for any purpose, without fee,
-* subject to the following restrictions:
-*
-*  1. The origin of this software must not be misrepresented; you
-*     must not claim that you wrote the original software.  If you
-*     use this software in a product, an acknowledgment in the product
-*     documentation would be appreciated, but is not required.
-*
-*  2. Altered source versions must be plainly marked as such, and must
-*     not be misrepresented as being the original software.
-*
-*  3. This Copyright notice may not be removed or altered from any
-*     source or altered source distribution.
-*/
+    px[0] = _mm_unpacklo_epi16(rg_lo, ba_lo);
+    px[1] = _mm_unpackhi_epi16(rg_lo, ba_lo);
+    px[2] = _mm_unpacklo_epi16(rg_hi, ba_hi);
+    px[3] = _mm_unpackhi_epi16(rg_hi, ba_hi);
+}
 
-#if defined(SPNG_X86)
+/* Expands palette indices below 16 into RGBA8, the palette fits in four registers */
+#if !defined(_MSC_VER)
+__attribute__((target("ssse3")))
+#endif
+static uint32_t expand_palette16_rgba8_ssse3(unsigned char *row, const unsigned char *scanline, const unsigned char *plte, uint32_t width)
+{
+    __m128i planes[4], px[4];
+    uint32_t i;
+    int k;
 
-#ifndef SPNG_SSE
-    #define SPNG_SSE 1
+    palette16_planes(plte, planes);
+
+    for(i=0; i + 16 <= width; i += 16)
+    {
+        palette16_lookup(planes, _mm_loadu_si128((const __m128i*)(scanline + i)), px);
+
+        for(k=0; k < 4; k++) _mm_storeu_si128((__m128i*)(row + i * 4 + k * 16), px[k]);
+    }
+
+    return i;
+}
+
+/* Same as above with the alpha channel dropped */
+#if !defined(_MSC_VER)
+__attribute__((target("ssse3")))
 #endif
+static uint32_t expand_palette16_rgb8_ssse3(unsigned char *row, const unsigned char *scanline, const unsigned char *plte, uint32_t width)
+{
+    const __m128i drop_alpha = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    __m128i planes[4], px[4];
+    uint32_t i;
+    int k;
 
-#if defined(__GNUC__) && !defined(__clang__)
-    #if SPNG_SSE == 3
-        #pragma GCC target("ssse3")
-    #elif SPNG_SSE == 4
-        #pragma GCC target("sse4.1")
-    #else
-        #pragma GCC target("sse2")
-    #endif
+    palette16_planes(plte, planes);
+
+    for(i=0; i + 16 <= width; i += 16)
+    {
+        palette16_lookup(planes, _mm_loadu_si128((const __m128i*)(scanline + i)), px);
+
+        for(k=0; k < 4; k++) px[k] = _mm_shuffle_epi8(px[k], drop_alpha);
+
+        /* 4 x 12 bytes -> 3 x 16 bytes */
+        _mm_storeu_si128((__m128i*)(row + i * 3), _mm_or_si128(px[0], _mm_slli_si128(px[1], 12)));
+        _mm_storeu_si128((__m128i*)(row + i * 3 + 16), _mm_or_si128(_mm_srli_si128(px[1], 4), _mm_slli_si128(px[2], 8)));
+        _mm_storeu_si128((__m128i*)(row + i * 3 + 32), _mm_or_si128(_mm_srli_si128(px[2], 8), _mm_slli_si128(px[3], 4)));
+    }
+
+    return i;
+}
+
+#if !defined(_MSC_VER)
+__attribute__((target("ssse3")))
 #endif
+static uint32_t rgb8_row_to_rgba8_ssse3(const unsigned char *row, unsigned char *out, uint32_t n)
+{
+    const __m128i widen = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    uint32_t i;
 
-/* SSE2 optimised filter functions
- * Derived from filter_neon_intrinsics.c
- *
- * Copyright (c) 2018 Cosmin Truta
- * Copyright (c) 2016-2017 Glenn Randers-Pehrson
- * Written by Mike Klein and Matt Sarett
- * Derived from arm/filter_neon_intrinsics.c
- *
- * This code is derived from libpng source code.
- * For conditions of distribution and use, see the disclaimer
- * and license above.
- */
+    /* 16-byte loads for 4 pixels, the last one has to stay within the row */
+    for(i=0; i + 6 <= n; i += 4)
+    {
+        __m128i px = _mm_loadu_si128((const __m128i*)(row + i * 3));
 
-#include <immintrin.h>
-#include <inttypes.h>
-#include <string.h>
+        _mm_storeu_si128((__m128i*)(out + i * 4), _mm_or_si128(_mm_shuffle_epi8(px, widen), alpha));
+    }
 
-/* Functions in this file look at most 3 pixels (a,b,c) to predict the 4th (d).
- * They're positioned like this:
- *    prev:  c b
- *    row:   a d
- * The Sub filter predicts d=a, Avg d=(a+b)/2, and Paeth predicts d to be
- * whichever of a, b, or c is closest to p=a+b-c.
- */
+    return i;
+}
+
+#endif /* SPNG_SSE >= 3 */
+
+static void copy_nontemporal(unsigned char *dst, const unsigned char *src, size_t len)
+{
+    size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+
+    if(head > len) head = len;
+
+    memcpy(dst, src, head);
+
+    dst += head;
+    src += head;
+    len -= head;
+
+    for(; len >= 16; len -= 16, dst += 16, src += 16)
+    {
+        _mm_stream_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+    }
+
+    memcpy(dst, src, len);
+}
+
+static void nontemporal_fence(void)
+{
+    _mm_sfence();
+}
+
+/* Adds a row of 8-bit samples to 16-bit column sums */
+static size_t accumulate_u8_sse2(uint16_t *acc, const unsigned char *row, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i;
+
+    for(i=0; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i lo = _mm_loadu_si128((const __m128i*)(acc + i));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(acc + i + 8));
+
+        lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+        hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+
+        _mm_storeu_si128((__m128i*)(acc + i), lo);
+        _mm_storeu_si128((__m128i*)(acc + i + 8), hi);
+    }
+
+    return i;
+}
+
+/* Interleave pixels of 1, 2, 4 or 8 bytes */
+static uint32_t interleave_pixels_sse2(unsigned char *out, const unsigned char *a, const unsigned char *b,
+                                       uint32_t n, size_t pixel_size)
+{
+    uint32_t i, step;
+
+    if(pixel_size > 8 || (pixel_size & (pixel_size - 1))) return 0;
+
+    step = 16 / (uint32_t)pixel_size;
+
+    for(i=0; i + step <= n; i += step)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i * pixel_size));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i * pixel_size));
+        __m128i lo, hi;
+
+        if(pixel_size == 1)
+        {
+            lo = _mm_unpacklo_epi8(va, vb);
+            hi = _mm_unpackhi_epi8(va, vb);
+        }
+        else if(pixel_size == 2)
+        {
+            lo = _mm_unpacklo_epi16(va, vb);
+            hi = _mm_unpackhi_epi16(va, vb);
+        }
+        else if(pixel_size == 4)
+        {
+            lo = _mm_unpacklo_epi32(va, vb);
+            hi = _mm_unpackhi_epi32(va, vb);
+        }
+        else
+        {
+            lo = _mm_unpacklo_epi64(va, vb);
+            hi = _mm_unpackhi_epi64(va, vb);
+        }
+
+        _mm_storeu_si128((__m128i*)(out + 2 * i * pixel_size), lo);
+        _mm_storeu_si128((__m128i*)(out + 2 * i * pixel_size + 16), hi);
+    }
+
+    return i;
+}
+
+#if defined(SPNG_X86_AVX)
+
+#if defined(_MSC_VER) && !defined(__clang__)
+    #include <intrin.h>
+    #define SPNG_TARGET(x)
+#else
+    #include <cpuid.h>
+    #define SPNG_TARGET(x) __attribute__((target(x)))
+#endif
+
+static void x86_cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4])
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int tmp[4];
+    __cpuidex(tmp, (int)leaf, (int)subleaf);
+    memcpy(regs, tmp, sizeof(tmp));
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/* Returns the register state enabled by the OS (XCR0) */
+static uint64_t x86_xgetbv(void)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+static int get_x86_simd_level(void)
+{
+    unsigned regs[4];
+    const unsigned osxsave_avx = (1u << 27) | (1u << 28);
+    const unsigned avx512f_bw = (1u << 16) | (1u << 30);
+
+    x86_cpuid(0, 0, regs);
+    if(regs[0] < 7) return SPNG__SIMD_BASE;
+
+    x86_cpuid(1, 0, regs);
+    if((regs[2] & osxsave_avx) != osxsave_avx) return SPNG__SIMD_BASE;
+
+    uint64_t xcr0 = x86_xgetbv();
+
+    /* XMM and YMM state */
+    if((xcr0 & 0x6) != 0x6) return SPNG__SIMD_BASE;
+
+    x86_cpuid(7, 0, regs);
+    if(!(regs[1] & (1u << 5))) return SPNG__SIMD_BASE;
+
+    /* Opmask, ZMM0-15 upper halves and ZMM16-31 state */
+    if((xcr0 & 0xE0) != 0xE0) return SPNG__SIMD_AVX2;
+    if((regs[1] & avx512f_bw) != avx512f_bw) return SPNG__SIMD_AVX2;
+
+    return SPNG__SIMD_AVX512;
+}
+
+static int get_x86_crc_level(int simd_level)
+{
+    unsigned regs[4];
+
+    x86_cpuid(1, 0, regs);
+    if(!(regs[2] & (1u << 1))) return SPNG__CRC_ZLIB; /* PCLMULQDQ */
+
+    if(simd_level < SPNG__SIMD_AVX2) return SPNG__CRC_HW;
+
+    x86_cpuid(7, 0, regs);
+    if(!(regs[2] & (1u << 10))) return SPNG__CRC_HW; /* VPCLMULQDQ */
+
+    return SPNG__CRC_VPCLMUL;
+}
+
+/* Returns the size of the largest data or unified cache in bytes, 0 if unknown */
+static size_t x86_llc_size(void)
+{
+    unsigned regs[4];
+    unsigned leaf = 0, i;
+    size_t max = 0;
+
+    x86_cpuid(0, 0, regs);
+
+    /* Deterministic cache parameters, Intel and AMD (Zen) */
+    if(regs[0] >= 4 && regs[1] == 0x756e6547) leaf = 4; /* "Genu" */
+    else
+    {
+        x86_cpuid(0x80000000, 0, regs);
+        if(regs[0] >= 0x8000001D) leaf = 0x8000001D;
+    }
+
+    if(!leaf) return 0;
+
+    for(i=0; i < 16; i++)
+    {
+        x86_cpuid(leaf, i, regs);
+
+        unsigned type = regs[0] & 31;
+
+        if(!type) break;
+        if(type != 1 && type != 3) continue; /* data or unified */
+
+        size_t ways = ((regs[1] >> 22) & 0x3FF) + 1;
+        size_t partitions = ((regs[1] >> 12) & 0x3FF) + 1;
+        size_t line_size = (regs[1] & 0xFFF) + 1;
+        size_t sets = (size_t)regs[2] + 1;
+
+        size_t size = ways * partitions * line_size * sets;
+
+        if(size > max) max = size;
+    }
+
+    return max;
+}
+
+/* Shuffle mask that broadcasts the last pixel of each 128-bit lane */
+static void last_pixel_mask(unsigned char *mask, size_t size, unsigned bpp)
+{
+    size_t i;
+    for(i=0; i < size; i++) mask[i] = 16 - bpp + (i % bpp);
+}
+
+SPNG_TARGET("avx2")
+static void defilter_up_avx2(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+{
+    size_t i;
+    for(i=0; i + 32 <= rowbytes; i += 32)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i*)(row + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(prev + i));
+
+        _mm256_storeu_si256((__m256i*)(row + i), _mm256_add_epi8(d, b));
+    }
+
+    for(; i < rowbytes; i++) row[i] += prev[i];
+}
+
+/* Sub for 1, 2 and 4 byte pixels as a prefix sum over 32 bytes:
+ * pixels are summed within each 128-bit lane first, then the last pixel
+ * of the low lane is added to the high lane and the last pixel of the
+ * previous block is added to both. */
+SPNG_TARGET("avx2")
+static void defilter_sub_avx2(size_t rowbytes, unsigned char *row, unsigned bpp)
+{
+    size_t i = 0;
+    unsigned char mask_bytes[32];
+    last_pixel_mask(mask_bytes, sizeof(mask_bytes), bpp);
+
+    const __m256i mask = _mm256_loadu_si256((const __m256i*)mask_bytes);
+    __m256i d, carry = _mm256_setzero_si256();
+
+    for(; i + 32 <= rowbytes; i += 32)
+    {
+        d = _mm256_loadu_si256((const __m256i*)(row + i));
+
+        if(bpp <= 1) d = _mm256_add_epi8(d, _mm256_slli_si256(d, 1));
+        if(bpp <= 2) d = _mm256_add_epi8(d, _mm256_slli_si256(d, 2));
+        d = _mm256_add_epi8(d, _mm256_slli_si256(d, 4));
+        d = _mm256_add_epi8(d, _mm256_slli_si256(d, 8));
+
+        /* Low lane moved to the high lane, the low lane is zeroed */
+        __m256i low = _mm256_permute2x128_si256(d, d, 0x08);
+
+        d = _mm256_add_epi8(d, _mm256_shuffle_epi8(low, mask));
+
+        _mm256_storeu_si256((__m256i*)(row + i), _mm256_add_epi8(d, carry));
+
+        carry = _mm256_add_epi8(carry, _mm256_shuffle_epi8(_mm256_permute2x128_si256(d, d, 0x11), mask));
+    }
+
+    if(i < bpp) i = bpp;
+
+    for(; i < rowbytes; i++) row[i] += row[i - bpp];
+}
+
+/* Returns 1 if the scanline was defiltered */
+static int defilter_avx2(size_t rowbytes, unsigned char *row, const unsigned char *prev, unsigned bpp, unsigned filter)
+{
+    if(filter == SPNG_FILTER_UP)
+    {
+        defilter_up_avx2(rowbytes, row, prev);
+        return 1;
+    }
+
+    /* defilter_sub8() already adds a whole pixel per instruction */
+    if(filter == SPNG_FILTER_SUB && (bpp == 1 || bpp == 2 || bpp == 4))
+    {
+        defilter_sub_avx2(rowbytes, row, bpp);
+        return 1;
+    }
+
+    /* Avg and Paeth depend on the previous pixel, wider registers do not help */
+    return 0;
+}
+
+SPNG_TARGET("avx512f,avx512bw")
+static void defilter_up_avx512(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+{
+    size_t i;
+    for(i=0; i + 64 <= rowbytes; i += 64)
+    {
+        __m512i d = _mm512_loadu_si512(row + i);
+        __m512i b = _mm512_loadu_si512(prev + i);
+
+        _mm512_storeu_si512(row + i, _mm512_add_epi8(d, b));
+    }
 
-static __m128i load4(const void* p)
-{
-    int tmp;
-    memcpy(&tmp, p, sizeof(tmp));
-    return _mm_cvtsi32_si128(tmp);
+    if(i < rowbytes)
+    {
+        __mmask64 tail = ~(uint64_t)0 >> (64 - (rowbytes - i));
+
+        __m512i d = _mm512_maskz_loadu_epi8(tail, row + i);
+        __m512i b = _mm512_maskz_loadu_epi8(tail, prev + i);
+
+        _mm512_mask_storeu_epi8(row + i, tail, _mm512_add_epi8(d, b));
+    }
 }
 
-static void store4(void* p, __m128i v)
+static int defilter_avx512(size_t rowbytes, unsigned char *row, const unsigned char *prev, unsigned bpp, unsigned filter)
 {
-    int tmp = _mm_cvtsi128_si32(v);
-    memcpy(p, &tmp, sizeof(int));
+    (void)bpp;
+
+    if(filter == SPNG_FILTER_UP)
+    {
+        defilter_up_avx512(rowbytes, row, prev);
+        return 1;
+    }
+
+    /* A prefix sum across four lanes is no faster than defilter_sub_avx2() */
+    return 0;
 }
 
-static __m128i load3(const void* p)
+SPNG_TARGET("avx2")
+static __m256i filter_cost_avx2(__m256i v)
 {
-    uint32_t tmp = 0;
-    memcpy(&tmp, p, 3);
-    return _mm_cvtsi32_si128(tmp);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i cost = _mm256_min_epu8(v, _mm256_sub_epi8(zero, v));
+
+    return _mm256_sad_epu8(cost, zero);
 }
 
-static void store3(void* p, __m128i v)
+SPNG_TARGET("avx2")
+static __m256i paeth_epi16_avx2(__m256i a, __m256i b, __m256i c)
 {
-    int tmp = _mm_cvtsi128_si32(v);
-    memcpy(p, &tmp, 3);
+    __m256i pa, pb, pc, smallest, nearest;
+
+    pa = _mm256_sub_epi16(b, c);
+    pb = _mm256_sub_epi16(a, c);
+    pc = _mm256_add_epi16(pa, pb);
+
+    pa = _mm256_abs_epi16(pa);
+    pb = _mm256_abs_epi16(pb);
+    pc = _mm256_abs_epi16(pc);
+
+    smallest = _mm256_min_epi16(pc, _mm256_min_epi16(pa, pb));
+
+    /* Ties favor a over b over c */
+    nearest = _mm256_blendv_epi8(c, b, _mm256_cmpeq_epi16(smallest, pb));
+
+    return _mm256_blendv_epi8(nearest, a, _mm256_cmpeq_epi16(smallest, pa));
 }
 
-static void defilter_sub3(size_t rowbytes, unsigned char *row)
+/* Same as filter_candidates_sse2() with 32 bytes,
+   unpacking and packing work within 128-bit lanes so the byte order is preserved */
+SPNG_TARGET("avx2")
+static size_t filter_candidates_avx2(unsigned char *rows, size_t stride, const unsigned char *prev, const unsigned char *row,
+                                     size_t i, size_t rowbytes, unsigned bpp, uint64_t scores[5])
 {
-    /* The Sub filter predicts each pixel as the previous pixel, a.
-     * There is no pixel to the left of the first pixel.  It's encoded directly.
-     * That works with our main loop if we just say that left pixel was zero.
-     */
-    size_t rb = rowbytes;
-
-    __m128i a, d = _mm_setzero_si128();
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    __m256i sum[5] = { zero, zero, zero, zero, zero };
+    uint64_t tmp[4];
+    int k;
 
-    while(rb >= 4)
+    for(; i + 32 <= rowbytes; i += 32)
     {
-        a = d; d = load4(row);
-        d = _mm_add_epi8(d, a);
-        store3(row, d);
+        __m256i x = _mm256_loadu_si256((const __m256i*)(row + i));
+        __m256i a = _mm256_loadu_si256((const __m256i*)(row + i - bpp));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(prev + i));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(prev + i - bpp));
 
-        row += 3;
-        rb  -= 3;
+        __m256i pred_lo = paeth_epi16_avx2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero));
+        __m256i pred_hi = paeth_epi16_avx2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero));
+
+        /* Truncating average */
+        __m256i avg = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+
+        __m256i sub = _mm256_sub_epi8(x, a);
+        __m256i up = _mm256_sub_epi8(x, b);
+        avg = _mm256_sub_epi8(x, avg);
+        __m256i pae = _mm256_sub_epi8(x, _mm256_packus_epi16(pred_lo, pred_hi));
+
+        _mm256_storeu_si256((__m256i*)(rows + i), sub);
+        _mm256_storeu_si256((__m256i*)(rows + stride + i), up);
+        _mm256_storeu_si256((__m256i*)(rows + stride * 2 + i), avg);
+        _mm256_storeu_si256((__m256i*)(rows + stride * 3 + i), pae);
+
+        sum[0] = _mm256_add_epi64(sum[0], filter_cost_avx2(x));
+        sum[1] = _mm256_add_epi64(sum[1], filter_cost_avx2(sub));
+        sum[2] = _mm256_add_epi64(sum[2], filter_cost_avx2(up));
+        sum[3] = _mm256_add_epi64(sum[3], filter_cost_avx2(avg));
+        sum[4] = _mm256_add_epi64(sum[4], filter_cost_avx2(pae));
     }
 
-    if(rb > 0)
+    for(k=0; k < 5; k++)
     {
-        a = d; d = load3(row);
-        d = _mm_add_epi8(d, a);
-        store3(row, d);
+        _mm256_storeu_si256((__m256i*)tmp, sum[k]);
+        scores[k] += tmp[0] + tmp[1] + tmp[2] + tmp[3];
     }
+
+    return i;
 }
 
-static void defilter_sub4(size_t rowbytes, unsigned char *row)
+/* Same as filter_candidates_avx2() for Sub and Up only, the Avg and Paeth rows and scores are not written */
+SPNG_TARGET("avx2")
+static size_t filter_sub_up_avx2(unsigned char *rows, size_t stride, const unsigned char *prev, const unsigned char *row,
+                                 size_t i, size_t rowbytes, unsigned bpp, uint64_t scores[5])
 {
-    /* The Sub filter predicts each pixel as the previous pixel, a.
-     * There is no pixel to the left of the first pixel.  It's encoded directly.
-     * That works with our main loop if we just say that left pixel was zero.
-     */
-    size_t rb = rowbytes+4;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum[3] = { zero, zero, zero };
+    uint64_t tmp[4];
+    int k;
 
-    __m128i a, d = _mm_setzero_si128();
-
-    while(rb > 4)
+    for(; i + 32 <= rowbytes; i += 32)
     {
-        a = d; d = load4(row);
-        d = _mm_add_epi8(d, a);
-        store4(row, d);
+        __m256i x = _mm256_loadu_si256((const __m256i*)(row + i));
+        __m256i a = _mm256_loadu_si256((const __m256i*)(row + i - bpp));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(prev + i));
 
-        row += 4;
-        rb  -= 4;
+        __m256i sub = _mm256_sub_epi8(x, a);
+        __m256i up = _mm256_sub_epi8(x, b);
+
+        _mm256_storeu_si256((__m256i*)(rows + i), sub);
+        _mm256_storeu_si256((__m256i*)(rows + stride + i), up);
+
+        sum[0] = _mm256_add_epi64(sum[0], filter_cost_avx2(x));
+        sum[1] = _mm256_add_epi64(sum[1], filter_cost_avx2(sub));
+        sum[2] = _mm256_add_epi64(sum[2], filter_cost_avx2(up));
+    }
+
+    for(k=0; k < 3; k++)
+    {
+        _mm256_storeu_si256((__m256i*)tmp, sum[k]);
+        scores[k] += tmp[0] + tmp[1] + tmp[2] + tmp[3];
     }
+
+    return i;
 }
 
-static void defilter_avg3(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+/* Expands a palettized row into RGBA8 with gathers from the 32-bit palette entries */
+SPNG_TARGET("avx2")
+static uint32_t expand_palette_rgba8_avx2(unsigned char *row, const unsigned char *scanline, const unsigned char *plte, uint32_t width)
 {
-    /* The Avg filter predicts each pixel as the (truncated) average of a and b.
-     * There's no pixel to the left of the first pixel.  Luckily, it's
-     * predicted to be half of the pixel above it.  So again, this works
-     * perfectly with our loop if we make sure a starts at zero.
-     */
+    uint32_t i;
+    for(i=0; i + 8 <= width; i += 8)
+    {
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(scanline + i)));
+        __m256i px = _mm256_i32gather_epi32((const int*)plte, idx, 4);
 
-    size_t rb = rowbytes;
+        _mm256_storeu_si256((__m256i*)(row + i * 4), px);
+    }
 
-    const __m128i zero = _mm_setzero_si128();
+    return i;
+}
 
-    __m128i b;
-    __m128i a, d = zero;
+/* Same as above, alpha is dropped from each lane and the 24 bytes are made contiguous */
+SPNG_TARGET("avx2")
+static uint32_t expand_palette_rgb8_avx2(unsigned char *row, const unsigned char *scanline, const unsigned char *plte, uint32_t width)
+{
+    const __m256i drop_alpha = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                                0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    uint32_t i;
 
-    while(rb >= 4)
+    for(i=0; i + 8 <= width; i += 8)
     {
-        __m128i avg;
-               b = load4(prev);
-        a = d; d = load4(row );
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(scanline + i)));
+        __m256i px = _mm256_i32gather_epi32((const int*)plte, idx, 4);
 
-        /* PNG requires a truncating average, so we can't just use _mm_avg_epu8 */
-        avg = _mm_avg_epu8(a,b);
-        /* ...but we can fix it up by subtracting off 1 if it rounded up. */
-        avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b),
-                                            _mm_set1_epi8(1)));
-        d = _mm_add_epi8(d, avg);
-        store3(row, d);
+        px = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(px, drop_alpha), compact);
 
-        prev += 3;
-        row  += 3;
-        rb   -= 3;
+        _mm_storeu_si128((__m128i*)(row + i * 3), _mm256_castsi256_si128(px));
+        _mm_storel_epi64((__m128i*)(row + i * 3 + 16), _mm256_extracti128_si256(px, 1));
     }
 
-    if(rb > 0)
+    return i;
+}
+
+SPNG_TARGET("avx2")
+static uint32_t rgb8_row_to_rgba8_avx2(const unsigned char *row, unsigned char *out, uint32_t n)
+{
+    const __m256i widen = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                           0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+    uint32_t i;
+
+    /* Two 16-byte loads for 8 pixels, the last one has to stay within the row */
+    for(i=0; i + 10 <= n; i += 8)
     {
-        __m128i avg;
-               b = load3(prev);
-        a = d; d = load3(row );
+        __m128i lo = _mm_loadu_si128((const __m128i*)(row + i * 3));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(row + i * 3 + 12));
+        __m256i px = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
 
-        /* PNG requires a truncating average, so we can't just use _mm_avg_epu8 */
-        avg = _mm_avg_epu8(a, b);
-        /* ...but we can fix it up by subtracting off 1 if it rounded up. */
-        avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b),
-                                            _mm_set1_epi8(1)));
+        _mm256_storeu_si256((__m256i*)(out + i * 4), _mm256_or_si256(_mm256_shuffle_epi8(px, widen), alpha));
+    }
 
-        d = _mm_add_epi8(d, avg);
-        store3(row, d);
+    return i;
+}
+
+/* CRC32 by folding with carry-less multiplication, from Intel's
+   "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+   The constants are x^(n+32) mod P and x^(n-32) mod P, bit-reflected and shifted left by one,
+   for a folding distance of n bits. */
+static const uint64_t crc_k512[2] = { 0x0154442bd4, 0x01c6e41596 };
+static const uint64_t crc_k128[2] = { 0x01751997d0, 0x00ccaa009e };
+static const uint64_t crc_k64[2] = { 0x0163cd6124, 0 };
+static const uint64_t crc_poly[2] = { 0x01db710641, 0x01f7011641 }; /* P and floor(x^64 / P) */
+
+SPNG_TARGET("pclmul")
+static inline __m128i crc_fold16(__m128i x, __m128i k, __m128i next)
+{
+    __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+
+    return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+/* Folds the remaining 16-byte blocks into x and reduces it to the (inverted) CRC */
+SPNG_TARGET("pclmul")
+static inline uint32_t crc_fold_reduce(__m128i x, unsigned char *dst, const unsigned char *src, size_t n)
+{
+    const __m128i k128 = _mm_loadu_si128((const __m128i*)crc_k128);
+    const __m128i mask = _mm_setr_epi32(-1, 0, -1, 0);
+    size_t i;
+
+    for(i=0; i < n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+
+        if(dst != NULL) _mm_storeu_si128((__m128i*)(dst + i), v);
+
+        x = crc_fold16(x, k128, v);
     }
+
+    /* 128 to 64 bits */
+    __m128i t = _mm_clmulepi64_si128(x, k128, 0x10);
+    x = _mm_xor_si128(_mm_srli_si128(x, 8), t);
+
+    t = _mm_srli_si128(x, 4);
+    x = _mm_clmulepi64_si128(_mm_and_si128(x, mask), _mm_loadu_si128((const __m128i*)crc_k64), 0x00);
+    x = _mm_xor_si128(x, t);
+
+    /* Barrett reduction to 32 bits */
+    const __m128i poly = _mm_loadu_si128((const __m128i*)crc_poly);
+
+    t = _mm_clmulepi64_si128(_mm_and_si128(x, mask), poly, 0x10);
+    t = _mm_clmulepi64_si128(_mm_and_si128(t, mask), poly, 0x00);
+    x = _mm_xor_si128(x, t);
+
+    return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x, 4));
 }
 
-static void defilter_avg4(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+/* Processes len rounded down to 16 bytes, len must be at least 64 */
+SPNG_TARGET("pclmul")
+static size_t crc32_pclmul(uint32_t *crc, unsigned char *dst, const unsigned char *src, size_t len)
 {
-    /* The Avg filter predicts each pixel as the (truncated) average of a and b.
-     * There's no pixel to the left of the first pixel.  Luckily, it's
-     * predicted to be half of the pixel above it.  So again, this works
-     * perfectly with our loop if we make sure a starts at zero.
-     */
-    size_t rb = rowbytes+4;
+    const __m128i k512 = _mm_loadu_si128((const __m128i*)crc_k512);
+    const __m128i k128 = _mm_loadu_si128((const __m128i*)crc_k128);
+    size_t i;
 
-    const __m128i zero = _mm_setzero_si128();
-    __m128i    b;
-    __m128i a, d = zero;
+    __m128i x0 = _mm_loadu_si128((const __m128i*)src);
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(src + 16));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(src + 32));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(src + 48));
 
-    while(rb > 4)
+    if(dst != NULL)
     {
-        __m128i avg;
-               b = load4(prev);
-        a = d; d = load4(row );
+        _mm_storeu_si128((__m128i*)dst, x0);
+        _mm_storeu_si128((__m128i*)(dst + 16), x1);
+        _mm_storeu_si128((__m128i*)(dst + 32), x2);
+        _mm_storeu_si128((__m128i*)(dst + 48), x3);
+    }
 
-        /* PNG requires a truncating average, so we can't just use _mm_avg_epu8 */
-        avg = _mm_avg_epu8(a,b);
-        /* ...but we can fix it up by subtracting off 1 if it rounded up. */
-        avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b),
-                                            _mm_set1_epi8(1)));
+    x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128((int)~*crc));
 
-        d = _mm_add_epi8(d, avg);
-        store4(row, d);
+    for(i=64; i + 64 <= len; i += 64)
+    {
+        __m128i y0 = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i y1 = _mm_loadu_si128((const __m128i*)(src + i + 16));
+        __m128i y2 = _mm_loadu_si128((const __m128i*)(src + i + 32));
+        __m128i y3 = _mm_loadu_si128((const __m128i*)(src + i + 48));
 
-        prev += 4;
-        row  += 4;
-        rb   -= 4;
+        if(dst != NULL)
+        {
+            _mm_storeu_si128((__m128i*)(dst + i), y0);
+            _mm_storeu_si128((__m128i*)(dst + i + 16), y1);
+            _mm_storeu_si128((__m128i*)(dst + i + 32), y2);
+            _mm_storeu_si128((__m128i*)(dst + i + 48), y3);
+        }
+
+        x0 = crc_fold16(x0, k512, y0);
+        x1 = crc_fold16(x1, k512, y1);
+        x2 = crc_fold16(x2, k512, y2);
+        x3 = crc_fold16(x3, k512, y3);
     }
+
+    x0 = crc_fold16(x0, k128, x1);
+    x0 = crc_fold16(x0, k128, x2);
+    x0 = crc_fold16(x0, k128, x3);
+
+    size_t n = (len - i) & ~(size_t)15;
+
+    *crc = ~crc_fold_reduce(x0, dst != NULL ? dst + i : NULL, src + i, n);
+
+    return i + n;
 }
 
-/* Returns |x| for 16-bit lanes. */
-#if (SPNG_SSE >= 3) && !defined(_MSC_VER)
-__attribute__((target("ssse3")))
-#endif
-static __m128i abs_i16(__m128i x)
+/* Adler-32 in blocks of 32 bytes, processes len rounded down to 32 bytes */
+SPNG_TARGET("avx2")
+static size_t adler32_avx2(uint32_t *adler, const unsigned char *data, size_t len)
 {
-#if SPNG_SSE >= 3
-    return _mm_abs_epi16(x);
-#else
-    /* Read this all as, return x<0 ? -x : x.
-     * To negate two's complement, you flip all the bits then add 1.
-     */
-    __m128i is_negative = _mm_cmplt_epi16(x, _mm_setzero_si128());
+    const uint32_t base = 65521;
+    const size_t nmax = 5536; /* largest multiple of 32 that can't overflow s2 */
+    const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                             16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t s1 = *adler & 0xFFFF, s2 = *adler >> 16;
+    size_t done = 0;
 
-    /* Flip negative lanes. */
-    x = _mm_xor_si128(x, is_negative);
+    len &= ~(size_t)31;
 
-    /* +1 to negative lanes, else +0. */
-    x = _mm_sub_epi16(x, is_negative);
-    return x;
-#endif
+    while(done < len)
+    {
+        size_t n = len - done, i;
+        uint32_t sums[8];
+        int k;
+
+        if(n > nmax) n = nmax;
+
+        __m256i v1 = zero, v2 = zero, prev = zero;
+
+        for(i=0; i < n; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(data + done + i));
+
+            prev = _mm256_add_epi32(prev, v1);
+            v1 = _mm256_add_epi32(v1, _mm256_sad_epu8(v, zero));
+            v2 = _mm256_add_epi32(v2, _mm256_madd_epi16(_mm256_maddubs_epi16(v, weights), ones));
+        }
+
+        v2 = _mm256_add_epi32(v2, _mm256_slli_epi32(prev, 5));
+
+        s2 += s1 * (uint32_t)n;
+
+        _mm256_storeu_si256((__m256i*)sums, v1);
+        for(k=0; k < 8; k++) s1 += sums[k];
+
+        _mm256_storeu_si256((__m256i*)sums, v2);
+        for(k=0; k < 8; k++) s2 += sums[k];
+
+        s1 %= base;
+        s2 %= base;
+
+        done += n;
+    }
+
+    *adler = (s2 << 16) | s1;
+
+    return len;
 }
 
-/* Bytewise c ? t : e. */
-static __m128i if_then_else(__m128i c, __m128i t, __m128i e)
+static inline unsigned ctz32(uint32_t x)
 {
-#if SPNG_SSE >= 4
-    return _mm_blendv_epi8(e, t, c);
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return (unsigned)index;
 #else
-    return _mm_or_si128(_mm_and_si128(c, t), _mm_andnot_si128(c, e));
+    return (unsigned)__builtin_ctz(x);
 #endif
 }
 
-static void defilter_paeth3(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+/* Bit mask of the bytes in p[0..31] that differ from the bytes at distance */
+SPNG_TARGET("avx2")
+static inline uint32_t mismatch_avx2(const unsigned char *p, size_t distance)
 {
-    /* Paeth tries to predict pixel d using the pixel to the left of it, a,
-     * and two pixels from the previous row, b and c:
-     *   prev: c b
-     *   row:  a d
-     * The Paeth function predicts d to be whichever of a, b, or c is nearest to
-     * p=a+b-c.
-     *
-     * The first pixel has no left context, and so uses an Up filter, p = b.
-     * This works naturally with our main loop's p = a+b-c if we force a and c
-     * to zero.
-     * Here we zero b and d, which become c and a respectively at the start of
-     * the loop.
-     */
-    size_t rb = rowbytes;
-    const __m128i zero = _mm_setzero_si128();
-    __m128i c, b = zero,
-            a, d = zero;
-
-    while(rb >= 4)
-    {
-        /* It's easiest to do this math (particularly, deal with pc) with 16-bit
-         * intermediates.
-         */
-        __m128i pa,pb,pc,smallest,nearest;
-        c = b; b = _mm_unpacklo_epi8(load4(prev), zero);
-        a = d; d = _mm_unpacklo_epi8(load4(row ), zero);
+    __m256i a = _mm256_loadu_si256((const __m256i*)p);
+    __m256i b = _mm256_loadu_si256((const __m256i*)(p - distance));
 
-        /* (p-a) == (a+b-c - a) == (b-c) */
+    return ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+}
 
-        pa = _mm_sub_epi16(b, c);
+/* Same as match_length() with 32 bytes, reads up to 31 bytes past max */
+SPNG_TARGET("avx2")
+static inline size_t match_length_avx2(const unsigned char *p, size_t distance, size_t max)
+{
+    size_t len = 0;
 
-        /* (p-b) == (a+b-c - b) == (a-c) */
-        pb = _mm_sub_epi16(a, c);
+    while(len < max)
+    {
+        uint32_t mismatch = mismatch_avx2(p + len, distance);
 
-        /* (p-c) == (a+b-c - c) == (a+b-c-c) == (b-c)+(a-c) */
-        pc = _mm_add_epi16(pa, pb);
+        if(mismatch)
+        {
+            len += ctz32(mismatch);
+            break;
+        }
 
-        pa = abs_i16(pa);  /* |p-a| */
-        pb = abs_i16(pb);  /* |p-b| */
-        pc = abs_i16(pc);  /* |p-c| */
+        len += 32;
+    }
 
-        smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    return len < max ? len : max;
+}
 
-        /* Paeth breaks ties favoring a over b over c. */
-        nearest  = if_then_else(_mm_cmpeq_epi16(smallest, pa), a,
-                            if_then_else(_mm_cmpeq_epi16(smallest, pb), b, c));
+/* Same parse as fast_parse(), the three candidates are compared at once and without branches
+   for matches shorter than 32 bytes, which are most matches outside of runs.
+   Starts after the first scanline and stops 290 bytes before the end so every read is in bounds. */
+SPNG_TARGET("avx2")
+static size_t fast_parse_avx2(struct spng__fast_parser *p, size_t i)
+{
+    const unsigned char *in = p->in;
+    const size_t bpp = p->bpp, up = p->up ? p->up : p->bpp;
 
-        /* Note `_epi8`: we need addition to wrap modulo 255. */
-        d = _mm_add_epi8(d, nearest);
-        store3(row, _mm_packus_epi16(d, d));
+    if(p->n < 258 + 32) return i;
 
-        prev += 3;
-        row  += 3;
-        rb   -= 3;
-    }
+    const size_t end = p->n - 258 - 32;
 
-    if(rb > 0)
+    while(i < end)
     {
-        /* It's easiest to do this math (particularly, deal with pc) with 16-bit
-         * intermediates.
-         */
-        __m128i pa, pb, pc, smallest, nearest;
-        c = b; b = _mm_unpacklo_epi8(load3(prev), zero);
-        a = d; d = _mm_unpacklo_epi8(load3(row ), zero);
+        uint32_t cur = read_le32(in + i);
+        uint32_t h = fast_hash(cur);
+        size_t candidate = p->hash[h];
 
-        /* (p-a) == (a+b-c - a) == (b-c) */
-        pa = _mm_sub_epi16(b, c);
+        p->hash[h] = (uint32_t)(i + 1);
 
-        /* (p-b) == (a+b-c - b) == (a-c) */
-        pb = _mm_sub_epi16(a, c);
+        /* Out of the window, or no candidate, compares with the previous pixel again */
+        size_t distance3 = candidate && i - (candidate - 1) <= p->window ? i - (candidate - 1) : bpp;
 
-        /* (p-c) == (a+b-c - c) == (a+b-c-c) == (b-c)+(a-c) */
-        pc = _mm_add_epi16(pa, pb);
+        uint32_t m1 = mismatch_avx2(in + i, bpp);
+        uint32_t m2 = mismatch_avx2(in + i, up);
+        uint32_t m3 = mismatch_avx2(in + i, distance3);
 
-        pa = abs_i16(pa);  /* |p-a| */
-        pb = abs_i16(pb);  /* |p-b| */
-        pc = abs_i16(pc);  /* |p-c| */
+        size_t l1 = m1 ? ctz32(m1) : match_length_avx2(in + i, bpp, 258);
+        size_t l2 = m2 ? ctz32(m2) : match_length_avx2(in + i, up, 258);
+        size_t l3 = m3 ? ctz32(m3) : match_length_avx2(in + i, distance3, 258);
 
-        smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+        size_t len = l1 >= 3 ? l1 : 0, distance = bpp;
 
-        /* Paeth breaks ties favoring a over b over c. */
-        nearest  = if_then_else(_mm_cmpeq_epi16(smallest, pa), a,
-                            if_then_else(_mm_cmpeq_epi16(smallest, pb), b, c));
+        if(p->up && l2 >= 3 && l2 > len)
+        {
+            len = l2;
+            distance = up;
+        }
 
-        /* Note `_epi8`: we need addition to wrap modulo 255. */
-        d = _mm_add_epi8(d, nearest);
-        store3(row, _mm_packus_epi16(d, d));
+        if(l3 >= 4 && l3 > len + 1)
+        {
+            len = l3;
+            distance = distance3;
+        }
+
+        if(len)
+        {
+            fast_add_match(p, len, distance);
+            i += len;
+        }
+        else i = fast_add_literals(p, i);
     }
+
+    return i;
 }
 
-static void defilter_paeth4(size_t rowbytes, unsigned char *row, const unsigned char *prev)
+#if defined(SPNG_X86_VPCLMUL)
+
+SPNG_TARGET("avx2,pclmul,vpclmulqdq")
+static inline __m256i crc_fold32(__m256i x, __m256i k, __m256i next)
 {
-    /* Paeth tries to predict pixel d using the pixel to the left of it, a,
-     * and two pixels from the previous row, b and c:
-     *   prev: c b
-     *   row:  a d
-     * The Paeth function predicts d to be whichever of a, b, or c is nearest to
-     * p=a+b-c.
-     *
-     * The first pixel has no left context, and so uses an Up filter, p = b.
-     * This works naturally with our main loop's p = a+b-c if we force a and c
-     * to zero.
-     * Here we zero b and d, which become c and a respectively at the start of
-     * the loop.
-     */
-    size_t rb = rowbytes+4;
+    __m256i lo = _mm256_clmulepi64_epi128(x, k, 0x00);
+    __m256i hi = _mm256_clmulepi64_epi128(x, k, 0x11);
 
-    const __m128i zero = _mm_setzero_si128();
-    __m128i pa, pb, pc, smallest, nearest;
-    __m128i c, b = zero,
-            a, d = zero;
+    return _mm256_xor_si256(_mm256_xor_si256(lo, hi), next);
+}
 
-    while(rb > 4)
+/* Same as crc32_pclmul() with 128 bytes per iteration, len must be at least 256 */
+SPNG_TARGET("avx2,pclmul,vpclmulqdq")
+static size_t crc32_vpclmul(uint32_t *crc, unsigned char *dst, const unsigned char *src, size_t len)
+{
+    static const uint64_t k1024[2] = { 0x01e88ef372, 0x014a7fe880 };
+    const __m256i k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)k1024));
+    const __m128i k128 = _mm_loadu_si128((const __m128i*)crc_k128);
+    size_t i;
+
+    __m256i x0 = _mm256_loadu_si256((const __m256i*)src);
+    __m256i x1 = _mm256_loadu_si256((const __m256i*)(src + 32));
+    __m256i x2 = _mm256_loadu_si256((const __m256i*)(src + 64));
+    __m256i x3 = _mm256_loadu_si256((const __m256i*)(src + 96));
+
+    if(dst != NULL)
     {
-        /* It's easiest to do this math (particularly, deal with pc) with 16-bit
-         * intermediates.
-         */
-        c = b; b = _mm_unpacklo_epi8(load4(prev), zero);
-        a = d; d = _mm_unpacklo_epi8(load4(row ), zero);
+        _mm256_storeu_si256((__m256i*)dst, x0);
+        _mm256_storeu_si256((__m256i*)(dst + 32), x1);
+        _mm256_storeu_si256((__m256i*)(dst + 64), x2);
+        _mm256_storeu_si256((__m256i*)(dst + 96), x3);
+    }
 
-        /* (p-a) == (a+b-c - a) == (b-c) */
-        pa = _mm_sub_epi16(b, c);
+    x0 = _mm256_xor_si256(x0, _mm256_setr_epi32((int)~*crc, 0, 0, 0, 0, 0, 0, 0));
 
-        /* (p-b) == (a+b-c - b) == (a-c) */
-        pb = _mm_sub_epi16(a, c);
+    for(i=128; i + 128 <= len; i += 128)
+    {
+        __m256i y0 = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i y1 = _mm256_loadu_si256((const __m256i*)(src + i + 32));
+        __m256i y2 = _mm256_loadu_si256((const __m256i*)(src + i + 64));
+        __m256i y3 = _mm256_loadu_si256((const __m256i*)(src + i + 96));
 
-        /* (p-c) == (a+b-c - c) == (a+b-c-c) == (b-c)+(a-c) */
-        pc = _mm_add_epi16(pa, pb);
+        if(dst != NULL)
+        {
+            _mm256_storeu_si256((__m256i*)(dst + i), y0);
+            _mm256_storeu_si256((__m256i*)(dst + i + 32), y1);
+            _mm256_storeu_si256((__m256i*)(dst + i + 64), y2);
+            _mm256_storeu_si256((__m256i*)(dst + i + 96), y3);
+        }
 
-        pa = abs_i16(pa);  /* |p-a| */
-        pb = abs_i16(pb);  /* |p-b| */
-        pc = abs_i16(pc);  /* |p-c| */
+        x0 = crc_fold32(x0, k, y0);
+        x1 = crc_fold32(x1, k, y1);
+        x2 = crc_fold32(x2, k, y2);
+        x3 = crc_fold32(x3, k, y3);
+    }
 
-        smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    /* Fold the eight 128-bit lanes in stream order */
+    __m128i v = _mm256_castsi256_si128(x0);
 
-        /* Paeth breaks ties favoring a over b over c. */
-        nearest  = if_then_else(_mm_cmpeq_epi16(smallest, pa), a,
-                            if_then_else(_mm_cmpeq_epi16(smallest, pb), b, c));
+    v = crc_fold16(v, k128, _mm256_extracti128_si256(x0, 1));
+    v = crc_fold16(v, k128, _mm256_castsi256_si128(x1));
+    v = crc_fold16(v, k128, _mm256_extracti128_si256(x1, 1));
+    v = crc_fold16(v, k128, _mm256_castsi256_si128(x2));
+    v = crc_fold16(v, k128, _mm256_extracti128_si256(x2, 1));
+    v = crc_fold16(v, k128, _mm256_castsi256_si128(x3));
+    v = crc_fold16(v, k128, _mm256_extracti128_si256(x3, 1));
 
-        /* Note `_epi8`: we need addition to wrap modulo 255. */
-        d = _mm_add_epi8(d, nearest);
-        store4(row, _mm_packus_epi16(d, d));
+    size_t n = (len - i) & ~(size_t)15;
 
-        prev += 4;
-        row  += 4;
-        rb   -= 4;
-    }
+    *crc = ~crc_fold_reduce(v, dst != NULL ? dst + i : NULL, src + i, n);
+
+    return i + n;
 }
 
+#endif /* SPNG_X86_VPCLMUL */
+
+#endif /* SPNG_X86_AVX */
+
 #endif /* SPNG_X86 */
 
 
@@ -6909,6 +14875,227 @@ static void defilter_paeth4(size_t rowbytes, unsigned char *row, const unsigned
     }
 }
 
+static void defilter_up_simd(size_t rowbytes, unsigned char *row, const unsigned char *prev_row)
+{
+    size_t i;
+    for(i=0; i + 16 <= rowbytes; i += 16)
+    {
+        vst1q_u8(row + i, vaddq_u8(vld1q_u8(row + i), vld1q_u8(prev_row + i)));
+    }
+
+    for(; i < rowbytes; i++) row[i] += prev_row[i];
+}
+
+static void defilter_sub1(size_t rowbytes, unsigned char *row)
+{
+    /* Log-step prefix sum over 16 bytes, vextq_u8() with a zero vector shifts lanes up */
+    size_t i = 0;
+    const uint8x16_t zero = vdupq_n_u8(0);
+    uint8x16_t d, carry = zero;
+
+    for(; i + 16 <= rowbytes; i += 16)
+    {
+        d = vld1q_u8(row + i);
+
+        d = vaddq_u8(d, vextq_u8(zero, d, 15));
+        d = vaddq_u8(d, vextq_u8(zero, d, 14));
+        d = vaddq_u8(d, vextq_u8(zero, d, 12));
+        d = vaddq_u8(d, vextq_u8(zero, d, 8));
+
+        vst1q_u8(row + i, vaddq_u8(d, carry));
+
+        carry = vaddq_u8(carry, vdupq_laneq_u8(d, 15));
+    }
+
+    if(!i) i = 1;
+
+    for(; i < rowbytes; i++) row[i] += row[i - 1];
+}
+
+static void defilter_sub2(size_t rowbytes, unsigned char *row)
+{
+    size_t i = 0;
+    const uint8x16_t zero = vdupq_n_u8(0);
+    uint8x16_t d, carry = zero;
+
+    for(; i + 16 <= rowbytes; i += 16)
+    {
+        d = vld1q_u8(row + i);
+
+        d = vaddq_u8(d, vextq_u8(zero, d, 14));
+        d = vaddq_u8(d, vextq_u8(zero, d, 12));
+        d = vaddq_u8(d, vextq_u8(zero, d, 8));
+
+        vst1q_u8(row + i, vaddq_u8(d, carry));
+
+        carry = vaddq_u8(carry, vreinterpretq_u8_u16(vdupq_laneq_u16(vreinterpretq_u16_u8(d), 7)));
+    }
+
+    if(!i) i = 2;
+
+    for(; i < rowbytes; i++) row[i] += row[i - 2];
+}
+
+static uint8x8_t load6_neon(const unsigned char *p)
+{
+    unsigned char tmp[8] = {0};
+    memcpy(tmp, p, 6);
+    return vld1_u8(tmp);
+}
+
+static void store6_neon(unsigned char *p, uint8x8_t v)
+{
+    unsigned char tmp[8];
+    vst1_u8(tmp, v);
+    memcpy(p, tmp, 6);
+}
+
+static void defilter_sub6(size_t rowbytes, unsigned char *row)
+{
+    size_t rb = rowbytes;
+    uint8x8_t d = vdup_n_u8(0);
+
+    while(rb >= 8)
+    {
+        d = vadd_u8(vld1_u8(row), d);
+        store6_neon(row, d);
+
+        row += 6;
+        rb  -= 6;
+    }
+
+    if(rb > 0) store6_neon(row, vadd_u8(load6_neon(row), d));
+}
+
+static void defilter_sub8(size_t rowbytes, unsigned char *row)
+{
+    unsigned char *rp_stop = row + rowbytes;
+    uint8x8_t d = vdup_n_u8(0);
+
+    for(; row < rp_stop; row += 8)
+    {
+        d = vadd_u8(vld1_u8(row), d);
+        vst1_u8(row, d);
+    }
+}
+
+static void defilter_avg6(size_t rowbytes, unsigned char *row, const unsigned char *prev_row)
+{
+    size_t rb = rowbytes;
+    uint8x8_t d = vdup_n_u8(0);
+
+    while(rb >= 8)
+    {
+        d = vadd_u8(vld1_u8(row), vhadd_u8(d, vld1_u8(prev_row)));
+        store6_neon(row, d);
+
+        row += 6;
+        prev_row += 6;
+        rb  -= 6;
+    }
+
+    if(rb > 0) store6_neon(row, vadd_u8(load6_neon(row), vhadd_u8(d, load6_neon(prev_row))));
+}
+
+static void defilter_avg8(size_t rowbytes, unsigned char *row, const unsigned char *prev_row)
+{
+    unsigned char *rp_stop = row + rowbytes;
+    uint8x8_t d = vdup_n_u8(0);
+
+    for(; row < rp_stop; row += 8, prev_row += 8)
+    {
+        d = vadd_u8(vld1_u8(row), vhadd_u8(d, vld1_u8(prev_row)));
+        vst1_u8(row, d);
+    }
+}
+
+static void defilter_paeth6(size_t rowbytes, unsigned char *row, const unsigned char *prev_row)
+{
+    size_t rb = rowbytes;
+    uint8x8_t b, c = vdup_n_u8(0), d = vdup_n_u8(0);
+
+    while(rb >= 8)
+    {
+        b = vld1_u8(prev_row);
+        d = vadd_u8(vld1_u8(row), paeth_arm(d, b, c));
+        store6_neon(row, d);
+
+        c = b;
+        row += 6;
+        prev_row += 6;
+        rb  -= 6;
+    }
+
+    if(rb > 0)
+    {
+        b = load6_neon(prev_row);
+        store6_neon(row, vadd_u8(load6_neon(row), paeth_arm(d, b, c)));
+    }
+}
+
+static void defilter_paeth8(size_t rowbytes, unsigned char *row, const unsigned char *prev_row)
+{
+    unsigned char *rp_stop = row + rowbytes;
+    uint8x8_t b, c = vdup_n_u8(0), d = vdup_n_u8(0);
+
+    for(; row < rp_stop; row += 8, prev_row += 8)
+    {
+        b = vld1_u8(prev_row);
+        d = vadd_u8(vld1_u8(row), paeth_arm(d, b, c));
+        vst1_u8(row, d);
+
+        c = b;
+    }
+}
+
+static uint32x4_t filter_cost_neon(uint32x4_t sum, uint8x16_t v)
+{
+    uint8x16_t cost = vminq_u8(v, vsubq_u8(vdupq_n_u8(0), v));
+
+    return vpadalq_u16(sum, vpaddlq_u8(cost));
+}
+
+/* Filtering only reads unfiltered bytes, 16 bytes of each filter type are computed at a time */
+static size_t filter_candidates_neon(unsigned char *rows, size_t stride, const unsigned char *prev, const unsigned char *row,
+                                     size_t i, size_t rowbytes, unsigned bpp, uint64_t scores[5])
+{
+    uint32x4_t sum[5];
+    int k;
+
+    for(k=0; k < 5; k++) sum[k] = vdupq_n_u32(0);
+
+    for(; i + 16 <= rowbytes; i += 16)
+    {
+        uint8x16_t x = vld1q_u8(row + i);
+        uint8x16_t a = vld1q_u8(row + i - bpp);
+        uint8x16_t b = vld1q_u8(prev + i);
+        uint8x16_t c = vld1q_u8(prev + i - bpp);
+
+        uint8x16_t pred = vcombine_u8(paeth_arm(vget_low_u8(a), vget_low_u8(b), vget_low_u8(c)),
+                                      paeth_arm(vget_high_u8(a), vget_high_u8(b), vget_high_u8(c)));
+
+        uint8x16_t sub = vsubq_u8(x, a);
+        uint8x16_t up = vsubq_u8(x, b);
+        uint8x16_t avg = vsubq_u8(x, vhaddq_u8(a, b));
+        uint8x16_t pae = vsubq_u8(x, pred);
+
+        vst1q_u8(rows + i, sub);
+        vst1q_u8(rows + stride + i, up);
+        vst1q_u8(rows + stride * 2 + i, avg);
+        vst1q_u8(rows + stride * 3 + i, pae);
+
+        sum[0] = filter_cost_neon(sum[0], x);
+        sum[1] = filter_cost_neon(sum[1], sub);
+        sum[2] = filter_cost_neon(sum[2], up);
+        sum[3] = filter_cost_neon(sum[3], avg);
+        sum[4] = filter_cost_neon(sum[4], pae);
+    }
+
+    for(k=0; k < 5; k++) scores[k] += vaddlvq_u32(sum[k]);
+
+    return i;
+}
+
 /* NEON optimised palette expansion functions
  * Derived from palette_neon_intrinsics.c
  *
@@ -6977,4 +15164,96 @@ static uint32_t expand_palette_rgb8_neon(unsigned char *row, const unsigned char
     return count * scanline_stride;
 }
 
+/* Adds a row of 8-bit samples to 16-bit column sums */
+static size_t accumulate_u8_neon(uint16_t *acc, const unsigned char *row, size_t n)
+{
+    size_t i;
+
+    for(i=0; i + 16 <= n; i += 16)
+    {
+        uint8x16_t v = vld1q_u8(row + i);
+
+        vst1q_u16(acc + i, vaddw_u8(vld1q_u16(acc + i), vget_low_u8(v)));
+        vst1q_u16(acc + i + 8, vaddw_u8(vld1q_u16(acc + i + 8), vget_high_u8(v)));
+    }
+
+    return i;
+}
+
+/* Interleave pixels of 1, 2, 4 or 8 bytes */
+static uint32_t interleave_pixels_neon(unsigned char *out, const unsigned char *a, const unsigned char *b,
+                                       uint32_t n, size_t pixel_size)
+{
+    uint32_t i, step;
+
+    if(pixel_size > 8 || (pixel_size & (pixel_size - 1))) return 0;
+
+    step = 16 / (uint32_t)pixel_size;
+
+    for(i=0; i + step <= n; i += step)
+    {
+        const unsigned char *pa = a + i * pixel_size, *pb = b + i * pixel_size;
+        unsigned char *dst = out + 2 * i * pixel_size;
+
+        if(pixel_size == 1)
+        {
+            uint8x16x2_t v = {{ vld1q_u8(pa), vld1q_u8(pb) }};
+            vst2q_u8(dst, v);
+        }
+        else if(pixel_size == 2)
+        {
+            uint16x8x2_t v = {{ vreinterpretq_u16_u8(vld1q_u8(pa)), vreinterpretq_u16_u8(vld1q_u8(pb)) }};
+            vst2q_u16((uint16_t*)dst, v);
+        }
+        else if(pixel_size == 4)
+        {
+            uint32x4x2_t v = {{ vreinterpretq_u32_u8(vld1q_u8(pa)), vreinterpretq_u32_u8(vld1q_u8(pb)) }};
+            vst2q_u32((uint32_t*)dst, v);
+        }
+        else
+        {
+            uint8x16_t va = vld1q_u8(pa), vb = vld1q_u8(pb);
+
+            vst1q_u8(dst, vcombine_u8(vget_low_u8(va), vget_low_u8(vb)));
+            vst1q_u8(dst + 16, vcombine_u8(vget_high_u8(va), vget_high_u8(vb)));
+        }
+    }
+
+    return i;
+}
+
+#if defined(SPNG_ARM_CRC32)
+
+#include <arm_acle.h>
+
+static size_t crc32_armv8(uint32_t *crc, unsigned char *dst, const unsigned char *src, size_t len)
+{
+    uint32_t c = ~*crc;
+    size_t i;
+
+    for(i=0; i + 8 <= len; i += 8)
+    {
+        uint64_t v;
+
+        memcpy(&v, src + i, 8);
+
+        if(dst != NULL) memcpy(dst + i, &v, 8);
+
+        c = __crc32d(c, v);
+    }
+
+    for(; i < len; i++)
+    {
+        if(dst != NULL) dst[i] = src[i];
+
+        c = __crc32b(c, src[i]);
+    }
+
+    *crc = ~c;
+
+    return len;
+}
+
+#endif /* SPNG_ARM_CRC32 */
+
 #endif /* SPNG_ARM */
@@ -120,6 +120,12 @@ enum spng_errno
     SPNG_ENODST,
     SPNG_EOPSTATE,
     SPNG_ENOTFINAL,
+    SPNG_ECROP,
+    SPNG_EAGAIN,
+    SPNG_EINDEX,
+    SPNG_EACTL,
+    SPNG_EFCTL,
+    SPNG_EFDAT,
 };
 
 enum spng_text_type
@@ -147,6 +153,36 @@ enum spng_filter
     SPNG_FILTER_PAETH = 4
 };
 
+enum spng_inflate_backend
+{
+    SPNG_INFLATE_STREAM = 0, /* zlib, one scanline at a time */
+    SPNG_INFLATE_ZLIB = 1, /* zlib, whole image */
+    SPNG_INFLATE_LIBDEFLATE = 2, /* libdeflate, whole image */
+    SPNG_INFLATE_SPECULATIVE = 3 /* zlib, whole image, multithreaded */
+};
+
+enum spng_deflate_backend
+{
+    SPNG_DEFLATE_STREAM = 0, /* zlib, one scanline at a time */
+    SPNG_DEFLATE_ZLIB = 1, /* zlib, whole image */
+    SPNG_DEFLATE_LIBDEFLATE = 2, /* libdeflate, whole image */
+    SPNG_DEFLATE_FAST = 3 /* built-in, strips, for screenshots */
+};
+
+enum spng_nontemporal
+{
+    SPNG_NONTEMPORAL_OFF = 0,
+    SPNG_NONTEMPORAL_AUTO = 1, /* images larger than the last-level cache */
+    SPNG_NONTEMPORAL_ALWAYS = 2
+};
+
+enum spng_downscale_mode
+{
+    SPNG_DOWNSCALE_BOX = 0, /* average the encoded sample values */
+    SPNG_DOWNSCALE_LINEAR = 1, /* average in linear light */
+    SPNG_DOWNSCALE_PARTIAL_ADAM7 = 2 /* stop after the Adam7 pass with enough resolution */
+};
+
 enum spng_filter_choice
 {
     SPNG_DISABLE_FILTERING = 0,
@@ -164,6 +200,19 @@ enum spng_interlace_method
     SPNG_INTERLACE_ADAM7 = 1
 };
 
+enum spng_dispose_op
+{
+    SPNG_DISPOSE_OP_NONE = 0,
+    SPNG_DISPOSE_OP_BACKGROUND = 1,
+    SPNG_DISPOSE_OP_PREVIOUS = 2
+};
+
+enum spng_blend_op
+{
+    SPNG_BLEND_OP_SOURCE = 0,
+    SPNG_BLEND_OP_OVER = 1
+};
+
 /* Channels are always in byte-order */
 enum spng_format
 {
@@ -369,6 +418,25 @@ struct spng_exif
     char *data;
 };
 
+struct spng_actl
+{
+    uint32_t num_frames;
+    uint32_t num_plays; /* 0 = loop forever */
+};
+
+struct spng_fctl
+{
+    uint32_t sequence_number;
+    uint32_t width;
+    uint32_t height;
+    uint32_t x_offset;
+    uint32_t y_offset;
+    uint16_t delay_num;
+    uint16_t delay_den;
+    uint8_t dispose_op;
+    uint8_t blend_op;
+};
+
 struct spng_chunk
 {
     size_t offset;
@@ -409,6 +477,15 @@ enum spng_option
     SPNG_FILTER_CHOICE,
     SPNG_CHUNK_COUNT_LIMIT,
     SPNG_ENCODE_TO_BUFFER,
+    SPNG_ENCODE_THREADS,
+    SPNG_DECODE_THREADS,
+    SPNG_INFLATE_BACKEND,
+    SPNG_DEFLATE_BACKEND,
+    SPNG_NONTEMPORAL_STORES,
+    SPNG_DOWNSCALE,
+    SPNG_DOWNSCALE_MODE,
+    SPNG_INDEX_INTERVAL,
+    SPNG_RESTART_STRIPS,
 };
 
 typedef void* SPNG_CDECL spng_malloc_fn(size_t size);
@@ -442,11 +519,14 @@ typedef int spng_rw_fn(spng_ctx *ctx, void *user, void *dst_src, size_t length);
 SPNG_API spng_ctx *spng_ctx_new(int flags);
 SPNG_API spng_ctx *spng_ctx_new2(struct spng_alloc *alloc, int flags);
 SPNG_API void spng_ctx_free(spng_ctx *ctx);
+SPNG_API int spng_ctx_reset(spng_ctx *ctx);
 
 SPNG_API int spng_set_png_buffer(spng_ctx *ctx, const void *buf, size_t size);
 SPNG_API int spng_set_png_stream(spng_ctx *ctx, spng_rw_fn *rw_func, void *user);
 SPNG_API int spng_set_png_file(spng_ctx *ctx, FILE *file);
 
+SPNG_API int spng_feed(spng_ctx *ctx, const void *data, size_t len);
+
 SPNG_API void *spng_get_png_buffer(spng_ctx *ctx, size_t *len, int *error);
 
 SPNG_API int spng_set_image_limits(spng_ctx *ctx, uint32_t width, uint32_t height);
@@ -456,14 +536,22 @@ SPNG_API int spng_set_chunk_limits(spng_ctx *ctx, size_t chunk_size, size_t cach
 SPNG_API int spng_get_chunk_limits(spng_ctx *ctx, size_t *chunk_size, size_t *cache_size);
 
 SPNG_API int spng_set_crc_action(spng_ctx *ctx, int critical, int ancillary);
+SPNG_API int spng_set_chunk_filter(spng_ctx *ctx, const char *const *types, uint32_t n_types);
 
 SPNG_API int spng_set_option(spng_ctx *ctx, enum spng_option option, int value);
 SPNG_API int spng_get_option(spng_ctx *ctx, enum spng_option option, int *value);
 
+SPNG_API int spng_set_crop(spng_ctx *ctx, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+SPNG_API int spng_get_crop(spng_ctx *ctx, uint32_t *x, uint32_t *y, uint32_t *width, uint32_t *height);
+
 SPNG_API int spng_decoded_image_size(spng_ctx *ctx, int fmt, size_t *len);
 
+SPNG_API int spng_get_index(spng_ctx *ctx, void *buf, size_t *len);
+SPNG_API int spng_set_index(spng_ctx *ctx, const void *buf, size_t len);
+
 /* Decode */
 SPNG_API int spng_decode_image(spng_ctx *ctx, void *out, size_t len, int fmt, int flags);
+SPNG_API int spng_decode_frame(spng_ctx *ctx, void *out, size_t len, int fmt, int flags);
 
 /* Progressive decode */
 SPNG_API int spng_decode_scanline(spng_ctx *ctx, void *out, size_t len);
@@ -475,6 +563,7 @@ SPNG_API int spng_get_row_info(spng_ctx *ctx, struct spng_row_info *row_info);
 
 /* Encode */
 SPNG_API int spng_encode_image(spng_ctx *ctx, const void *img, size_t len, int fmt, int flags);
+SPNG_API int spng_encode_frame(spng_ctx *ctx, const void *img, size_t len, int fmt, int flags);
 
 /* Progressive encode */
 SPNG_API int spng_encode_scanline(spng_ctx *ctx, const void *scanline, size_t len);
@@ -502,6 +591,8 @@ SPNG_API int spng_get_unknown_chunks(spng_ctx *ctx, struct spng_unknown_chunk *c
 /* Official extensions */
 SPNG_API int spng_get_offs(spng_ctx *ctx, struct spng_offs *offs);
 SPNG_API int spng_get_exif(spng_ctx *ctx, struct spng_exif *exif);
+SPNG_API int spng_get_actl(spng_ctx *ctx, struct spng_actl *actl);
+SPNG_API int spng_get_fctl(spng_ctx *ctx, struct spng_fctl *fctl);
 
 
 SPNG_API int spng_set_ihdr(spng_ctx *ctx, struct spng_ihdr *ihdr);
@@ -525,6 +616,8 @@ SPNG_API int spng_set_unknown_chunks(spng_ctx *ctx, struct spng_unknown_chunk *c
 /* Official extensions */
 SPNG_API int spng_set_offs(spng_ctx *ctx, struct spng_offs *offs);
 SPNG_API int spng_set_exif(spng_ctx *ctx, struct spng_exif *exif);
+SPNG_API int spng_set_actl(spng_ctx *ctx, struct spng_actl *actl);
+SPNG_API int spng_set_fctl(spng_ctx *ctx, struct spng_fctl *fctl);
 
 
 SPNG_API const char *spng_strerror(int err);
@@ -0,0 +1,181 @@
+/* Per-image overhead of spng_ctx_new()/spng_ctx_free() versus spng_ctx_reset() */
+#include <spng.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static size_t n_allocs;
+
+static void *counting_malloc(size_t size)
+{
+    n_allocs++;
+    return malloc(size);
+}
+
+static void *counting_realloc(void *ptr, size_t size)
+{
+    n_allocs++;
+    return realloc(ptr, size);
+}
+
+static void *counting_calloc(size_t count, size_t size)
+{
+    n_allocs++;
+    return calloc(count, size);
+}
+
+static struct spng_alloc alloc =
+{
+    .malloc_fn = counting_malloc,
+    .realloc_fn = counting_realloc,
+    .calloc_fn = counting_calloc,
+    .free_fn = free
+};
+
+struct png_file
+{
+    unsigned char *data;
+    size_t size;
+};
+
+static void *read_file(const char *filename, size_t *size)
+{
+    FILE *file = fopen(filename, "rb");
+    unsigned char *data = NULL;
+    long length;
+
+    if(file == NULL) return NULL;
+
+    if(fseek(file, 0, SEEK_END) || (length = ftell(file)) <= 0) goto err;
+
+    rewind(file);
+
+    data = malloc(length);
+    if(data == NULL) goto err;
+
+    if(fread(data, length, 1, file) != 1)
+    {
+        free(data);
+        data = NULL;
+        goto err;
+    }
+
+    *size = length;
+
+err:
+    fclose(file);
+
+    return data;
+}
+
+static int decode(spng_ctx *ctx, const struct png_file *png, unsigned char **out, size_t *out_size)
+{
+    size_t size;
+    int ret = spng_set_png_buffer(ctx, png->data, png->size);
+    if(ret) return ret;
+
+    ret = spng_decoded_image_size(ctx, SPNG_FMT_RGBA8, &size);
+    if(ret) return ret;
+
+    if(size > *out_size)
+    {
+        void *tmp = realloc(*out, size);
+        if(tmp == NULL) return SPNG_EMEM;
+
+        *out = tmp;
+        *out_size = size;
+    }
+
+    return spng_decode_image(ctx, *out, size, SPNG_FMT_RGBA8, SPNG_DECODE_TRNS);
+}
+
+int main(int argc, char **argv)
+{
+    int i, k, n = 0, iterations = 200, ret = 0;
+    unsigned char *out = NULL;
+    size_t out_size = 0;
+    struct png_file *files;
+    clock_t start, new_time, reset_time;
+    size_t new_allocs, reset_allocs;
+
+    if(argc < 2)
+    {
+        printf("usage: %s file.png...\n", argv[0]);
+        return 1;
+    }
+
+    files = calloc(argc - 1, sizeof(struct png_file));
+    if(files == NULL) return 1;
+
+    for(i=1; i < argc; i++)
+    {
+        files[n].data = read_file(argv[i], &files[n].size);
+        if(files[n].data != NULL) n++;
+    }
+
+    if(!n)
+    {
+        printf("no input files\n");
+        ret = 1;
+        goto cleanup;
+    }
+
+    /* Invalid files are still decoded up to the error, the result is ignored */
+    n_allocs = 0;
+    start = clock();
+
+    for(k=0; k < iterations; k++)
+    {
+        for(i=0; i < n; i++)
+        {
+            spng_ctx *ctx = spng_ctx_new2(&alloc, 0);
+            if(ctx == NULL) return 1;
+
+            decode(ctx, &files[i], &out, &out_size);
+
+            spng_ctx_free(ctx);
+        }
+    }
+
+    new_time = clock() - start;
+    new_allocs = n_allocs;
+
+    spng_ctx *ctx = spng_ctx_new2(&alloc, 0);
+    if(ctx == NULL) return 1;
+
+    n_allocs = 0;
+    start = clock();
+
+    for(k=0; k < iterations; k++)
+    {
+        for(i=0; i < n; i++)
+        {
+            decode(ctx, &files[i], &out, &out_size);
+
+            spng_ctx_reset(ctx);
+        }
+    }
+
+    reset_time = clock() - start;
+    reset_allocs = n_allocs;
+
+    spng_ctx_free(ctx);
+
+    double images = (double)n * iterations;
+    double new_us = (double)new_time / CLOCKS_PER_SEC * 1e6 / images;
+    double reset_us = (double)reset_time / CLOCKS_PER_SEC * 1e6 / images;
+
+    printf("%d images x %d iterations\n", n, iterations);
+    printf("spng_ctx_new/free: %8.2f us/image, %6.2f allocations/image\n", new_us, new_allocs / images);
+    printf("spng_ctx_reset:    %8.2f us/image, %6.2f allocations/image\n", reset_us, reset_allocs / images);
+    printf("difference:        %8.2f us/image (%.1f%%)\n", new_us - reset_us, (new_us - reset_us) / new_us * 100.0);
+
+cleanup:
+    for(i=0; i < n; i++) free(files[i].data);
+
+    free(files);
+    free(out);
+
+    return ret;
+}
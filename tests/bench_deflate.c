@@ -0,0 +1,189 @@
+/* Compressed size and encoding throughput for each deflate backend */
+#include <spng.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct image
+{
+    struct spng_ihdr ihdr;
+    struct spng_plte plte;
+    unsigned char *data;
+    size_t size;
+};
+
+struct config
+{
+    const char *name;
+    int backend;
+    int level;
+};
+
+static const struct config configs[] =
+{
+    { "zlib stream",    SPNG_DEFLATE_STREAM,     1 },
+    { "zlib stream",    SPNG_DEFLATE_STREAM,     6 },
+    { "zlib stream",    SPNG_DEFLATE_STREAM,     9 },
+    { "zlib one-shot",  SPNG_DEFLATE_ZLIB,       6 },
+    { "libdeflate",     SPNG_DEFLATE_LIBDEFLATE, 1 },
+    { "libdeflate",     SPNG_DEFLATE_LIBDEFLATE, 4 },
+    { "libdeflate",     SPNG_DEFLATE_LIBDEFLATE, 6 },
+    { "libdeflate",     SPNG_DEFLATE_LIBDEFLATE, 9 },
+    { "libdeflate",     SPNG_DEFLATE_LIBDEFLATE, 12 },
+    { "fast",           SPNG_DEFLATE_FAST,       0 },
+};
+
+static int load_image(const char *filename, struct image *image)
+{
+    int ret;
+    FILE *file = fopen(filename, "rb");
+    if(file == NULL) return 1;
+
+    spng_ctx *ctx = spng_ctx_new(0);
+    if(ctx == NULL)
+    {
+        fclose(file);
+        return 1;
+    }
+
+    spng_set_png_file(ctx, file);
+
+    ret = spng_get_ihdr(ctx, &image->ihdr);
+    if(ret) goto err;
+
+    if(spng_get_plte(ctx, &image->plte)) image->plte.n_entries = 0;
+
+    ret = spng_decoded_image_size(ctx, SPNG_FMT_PNG, &image->size);
+    if(ret) goto err;
+
+    image->data = calloc(1, image->size);
+    if(image->data == NULL)
+    {
+        ret = 1;
+        goto err;
+    }
+
+    ret = spng_decode_image(ctx, image->data, image->size, SPNG_FMT_PNG, 0);
+
+    /* The one-shot backends only apply to non-interlaced images */
+    image->ihdr.interlace_method = 0;
+
+err:
+    spng_ctx_free(ctx);
+    fclose(file);
+
+    return ret;
+}
+
+static int encode(const struct image *image, const struct config *config, size_t *len)
+{
+    int ret;
+    spng_ctx *ctx = spng_ctx_new(SPNG_CTX_ENCODER);
+    if(ctx == NULL) return 1;
+
+    spng_set_option(ctx, SPNG_ENCODE_TO_BUFFER, 1);
+    spng_set_option(ctx, SPNG_IMG_COMPRESSION_LEVEL, config->level);
+
+    ret = spng_set_option(ctx, SPNG_DEFLATE_BACKEND, config->backend);
+    if(ret) goto err;
+
+    spng_set_ihdr(ctx, (struct spng_ihdr*)&image->ihdr);
+
+    if(image->plte.n_entries) spng_set_plte(ctx, (struct spng_plte*)&image->plte);
+
+    ret = spng_encode_image(ctx, image->data, image->size, SPNG_FMT_PNG, SPNG_ENCODE_FINALIZE);
+    if(ret) goto err;
+
+    size_t encoded_len;
+    void *encoded = spng_get_png_buffer(ctx, &encoded_len, &ret);
+
+    free(encoded);
+
+    *len = encoded_len;
+
+err:
+    spng_ctx_free(ctx);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int i, k, n = 0, iterations = 3;
+    size_t c, total_size = 0;
+    struct image *images;
+
+    if(argc < 2)
+    {
+        printf("usage: %s file.png...\n", argv[0]);
+        return 1;
+    }
+
+    images = calloc(argc - 1, sizeof(struct image));
+    if(images == NULL) return 1;
+
+    for(i=1; i < argc; i++)
+    {
+        if(load_image(argv[i], &images[n]))
+        {
+            free(images[n].data);
+            images[n].data = NULL;
+            continue;
+        }
+
+        total_size += images[n].size;
+        n++;
+    }
+
+    if(!n)
+    {
+        printf("no input files\n");
+        free(images);
+        return 1;
+    }
+
+    printf("%d images, %zu bytes of image data\n", n, total_size);
+    printf("%-16s %5s %12s %8s %10s\n", "backend", "level", "size", "ratio", "MB/s");
+
+    for(c=0; c < sizeof(configs) / sizeof(configs[0]); c++)
+    {
+        const struct config *config = &configs[c];
+        size_t encoded_size = 0;
+        int ret = 0;
+
+        clock_t start = clock();
+
+        for(k=0; k < iterations && !ret; k++)
+        {
+            encoded_size = 0;
+
+            for(i=0; i < n && !ret; i++)
+            {
+                size_t len = 0;
+
+                ret = encode(&images[i], config, &len);
+
+                encoded_size += len;
+            }
+        }
+
+        if(ret)
+        {
+            printf("%-16s %5d %12s\n", config->name, config->level, "unavailable");
+            continue;
+        }
+
+        double seconds = (double)(clock() - start) / CLOCKS_PER_SEC / iterations;
+        double mbps = seconds > 0.0 ? total_size / seconds / 1e6 : 0.0;
+
+        printf("%-16s %5d %12zu %7.2f%% %10.2f\n", config->name, config->level, encoded_size,
+               100.0 * encoded_size / total_size, mbps);
+    }
+
+    for(i=0; i < n; i++) free(images[i].data);
+
+    free(images);
+
+    return 0;
+}
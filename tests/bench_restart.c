@@ -0,0 +1,181 @@
+/* Decoding time of SPNG_RESTART_STRIPS images for each SPNG_DECODE_THREADS value */
+#define _POSIX_C_SOURCE 200809L /* clock_gettime(), clock() adds up the time of all threads */
+
+#include <spng.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Smooth gradients with some noise, compresses to about a third of the size */
+static unsigned char *make_image(uint32_t width, uint32_t height, size_t *size)
+{
+    uint32_t x, y, seed = 1;
+    unsigned char *image = malloc((size_t)width * height * 3);
+
+    if(image == NULL) return NULL;
+
+    unsigned char *p = image;
+
+    for(y=0; y < height; y++)
+    {
+        for(x=0; x < width; x++, p += 3)
+        {
+            seed = seed * 1103515245 + 12345;
+
+            unsigned noise = (seed >> 16) & 7;
+
+            p[0] = (unsigned char)(x * 255 / width + noise);
+            p[1] = (unsigned char)(y * 255 / height + noise);
+            p[2] = (unsigned char)((x + y) / 64 + noise);
+        }
+    }
+
+    *size = (size_t)width * height * 3;
+
+    return image;
+}
+
+static unsigned char *encode(const unsigned char *image, size_t size, uint32_t width, uint32_t height, size_t *len)
+{
+    int ret;
+    unsigned char *png = NULL;
+    struct spng_ihdr ihdr = { .width = width, .height = height, .bit_depth = 8, .color_type = SPNG_COLOR_TYPE_TRUECOLOR };
+    spng_ctx *ctx = spng_ctx_new(SPNG_CTX_ENCODER);
+
+    if(ctx == NULL) return NULL;
+
+    spng_set_option(ctx, SPNG_ENCODE_TO_BUFFER, 1);
+    spng_set_option(ctx, SPNG_ENCODE_THREADS, 8);
+
+    ret = spng_set_option(ctx, SPNG_RESTART_STRIPS, 1);
+    if(ret) goto err;
+
+    spng_set_ihdr(ctx, &ihdr);
+
+    ret = spng_encode_image(ctx, image, size, SPNG_FMT_PNG, SPNG_ENCODE_FINALIZE);
+    if(ret) goto err;
+
+    png = spng_get_png_buffer(ctx, len, &ret);
+
+err:
+    if(ret) printf("encoding failed: %s\n", spng_strerror(ret));
+
+    spng_ctx_free(ctx);
+
+    return png;
+}
+
+static int decode(const unsigned char *png, size_t len, int threads, unsigned char *out, size_t out_size)
+{
+    spng_ctx *ctx = spng_ctx_new(0);
+    if(ctx == NULL) return 1;
+
+    spng_set_option(ctx, SPNG_DECODE_THREADS, threads);
+    spng_set_png_buffer(ctx, png, len);
+
+    int ret = spng_decode_image(ctx, out, out_size, SPNG_FMT_RGBA8, 0);
+
+    spng_ctx_free(ctx);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int ret = 0, k, iterations = 3;
+    uint32_t width = 8192, height = 8192;
+    size_t size, len, out_size;
+    unsigned char *image, *png = NULL, *out = NULL, *reference = NULL;
+    const int thread_counts[] = { 0, 1, 2, 4, 8, 16 };
+    size_t i;
+    double serial = 0.0;
+
+    if(argc > 2)
+    {
+        width = (uint32_t)strtoul(argv[1], NULL, 10);
+        height = (uint32_t)strtoul(argv[2], NULL, 10);
+    }
+
+    if(!width || !height)
+    {
+        printf("usage: %s [width height]\n", argv[0]);
+        return 1;
+    }
+
+    image = make_image(width, height, &size);
+    if(image == NULL) return 1;
+
+    png = encode(image, size, width, height, &len);
+    if(png == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    out_size = (size_t)width * height * 4;
+    out = malloc(out_size);
+    reference = malloc(out_size);
+
+    if(out == NULL || reference == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    printf("%ux%u RGB8, %zu bytes compressed\n", width, height, len);
+    printf("%7s %10s %10s %8s\n", "threads", "ms", "MP/s", "speedup");
+
+    for(i=0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++)
+    {
+        int threads = thread_counts[i];
+        double best = 0.0;
+
+        for(k=0; k < iterations; k++)
+        {
+            double start = now();
+
+            ret = decode(png, len, threads, threads ? out : reference, out_size);
+            if(ret) break;
+
+            double t = now() - start;
+
+            if(!k || t < best) best = t;
+        }
+
+        if(ret)
+        {
+            printf("decoding with %d threads failed: %s\n", threads, spng_strerror(ret));
+            goto cleanup;
+        }
+
+        if(threads && memcmp(out, reference, out_size))
+        {
+            printf("output with %d threads does not match\n", threads);
+            ret = 1;
+            goto cleanup;
+        }
+
+        if(!threads) serial = best;
+
+        printf("%7d %10.2f %10.2f %7.2fx\n", threads, best * 1e3, (double)width * height / best / 1e6, serial / best);
+    }
+
+cleanup:
+    free(image);
+    free(png);
+    free(out);
+    free(reference);
+
+    return ret;
+}
@@ -0,0 +1,269 @@
+/* Encoding time and size of SPNG_DEFLATE_FAST versus zlib on screenshot-like images */
+#define _POSIX_C_SOURCE 200809L /* clock_gettime(), clock() adds up the time of all threads */
+
+#include <spng.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct config
+{
+    const char *name;
+    int backend;
+    int level;
+    int threads;
+};
+
+static const struct config configs[] =
+{
+    { "zlib",       SPNG_DEFLATE_STREAM, 1, 0 },
+    { "zlib",       SPNG_DEFLATE_STREAM, 6, 0 },
+    { "fast",       SPNG_DEFLATE_FAST,   6, 0 },
+    { "fast 8 thr", SPNG_DEFLATE_FAST,   6, 8 },
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(unsigned char *image, uint32_t width, int channels,
+                 uint32_t x0, uint32_t y0, uint32_t w, uint32_t h, const unsigned char color[4])
+{
+    uint32_t x, y;
+
+    for(y=y0; y < y0 + h; y++)
+    {
+        unsigned char *p = image + ((size_t)y * width + x0) * channels;
+
+        for(x=0; x < w; x++, p += channels) memcpy(p, color, channels);
+    }
+}
+
+/* Desktop gradient, windows with title bars and lines of "text", one window with a photo */
+static unsigned char *make_screenshot(uint32_t width, uint32_t height, int channels, size_t *size)
+{
+    unsigned char *image = malloc((size_t)width * height * channels);
+    uint32_t x, y, seed = 1, i;
+
+    if(image == NULL) return NULL;
+
+    for(y=0; y < height; y++)
+    {
+        unsigned char *p = image + (size_t)y * width * channels;
+
+        for(x=0; x < width; x++, p += channels)
+        {
+            p[0] = (unsigned char)(40 + y * 60 / height);
+            p[1] = (unsigned char)(70 + y * 80 / height);
+            p[2] = (unsigned char)(120 + x * 60 / width);
+            if(channels == 4) p[3] = 255;
+        }
+    }
+
+    /* Glyphs are 6x10 cells from a set of 64 random bitmaps */
+    unsigned char glyphs[64][10];
+
+    for(i=0; i < 64 * 10; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        glyphs[i / 10][i % 10] = (i % 10 == 0 || i % 10 == 9) ? 0 : (unsigned char)((seed >> 16) & 0x3E);
+    }
+
+    for(i=0; i < 6; i++)
+    {
+        const unsigned char window[4] = { 250, 250, 248, 255 };
+        const unsigned char title[4] = { 60, 64, 72, 255 };
+        const unsigned char text[4] = { 20, 20, 24, 255 };
+
+        uint32_t w = width * (3 + i % 3) / 10, h = height * (3 + (i + 1) % 3) / 10;
+        uint32_t wx = (width - w) * i / 6, wy = (height - h) * ((i * 7) % 6) / 6;
+
+        fill(image, width, channels, wx, wy, w, h, window);
+        fill(image, width, channels, wx, wy, w, 24, title);
+
+        if(i == 3)
+        {
+            /* Photo: smooth color with noise */
+            for(y=wy + 24; y < wy + h; y++)
+            {
+                unsigned char *p = image + ((size_t)y * width + wx) * channels;
+
+                for(x=0; x < w; x++, p += channels)
+                {
+                    seed = seed * 1103515245 + 12345;
+
+                    unsigned noise = (seed >> 16) & 15;
+
+                    p[0] = (unsigned char)(x * 200 / w + noise);
+                    p[1] = (unsigned char)((y - wy) * 180 / h + noise);
+                    p[2] = (unsigned char)(90 + noise * 3);
+                }
+            }
+
+            continue;
+        }
+
+        for(y=wy + 32; y + 14 < wy + h; y += 14)
+        {
+            uint32_t line_end = wx + 8 + (w - 16) * (60 + (y * 13) % 40) / 100;
+
+            for(x=wx + 8; x + 6 < line_end; x += 6)
+            {
+                seed = seed * 1103515245 + 12345;
+
+                const unsigned char *glyph = glyphs[(seed >> 16) & 63];
+                uint32_t gx, gy;
+
+                if(((seed >> 24) & 7) == 0) continue; /* space */
+
+                for(gy=0; gy < 10; gy++)
+                {
+                    for(gx=0; gx < 6; gx++)
+                    {
+                        if(glyph[gy] & (1 << gx)) fill(image, width, channels, x + gx, y + gy, 1, 1, text);
+                    }
+                }
+            }
+        }
+    }
+
+    *size = (size_t)width * height * channels;
+
+    return image;
+}
+
+static unsigned char *encode(const unsigned char *image, size_t size, const struct spng_ihdr *ihdr,
+                             const struct config *config, size_t *len)
+{
+    int ret;
+    unsigned char *png = NULL;
+    spng_ctx *ctx = spng_ctx_new(SPNG_CTX_ENCODER);
+
+    if(ctx == NULL) return NULL;
+
+    spng_set_option(ctx, SPNG_ENCODE_TO_BUFFER, 1);
+    spng_set_option(ctx, SPNG_IMG_COMPRESSION_LEVEL, config->level);
+    spng_set_option(ctx, SPNG_ENCODE_THREADS, config->threads);
+
+    ret = spng_set_option(ctx, SPNG_DEFLATE_BACKEND, config->backend);
+    if(ret) goto err;
+
+    spng_set_ihdr(ctx, (struct spng_ihdr*)ihdr);
+
+    ret = spng_encode_image(ctx, image, size, SPNG_FMT_PNG, SPNG_ENCODE_FINALIZE);
+    if(ret) goto err;
+
+    png = spng_get_png_buffer(ctx, len, &ret);
+
+err:
+    spng_ctx_free(ctx);
+
+    return png;
+}
+
+static int check(const unsigned char *png, size_t len, const unsigned char *image, size_t size)
+{
+    int ret = 1;
+    unsigned char *out = malloc(size);
+    spng_ctx *ctx = spng_ctx_new(0);
+
+    if(out != NULL && ctx != NULL)
+    {
+        spng_set_png_buffer(ctx, png, len);
+
+        ret = spng_decode_image(ctx, out, size, SPNG_FMT_PNG, 0);
+
+        if(!ret && memcmp(out, image, size)) ret = 1;
+    }
+
+    spng_ctx_free(ctx);
+    free(out);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int ret = 0, k, channels, iterations = 5;
+    uint32_t width = 1920, height = 1080;
+    size_t c;
+
+    if(argc > 2)
+    {
+        width = (uint32_t)strtoul(argv[1], NULL, 10);
+        height = (uint32_t)strtoul(argv[2], NULL, 10);
+    }
+
+    if(width < 64 || height < 64)
+    {
+        printf("usage: %s [width height], at least 64x64\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-12s %5s %5s %12s %8s %10s\n", "backend", "fmt", "level", "size", "ratio", "MB/s");
+
+    for(channels=3; channels <= 4 && !ret; channels++)
+    {
+        size_t size;
+        unsigned char *image = make_screenshot(width, height, channels, &size);
+
+        if(image == NULL) return 1;
+
+        struct spng_ihdr ihdr =
+        {
+            .width = width,
+            .height = height,
+            .bit_depth = 8,
+            .color_type = channels == 4 ? SPNG_COLOR_TYPE_TRUECOLOR_ALPHA : SPNG_COLOR_TYPE_TRUECOLOR
+        };
+
+        for(c=0; c < sizeof(configs) / sizeof(configs[0]); c++)
+        {
+            const struct config *config = &configs[c];
+            unsigned char *png = NULL;
+            size_t len = 0;
+            double best = 0.0;
+
+            for(k=0; k < iterations; k++)
+            {
+                free(png);
+
+                double start = now();
+
+                png = encode(image, size, &ihdr, config, &len);
+                if(png == NULL) break;
+
+                double t = now() - start;
+
+                if(!k || t < best) best = t;
+            }
+
+            if(png == NULL)
+            {
+                printf("%-12s %5s %5d %12s\n", config->name, channels == 4 ? "RGBA8" : "RGB8", config->level, "unavailable");
+                continue;
+            }
+
+            if(check(png, len, image, size))
+            {
+                printf("%s output does not decode to the source image\n", config->name);
+                ret = 1;
+            }
+            else printf("%-12s %5s %5d %12zu %7.2f%% %10.2f\n", config->name, channels == 4 ? "RGBA8" : "RGB8",
+                        config->backend == SPNG_DEFLATE_FAST ? 0 : config->level, len, 100.0 * len / size, size / best / 1e6);
+
+            free(png);
+        }
+
+        free(image);
+    }
+
+    return ret;
+}
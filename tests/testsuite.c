@@ -1,3 +1,8 @@
+#if defined(__unix__) || defined(__APPLE__)
+    #define _POSIX_C_SOURCE 200809L /* fdopen(), fork() */
+    #define SPNGT_HAVE_PIPE
+#endif
+
 #include "spngt_common.h"
 
 #include "test_spng.h"
@@ -5,6 +10,11 @@
 
 #include <errno.h>
 
+#if defined(SPNGT_HAVE_PIPE)
+    #include <unistd.h>
+    #include <sys/wait.h>
+#endif
+
 static int n_test_cases, actual_count;
 static struct spngt_test_case test_cases[100];
 
@@ -987,425 +997,3399 @@ cleanup:
     return ret;
 }
 
-static int decode_and_compare(spngt_test_case *spng, spngt_test_case *png)
+/* Get the test case's PNG as a buffer source,
+   *png is set to a copy of the file which must be freed by the caller */
+static int get_png_buffer(spngt_test_case *spng, spngt_test_case *test_case, unsigned char **png)
 {
-    int ret = 0;
+    *test_case = *spng;
+    *png = NULL;
 
-    spng_ctx *ctx = NULL;
-    size_t img_spng_size;
-    unsigned char *img_spng =  NULL;
+    /* The original context may still read from the file */
+    if(spng->source.type == SPNGT_SRC_FILE)
+    {
+        FILE *file = spng->source.file;
+        long offset = ftell(file);
+        long length;
+        int ret;
 
-    int fmt = spng->fmt, flags = spng->flags, test_flags = spng->test_flags;
+        fseek(file, 0, SEEK_END);
+        length = ftell(file);
+        rewind(file);
 
-    png_infop info_ptr = NULL;
-    png_structp png_ptr = NULL;
-    size_t img_png_size;
-    unsigned char *img_png = NULL;
+        *png = malloc(length);
+        if(*png == NULL || fread(*png, length, 1, file) != 1) ret = 1;
+        else ret = 0;
 
-    struct spng_ihdr ihdr;
-    ctx = init_spng(spng, &ihdr);
+        fseek(file, offset, SEEK_SET);
+
+        if(ret) return 1;
+
+        test_case->source.type = SPNGT_SRC_BUFFER;
+        test_case->source.buffer = *png;
+        test_case->source.png_size = length;
+    }
+
+    return 0;
+}
+
+/* Create a decoder that reads the test case's PNG from memory,
+   *png is set to a copy of the file which must be freed by the caller */
+static spng_ctx *init_spng_memory(spngt_test_case *spng, unsigned char **png)
+{
+    spngt_test_case test_case;
+    spng_ctx *ctx;
+
+    if(get_png_buffer(spng, &test_case, png)) return NULL;
+
+    ctx = init_spng(&test_case, NULL);
+    if(ctx == NULL) return NULL;
+
+    spng_set_crc_action(ctx, SPNG_CRC_ERROR, SPNG_CRC_ERROR);
+
+    return ctx;
+}
+
+/* Decode the whole image from memory with a decode option set and compare it to the progressive decode */
+/* Decode with each option set to its value and compare to the expected image */
+static int compare_decode_options(spngt_test_case *spng, const unsigned char *expected, size_t expected_size,
+                                  int fmt, int flags, const int (*options)[2], int n_options)
+{
+    int i, ret = 0;
+    enum spng_option option = 0;
+    int value = 0;
+    size_t size;
+    unsigned char *img = NULL;
+    unsigned char *png = NULL;
+    spng_ctx *ctx = NULL;
 
+    ctx = init_spng_memory(spng, &png);
     if(ctx == NULL)
     {
         ret = 1;
         goto cleanup;
     }
 
-    spng_set_crc_action(ctx, SPNG_CRC_ERROR, SPNG_CRC_ERROR);
+    for(i=0; i < n_options && !ret; i++)
+    {
+        option = options[i][0];
+        value = options[i][1];
 
-    img_spng = getimage_spng(ctx, &img_spng_size, fmt, flags);
-    if(img_spng == NULL)
+        ret = spng_set_option(ctx, option, value);
+    }
+
+    if(ret) goto cleanup;
+
+    ret = spng_decoded_image_size(ctx, fmt, &size);
+    if(ret) goto cleanup;
+
+    if(size != expected_size)
     {
-        printf("getimage_spng() failed\n");
         ret = 1;
         goto cleanup;
     }
 
-    png_ptr = init_libpng(png, &info_ptr);
-    if(png_ptr == NULL)
+    img = calloc(1, size);
+    if(img == NULL)
     {
         ret = 1;
         goto cleanup;
     }
 
-    if(test_flags & SPNGT_COMPARE_CHUNKS)
+    ret = spng_decode_image(ctx, img, size, fmt, flags);
+    if(ret)
     {
-        ret = compare_chunks(ctx, info_ptr, png_ptr, 0);
+        printf("spng_decode_image() error with option %d = %d: %s\n", option, value, spng_strerror(ret));
+        goto cleanup;
     }
 
-    img_png = getimage_libpng(png_ptr, info_ptr, &img_png_size, fmt, flags);
-    if(img_png == NULL)
+    if(memcmp(img, expected, size))
     {
-        printf("getimage_libpng() failed\n");
+        printf("error: decoded image with option %d = %d is not identical\n", option, value);
         ret = 1;
-        goto cleanup;
     }
 
-    if(img_png_size != img_spng_size)
+cleanup:
+    spng_ctx_free(ctx);
+    free(img);
+    free(png);
+
+    return ret;
+}
+
+static int compare_decode_option(spngt_test_case *spng, const unsigned char *expected, size_t expected_size,
+                                 int fmt, int flags, enum spng_option option, int value)
+{
+    const int options[1][2] = { { option, value } };
+
+    return compare_decode_options(spng, expected, expected_size, fmt, flags, options, 1);
+}
+
+static unsigned fmt_bits(const struct spng_ihdr *ihdr, int fmt)
+{
+    unsigned channels = 1;
+
+    switch(fmt)
     {
-        printf("output image size mismatch\n");
-        printf("spng: %lu\n png: %lu\n", (unsigned long int)img_spng_size, (unsigned long int)img_png_size);
-        ret = 1;
-        goto cleanup;
+        case SPNG_FMT_RGBA16: return 64;
+        case SPNG_FMT_RGBA8:
+        case SPNG_FMT_GA16: return 32;
+        case SPNG_FMT_RGB8: return 24;
+        case SPNG_FMT_GA8: return 16;
+        case SPNG_FMT_G8: return 8;
+        default: break;
     }
 
-    if(fmt == SPNGT_FMT_VIPS)
-    {/* Get the right format for compare_images() */
-        fmt = SPNG_FMT_PNG;
-        if(ihdr.color_type == SPNG_COLOR_TYPE_INDEXED) fmt = SPNG_FMT_RGB8;
-        else if(ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr.bit_depth < 8) fmt = SPNG_FMT_G8;
+    if(ihdr->color_type == SPNG_COLOR_TYPE_TRUECOLOR) channels = 3;
+    else if(ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE_ALPHA) channels = 2;
+    else if(ihdr->color_type == SPNG_COLOR_TYPE_TRUECOLOR_ALPHA) channels = 4;
 
-        spng_get_trns_fmt(ctx, &fmt);
-        printf("VIPS format: %s\n", fmt_str(fmt));
-    }
+    return ihdr->bit_depth * channels;
+}
 
-    if(!memcmp(img_spng, img_png, img_spng_size)) goto identical;
+static unsigned get_pixel_bits(const unsigned char *row, size_t x, unsigned bits)
+{
+    size_t offset = x * bits;
 
-    if( !(flags & SPNG_DECODE_GAMMA) )
+    return (row[offset / 8] >> (8 - bits - offset % 8)) & ((1 << bits) - 1);
+}
+
+/* Decode a crop rectangle from memory and compare it to the same region of the full image */
+static int compare_crop(spngt_test_case *spng, const unsigned char *expected, size_t expected_size,
+                        const struct spng_ihdr *ihdr, int fmt, int flags,
+                        uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    int ret;
+    size_t size;
+    unsigned char *img = NULL;
+    unsigned char *png = NULL;
+    spng_ctx *ctx = NULL;
+    const unsigned bits = fmt_bits(ihdr, fmt);
+    const size_t expected_width = expected_size / ihdr->height;
+    const size_t crop_width = ((size_t)width * bits + 7) / 8;
+    uint32_t i, k;
+
+    ctx = init_spng_memory(spng, &png);
+    if(ctx == NULL)
     {
-        printf("error: image buffers are not identical\n");
         ret = 1;
+        goto cleanup;
     }
 
-    ret |= compare_images(&ihdr, fmt, flags, img_spng, img_png, img_spng_size);
+    ret = spng_set_crop(ctx, x, y, width, height);
+    if(ret) goto cleanup;
 
-    if(!ret && !(flags & SPNG_DECODE_GAMMA))
-    {/* in case compare_images() has some edge case */
-        printf("compare_images() returned 0 but images are not identical\n");
+    ret = spng_decoded_image_size(ctx, fmt, &size);
+    if(ret) goto cleanup;
+
+    if(size != crop_width * height)
+    {
+        printf("error: crop size %zu, expected %zu\n", size, crop_width * height);
         ret = 1;
         goto cleanup;
     }
 
-identical:
+    img = calloc(1, size);
+    if(img == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
 
-    if(test_flags & SPNGT_COMPARE_CHUNKS)
+    ret = spng_decode_image(ctx, img, size, fmt, flags);
+    if(ret)
     {
-        ret |= compare_chunks(ctx, info_ptr, png_ptr, 1);
+        printf("spng_decode_image() error with crop %u,%u %ux%u: %s\n", x, y, width, height, spng_strerror(ret));
+        goto cleanup;
     }
 
-cleanup:
+    for(i=0; i < height && !ret; i++)
+    {
+        const unsigned char *src = expected + (size_t)(y + i) * expected_width;
+        const unsigned char *dst = img + (size_t)i * crop_width;
 
-    spng_ctx_free(ctx);
-    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        if(bits % 8)
+        {
+            for(k=0; k < width; k++)
+            {
+                if(get_pixel_bits(src, x + k, bits) != get_pixel_bits(dst, k, bits)) ret = 1;
+            }
+        }
+        else if(memcmp(src + (size_t)x * bits / 8, dst, crop_width)) ret = 1;
+    }
 
-    free(img_spng);
-    free(img_png);
+    if(ret) printf("error: crop %u,%u %ux%u is not identical\n", x, y, width, height);
+
+    if(!ret && spng_set_crop(ctx, 0, 0, 1, 1) != SPNG_EOPSTATE)
+    {
+        printf("error: spng_set_crop() after decoding should fail\n");
+        ret = 1;
+    }
+
+cleanup:
+    spng_ctx_free(ctx);
+    free(img);
+    free(png);
 
     return ret;
 }
 
-static void dump_buffer(void *buf, size_t size, const char *opt_name)
+/* Decode with SPNG_DOWNSCALE and compare to box averages of a region of the full image,
+   with SPNG_DOWNSCALE_PARTIAL_ADAM7 interlaced images are expected to have the top-left pixel of each box */
+static int compare_downscale(spngt_test_case *spng, const unsigned char *expected, size_t expected_size,
+                             const struct spng_ihdr *ihdr, int fmt, int flags, int factor, int mode,
+                             uint32_t x, uint32_t y, uint32_t width, uint32_t height)
 {
-    const char *filename = opt_name ? opt_name : "dump.png";
-    FILE *f = fopen(filename, "wb");
-
-    if(f == NULL) goto err;
-
-    size_t written = fwrite(buf, size, 1, f);
-
-    if(written != 1) goto err;
-
-    printf("file dumped to %s\n", filename);
+    int ret;
+    size_t size;
+    unsigned char *img = NULL;
+    unsigned char *png = NULL;
+    spng_ctx *ctx = NULL;
+    const int eight_bit = fmt & (SPNG_FMT_RGBA8 | SPNG_FMT_RGB8 | SPNG_FMT_G8 | SPNG_FMT_GA8);
+    const unsigned channels = fmt_bits(ihdr, fmt) / 8;
+    const size_t expected_width = expected_size / ihdr->height;
+    const uint32_t out_width = (width + factor - 1) / factor, out_height = (height + factor - 1) / factor;
+    const int top_left = (mode & SPNG_DOWNSCALE_PARTIAL_ADAM7) && ihdr->interlace_method && !(x % factor) && !(y % factor);
+    uint32_t i, k, bx, by;
+    unsigned c;
+
+    ctx = init_spng_memory(spng, &png);
+    if(ctx == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
 
-    goto cleanup;
+    ret = spng_set_option(ctx, SPNG_DOWNSCALE, factor);
+    if(ret) goto cleanup;
 
-err:
-    printf("failed to dump file: %s\n", strerror(errno));
+    ret = spng_set_option(ctx, SPNG_DOWNSCALE_MODE, mode);
+    if(ret) goto cleanup;
 
-cleanup:
-    if(f != NULL) fclose(f);
-}
+    ret = spng_set_crop(ctx, x, y, width, height);
+    if(ret) goto cleanup;
 
-static int spngt_run_test(const char *filename, struct spngt_test_case *test_case)
-{
-    enum spng_errno ret;
-    size_t file_length = 0;
-    struct spngt_test_case spng = *test_case;
-    struct spngt_test_case libpng = *test_case;
+    ret = spng_decoded_image_size(ctx, fmt, &size);
 
-    if(test_case->source.type == SPNGT_SRC_FILE)
+    if(!eight_bit)
     {
-        spng.source.file = fopen(filename, "rb");
-        libpng.source.file = fopen(filename, "rb");
-
-        if(!spng.source.file || !libpng.source.file)
+        if(ret != SPNG_EFMT)
         {
+            printf("error: downscaling to %s should fail\n", fmt_str(fmt));
             ret = 1;
-            goto cleanup;
         }
+        else ret = 0;
 
-        fseek(spng.source.file, 0, SEEK_END);
-        file_length = ftell(spng.source.file);
-        rewind(spng.source.file);
+        goto cleanup;
     }
 
-    ret = decode_and_compare(&spng, &libpng);
     if(ret) goto cleanup;
 
-    if(test_case->test_flags & SPNGT_ENCODE_ROUNDTRIP)
+    if(size != (size_t)out_width * out_height * channels)
     {
-        printf("           compare (reencoded, original)...\n");
+        printf("error: downscaled size %zu, expected %zu\n", size, (size_t)out_width * out_height * channels);
+        ret = 1;
+        goto cleanup;
+    }
 
-        if(test_case->source.type == SPNGT_SRC_FILE)
+    img = calloc(1, size);
+    if(img == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    ret = spng_decode_image(ctx, img, size, fmt, flags);
+    if(ret)
+    {
+        printf("spng_decode_image() error with 1/%d downscale: %s\n", factor, spng_strerror(ret));
+        goto cleanup;
+    }
+
+    for(by=0; by < out_height && !ret; by++)
+    {
+        for(bx=0; bx < out_width && !ret; bx++)
         {
-            rewind(spng.source.file);
-            rewind(libpng.source.file);
-        }
+            uint32_t rows = height - by * factor < (uint32_t)factor ? height - by * factor : factor;
+            uint32_t cols = width - bx * factor < (uint32_t)factor ? width - bx * factor : factor;
+            const unsigned char *src = expected + (size_t)(y + by * factor) * expected_width + (size_t)(x + bx * factor) * channels;
+            const unsigned char *dst = img + ((size_t)by * out_width + bx) * channels;
 
-        spng_ctx *src = init_spng(&spng, NULL);
-        spng_ctx *dst = NULL;
-        spngt_chunk_data data = {0};
+            if(top_left) rows = cols = 1;
 
-        size_t img_size;
-        void *img_spng = getimage_spng(src, &img_size, test_case->fmt, test_case->flags);
+            for(c=0; c < channels; c++)
+            {
+                uint32_t sum = 0, count = rows * cols;
 
-        size_t encoded_len;
-        char *encoded_pngbuf = NULL;
+                for(i=0; i < rows; i++)
+                {
+                    for(k=0; k < cols; k++) sum += src[i * expected_width + k * channels + c];
+                }
 
-        if(img_spng == NULL)
-        {
-            ret = 1;
-            goto encode_cleanup;
+                if(dst[c] != (sum + count / 2) / count)
+                {
+                    printf("error: 1/%d downscale pixel %u,%u differs\n", factor, bx, by);
+                    ret = 1;
+                    break;
+                }
+            }
         }
+    }
 
-        ret = get_chunks(src, &data);
-        if(ret) goto encode_cleanup;
+cleanup:
+    spng_ctx_free(ctx);
+    free(img);
+    free(png);
 
-        dst = spng_ctx_new(SPNG_CTX_ENCODER);
+    return ret;
+}
 
-        spng_set_option(dst, SPNG_ENCODE_TO_BUFFER, 1);
+struct feed_state
+{
+    const unsigned char *png;
+    size_t size;
+    size_t offset;
+    size_t max_fragment;
+    uint32_t seed;
+    int eof;
+};
+
+/* Feed the next 1 to max_fragment bytes, the end of the data is signaled after the last fragment */
+static int feed_more(spng_ctx *ctx, struct feed_state *s)
+{
+    size_t len = 1;
 
-        ret = set_chunks(dst, &data);
-        if(ret) goto encode_cleanup;
+    if(s->eof)
+    {
+        printf("error: SPNG_EAGAIN after the end of the data\n");
+        return 1;
+    }
 
-        ret = spng_encode_image(dst, img_spng, img_size, test_case->fmt, SPNG_ENCODE_FINALIZE);
-        if(ret)
-        {
-            printf("encode error: %s\n", spng_strerror(ret));
-            goto encode_cleanup;
-        }
+    if(s->offset == s->size)
+    {
+        s->eof = 1;
+        return spng_feed(ctx, NULL, 0);
+    }
 
-        encoded_pngbuf = spng_get_png_buffer(dst, &encoded_len, &ret);
+    if(s->max_fragment > 1)
+    {
+        s->seed = s->seed * 1103515245 + 12345;
+        len = 1 + (s->seed >> 16) % s->max_fragment;
+    }
 
-        if(ret)
-        {
-            printf("failed to get encoded PNG: %s\n", spng_strerror(ret));
-            goto encode_cleanup;
-        }
+    if(len > s->size - s->offset) len = s->size - s->offset;
 
-        /* Unfortunately there's a handful of testsuite image that don't
-           compress well with the default filter heuristic */
-        /* Fail the test on a 4% size increase */
-        /*int pct = 25;
-        if( (encoded_len - encoded_len / pct) > file_length)
-        {
-            printf("Reencoded PNG exceeds maximum %d%% size increase: %zu (original: %zu)\n", 100 / pct, encoded_len, file_length);
-            ret = 1;
-            goto encode_cleanup;
-        }*/
-        (void)file_length;
+    s->offset += len;
 
-        spng.source.type = SPNGT_SRC_BUFFER;
-        spng.source.buffer = encoded_pngbuf;
-        spng.source.png_size = encoded_len;
-        spng.test_flags |= SPNGT_COMPARE_CHUNKS;
+    return spng_feed(ctx, s->png + s->offset - len, len);
+}
+
+/* Repeat the call while it returns SPNG_EAGAIN */
+#define FEED_CALL(call) \
+    while((ret = (call)) == SPNG_EAGAIN) \
+    { \
+        if(feed_more(ctx, &feed)) break; \
+    }
+
+/* Decode from spng_feed() input in random fragments of up to max_fragment bytes,
+   more data is only fed when a call returns SPNG_EAGAIN */
+static int compare_feed(spngt_test_case *spng, const unsigned char *expected, size_t expected_size,
+                        int fmt, int flags, size_t max_fragment, int progressive)
+{
+    int ret;
+    size_t size, width;
+    unsigned char *img = NULL;
+    unsigned char *png = NULL;
+    spng_ctx *ctx = NULL;
+    spngt_test_case test_case;
+    struct spng_ihdr ihdr;
+    struct spng_row_info row_info;
+    struct feed_state feed = { 0 };
+
+    ret = get_png_buffer(spng, &test_case, &png);
+    if(ret) goto cleanup;
+
+    feed.png = test_case.source.buffer;
+    feed.size = test_case.source.png_size;
+    feed.max_fragment = max_fragment;
+    feed.seed = (uint32_t)feed.size;
+
+    ctx = spng_ctx_new(0);
+    if(ctx == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    spng_set_option(ctx, SPNG_KEEP_UNKNOWN_CHUNKS, 1);
+    spng_set_image_limits(ctx, 16000, 16000);
+    spng_set_chunk_limits(ctx, 66 * 1000 * 1000, 66 * 1000* 1000);
+    spng_set_crc_action(ctx, SPNG_CRC_ERROR, SPNG_CRC_ERROR);
+
+    ret = feed_more(ctx, &feed);
+    if(ret) goto cleanup;
+
+    FEED_CALL(spng_get_ihdr(ctx, &ihdr));
+    if(ret) goto decode_err;
+
+    FEED_CALL(spng_decoded_image_size(ctx, fmt, &size));
+    if(ret) goto decode_err;
+
+    if(size != expected_size)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    img = calloc(1, size);
+    if(img == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if(progressive)
+    {
+        FEED_CALL(spng_decode_image(ctx, NULL, 0, fmt, flags | SPNG_DECODE_PROGRESSIVE));
+        if(ret) goto decode_err;
+
+        width = size / ihdr.height;
+
+        do
+        {
+            ret = spng_get_row_info(ctx, &row_info);
+            if(ret) break;
+
+            /* Data also arrives while zlib still has unread input */
+            if(feed.offset < feed.size)
+            {
+                ret = feed_more(ctx, &feed);
+                if(ret) goto cleanup;
+            }
+
+            FEED_CALL(spng_decode_row(ctx, img + row_info.row_num * width, width));
+        }while(!ret);
+
+        if(ret != SPNG_EOI) goto decode_err;
+    }
+    else
+    {
+        FEED_CALL(spng_decode_image(ctx, img, size, fmt, flags));
+        if(ret) goto decode_err;
+    }
+
+    FEED_CALL(spng_decode_chunks(ctx));
+    if(ret) goto decode_err;
+
+    if(memcmp(img, expected, size))
+    {
+        printf("error: image decoded from %zu-byte fragments is not identical\n", max_fragment);
+        ret = 1;
+    }
+
+    goto cleanup;
+
+decode_err:
+    printf("error decoding %zu-byte fragments at offset %zu: %s\n", max_fragment, feed.offset, spng_strerror(ret));
+    if(!ret) ret = 1;
+
+cleanup:
+    spng_ctx_free(ctx);
+    free(img);
+    free(png);
+
+    return ret;
+}
+
+static int have_inflate_backend(int backend)
+{
+    spng_ctx *ctx = spng_ctx_new(0);
+    int ret = spng_set_option(ctx, SPNG_INFLATE_BACKEND, backend);
+
+    spng_ctx_free(ctx);
+
+    return !ret;
+}
+
+static int decode_and_compare(spngt_test_case *spng, spngt_test_case *png)
+{
+    int ret = 0;
+
+    spng_ctx *ctx = NULL;
+    size_t img_spng_size;
+    unsigned char *img_spng =  NULL;
+
+    int fmt = spng->fmt, flags = spng->flags, test_flags = spng->test_flags;
+
+    png_infop info_ptr = NULL;
+    png_structp png_ptr = NULL;
+    size_t img_png_size;
+    unsigned char *img_png = NULL;
+
+    struct spng_ihdr ihdr;
+    ctx = init_spng(spng, &ihdr);
+
+    if(ctx == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    spng_set_crc_action(ctx, SPNG_CRC_ERROR, SPNG_CRC_ERROR);
+
+    img_spng = getimage_spng(ctx, &img_spng_size, fmt, flags);
+    if(img_spng == NULL)
+    {
+        printf("getimage_spng() failed\n");
+        ret = 1;
+        goto cleanup;
+    }
+
+    png_ptr = init_libpng(png, &info_ptr);
+    if(png_ptr == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if(test_flags & SPNGT_COMPARE_CHUNKS)
+    {
+        ret = compare_chunks(ctx, info_ptr, png_ptr, 0);
+    }
+
+    img_png = getimage_libpng(png_ptr, info_ptr, &img_png_size, fmt, flags);
+    if(img_png == NULL)
+    {
+        printf("getimage_libpng() failed\n");
+        ret = 1;
+        goto cleanup;
+    }
+
+    if(img_png_size != img_spng_size)
+    {
+        printf("output image size mismatch\n");
+        printf("spng: %lu\n png: %lu\n", (unsigned long int)img_spng_size, (unsigned long int)img_png_size);
+        ret = 1;
+        goto cleanup;
+    }
+
+    if(fmt == SPNGT_FMT_VIPS)
+    {/* Get the right format for compare_images() */
+        fmt = SPNG_FMT_PNG;
+        if(ihdr.color_type == SPNG_COLOR_TYPE_INDEXED) fmt = SPNG_FMT_RGB8;
+        else if(ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr.bit_depth < 8) fmt = SPNG_FMT_G8;
+
+        spng_get_trns_fmt(ctx, &fmt);
+        printf("VIPS format: %s\n", fmt_str(fmt));
+    }
+
+    ret = compare_decode_option(spng, img_spng, img_spng_size, fmt, flags, SPNG_DECODE_THREADS, 4);
+    if(ret) goto cleanup;
+
+    ret = compare_decode_option(spng, img_spng, img_spng_size, fmt, flags, SPNG_INFLATE_BACKEND, SPNG_INFLATE_ZLIB);
+    if(ret) goto cleanup;
+
+    /* Interlaced images are defiltered and deinterlaced by pass and row band in parallel */
+    const int buffered_threads[2][2] = { { SPNG_INFLATE_BACKEND, SPNG_INFLATE_ZLIB }, { SPNG_DECODE_THREADS, 4 } };
+
+    ret = compare_decode_options(spng, img_spng, img_spng_size, fmt, flags, buffered_threads, 2);
+    if(ret) goto cleanup;
+
+    ret = compare_decode_option(spng, img_spng, img_spng_size, fmt, flags, SPNG_NONTEMPORAL_STORES, SPNG_NONTEMPORAL_ALWAYS);
+    if(ret) goto cleanup;
+
+    if(have_inflate_backend(SPNG_INFLATE_LIBDEFLATE))
+    {
+        ret = compare_decode_option(spng, img_spng, img_spng_size, fmt, flags, SPNG_INFLATE_BACKEND, SPNG_INFLATE_LIBDEFLATE);
+        if(ret) goto cleanup;
+    }
+
+    ret = compare_feed(spng, img_spng, img_spng_size, fmt, flags, 1024, 0);
+    if(ret) goto cleanup;
+
+    ret = compare_feed(spng, img_spng, img_spng_size, fmt, flags, 1, 1);
+    if(ret) goto cleanup;
+
+    uint32_t crop_x = ihdr.width / 3, crop_y = ihdr.height / 3;
+
+    ret = compare_crop(spng, img_spng, img_spng_size, &ihdr, fmt, flags, crop_x, crop_y,
+                       (ihdr.width - crop_x + 1) / 2, (ihdr.height - crop_y + 1) / 2);
+    if(ret) goto cleanup;
+
+    ret = compare_crop(spng, img_spng, img_spng_size, &ihdr, fmt, flags, ihdr.width - 1, ihdr.height - 1, 1, 1);
+    if(ret) goto cleanup;
+
+    ret = compare_crop(spng, img_spng, img_spng_size, &ihdr, fmt, flags, 0, ihdr.height / 2, ihdr.width, 1);
+    if(ret) goto cleanup;
+
+    ret = compare_downscale(spng, img_spng, img_spng_size, &ihdr, fmt, flags, 2, SPNG_DOWNSCALE_BOX,
+                            0, 0, ihdr.width, ihdr.height);
+    if(ret) goto cleanup;
+
+    ret = compare_downscale(spng, img_spng, img_spng_size, &ihdr, fmt, flags, 8, SPNG_DOWNSCALE_BOX,
+                            crop_x, crop_y, ihdr.width - crop_x, ihdr.height - crop_y);
+    if(ret) goto cleanup;
+
+    ret = compare_downscale(spng, img_spng, img_spng_size, &ihdr, fmt, flags, 4, SPNG_DOWNSCALE_PARTIAL_ADAM7,
+                            0, 0, ihdr.width, ihdr.height);
+    if(ret) goto cleanup;
+
+    if(!memcmp(img_spng, img_png, img_spng_size)) goto identical;
+
+    if( !(flags & SPNG_DECODE_GAMMA) )
+    {
+        printf("error: image buffers are not identical\n");
+        ret = 1;
+    }
+
+    ret |= compare_images(&ihdr, fmt, flags, img_spng, img_png, img_spng_size);
+
+    if(!ret && !(flags & SPNG_DECODE_GAMMA))
+    {/* in case compare_images() has some edge case */
+        printf("compare_images() returned 0 but images are not identical\n");
+        ret = 1;
+        goto cleanup;
+    }
+
+identical:
+
+    if(test_flags & SPNGT_COMPARE_CHUNKS)
+    {
+        ret |= compare_chunks(ctx, info_ptr, png_ptr, 1);
+    }
+
+cleanup:
+
+    spng_ctx_free(ctx);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+    free(img_spng);
+    free(img_png);
+
+    return ret;
+}
+
+static void dump_buffer(void *buf, size_t size, const char *opt_name)
+{
+    const char *filename = opt_name ? opt_name : "dump.png";
+    FILE *f = fopen(filename, "wb");
+
+    if(f == NULL) goto err;
+
+    size_t written = fwrite(buf, size, 1, f);
+
+    if(written != 1) goto err;
+
+    printf("file dumped to %s\n", filename);
+
+    goto cleanup;
+
+err:
+    printf("failed to dump file: %s\n", strerror(errno));
+
+cleanup:
+    if(f != NULL) fclose(f);
+}
+
+static int spngt_run_test(const char *filename, struct spngt_test_case *test_case)
+{
+    enum spng_errno ret;
+    size_t file_length = 0;
+    struct spngt_test_case spng = *test_case;
+    struct spngt_test_case libpng = *test_case;
+
+    if(test_case->source.type == SPNGT_SRC_FILE)
+    {
+        spng.source.file = fopen(filename, "rb");
+        libpng.source.file = fopen(filename, "rb");
+
+        if(!spng.source.file || !libpng.source.file)
+        {
+            ret = 1;
+            goto cleanup;
+        }
+
+        fseek(spng.source.file, 0, SEEK_END);
+        file_length = ftell(spng.source.file);
+        rewind(spng.source.file);
+    }
+
+    ret = decode_and_compare(&spng, &libpng);
+    if(ret) goto cleanup;
+
+    if(test_case->test_flags & SPNGT_ENCODE_ROUNDTRIP)
+    {
+        printf("           compare (reencoded, original)...\n");
+
+        if(test_case->source.type == SPNGT_SRC_FILE)
+        {
+            rewind(spng.source.file);
+            rewind(libpng.source.file);
+        }
+
+        spng_ctx *src = init_spng(&spng, NULL);
+        spng_ctx *dst = NULL;
+        spngt_chunk_data data = {0};
+
+        size_t img_size;
+        void *img_spng = getimage_spng(src, &img_size, test_case->fmt, test_case->flags);
+
+        size_t encoded_len;
+        char *encoded_pngbuf = NULL;
+
+        if(img_spng == NULL)
+        {
+            ret = 1;
+            goto encode_cleanup;
+        }
+
+        ret = get_chunks(src, &data);
+        if(ret) goto encode_cleanup;
+
+        dst = spng_ctx_new(SPNG_CTX_ENCODER);
+
+        spng_set_option(dst, SPNG_ENCODE_TO_BUFFER, 1);
+
+        ret = set_chunks(dst, &data);
+        if(ret) goto encode_cleanup;
+
+        ret = spng_encode_image(dst, img_spng, img_size, test_case->fmt, SPNG_ENCODE_FINALIZE);
+        if(ret)
+        {
+            printf("encode error: %s\n", spng_strerror(ret));
+            goto encode_cleanup;
+        }
+
+        encoded_pngbuf = spng_get_png_buffer(dst, &encoded_len, &ret);
+
+        if(ret)
+        {
+            printf("failed to get encoded PNG: %s\n", spng_strerror(ret));
+            goto encode_cleanup;
+        }
+
+        /* Unfortunately there's a handful of testsuite image that don't
+           compress well with the default filter heuristic */
+        /* Fail the test on a 4% size increase */
+        /*int pct = 25;
+        if( (encoded_len - encoded_len / pct) > file_length)
+        {
+            printf("Reencoded PNG exceeds maximum %d%% size increase: %zu (original: %zu)\n", 100 / pct, encoded_len, file_length);
+            ret = 1;
+            goto encode_cleanup;
+        }*/
+        (void)file_length;
+
+        spng.source.type = SPNGT_SRC_BUFFER;
+        spng.source.buffer = encoded_pngbuf;
+        spng.source.png_size = encoded_len;
+        spng.test_flags |= SPNGT_COMPARE_CHUNKS;
+
+        ret = decode_and_compare(&spng, &libpng);
+        if(ret)
+        {
+            printf("compare error (%d))\n", ret);
+            dump_buffer(encoded_pngbuf, encoded_len, NULL);
+            goto encode_cleanup;
+        }
+
+        libpng.source.type = SPNGT_SRC_BUFFER;
+        libpng.source.buffer = encoded_pngbuf;
+        libpng.source.png_size = encoded_len;
+        libpng.test_flags |= SPNGT_COMPARE_CHUNKS;
+
+        printf("           compare (reencoded, reencoded)...\n");
 
         ret = decode_and_compare(&spng, &libpng);
+
+        if(ret)
+        {
+            printf("compare error (%d))\n", ret);
+            dump_buffer(encoded_pngbuf, encoded_len, NULL);
+        }
+
+encode_cleanup:
+        free(img_spng);
+        free(encoded_pngbuf);
+        spng_ctx_free(src);
+        spng_ctx_free(dst);
+        free_chunks(&data);
+    }
+
+    if(test_case->test_flags & SPNGT_EXTENDED_TESTS)
+    {
+        rewind(spng.source.file);
+        ret = extended_tests(spng.source.file, test_case->fmt);
+        if(ret) printf("extended tests failed\n");
+    }
+
+cleanup:
+
+    if(spng.source.file) fclose(spng.source.file);
+    if(libpng.source.file) fclose(libpng.source.file);
+
+    return ret;
+}
+
+static int get_image_info(FILE *f, struct spng_ihdr *ihdr)
+{
+    spng_ctx *ctx = spng_ctx_new(0);
+
+    spng_set_crc_action(ctx, SPNG_CRC_USE, SPNG_CRC_USE);
+
+    spng_set_png_file(ctx, f);
+
+    int ret = spng_get_ihdr(ctx, ihdr);
+
+    spng_ctx_free(ctx);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2)
+    {
+        printf("no input file\n");
+        return 1;
+    }
+
+    char *filename = argv[1];
+
+    if(!strcmp(filename, "info"))
+    {
+        unsigned int png_ver = png_access_version_number();
+
+        printf("spng header version: %u.%u.%u, library version: %s\n",
+               SPNG_VERSION_MAJOR, SPNG_VERSION_MINOR, SPNG_VERSION_PATCH,
+               spng_version_string());
+        printf("png header version: %u.%u.%u, library version: %u.%u.%u\n",
+               PNG_LIBPNG_VER_MAJOR, PNG_LIBPNG_VER_MINOR, PNG_LIBPNG_VER_RELEASE,
+               png_ver / 10000, png_ver / 100 % 100, png_ver % 100);
+
+
+        return 0;
+    }
+
+    FILE *file = fopen(filename, "rb");
+
+    if(file == NULL)
+    {
+        printf("error opening input file %s\n", filename);
+        return 1;
+    }
+
+    struct spng_ihdr ihdr = {0};
+
+    if(!get_image_info(file, &ihdr))
+    {
+        char *clr_type_str;
+        if(ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE)
+            clr_type_str = "GRAY";
+        else if(ihdr.color_type == SPNG_COLOR_TYPE_TRUECOLOR)
+            clr_type_str = "RGB";
+        else if(ihdr.color_type == SPNG_COLOR_TYPE_INDEXED)
+            clr_type_str = "INDEXED";
+        else if(ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE_ALPHA)
+            clr_type_str = "GRAY-ALPHA";
+        else
+            clr_type_str = "RGBA";
+
+        printf("%s %" PRIu8 "-bit, %" PRIu32 "x%" PRIu32 " %s\n",
+               clr_type_str, ihdr.bit_depth, ihdr.width, ihdr.height,
+               ihdr.interlace_method ? "interlaced" : "non-interlaced");
+    }
+    else printf("failed to get image info\n");
+
+    fclose(file);
+
+/*  With libpng it's not possible to request 8/16-bit images regardless of
+    PNG format without calling functions that alias to png_set_expand(_16),
+    which acts as if png_set_tRNS_to_alpha() was called, as a result
+    there are no tests where transparency is not applied
+*/
+    int gamma_bug = 0;
+    int skip_encode = 0;
+    int fmt_limit = SPNGT_SKIP;
+    int fmt_limit_2 = SPNGT_SKIP;
+
+    /* https://github.com/randy408/libspng/issues/17 */
+    if(ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE) gamma_bug = SPNGT_SKIP;
+
+    /* Some output formats are limited to certain PNG formats */
+    if(ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr.bit_depth <= 8) fmt_limit = 0;
+    if(ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr.bit_depth == 16) fmt_limit_2 = 0;
+
+    add_test_case(SPNG_FMT_PNG, 0, SPNGT_COMPARE_CHUNKS);
+    add_test_case(SPNG_FMT_PNG, 0, SPNGT_ENCODE_ROUNDTRIP | skip_encode);
+    add_test_case(SPNG_FMT_RAW, 0, SPNGT_ENCODE_ROUNDTRIP | skip_encode);
+    add_test_case(SPNG_FMT_RAW, 0, 0);
+    add_test_case(SPNG_FMT_RGBA8, SPNG_DECODE_TRNS, 0);
+    add_test_case(SPNG_FMT_RGBA8, SPNG_DECODE_TRNS | SPNG_DECODE_GAMMA, gamma_bug);
+    add_test_case(SPNG_FMT_RGBA16, SPNG_DECODE_TRNS, 0);
+    add_test_case(SPNG_FMT_RGBA16, SPNG_DECODE_TRNS | SPNG_DECODE_GAMMA, 0);
+    add_test_case(SPNG_FMT_RGB8, 0, 0);
+    add_test_case(SPNG_FMT_RGB8, SPNG_DECODE_GAMMA, gamma_bug);
+
+    add_test_case(SPNG_FMT_G8, 0, fmt_limit);
+    add_test_case(SPNG_FMT_GA8, 0, fmt_limit);
+    add_test_case(SPNG_FMT_GA8, SPNG_DECODE_TRNS, fmt_limit);
+
+    add_test_case(SPNG_FMT_GA16, 0, fmt_limit_2);
+    add_test_case(SPNG_FMT_GA16, SPNG_DECODE_TRNS, fmt_limit_2);
+
+    /* This tests the input->output format logic used in libvips,
+       it emulates the behavior of their old PNG loader which uses libpng. */
+    add_test_case(SPNGT_FMT_VIPS, SPNG_DECODE_TRNS, 0);
+
+    add_test_case(SPNG_FMT_PNG, 0, SPNGT_EXTENDED_TESTS);
+
+    printf("%d test cases", n_test_cases);
+
+    if(n_test_cases != actual_count) printf(" (skipping %d)", n_test_cases - actual_count);
+
+    printf("\n");
+
+    int i, ret = 0;
+    for(i=0; i < n_test_cases; i++)
+    {
+        print_test_args(&test_cases[i]);
+
+        if(test_cases[i].test_flags & SPNGT_SKIP) continue;
+
+        int e = spngt_run_test(filename, &test_cases[i]);
+        if(!ret) ret = e;
+    }
+
+    return ret;
+}
+
+static int stream_write_checked(spng_ctx *ctx, void *user, void *data, size_t len)
+{
+    (void)ctx;
+    struct buf_state *state = user;
+
+    if(len > state->bytes_left) return SPNG_IO_EOF;
+
+    if(memcmp(data, state->data, len))
+    {
+        printf("stream write does not match buffer data\n");
+        return SPNG_IO_ERROR;
+    }
+
+    state->data += len;
+    state->bytes_left -= len;
+
+    return 0;
+}
+
+static int stream_read(spng_ctx *ctx, void *user, void *data, size_t len)
+{
+    (void)ctx;
+    struct buf_state *state = user;
+
+    if(len > state->bytes_left) return SPNG_IO_EOF;
+
+    memcpy(data, state->data, len);
+
+    state->data += len;
+    state->bytes_left -= len;
+
+    return 0;
+}
+
+#if defined(SPNGT_HAVE_PIPE)
+/* Returns the read end of a pipe that a child process fills with data, for FILE input that can't seek */
+static FILE *open_pipe(const void *data, size_t len, pid_t *child)
+{
+    int fd[2];
+
+    if(pipe(fd)) return NULL;
+
+    *child = fork();
+
+    if(*child < 0)
+    {
+        close(fd[0]);
+        close(fd[1]);
+        return NULL;
+    }
+
+    if(*child == 0)
+    {
+        const unsigned char *p = data;
+
+        close(fd[0]);
+
+        while(len)
+        {
+            ssize_t n = write(fd[1], p, len);
+            if(n <= 0) _exit(1);
+
+            p += n;
+            len -= (size_t)n;
+        }
+
+        _exit(0);
+    }
+
+    close(fd[1]);
+
+    FILE *file = fdopen(fd[0], "rb");
+
+    if(file == NULL)
+    {
+        close(fd[0]);
+        waitpid(*child, NULL, 0);
+    }
+
+    return file;
+}
+
+static void close_pipe(FILE *file, pid_t child)
+{
+    fclose(file);
+    waitpid(child, NULL, 0);
+}
+#endif
+
+/* Encoder option and ancillary chunks for encode_with_chunks(), zero members are not set */
+struct encode_chunks
+{
+    enum spng_option option;
+    int value;
+
+    uint32_t gama;
+    struct spng_iccp *iccp;
+
+    struct spng_text *text;
+    uint32_t n_text;
+
+    struct spng_unknown_chunk *unknown;
+    uint32_t n_unknown;
+};
+
+/* Encodes to a buffer, returns NULL and sets *error on failure */
+static unsigned char *encode_with_chunks(const struct spng_ihdr *ihdr, const struct spng_plte *plte,
+                                         const unsigned char *image, size_t image_size, int fmt,
+                                         const struct encode_chunks *chunks, size_t *len, int *error)
+{
+    int ret;
+    unsigned char *encoded = NULL;
+    spng_ctx *enc = spng_ctx_new(SPNG_CTX_ENCODER);
+
+    spng_set_option(enc, SPNG_ENCODE_TO_BUFFER, 1);
+
+    if(chunks->option) spng_set_option(enc, chunks->option, chunks->value);
+
+    spng_set_ihdr(enc, (struct spng_ihdr*)ihdr);
+
+    if(plte->n_entries) spng_set_plte(enc, (struct spng_plte*)plte);
+
+    if(chunks->gama) spng_set_gama_int(enc, chunks->gama);
+    if(chunks->iccp != NULL) spng_set_iccp(enc, chunks->iccp);
+    if(chunks->n_text) spng_set_text(enc, chunks->text, chunks->n_text);
+    if(chunks->n_unknown) spng_set_unknown_chunks(enc, chunks->unknown, chunks->n_unknown);
+
+    ret = spng_encode_image(enc, image, image_size, fmt, SPNG_ENCODE_FINALIZE);
+
+    if(!ret) encoded = spng_get_png_buffer(enc, len, &ret);
+    if(encoded == NULL && !ret) ret = 1;
+
+    *error = ret;
+
+    spng_ctx_free(enc);
+
+    return encoded;
+}
+
+static unsigned char *encode_with_option(const struct spng_ihdr *ihdr, const struct spng_plte *plte,
+                                         const unsigned char *image, size_t image_size, int fmt,
+                                         enum spng_option option, int value, size_t *len)
+{
+    int ret;
+    struct encode_chunks chunks = { .option = option, .value = value };
+    unsigned char *encoded = encode_with_chunks(ihdr, plte, image, image_size, fmt, &chunks, len, &ret);
+
+    if(ret) printf("encoding with option %d = %d failed (%d): %s\n", option, value, ret, spng_strerror(ret));
+
+    return encoded;
+}
+
+/* Strip compression must produce the same, valid PNG for any thread count */
+static int strip_tests(const struct spng_ihdr *src_ihdr, const struct spng_plte *plte,
+                       const unsigned char *image, size_t image_size, int fmt)
+{
+    int ret = 0;
+    size_t i, len_1, len_n, tall_size, decoded_size;
+    unsigned char *tall = NULL, *decoded = NULL, *encoded_1 = NULL, *encoded_n = NULL;
+    struct spng_ihdr ihdr = *src_ihdr;
+    spng_ctx *dec = NULL;
+
+    /* Repeat the image vertically to span multiple strips */
+    size_t repeat = 1 + (512 * 1024) / image_size;
+
+    ihdr.height *= repeat;
+    ihdr.interlace_method = 0;
+
+    tall_size = image_size * repeat;
+    tall = malloc(tall_size);
+    if(tall == NULL) return 1;
+
+    for(i=0; i < repeat; i++) memcpy(tall + i * image_size, image, image_size);
+
+    encoded_1 = encode_with_option(&ihdr, plte, tall, tall_size, fmt, SPNG_ENCODE_THREADS, 1, &len_1);
+    encoded_n = encode_with_option(&ihdr, plte, tall, tall_size, fmt, SPNG_ENCODE_THREADS, 4, &len_n);
+
+    if(encoded_1 == NULL || encoded_n == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if(len_1 != len_n || memcmp(encoded_1, encoded_n, len_1))
+    {
+        printf("strip compression output depends on thread count\n");
+        ret = 1;
+        goto cleanup;
+    }
+
+    dec = spng_ctx_new(0);
+    spng_set_png_buffer(dec, encoded_n, len_n);
+
+    if(spng_set_option(dec, SPNG_DECODE_THREADS, 65) != SPNG_EINVAL ||
+       spng_set_option(dec, SPNG_DECODE_THREADS, INT_MAX) != SPNG_EINVAL)
+    {
+        printf("thread count above the limit was accepted\n");
+        ret = 1;
+        goto cleanup;
+    }
+
+    decoded_size = tall_size;
+    decoded = malloc(decoded_size);
+    if(decoded == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    ret = spng_decode_image(dec, decoded, decoded_size, fmt, 0);
+
+    if(ret)
+    {
+        printf("decoding strip compressed image failed: %s\n", spng_strerror(ret));
+        goto cleanup;
+    }
+
+    if(memcmp(tall, decoded, tall_size))
+    {
+        printf("strip compressed image does not match the source\n");
+        ret = 1;
+    }
+
+cleanup:
+    free(tall);
+    free(decoded);
+    free(encoded_1);
+    free(encoded_n);
+    spng_ctx_free(dec);
+
+    return ret;
+}
+
+static unsigned char *decode_crop(spng_ctx *dec, uint32_t width, uint32_t y, uint32_t height, int fmt, size_t *size)
+{
+    int ret;
+    unsigned char *band = NULL;
+
+    ret = spng_set_crop(dec, 0, y, width, height);
+    if(ret) return NULL;
+
+    ret = spng_decoded_image_size(dec, fmt, size);
+    if(ret) return NULL;
+
+    band = calloc(1, *size);
+    if(band == NULL) return NULL;
+
+    ret = spng_decode_image(dec, band, *size, fmt, 0);
+    if(ret)
+    {
+        printf("decoding rows %u-%u failed: %s\n", y, y + height - 1, spng_strerror(ret));
+        free(band);
+        return NULL;
+    }
+
+    return band;
+}
+
+/* Decode rows y to y + height - 1 starting from the index's checkpoints and without the index */
+static int decode_band(spng_ctx *dec, spng_ctx *ref, const void *index, size_t index_len,
+                       uint32_t width, uint32_t y, uint32_t height, int fmt)
+{
+    int ret;
+    size_t size, ref_size;
+    unsigned char *band = NULL, *expected = NULL;
+
+    ret = spng_set_index(dec, index, index_len);
+    if(ret)
+    {
+        printf("spng_set_index() error: %s\n", spng_strerror(ret));
+        return ret;
+    }
+
+    band = decode_crop(dec, width, y, height, fmt, &size);
+    expected = decode_crop(ref, width, y, height, fmt, &ref_size);
+
+    if(band == NULL || expected == NULL) ret = 1;
+    else if(size != ref_size || memcmp(band, expected, size))
+    {
+        printf("rows %u-%u decoded with an index do not match\n", y, y + height - 1);
+        ret = 1;
+    }
+
+    free(band);
+    free(expected);
+
+    return ret;
+}
+
+/* Bands decoded from checkpoints must match the full image for buffer and file input,
+   the index is also stored in and read back from a private chunk */
+static int index_tests(const struct spng_ihdr *src_ihdr, const struct spng_plte *plte,
+                       const unsigned char *image, size_t image_size, int fmt)
+{
+    int ret = 0;
+    uint32_t n_chunks = 0;
+    size_t i, len, tall_size, index_len = 0;
+    unsigned char *tall = NULL, *decoded = NULL, *encoded = NULL, *index = NULL, *with_chunk = NULL;
+    struct spng_unknown_chunk *chunks = NULL;
+    struct spng_ihdr ihdr = *src_ihdr;
+    spng_ctx *dec = NULL, *ref = NULL;
+    FILE *file = NULL;
+
+    size_t repeat = 1 + (256 * 1024) / image_size;
+
+    ihdr.height *= repeat;
+    ihdr.interlace_method = 0;
+
+    tall_size = image_size * repeat;
+    tall = malloc(tall_size);
+    decoded = malloc(tall_size);
+    if(tall == NULL || decoded == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    for(i=0; i < repeat; i++) memcpy(tall + i * image_size, image, image_size);
+
+    /* Small deflate blocks for closely spaced checkpoints */
+    encoded = encode_with_option(&ihdr, plte, tall, tall_size, fmt, SPNG_IMG_MEM_LEVEL, 1, &len);
+    if(encoded == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    dec = spng_ctx_new(0);
+    spng_set_png_buffer(dec, encoded, len);
+
+    /* Not supported with miniz and older zlib versions */
+    if(spng_set_option(dec, SPNG_INDEX_INTERVAL, 8)) goto cleanup;
+
+    ret = spng_decode_image(dec, decoded, tall_size, fmt, 0);
+    if(ret)
+    {
+        printf("decoding with SPNG_INDEX_INTERVAL failed: %s\n", spng_strerror(ret));
+        goto cleanup;
+    }
+
+    if(memcmp(tall, decoded, tall_size))
+    {
+        printf("image decoded with SPNG_INDEX_INTERVAL does not match\n");
+        ret = 1;
+        goto cleanup;
+    }
+
+    ret = spng_get_index(dec, NULL, &index_len);
+    if(ret) goto cleanup;
+
+    index = malloc(index_len);
+    if(index == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    ret = spng_get_index(dec, index, &index_len);
+    if(ret) goto cleanup;
+
+    const uint32_t bands[4][2] =
+    {
+        { 1, 1 },
+        { ihdr.height / 3, ihdr.height / 4 + 1 },
+        { ihdr.height / 2, 1 },
+        { ihdr.height - 1, 1 }
+    };
+
+    for(i=0; i < 4 && !ret; i++)
+    {
+        spng_ctx_free(dec);
+        spng_ctx_free(ref);
+        dec = spng_ctx_new(0);
+        ref = spng_ctx_new(0);
+        spng_set_png_buffer(dec, encoded, len);
+        spng_set_png_buffer(ref, encoded, len);
+
+        ret = decode_band(dec, ref, index, index_len, ihdr.width, bands[i][0], bands[i][1], fmt);
+    }
+
+    if(ret) goto cleanup;
+
+    file = tmpfile();
+    if(file != NULL && fwrite(encoded, len, 1, file) == 1 && !fseek(file, 0, SEEK_SET))
+    {
+        spng_ctx_free(dec);
+        spng_ctx_free(ref);
+        dec = spng_ctx_new(0);
+        ref = spng_ctx_new(0);
+        spng_set_png_file(dec, file);
+        spng_set_png_buffer(ref, encoded, len);
+
+        ret = decode_band(dec, ref, index, index_len, ihdr.width, ihdr.height / 2, ihdr.height / 4 + 1, fmt);
+        if(ret) goto cleanup;
+    }
+
+#if defined(SPNGT_HAVE_PIPE)
+    /* Pipes can't seek to a checkpoint, the band is decoded from the start */
+    pid_t child;
+    FILE *piped = open_pipe(encoded, len, &child);
+
+    if(piped != NULL)
+    {
+        spng_ctx_free(dec);
+        spng_ctx_free(ref);
+        dec = spng_ctx_new(0);
+        ref = spng_ctx_new(0);
+        spng_set_png_file(dec, piped);
+        spng_set_png_buffer(ref, encoded, len);
+
+        ret = decode_band(dec, ref, index, index_len, ihdr.width, ihdr.height / 2, ihdr.height / 4 + 1, fmt);
+
+        spng_ctx_free(dec);
+        dec = NULL;
+        close_pipe(piped, child);
+
+        if(ret)
+        {
+            printf("decoding a band from a pipe failed\n");
+            goto cleanup;
+        }
+    }
+#endif
+
+    /* Offsets are relative to the first IDAT, the same image data with a chunk before it */
+    struct spng_unknown_chunk chunk =
+    {
+        .location = SPNG_AFTER_IHDR,
+        .type = "spIX",
+        .length = index_len,
+        .data = index
+    };
+
+    struct encode_chunks spix = { .option = SPNG_IMG_MEM_LEVEL, .value = 1, .unknown = &chunk, .n_unknown = 1 };
+
+    with_chunk = encode_with_chunks(&ihdr, plte, tall, tall_size, fmt, &spix, &len, &ret);
+    if(with_chunk == NULL) goto cleanup;
+
+    spng_ctx_free(dec);
+    dec = spng_ctx_new(0);
+
+    spng_set_option(dec, SPNG_KEEP_UNKNOWN_CHUNKS, 1);
+    spng_set_png_buffer(dec, with_chunk, len);
+
+    ret = spng_get_unknown_chunks(dec, NULL, &n_chunks);
+    if(ret || n_chunks != 1)
+    {
+        printf("index chunk not found\n");
+        ret = 1;
+        goto cleanup;
+    }
+
+    chunks = malloc(sizeof(struct spng_unknown_chunk));
+    if(chunks == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    ret = spng_get_unknown_chunks(dec, chunks, &n_chunks);
+    if(ret) goto cleanup;
+
+    spng_ctx_free(ref);
+    ref = spng_ctx_new(0);
+    spng_set_png_buffer(ref, with_chunk, len);
+
+    ret = decode_band(dec, ref, chunks->data, chunks->length, ihdr.width, ihdr.height - 2, 2, fmt);
+
+cleanup:
+    if(file != NULL) fclose(file);
+    free(tall);
+    free(decoded);
+    free(encoded);
+    free(index);
+    free(with_chunk);
+    free(chunks);
+    spng_ctx_free(dec);
+    spng_ctx_free(ref);
+
+    return ret;
+}
+
+/* Restart strips must decode to the source image with and without threads */
+static int restart_tests(const struct spng_ihdr *src_ihdr, const struct spng_plte *plte,
+                         const unsigned char *image, size_t image_size, int fmt)
+{
+    int ret = 0, threads;
+    size_t i, len, tall_size;
+    uint32_t n_chunks = 0;
+    unsigned char *tall = NULL, *decoded = NULL, *encoded = NULL;
+    struct spng_unknown_chunk chunk;
+    struct spng_ihdr ihdr = *src_ihdr;
+    spng_ctx *dec = NULL;
+
+    size_t repeat = 1 + (512 * 1024) / image_size;
+
+    ihdr.height *= repeat;
+    ihdr.interlace_method = 0;
+
+    tall_size = image_size * repeat;
+    tall = malloc(tall_size);
+    decoded = malloc(tall_size);
+    if(tall == NULL || decoded == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    for(i=0; i < repeat; i++) memcpy(tall + i * image_size, image, image_size);
+
+    encoded = encode_with_option(&ihdr, plte, tall, tall_size, fmt, SPNG_RESTART_STRIPS, 1, &len);
+    if(encoded == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    for(threads=0; threads <= 4 && !ret; threads += 4)
+    {
+        spng_ctx_free(dec);
+        dec = spng_ctx_new(0);
+
+        spng_set_option(dec, SPNG_KEEP_UNKNOWN_CHUNKS, 1);
+        spng_set_option(dec, SPNG_DECODE_THREADS, threads);
+        spng_set_png_buffer(dec, encoded, len);
+
+        memset(decoded, 0, tall_size);
+
+        ret = spng_decode_image(dec, decoded, tall_size, fmt, 0);
+        if(ret)
+        {
+            printf("decoding restart strips with %d threads failed: %s\n", threads, spng_strerror(ret));
+            goto cleanup;
+        }
+
+        if(memcmp(tall, decoded, tall_size))
+        {
+            printf("restart strips decoded with %d threads do not match the source\n", threads);
+            ret = 1;
+            goto cleanup;
+        }
+
+        ret = spng_decode_chunks(dec);
+        if(ret) goto cleanup;
+
+        n_chunks = 1;
+        ret = spng_get_unknown_chunks(dec, &chunk, &n_chunks);
+
+        if(ret || n_chunks != 1 || memcmp(chunk.type, "spRS", 4))
+        {
+            printf("restart strip chunk missing\n");
+            ret = 1;
+        }
+    }
+
+cleanup:
+    free(tall);
+    free(decoded);
+    free(encoded);
+    spng_ctx_free(dec);
+
+    return ret;
+}
+
+/* Decode a large image with SPNG_INFLATE_SPECULATIVE, the inflate ranges must join to the same image */
+static int speculative_tests(const struct spng_ihdr *src_ihdr, const struct spng_plte *plte,
+                             const unsigned char *image, size_t image_size, int fmt)
+{
+    int ret = 0, level;
+    size_t i, len, tall_size;
+    uint32_t seed = 1;
+    unsigned char *tall = NULL, *decoded = NULL, *reference = NULL, *encoded = NULL;
+    struct spng_ihdr ihdr = *src_ihdr;
+    spng_ctx *dec = NULL;
+
+    /* Palette indices can't be changed */
+    if(!have_inflate_backend(SPNG_INFLATE_SPECULATIVE) || ihdr.color_type == SPNG_COLOR_TYPE_INDEXED) return 0;
+
+    /* Noise keeps the compressed size above the minimum for multiple threads */
+    size_t repeat = 1 + (1024 * 1024) / image_size;
+
+    ihdr.height *= repeat;
+
+    tall_size = image_size * repeat;
+    tall = malloc(tall_size);
+    decoded = malloc(tall_size);
+    reference = malloc(tall_size);
+    if(tall == NULL || decoded == NULL || reference == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    for(i=0; i < tall_size; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        tall[i] = image[i % image_size] + ((seed >> 16) & 15);
+    }
+
+    for(level=0; level <= 1 && !ret; level++)
+    {
+        free(encoded);
+        encoded = encode_with_option(&ihdr, plte, tall, tall_size, fmt, SPNG_IMG_COMPRESSION_LEVEL, level, &len);
+        if(encoded == NULL)
+        {
+            ret = 1;
+            goto cleanup;
+        }
+
+        spng_ctx_free(dec);
+        dec = spng_ctx_new(0);
+
+        spng_set_png_buffer(dec, encoded, len);
+
+        ret = spng_decode_image(dec, reference, tall_size, fmt, 0);
+        if(ret) goto cleanup;
+
+        spng_ctx_free(dec);
+        dec = spng_ctx_new(0);
+
+        spng_set_option(dec, SPNG_DECODE_THREADS, 4);
+        spng_set_option(dec, SPNG_INFLATE_BACKEND, SPNG_INFLATE_SPECULATIVE);
+        spng_set_png_buffer(dec, encoded, len);
+
+        memset(decoded, 0, tall_size);
+
+        ret = spng_decode_image(dec, decoded, tall_size, fmt, 0);
+        if(ret)
+        {
+            printf("speculative inflate failed (level %d): %s\n", level, spng_strerror(ret));
+            goto cleanup;
+        }
+
+        if(memcmp(reference, decoded, tall_size))
+        {
+            printf("speculative inflate does not match (level %d)\n", level);
+            ret = 1;
+        }
+    }
+
+cleanup:
+    free(tall);
+    free(decoded);
+    free(reference);
+    free(encoded);
+    spng_ctx_free(dec);
+
+    return ret;
+}
+
+static uint32_t chunk_crc(const unsigned char *buf, size_t len)
+{
+    uint32_t crc = 0xffffffff;
+    size_t i;
+    int k;
+
+    for(i=0; i < len; i++)
+    {
+        crc ^= buf[i];
+
+        for(k=0; k < 8; k++) crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+    }
+
+    return ~crc;
+}
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* The buffer must have room for length + 12 bytes */
+static size_t append_chunk(unsigned char *png, size_t len, const char *type, const unsigned char *data, uint32_t length)
+{
+    unsigned char *p = png + len;
+
+    put_u32(p, length);
+    memcpy(p + 4, type, 4);
+    if(length) memcpy(p + 8, data, length);
+    put_u32(p + 8 + length, chunk_crc(p + 4, length + 4));
+
+    return len + length + 12;
+}
+
+/* Concatenated IDAT data of a PNG */
+static unsigned char *get_idat_data(const unsigned char *png, size_t png_len, size_t *len)
+{
+    size_t offset = 8;
+    unsigned char *data = malloc(png_len);
+    if(data == NULL) return NULL;
+
+    *len = 0;
+
+    while(offset + 12 <= png_len)
+    {
+        uint32_t length = get_u32(png + offset);
+
+        if(!memcmp(png + offset + 4, "IDAT", 4))
+        {
+            memcpy(data + *len, png + offset + 8, length);
+            *len += length;
+        }
+
+        offset += (size_t)length + 12;
+    }
+
+    return data;
+}
+
+static size_t append_fctl(unsigned char *png, size_t len, const struct spng_fctl *fctl)
+{
+    unsigned char data[26];
+
+    put_u32(data, fctl->sequence_number);
+    put_u32(data + 4, fctl->width);
+    put_u32(data + 8, fctl->height);
+    put_u32(data + 12, fctl->x_offset);
+    put_u32(data + 16, fctl->y_offset);
+    data[20] = (unsigned char)(fctl->delay_num >> 8);
+    data[21] = (unsigned char)fctl->delay_num;
+    data[22] = (unsigned char)(fctl->delay_den >> 8);
+    data[23] = (unsigned char)fctl->delay_den;
+    data[24] = fctl->dispose_op;
+    data[25] = fctl->blend_op;
+
+    return append_chunk(png, len, "fcTL", data, 26);
+}
+
+/* Frame data is split into two fdAT's, scratch must have room for len + 4 bytes */
+static size_t append_fdat(unsigned char *png, size_t png_len, const unsigned char *data, size_t len,
+                          uint32_t *seq, unsigned char *scratch)
+{
+    size_t half = len / 2;
+
+    if(half)
+    {
+        put_u32(scratch, (*seq)++);
+        memcpy(scratch + 4, data, half);
+        png_len = append_chunk(png, png_len, "fdAT", scratch, (uint32_t)(half + 4));
+    }
+
+    put_u32(scratch, (*seq)++);
+    memcpy(scratch + 4, data + half, len - half);
+
+    return append_chunk(png, png_len, "fdAT", scratch, (uint32_t)(len - half + 4));
+}
+
+static unsigned get_sample(const unsigned char *p, int c, int depth)
+{
+    uint16_t s;
+
+    if(depth == 8) return p[c];
+
+    memcpy(&s, p + c * 2, 2);
+
+    return s;
+}
+
+static void set_sample(unsigned char *p, int c, int depth, unsigned v)
+{
+    uint16_t s = (uint16_t)v;
+
+    if(depth == 8) p[c] = (unsigned char)v;
+    else memcpy(p + c * 2, &s, 2);
+}
+
+/* Reference compositor, frame pixels are the top-left area of the image */
+static void compose_frame(unsigned char *canvas, const unsigned char *image, uint32_t image_width,
+                          const struct spng_fctl *fctl, int blend_op, int depth)
+{
+    uint32_t x, y;
+    const size_t pixel_size = depth / 2;
+    const uint64_t max = depth == 8 ? 255 : 65535;
+    int c;
+
+    for(y=0; y < fctl->height; y++)
+    {
+        for(x=0; x < fctl->width; x++)
+        {
+            const unsigned char *src = image + ((size_t)y * image_width + x) * pixel_size;
+            unsigned char *dst = canvas + ((size_t)(y + fctl->y_offset) * image_width + x + fctl->x_offset) * pixel_size;
+            uint64_t sa = get_sample(src, 3, depth);
+
+            if(blend_op == SPNG_BLEND_OP_SOURCE || sa == max) memcpy(dst, src, pixel_size);
+            else if(sa)
+            {
+                uint64_t u = sa * max;
+                uint64_t v = (max - sa) * get_sample(dst, 3, depth);
+                uint64_t a = u + v;
+
+                for(c=0; c < 3; c++)
+                {
+                    set_sample(dst, c, depth, (unsigned)((get_sample(src, c, depth) * u + get_sample(dst, c, depth) * v + a / 2) / a));
+                }
+
+                set_sample(dst, 3, depth, (unsigned)((a + max / 2) / max));
+            }
+        }
+    }
+}
+
+static void clear_area(unsigned char *canvas, const unsigned char *from, uint32_t image_width,
+                       const struct spng_fctl *fctl, size_t pixel_size)
+{
+    uint32_t y;
+
+    for(y=fctl->y_offset; y < fctl->y_offset + fctl->height; y++)
+    {
+        size_t offset = ((size_t)y * image_width + fctl->x_offset) * pixel_size;
+
+        if(from == NULL) memset(canvas + offset, 0, fctl->width * pixel_size);
+        else memcpy(canvas + offset, from + offset, fctl->width * pixel_size);
+    }
+}
+
+/* Frames made from parts of the image are composited onto the canvas */
+static int apng_tests(const struct spng_ihdr *ihdr, const struct spng_plte *plte,
+                      const unsigned char *image, size_t image_size, int fmt)
+{
+    int ret = 0, hidden, threads;
+    size_t i, len, apng_len, canvas_size, max_data = 0;
+    const uint32_t w = ihdr->width, h = ihdr->height;
+    unsigned char *encoded = NULL, *apng = NULL, *scratch = NULL;
+    unsigned char *reference = NULL, *canvas = NULL, *expected = NULL, *saved = NULL;
+    unsigned char *frame_data[5] = {0};
+    size_t frame_len[5] = {0};
+    spng_ctx *dec = NULL;
+
+    const int depth = ihdr->bit_depth == 16 ? 16 : 8;
+    const int canvas_fmt = depth == 16 ? SPNG_FMT_RGBA16 : SPNG_FMT_RGBA8;
+    const size_t pixel_size = depth / 2;
+    const size_t row_bytes = image_size / h;
+    size_t first_idat = 8, bits = ihdr->bit_depth;
+
+    if(ihdr->color_type == SPNG_COLOR_TYPE_TRUECOLOR) bits *= 3;
+    else if(ihdr->color_type == SPNG_COLOR_TYPE_GRAYSCALE_ALPHA) bits *= 2;
+    else if(ihdr->color_type == SPNG_COLOR_TYPE_TRUECOLOR_ALPHA) bits *= 4;
+
+    struct spng_fctl frames[5] =
+    {
+        { .width = w, .height = h, .dispose_op = SPNG_DISPOSE_OP_PREVIOUS, .blend_op = SPNG_BLEND_OP_OVER },
+        { .x_offset = w / 4, .y_offset = h / 4, .width = w / 2 ? w / 2 : 1, .height = h / 2 ? h / 2 : 1, .blend_op = SPNG_BLEND_OP_OVER },
+        { .y_offset = h / 2, .width = w, .height = h - h / 2, .dispose_op = SPNG_DISPOSE_OP_PREVIOUS },
+        { .x_offset = w / 2, .width = w - w / 2, .height = h / 3 ? h / 3 : 1, .dispose_op = SPNG_DISPOSE_OP_BACKGROUND, .blend_op = SPNG_BLEND_OP_OVER },
+        { .width = w, .height = h, .blend_op = SPNG_BLEND_OP_OVER }
+    };
+
+    const size_t n_frames = sizeof(frames) / sizeof(frames[0]);
+
+    encoded = encode_with_option(ihdr, plte, image, image_size, fmt, SPNG_IMG_COMPRESSION_LEVEL, 1, &len);
+    if(encoded == NULL) return 1;
+
+    dec = spng_ctx_new(0);
+    spng_set_png_buffer(dec, encoded, len);
+
+    ret = spng_decoded_image_size(dec, canvas_fmt, &canvas_size);
+    if(ret) goto cleanup;
+
+    reference = malloc(canvas_size);
+    canvas = malloc(canvas_size);
+    expected = malloc(canvas_size);
+    saved = malloc(canvas_size);
+    if(reference == NULL || canvas == NULL || expected == NULL || saved == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    ret = spng_decode_image(dec, reference, canvas_size, canvas_fmt, 0);
+    if(ret) goto cleanup;
+
+    while(memcmp(encoded + first_idat + 4, "IDAT", 4)) first_idat += (size_t)get_u32(encoded + first_idat) + 12;
+
+    /* Frame data comes from images of the top-left area of the image */
+    for(i=1; i < n_frames; i++)
+    {
+        struct spng_ihdr frame_ihdr = *ihdr;
+        unsigned char *frame_png;
+        size_t frame_png_len, y, frame_row_bytes;
+
+        frame_ihdr.width = frames[i].width;
+        frame_ihdr.height = frames[i].height;
+        frame_row_bytes = ((size_t)frames[i].width * bits + 7) / 8;
+
+        unsigned char *area = malloc(frame_row_bytes * frames[i].height);
+        if(area == NULL)
+        {
+            ret = 1;
+            goto cleanup;
+        }
+
+        for(y=0; y < frames[i].height; y++) memcpy(area + y * frame_row_bytes, image + y * row_bytes, frame_row_bytes);
+
+        frame_png = encode_with_option(&frame_ihdr, plte, area, frame_row_bytes * frames[i].height, fmt,
+                                       SPNG_IMG_COMPRESSION_LEVEL, 1, &frame_png_len);
+        free(area);
+
+        if(frame_png == NULL)
+        {
+            ret = 1;
+            goto cleanup;
+        }
+
+        frame_data[i] = get_idat_data(frame_png, frame_png_len, &frame_len[i]);
+        free(frame_png);
+
+        if(frame_data[i] == NULL)
+        {
+            ret = 1;
+            goto cleanup;
+        }
+
+        if(frame_len[i] > max_data) max_data = frame_len[i];
+    }
+
+    apng = malloc(len + max_data * n_frames + 1024);
+    scratch = malloc(max_data + 4);
+    if(apng == NULL || scratch == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    /* The default image is the first frame or hidden */
+    for(hidden=0; hidden <= 1 && !ret; hidden++)
+    {
+        size_t offset = 8;
+        uint32_t seq = 0;
+        unsigned char actl[8];
+
+        memcpy(apng, encoded, 8);
+        apng_len = 8;
+
+        while(offset < len)
+        {
+            const unsigned char *chunk = encoded + offset;
+            size_t chunk_len = (size_t)get_u32(chunk) + 12;
+
+            if(!memcmp(chunk + 4, "IDAT", 4) && offset == first_idat)
+            {
+                put_u32(actl, (uint32_t)(n_frames - hidden));
+                put_u32(actl + 4, 0);
+
+                apng_len = append_chunk(apng, apng_len, "acTL", actl, 8);
+
+                if(!hidden)
+                {
+                    frames[0].sequence_number = seq++;
+                    apng_len = append_fctl(apng, apng_len, &frames[0]);
+                }
+            }
+            else if(!memcmp(chunk + 4, "IEND", 4))
+            {
+                for(i=1; i < n_frames; i++)
+                {
+                    frames[i].sequence_number = seq++;
+                    apng_len = append_fctl(apng, apng_len, &frames[i]);
+                    apng_len = append_fdat(apng, apng_len, frame_data[i], frame_len[i], &seq, scratch);
+                }
+            }
+
+            memcpy(apng + apng_len, chunk, chunk_len);
+            apng_len += chunk_len;
+            offset += chunk_len;
+        }
+
+        /* spng_decode_image() only decodes the default image */
+        spng_ctx_free(dec);
+        dec = spng_ctx_new(0);
+        spng_set_png_buffer(dec, apng, apng_len);
+
+        ret = spng_decode_image(dec, canvas, canvas_size, canvas_fmt, 0);
+        if(ret || memcmp(canvas, reference, canvas_size))
+        {
+            printf("APNG default image does not match (hidden %d): %s\n", hidden, spng_strerror(ret));
+            ret = 1;
+            break;
+        }
+
+        if(spng_decode_frame(dec, canvas, canvas_size, canvas_fmt, 0) != SPNG_EOPSTATE)
+        {
+            printf("spng_decode_frame() after spng_decode_image() should fail\n");
+            ret = 1;
+            break;
+        }
+
+        for(threads=0; threads <= 2 && !ret; threads += 2)
+        {
+            struct spng_actl actl_chunk;
+            struct spng_fctl fctl;
+
+            spng_ctx_free(dec);
+            dec = spng_ctx_new(0);
+
+            spng_set_option(dec, SPNG_DECODE_THREADS, threads);
+            spng_set_png_buffer(dec, apng, apng_len);
+
+            ret = spng_get_actl(dec, &actl_chunk);
+            if(ret || actl_chunk.num_frames != n_frames - hidden)
+            {
+                printf("invalid acTL (hidden %d): %s\n", hidden, spng_strerror(ret));
+                ret = 1;
+                break;
+            }
+
+            memset(expected, 0, canvas_size);
+
+            for(i=hidden; i < n_frames; i++)
+            {
+                if(i > hidden && frames[i - 1].dispose_op == SPNG_DISPOSE_OP_BACKGROUND)
+                {
+                    clear_area(expected, NULL, w, &frames[i - 1], pixel_size);
+                }
+                else if(i > hidden && frames[i - 1].dispose_op == SPNG_DISPOSE_OP_PREVIOUS)
+                {
+                    clear_area(expected, saved, w, &frames[i - 1], pixel_size);
+                }
+
+                memcpy(saved, expected, canvas_size);
+
+                /* The first frame replaces the transparent canvas */
+                compose_frame(expected, reference, w, &frames[i], i == (size_t)hidden ? SPNG_BLEND_OP_SOURCE : frames[i].blend_op, depth);
+
+                ret = spng_decode_frame(dec, canvas, canvas_size, canvas_fmt, 0);
+                if(ret)
+                {
+                    printf("decoding frame %zu failed (hidden %d, threads %d): %s\n", i, hidden, threads, spng_strerror(ret));
+                    break;
+                }
+
+                if(memcmp(canvas, expected, canvas_size))
+                {
+                    printf("frame %zu does not match (hidden %d, threads %d)\n", i, hidden, threads);
+                    ret = 1;
+                    break;
+                }
+
+                ret = spng_get_fctl(dec, &fctl);
+                if(ret || fctl.sequence_number != frames[i].sequence_number || fctl.x_offset != frames[i].x_offset ||
+                   fctl.y_offset != frames[i].y_offset || fctl.width != frames[i].width || fctl.height != frames[i].height ||
+                   fctl.dispose_op != frames[i].dispose_op || fctl.blend_op != frames[i].blend_op)
+                {
+                    printf("invalid fcTL for frame %zu: %s\n", i, spng_strerror(ret));
+                    ret = 1;
+                    break;
+                }
+            }
+
+            if(!ret && spng_decode_frame(dec, canvas, canvas_size, canvas_fmt, 0) != SPNG_EOI)
+            {
+                printf("expected SPNG_EOI after the last frame\n");
+                ret = 1;
+            }
+        }
+    }
+
+cleanup:
+    for(i=0; i < n_frames; i++) free(frame_data[i]);
+
+    free(encoded);
+    free(apng);
+    free(scratch);
+    free(reference);
+    free(canvas);
+    free(expected);
+    free(saved);
+    spng_ctx_free(dec);
+
+    return ret;
+}
+
+static unsigned char *encode_frames(const struct spng_ihdr *ihdr, const struct spng_plte *plte,
+                                    unsigned char **frames, uint32_t n_frames, size_t image_size,
+                                    int fmt, int threads, size_t *len)
+{
+    int ret = 0;
+    uint32_t i;
+    unsigned char *encoded = NULL;
+    struct spng_actl actl = { .num_frames = n_frames };
+    struct spng_fctl fctl = { .delay_num = 1, .delay_den = 25 };
+    spng_ctx *enc = spng_ctx_new(SPNG_CTX_ENCODER);
+
+    spng_set_option(enc, SPNG_ENCODE_TO_BUFFER, 1);
+    spng_set_option(enc, SPNG_ENCODE_THREADS, threads);
+
+    spng_set_ihdr(enc, (struct spng_ihdr*)ihdr);
+
+    if(plte->n_entries) spng_set_plte(enc, (struct spng_plte*)plte);
+
+    spng_set_actl(enc, &actl);
+    spng_set_fctl(enc, &fctl);
+
+    if(spng_encode_image(enc, frames[0], image_size, fmt, 0) != SPNG_EOPSTATE)
+    {
+        printf("spng_encode_image() should fail with an acTL chunk\n");
+        ret = 1;
+    }
+
+    for(i=0; i < n_frames && !ret; i++)
+    {
+        ret = spng_encode_frame(enc, frames[i], image_size, fmt, i == n_frames - 1 ? SPNG_ENCODE_FINALIZE : 0);
+    }
+
+    if(ret) printf("encoding frame %u failed (%d): %s\n", i, ret, spng_strerror(ret));
+    else encoded = spng_get_png_buffer(enc, len, &ret);
+
+    spng_ctx_free(enc);
+
+    return encoded;
+}
+
+/* Encoded frames must decode to the same images */
+static int apng_encode_tests(const struct spng_ihdr *src_ihdr, const struct spng_plte *plte,
+                             const unsigned char *image, size_t image_size, int fmt)
+{
+    int ret = 0;
+    uint32_t i, y;
+    size_t k, len, len_mt = 0, canvas_size;
+    unsigned char *frames[6] = {0};
+    unsigned char *encoded = NULL, *encoded_mt = NULL, *canvas = NULL, *expected = NULL;
+    struct spng_ihdr ihdr = *src_ihdr;
+    spng_ctx *dec = NULL;
+
+    const uint32_t n_frames = 6;
+    const size_t row_bytes = image_size / ihdr.height;
+    const int canvas_fmt = ihdr.bit_depth == 16 ? SPNG_FMT_RGBA16 : SPNG_FMT_RGBA8;
+    const int has_alpha = ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE_ALPHA || ihdr.color_type == SPNG_COLOR_TYPE_TRUECOLOR_ALPHA;
+    const size_t alpha_size = has_alpha ? ihdr.bit_depth / 8 : 0;
+    size_t pixel_bytes = 1;
+
+    if(ihdr.bit_depth >= 8) pixel_bytes = row_bytes / ihdr.width;
+
+    /* Pixel-aligned area */
+    const uint32_t y0 = ihdr.height / 4, y1 = y0 + (ihdr.height / 4 ? ihdr.height / 4 : 1);
+    const size_t x0 = row_bytes / 4 / pixel_bytes * pixel_bytes;
+    size_t x1 = row_bytes / 2 / pixel_bytes * pixel_bytes + pixel_bytes;
+
+    if(x1 > row_bytes) x1 = row_bytes;
+
+    ihdr.interlace_method = 0;
+
+    for(i=0; i < n_frames; i++)
+    {
+        frames[i] = malloc(image_size);
+        if(frames[i] == NULL)
+        {
+            ret = 1;
+            goto cleanup;
+        }
+    }
+
+    /* An opaque area, the area cleared, an unchanged frame, cleared rows and the first frame again */
+    memcpy(frames[0], image, image_size);
+    memcpy(frames[1], image, image_size);
+
+    for(y=y0; y < y1; y++)
+    {
+        for(k=x0; k < x1; k++)
+        {/* Palette indices must stay valid */
+            unsigned char *p = frames[1] + y * row_bytes + k;
+
+            *p = ihdr.color_type == SPNG_COLOR_TYPE_INDEXED ? 0 : ~*p;
+        }
+
+        /* Opaque pixels can be blended */
+        for(k=x0 + pixel_bytes - alpha_size; alpha_size && k < x1; k += pixel_bytes)
+        {
+            memset(frames[1] + y * row_bytes + k, 0xff, alpha_size);
+        }
+    }
+
+    memcpy(frames[2], frames[1], image_size);
+
+    for(y=y0; y < y1; y++) memset(frames[2] + y * row_bytes + x0, 0, x1 - x0);
+
+    memcpy(frames[3], frames[2], image_size);
+    memcpy(frames[4], image, image_size);
+    memset(frames[4], 0, row_bytes * (ihdr.height / 3 ? ihdr.height / 3 : 1));
+    memcpy(frames[5], image, image_size);
+
+    encoded = encode_frames(&ihdr, plte, frames, n_frames, image_size, fmt, 0, &len);
+    encoded_mt = encode_frames(&ihdr, plte, frames, n_frames, image_size, fmt, 3, &len_mt);
+
+    if(encoded == NULL || encoded_mt == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if(len != len_mt || memcmp(encoded, encoded_mt, len))
+    {
+        printf("APNG encoded with threads does not match\n");
+        ret = 1;
+        goto cleanup;
+    }
+
+    dec = spng_ctx_new(0);
+    spng_set_png_buffer(dec, encoded, len);
+
+    ret = spng_decoded_image_size(dec, canvas_fmt, &canvas_size);
+    if(ret) goto cleanup;
+
+    canvas = malloc(canvas_size);
+    expected = malloc(canvas_size);
+    if(canvas == NULL || expected == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    for(i=0; i < n_frames; i++)
+    {
+        size_t frame_len;
+        unsigned char *frame_png = encode_with_option(&ihdr, plte, frames[i], image_size, fmt,
+                                                      SPNG_IMG_COMPRESSION_LEVEL, 1, &frame_len);
+        if(frame_png == NULL)
+        {
+            ret = 1;
+            goto cleanup;
+        }
+
+        spng_ctx *ref = spng_ctx_new(0);
+        spng_set_png_buffer(ref, frame_png, frame_len);
+
+        ret = spng_decode_image(ref, expected, canvas_size, canvas_fmt, 0);
+
+        spng_ctx_free(ref);
+        free(frame_png);
+
+        if(ret) goto cleanup;
+
+        ret = spng_decode_frame(dec, canvas, canvas_size, canvas_fmt, 0);
+        if(ret)
+        {
+            printf("decoding encoded frame %u failed: %s\n", i, spng_strerror(ret));
+            goto cleanup;
+        }
+
+        if(memcmp(canvas, expected, canvas_size))
+        {
+            printf("encoded frame %u does not match\n", i);
+            ret = 1;
+            goto cleanup;
+        }
+    }
+
+    if(spng_decode_frame(dec, canvas, canvas_size, canvas_fmt, 0) != SPNG_EOI)
+    {
+        printf("expected SPNG_EOI after the last encoded frame\n");
+        ret = 1;
+    }
+
+cleanup:
+    for(i=0; i < n_frames; i++) free(frames[i]);
+
+    free(encoded);
+    free(encoded_mt);
+    free(canvas);
+    free(expected);
+    spng_ctx_free(dec);
+
+    return ret;
+}
+
+static int have_deflate_backend(int backend)
+{
+    spng_ctx *ctx = spng_ctx_new(SPNG_CTX_ENCODER);
+    int ret = spng_set_option(ctx, SPNG_DEFLATE_BACKEND, backend);
+
+    spng_ctx_free(ctx);
+
+    return !ret;
+}
+
+/* Encode with a one-shot deflate backend and check that it decodes to the source image */
+/* Decodes an encoded image with libpng and compares it with the source */
+static int compare_libpng(unsigned char *png, size_t len, const unsigned char *image, size_t image_size, int fmt)
+{
+    int ret = 0;
+    size_t decoded_size;
+    png_infop info_ptr = NULL;
+    spngt_test_case test_case = { .fmt = fmt };
+
+    test_case.source.type = SPNGT_SRC_BUFFER;
+    test_case.source.buffer = png;
+    test_case.source.png_size = len;
+
+    png_structp png_ptr = init_libpng(&test_case, &info_ptr);
+    if(png_ptr == NULL) return 1;
+
+    /* libpng's structs are freed on errors */
+    unsigned char *decoded = getimage_libpng(png_ptr, info_ptr, &decoded_size, fmt, 0);
+    if(decoded == NULL) return 1;
+
+    if(decoded_size != image_size || memcmp(decoded, image, image_size)) ret = 1;
+
+    free(decoded);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+    return ret;
+}
+
+static int deflate_backend_tests(const struct spng_ihdr *ihdr, const struct spng_plte *plte,
+                                 const unsigned char *image, size_t image_size, int fmt)
+{
+    int i, ret = 0;
+    size_t len, stream_len, decoded_size;
+    unsigned char *encoded = NULL, *stream = NULL, *decoded = NULL;
+    spng_ctx *dec = NULL;
+    const int backends[3] = { SPNG_DEFLATE_ZLIB, SPNG_DEFLATE_LIBDEFLATE, SPNG_DEFLATE_FAST };
+
+    stream = encode_with_option(ihdr, plte, image, image_size, fmt, SPNG_DEFLATE_BACKEND, SPNG_DEFLATE_STREAM, &stream_len);
+    if(stream == NULL) return 1;
+
+    for(i=0; i < 3; i++)
+    {
+        if(!have_deflate_backend(backends[i])) continue;
+
+        encoded = encode_with_option(ihdr, plte, image, image_size, fmt, SPNG_DEFLATE_BACKEND, backends[i], &len);
+        if(encoded == NULL)
+        {
+            ret = 1;
+            goto cleanup;
+        }
+
+        /* zlib's output does not depend on how the input is split */
+        if(backends[i] == SPNG_DEFLATE_ZLIB && (len != stream_len || memcmp(encoded, stream, len)))
+        {
+            printf("one-shot zlib output does not match the streaming encoder\n");
+            ret = 1;
+            goto cleanup;
+        }
+
+        dec = spng_ctx_new(0);
+        spng_set_png_buffer(dec, encoded, len);
+
+        ret = spng_decoded_image_size(dec, fmt, &decoded_size);
+        if(ret) goto cleanup;
+
+        decoded = calloc(1, decoded_size);
+        if(decoded == NULL || decoded_size != image_size)
+        {
+            ret = 1;
+            goto cleanup;
+        }
+
+        ret = spng_decode_image(dec, decoded, decoded_size, fmt, 0);
+        if(ret)
+        {
+            printf("decoding image compressed with deflate backend %d failed: %s\n", backends[i], spng_strerror(ret));
+            goto cleanup;
+        }
+
+        if(memcmp(image, decoded, image_size))
+        {
+            printf("image compressed with deflate backend %d does not match the source\n", backends[i]);
+            ret = 1;
+            goto cleanup;
+        }
+
+        if(compare_libpng(encoded, len, image, image_size, fmt))
+        {
+            printf("libpng does not decode the image compressed with deflate backend %d\n", backends[i]);
+            ret = 1;
+            goto cleanup;
+        }
+
+        free(encoded);
+        free(decoded);
+        spng_ctx_free(dec);
+
+        encoded = NULL;
+        decoded = NULL;
+        dec = NULL;
+    }
+
+cleanup:
+    free(stream);
+    free(encoded);
+    free(decoded);
+    spng_ctx_free(dec);
+
+    return ret;
+}
+
+/* Reference for the filter heuristic used with multiple filter choices */
+static int best_filter(const unsigned char *prev, const unsigned char *row, size_t row_bytes, unsigned bpp)
+{
+    int filter, best = 0;
+    size_t i;
+    uint64_t score, best_score = UINT64_MAX;
+
+    for(filter=0; filter < 5; filter++)
+    {
+        score = 0;
+
+        for(i=0; i < row_bytes; i++)
+        {
+            int a = i >= bpp ? row[i - bpp] : 0;
+            int b = prev[i];
+            int c = i >= bpp ? prev[i - bpp] : 0;
+            int pred = 0;
+
+            if(filter == 1) pred = a;
+            else if(filter == 2) pred = b;
+            else if(filter == 3) pred = (a + b) / 2;
+            else if(filter == 4)
+            {
+                int p = a + b - c;
+                int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+                if(pa <= pb && pa <= pc) pred = a;
+                else if(pb <= pc) pred = b;
+                else pred = c;
+            }
+
+            uint8_t x = row[i] - pred;
+            score += x < 128 ? x : 256 - x;
+        }
+
+        if(score < best_score)
+        {
+            best_score = score;
+            best = filter;
+        }
+    }
+
+    return best;
+}
+
+/* Encode random rows with a single filter type and decode them again,
+   the encoder's filters are always scalar so this checks the optimized defilter
+   functions against the scalar implementation for every row width up to 40 pixels
+   and a few widths around multiples of 64 bytes */
+static int defilter_tests(const struct spng_ihdr *src_ihdr, const struct spng_plte *plte)
+{
+    int i, k, ret = 0;
+    uint32_t width, rng = 0x12345678;
+    const uint32_t extra_widths[6] = { 63, 64, 65, 127, 128, 129 };
+    size_t j, image_size, len, decoded_size;
+    unsigned char *image = NULL, *encoded = NULL, *decoded = NULL;
+    spng_ctx *dec = NULL;
+    struct spng_ihdr ihdr = *src_ihdr;
+    const int filters[3] = { SPNG_FILTER_CHOICE_SUB, SPNG_FILTER_CHOICE_AVG, SPNG_FILTER_CHOICE_PAETH };
+    const unsigned char zero_row[1032] = { 0 };
+
+    /* Palette indices have to be valid */
+    if(ihdr.color_type == SPNG_COLOR_TYPE_INDEXED) return 0;
+
+    unsigned channels = 1;
+    if(ihdr.color_type == SPNG_COLOR_TYPE_TRUECOLOR) channels = 3;
+    else if(ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE_ALPHA) channels = 2;
+    else if(ihdr.color_type == SPNG_COLOR_TYPE_TRUECOLOR_ALPHA) channels = 4;
+
+    ihdr.height = 4;
+    ihdr.interlace_method = 0;
+
+    for(k=0; k < 46; k++)
+    {
+        width = k < 40 ? k + 1 : extra_widths[k - 40];
+        ihdr.width = width;
+
+        size_t row_bytes = ((size_t)width * channels * ihdr.bit_depth + 7) / 8;
+        image_size = row_bytes * ihdr.height;
+
+        image = malloc(image_size);
+        decoded = malloc(image_size);
+        if(image == NULL || decoded == NULL)
+        {
+            ret = 1;
+            goto cleanup;
+        }
+
+        for(j=0; j < image_size; j++)
+        {
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            image[j] = rng >> 24;
+        }
+
+        /* Sub-byte samples do not use all bits of the last byte */
+        if(ihdr.bit_depth < 8)
+        {
+            unsigned unused_bits = row_bytes * 8 - (size_t)width * ihdr.bit_depth;
+
+            for(j=row_bytes - 1; j < image_size; j += row_bytes) image[j] &= 0xFF << unused_bits;
+        }
+
+        for(i=0; i < 3; i++)
+        {
+            encoded = encode_with_option(&ihdr, plte, image, image_size, SPNG_FMT_PNG, SPNG_FILTER_CHOICE, filters[i], &len);
+            if(encoded == NULL)
+            {
+                ret = 1;
+                goto cleanup;
+            }
+
+            dec = spng_ctx_new(0);
+            spng_set_png_buffer(dec, encoded, len);
+
+            ret = spng_decoded_image_size(dec, SPNG_FMT_PNG, &decoded_size);
+            if(!ret && decoded_size != image_size) ret = 1;
+            if(!ret) ret = spng_decode_image(dec, decoded, decoded_size, SPNG_FMT_PNG, 0);
+
+            if(ret || memcmp(image, decoded, image_size))
+            {
+                printf("defiltering failed for filter choice %d at width %" PRIu32 "\n", filters[i], width);
+                if(!ret) ret = 1;
+                goto cleanup;
+            }
+
+            free(encoded);
+            spng_ctx_free(dec);
+
+            encoded = NULL;
+            dec = NULL;
+        }
+
+        /* The encoder must pick the same filter for each row as the reference */
+        encoded = encode_with_option(&ihdr, plte, image, image_size, SPNG_FMT_PNG, SPNG_FILTER_CHOICE, SPNG_FILTER_CHOICE_ALL, &len);
+        if(encoded == NULL)
+        {
+            ret = 1;
+            goto cleanup;
+        }
+
+        dec = spng_ctx_new(0);
+        spng_set_png_buffer(dec, encoded, len);
+
+        ret = spng_decode_image(dec, NULL, 0, SPNG_FMT_PNG, SPNG_DECODE_PROGRESSIVE);
+
+        for(j=0; !ret && j < ihdr.height; j++)
+        {
+            struct spng_row_info row_info;
+            const unsigned char *row = image + j * row_bytes;
+            unsigned bpp = (channels * ihdr.bit_depth + 7) / 8;
+            int expected = best_filter(j ? row - row_bytes : zero_row, row, row_bytes, bpp);
+
+            ret = spng_get_row_info(dec, &row_info);
+            if(!ret) ret = spng_decode_row(dec, decoded + j * row_bytes, row_bytes);
+            if(ret == SPNG_EOI) ret = 0;
+
+            if(!ret && row_info.filter != expected)
+            {
+                printf("filter choice for row %zu is %d, expected %d at width %" PRIu32 "\n",
+                       j, (int)row_info.filter, expected, width);
+                ret = 1;
+            }
+        }
+
+        if(ret) goto cleanup;
+
+        free(encoded);
+        spng_ctx_free(dec);
+
+        encoded = NULL;
+        dec = NULL;
+
+        free(image);
+        free(decoded);
+
+        image = NULL;
+        decoded = NULL;
+    }
+
+cleanup:
+    free(image);
+    free(encoded);
+    free(decoded);
+    spng_ctx_free(dec);
+
+    return ret;
+}
+
+static int compare_text(spng_ctx *dec, const struct spng_text *text, uint32_t n_text, const struct spng_iccp *iccp)
+{
+    uint32_t i, n = 0;
+    struct spng_text out[3];
+    struct spng_iccp out_iccp;
+
+    int ret = spng_get_iccp(dec, &out_iccp);
+
+    if(ret)
+    {
+        printf("spng_get_iccp() failed: %s\n", spng_strerror(ret));
+        return ret;
+    }
+
+    if(out_iccp.profile_len != iccp->profile_len || memcmp(out_iccp.profile, iccp->profile, iccp->profile_len))
+    {
+        printf("iCCP profile does not match\n");
+        return 1;
+    }
+
+    ret = spng_get_text(dec, NULL, &n);
+
+    if(ret || n != n_text)
+    {
+        printf("expected %u text chunks, got %u: %s\n", n_text, n, spng_strerror(ret));
+        return 1;
+    }
+
+    ret = spng_get_text(dec, out, &n);
+    if(ret) return ret;
+
+    for(i=0; i < n; i++)
+    {
+        if(strcmp(out[i].keyword, text[i].keyword) || out[i].length != text[i].length ||
+           memcmp(out[i].text, text[i].text, text[i].length))
+        {
+            printf("text[%u] does not match\n", i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* spng_get_unknown_chunks() copies every stored chunk and sets the count */
+static int unknown_chunk_tests(const struct spng_ihdr *src_ihdr, const struct spng_plte *plte,
+                               const unsigned char *image, size_t image_size, int fmt)
+{
+    int ret = 0;
+    uint32_t i, n;
+    size_t len;
+    unsigned char *encoded = NULL, *decoded = NULL;
+    unsigned char data[3][8] = { "first", "second", "third" };
+    struct spng_ihdr ihdr = *src_ihdr;
+    struct spng_unknown_chunk chunks[3] =
+    {
+        { .location = SPNG_AFTER_IHDR, .type = "cHNa", .length = 5, .data = data[0] },
+        { .location = SPNG_AFTER_IHDR, .type = "cHNb", .length = 6, .data = data[1] },
+        { .location = SPNG_AFTER_IDAT, .type = "cHNc", .length = 5, .data = data[2] }
+    };
+    struct spng_unknown_chunk out[4];
+    spng_ctx *dec = NULL;
+
+    ihdr.interlace_method = 0;
+
+    struct encode_chunks set = { .unknown = chunks, .n_unknown = 3 };
+
+    encoded = encode_with_chunks(&ihdr, plte, image, image_size, fmt, &set, &len, &ret);
+    if(encoded == NULL)
+    {
+        printf("encoding unknown chunks failed: %s\n", spng_strerror(ret));
+        goto cleanup;
+    }
+
+    dec = spng_ctx_new(0);
+
+    spng_set_option(dec, SPNG_KEEP_UNKNOWN_CHUNKS, 1);
+    spng_set_png_buffer(dec, encoded, len);
+
+    /* Chunks after IDAT are read with the image */
+    decoded = malloc(image_size);
+    if(decoded == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    ret = spng_decode_image(dec, decoded, image_size, fmt, 0);
+    if(!ret) ret = spng_decode_chunks(dec);
+    if(ret)
+    {
+        printf("decoding unknown chunks failed: %s\n", spng_strerror(ret));
+        goto cleanup;
+    }
+
+    n = 2;
+    if(spng_get_unknown_chunks(dec, out, &n) == 0)
+    {
+        printf("spng_get_unknown_chunks() accepted a short list\n");
+        ret = 1;
+        goto cleanup;
+    }
+
+    n = 4;
+    memset(out, 0, sizeof(out));
+
+    ret = spng_get_unknown_chunks(dec, out, &n);
+    if(ret || n != 3)
+    {
+        printf("spng_get_unknown_chunks() returned %u chunks: %s\n", n, spng_strerror(ret));
+        if(!ret) ret = 1;
+        goto cleanup;
+    }
+
+    for(i=0; i < 3; i++)
+    {
+        if(memcmp(out[i].type, chunks[i].type, 4) || out[i].location != chunks[i].location ||
+           out[i].length != chunks[i].length || memcmp(out[i].data, chunks[i].data, chunks[i].length))
+        {
+            printf("unknown chunk %u does not match\n", i);
+            ret = 1;
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    free(encoded);
+    free(decoded);
+    spng_ctx_free(dec);
+
+    return ret;
+}
+
+/* Largest allocation made by a context */
+static size_t largest_alloc;
+
+static void *tracking_malloc(size_t size)
+{
+    if(size > largest_alloc) largest_alloc = size;
+
+    return malloc(size);
+}
+
+static void *tracking_realloc(void *ptr, size_t size)
+{
+    if(size > largest_alloc) largest_alloc = size;
+
+    return realloc(ptr, size);
+}
+
+static void *tracking_calloc(size_t count, size_t size)
+{
+    if(count && size > SIZE_MAX / count) return NULL;
+    if(count * size > largest_alloc) largest_alloc = count * size;
+
+    return calloc(count, size);
+}
+
+/* Compressed text and iCCP are inflated on first access,
+   also while the image is decoded from a buffer, file or stream */
+static int text_tests(const struct spng_ihdr *src_ihdr, const struct spng_plte *plte,
+                      const unsigned char *image, size_t image_size, int fmt)
+{
+    int ret = 0, input;
+    size_t i, len, row_bytes = image_size / src_ihdr->height;
+    const size_t profile_len = 20000, text_len = 30000;
+    unsigned char *tall = NULL, *encoded = NULL, *decoded = NULL;
+    char *profile = malloc(profile_len), *long_text = malloc(text_len + 1);
+    struct spng_ihdr ihdr = *src_ihdr;
+    struct spng_text text[3];
+    struct spng_iccp iccp = { .profile_name = "Test profile", .profile_len = profile_len, .profile = profile };
+    struct spng_row_info row_info;
+    struct buf_state state;
+    struct encode_chunks set = { .option = SPNG_IMG_COMPRESSION_LEVEL, .value = 0, .iccp = &iccp, .text = text, .n_text = 3 };
+    spng_ctx *dec = NULL;
+    FILE *file = NULL;
+
+    /* Uncompressed image data longer than a few stream reads */
+    size_t repeat = 1 + (64 * 1024) / image_size;
+
+    ihdr.height *= repeat;
+    ihdr.interlace_method = 0;
+
+    size_t tall_size = image_size * repeat;
+    tall = malloc(tall_size);
+    decoded = malloc(tall_size);
+
+    if(tall == NULL || decoded == NULL || profile == NULL || long_text == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    for(i=0; i < repeat; i++) memcpy(tall + i * image_size, image, image_size);
+
+    /* ICC profiles start with their size */
+    for(i=0; i < profile_len; i++) profile[i] = (char)(i % 251);
+
+    profile[0] = 0;
+    profile[1] = 0;
+    profile[2] = (char)(profile_len >> 8);
+    profile[3] = (char)(profile_len & 0xff);
+
+    for(i=0; i < text_len; i++) long_text[i] = "lazy text chunk "[i % 16] + (i % 7 == 0);
+
+    long_text[text_len] = '\0';
+
+    memset(text, 0, sizeof(text));
+
+    strcpy(text[0].keyword, "Title");
+    text[0].type = SPNG_TEXT;
+    text[0].text = "uncompressed";
+    text[0].length = strlen(text[0].text);
+
+    strcpy(text[1].keyword, "Comment");
+    text[1].type = SPNG_ZTXT;
+    text[1].text = long_text;
+    text[1].length = text_len;
+
+    strcpy(text[2].keyword, "Description");
+    text[2].type = SPNG_ITXT;
+    text[2].compression_flag = 1;
+    text[2].language_tag = "en";
+    text[2].translated_keyword = "Description";
+    text[2].text = long_text;
+    text[2].length = text_len;
+
+    encoded = encode_with_chunks(&ihdr, plte, tall, tall_size, fmt, &set, &len, &ret);
+    if(encoded == NULL)
+    {
+        printf("encoding text chunks failed: %s\n", spng_strerror(ret));
+        goto cleanup;
+    }
+
+    file = tmpfile();
+    if(file != NULL && fwrite(encoded, len, 1, file) != 1)
+    {
+        fclose(file);
+        file = NULL;
+    }
+
+#if defined(SPNGT_HAVE_PIPE)
+    pid_t child;
+    FILE *piped = NULL;
+#endif
+
+    /* Buffer, file, stream and pipe input, compressed text is read after the first row */
+    for(input=0; input < 4 && !ret; input++)
+    {
+        spng_ctx_free(dec);
+        dec = spng_ctx_new(0);
+
+        if(input == 0) spng_set_png_buffer(dec, encoded, len);
+        else if(input == 1)
+        {
+            if(file == NULL) continue;
+
+            rewind(file);
+            spng_set_png_file(dec, file);
+        }
+        else if(input == 2)
+        {
+            state.data = encoded;
+            state.bytes_left = len;
+
+            spng_set_png_stream(dec, stream_read, &state);
+        }
+        else
+        {
+#if defined(SPNGT_HAVE_PIPE)
+            piped = open_pipe(encoded, len, &child);
+            if(piped == NULL) continue;
+
+            spng_set_png_file(dec, piped);
+#else
+            continue;
+#endif
+        }
+
+        ret = spng_decode_image(dec, NULL, 0, fmt, SPNG_DECODE_PROGRESSIVE);
+        if(ret) break;
+
+        ret = spng_decode_row(dec, decoded, row_bytes);
+
+        if(!ret || ret == SPNG_EOI) ret = compare_text(dec, text, 3, &iccp);
+
+        while(!ret)
+        {
+            ret = spng_get_row_info(dec, &row_info);
+            if(ret) break;
+
+            ret = spng_decode_row(dec, decoded + row_info.row_num * row_bytes, row_bytes);
+        }
+
+        if(ret == SPNG_EOI) ret = 0;
+
+        if(ret) printf("decoding with text chunks failed (input %d): %s\n", input, spng_strerror(ret));
+        else if(memcmp(decoded, tall, tall_size))
+        {
+            printf("image decoded with text chunks does not match (input %d)\n", input);
+            ret = 1;
+        }
+    }
+
+#if defined(SPNGT_HAVE_PIPE)
+    if(piped != NULL)
+    {
+        spng_ctx_free(dec);
+        dec = NULL;
+        close_pipe(piped, child);
+    }
+#endif
+
+    if(ret) goto cleanup;
+
+    /* An invalid zTXt stream is dropped on first access */
+    unsigned char *ztxt = NULL;
+
+    for(i=8; i + 4 < len && ztxt == NULL; i++)
+    {
+        if(!memcmp(encoded + i, "zTXt", 4)) ztxt = encoded + i + 4;
+    }
+
+    if(ztxt == NULL)
+    {
+        printf("zTXt chunk not found\n");
+        ret = 1;
+        goto cleanup;
+    }
+
+    ztxt[sizeof("Comment") + 1] = 0; /* invalid compression method in the zlib header */
+
+    spng_ctx_free(dec);
+    dec = spng_ctx_new(0);
+
+    spng_set_crc_action(dec, SPNG_CRC_ERROR, SPNG_CRC_USE);
+    spng_set_png_buffer(dec, encoded, len);
+
+    text[1] = text[2];
+
+    ret = compare_text(dec, text, 2, &iccp);
+    if(ret) goto cleanup;
+
+    /* The profile size from the header is only a hint */
+    profile[0] = 0x7f;
+    profile[1] = 0xff;
+
+    set = (struct encode_chunks){ .iccp = &iccp };
+
+    free(encoded);
+
+    encoded = encode_with_chunks(src_ihdr, plte, image, image_size, fmt, &set, &len, &ret);
+    if(encoded == NULL)
+    {
+        printf("encoding iCCP with an invalid size failed: %s\n", spng_strerror(ret));
+        goto cleanup;
+    }
+
+    struct spng_alloc alloc = { tracking_malloc, tracking_realloc, tracking_calloc, free };
+
+    spng_ctx_free(dec);
+    dec = spng_ctx_new2(&alloc, 0);
+
+    spng_set_png_buffer(dec, encoded, len);
+
+    largest_alloc = 0;
+
+    struct spng_iccp out_iccp;
+
+    ret = spng_get_iccp(dec, &out_iccp);
+    if(ret)
+    {
+        printf("spng_get_iccp() failed for an invalid profile size: %s\n", spng_strerror(ret));
+        goto cleanup;
+    }
+
+    if(out_iccp.profile_len != iccp.profile_len || memcmp(out_iccp.profile, iccp.profile, iccp.profile_len))
+    {
+        printf("iCCP profile with an invalid size does not match\n");
+        ret = 1;
+    }
+    else if(largest_alloc > 2 * 1024 * 1024)
+    {
+        printf("iCCP profile header size was allocated, %zu bytes\n", largest_alloc);
+        ret = 1;
+    }
+
+cleanup:
+    if(file != NULL) fclose(file);
+    free(tall);
+    free(encoded);
+    free(decoded);
+    free(profile);
+    free(long_text);
+    spng_ctx_free(dec);
+
+    return ret;
+}
+
+/* Chunk CRCs written and checked around the hardware CRC block sizes */
+static int crc_tests(const struct spng_ihdr *ihdr, const struct spng_plte *plte,
+                     const unsigned char *image, size_t image_size, int fmt)
+{
+    int ret = 0, input;
+    const uint32_t lengths[] = { 0, 1, 15, 16, 17, 63, 64, 65, 127, 128, 129, 255, 256, 257, 1000, 20003 };
+    const uint32_t n_chunks = sizeof(lengths) / sizeof(lengths[0]);
+    struct spng_unknown_chunk chunks[sizeof(lengths) / sizeof(lengths[0])];
+    struct spng_unknown_chunk out[sizeof(lengths) / sizeof(lengths[0])];
+    size_t i, len, pos, offset = 0;
+    unsigned char *chunk_data = malloc(30000), *encoded = NULL;
+    uint32_t n, x = 1, n_checked = 0;
+    struct buf_state state;
+    spng_ctx *dec = NULL;
+
+    if(chunk_data == NULL) return 1;
+
+    for(i=0; i < 30000; i++)
+    {
+        x = x * 1103515245 + 12345;
+        chunk_data[i] = (unsigned char)(x >> 16);
+    }
+
+    /* Misaligned data for each chunk */
+    for(i=0; i < n_chunks; i++)
+    {
+        chunks[i] = (struct spng_unknown_chunk){ .location = SPNG_AFTER_IHDR, .type = "cHNK", .length = lengths[i] };
+        chunks[i].data = chunk_data + offset;
+
+        offset += lengths[i] + 1;
+    }
+
+    struct encode_chunks set = { .unknown = chunks, .n_unknown = n_chunks };
+
+    encoded = encode_with_chunks(ihdr, plte, image, image_size, fmt, &set, &len, &ret);
+    if(encoded == NULL)
+    {
+        printf("encoding for CRC tests failed: %s\n", spng_strerror(ret));
+        goto cleanup;
+    }
+
+    for(pos=8; pos + 12 <= len; pos += (size_t)12 + n)
+    {
+        n = ((uint32_t)encoded[pos] << 24) | ((uint32_t)encoded[pos + 1] << 16) | ((uint32_t)encoded[pos + 2] << 8) | encoded[pos + 3];
+
+        if(n > len - pos - 12) break;
+
+        const unsigned char *p = encoded + pos + 8 + n;
+        uint32_t crc = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+
+        if(crc != chunk_crc(encoded + pos + 4, (size_t)n + 4))
+        {
+            printf("wrong CRC for %.4s chunk of length %u\n", (const char*)encoded + pos + 4, n);
+            ret = 1;
+            goto cleanup;
+        }
+
+        n_checked++;
+    }
+
+    if(pos != len || n_checked < n_chunks + 3)
+    {
+        printf("encoded chunks are truncated\n");
+        ret = 1;
+        goto cleanup;
+    }
+
+    for(input=0; input < 2; input++)
+    {
+        spng_ctx_free(dec);
+        dec = spng_ctx_new(0);
+
+        spng_set_option(dec, SPNG_KEEP_UNKNOWN_CHUNKS, 1);
+        spng_set_crc_action(dec, SPNG_CRC_ERROR, SPNG_CRC_ERROR);
+
+        if(input == 0) spng_set_png_buffer(dec, encoded, len);
+        else
+        {
+            state.data = encoded;
+            state.bytes_left = len;
+
+            spng_set_png_stream(dec, stream_read, &state);
+        }
+
+        n = n_chunks;
+
+        ret = spng_get_unknown_chunks(dec, out, &n);
+        if(ret || n != n_chunks)
+        {
+            printf("reading unknown chunks failed (input %d): %s\n", input, spng_strerror(ret));
+            if(!ret) ret = 1;
+            goto cleanup;
+        }
+
+        for(i=0; i < n_chunks; i++)
+        {
+            if(out[i].length != lengths[i] || (lengths[i] && memcmp(out[i].data, chunks[i].data, lengths[i])))
+            {
+                printf("unknown chunk of length %u does not match (input %d)\n", lengths[i], input);
+                ret = 1;
+                goto cleanup;
+            }
+        }
+    }
+
+cleanup:
+    free(chunk_data);
+    free(encoded);
+    spng_ctx_free(dec);
+
+    return ret;
+}
+
+/* Chunks left out by spng_set_chunk_filter() are skipped without checking their CRC */
+static int chunk_filter_tests(const struct spng_ihdr *src_ihdr, const struct spng_plte *plte,
+                              const unsigned char *image, size_t image_size, int fmt)
+{
+    int ret = 0, input;
+    uint32_t gama, n_text;
+    size_t i, len;
+    unsigned char *encoded = NULL, *decoded = malloc(image_size);
+    unsigned char chunk_data[64] = { 0 };
+    struct spng_ihdr ihdr = *src_ihdr;
+    struct spng_text text[2];
+    struct spng_iccp iccp = { .profile_name = "Test profile", .profile_len = sizeof(chunk_data), .profile = (char*)chunk_data };
+    struct spng_unknown_chunk chunk = { .location = SPNG_AFTER_IHDR, .type = "cHNK", .length = sizeof(chunk_data), .data = chunk_data };
+    const char *keep[] = { "gAMA", "tEXt" };
+    struct buf_state state;
+    struct encode_chunks set = { .gama = 45455, .iccp = &iccp, .text = text, .n_text = 2, .unknown = &chunk, .n_unknown = 1 };
+    spng_ctx *dec = NULL;
+    FILE *file = NULL;
+#if defined(SPNGT_HAVE_PIPE)
+    pid_t child = 0;
+    FILE *piped = NULL;
+#endif
+
+    if(decoded == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
+
+    ihdr.interlace_method = 0;
+
+    memset(text, 0, sizeof(text));
+
+    strcpy(text[0].keyword, "Title");
+    text[0].type = SPNG_TEXT;
+    text[0].text = "kept";
+    text[0].length = 4;
+
+    strcpy(text[1].keyword, "Comment");
+    text[1].type = SPNG_ZTXT;
+    text[1].text = "skipped";
+    text[1].length = 7;
+
+    encoded = encode_with_chunks(&ihdr, plte, image, image_size, fmt, &set, &len, &ret);
+    if(encoded == NULL)
+    {
+        printf("encoding chunks for the chunk filter failed: %s\n", spng_strerror(ret));
+        goto cleanup;
+    }
+
+    /* Invalid CRC's for the chunks that are skipped */
+    for(i=8; i + 12 <= len; i += 12 + (size_t)get_u32(encoded + i))
+    {
+        const unsigned char *type = encoded + i + 4;
+
+        if(!memcmp(type, "iCCP", 4) || !memcmp(type, "zTXt", 4) || !memcmp(type, "cHNK", 4))
+        {
+            encoded[i + 8 + get_u32(encoded + i)] ^= 0xff;
+        }
+    }
+
+    file = tmpfile();
+    if(file != NULL && fwrite(encoded, len, 1, file) != 1)
+    {
+        fclose(file);
+        file = NULL;
+    }
+
+    /* Buffer, file, stream and pipe input, files that can't seek read the skipped chunks */
+    for(input=0; input < 4 && !ret; input++)
+    {
+        spng_ctx_free(dec);
+        dec = spng_ctx_new(0);
+
+        spng_set_crc_action(dec, SPNG_CRC_ERROR, SPNG_CRC_ERROR);
+        spng_set_option(dec, SPNG_KEEP_UNKNOWN_CHUNKS, 1);
+
+        ret = spng_set_chunk_filter(dec, keep, 2);
         if(ret)
         {
-            printf("compare error (%d))\n", ret);
-            dump_buffer(encoded_pngbuf, encoded_len, NULL);
-            goto encode_cleanup;
+            printf("spng_set_chunk_filter() failed: %s\n", spng_strerror(ret));
+            goto cleanup;
         }
 
-        libpng.source.type = SPNGT_SRC_BUFFER;
-        libpng.source.buffer = encoded_pngbuf;
-        libpng.source.png_size = encoded_len;
-        libpng.test_flags |= SPNGT_COMPARE_CHUNKS;
+        if(input == 0) spng_set_png_buffer(dec, encoded, len);
+        else if(input == 1)
+        {
+            if(file == NULL) continue;
 
-        printf("           compare (reencoded, reencoded)...\n");
+            rewind(file);
+            spng_set_png_file(dec, file);
+        }
+        else if(input == 2)
+        {
+            state.data = encoded;
+            state.bytes_left = len;
 
-        ret = decode_and_compare(&spng, &libpng);
+            spng_set_png_stream(dec, stream_read, &state);
+        }
+        else
+        {
+#if defined(SPNGT_HAVE_PIPE)
+            piped = open_pipe(encoded, len, &child);
+            if(piped == NULL) continue;
+
+            spng_set_png_file(dec, piped);
+#else
+            continue;
+#endif
+        }
+
+        ret = spng_decode_image(dec, decoded, image_size, fmt, 0);
 
         if(ret)
         {
-            printf("compare error (%d))\n", ret);
-            dump_buffer(encoded_pngbuf, encoded_len, NULL);
+            printf("decoding with chunk filter failed (input %d): %s\n", input, spng_strerror(ret));
+            goto cleanup;
         }
 
-encode_cleanup:
-        free(img_spng);
-        free(encoded_pngbuf);
-        spng_ctx_free(src);
-        spng_ctx_free(dst);
-        free_chunks(&data);
+        if(memcmp(decoded, image, image_size))
+        {
+            printf("image decoded with chunk filter does not match (input %d)\n", input);
+            ret = 1;
+            goto cleanup;
+        }
+
+        if(spng_get_gama_int(dec, &gama) || gama != 45455 ||
+           spng_get_text(dec, NULL, &n_text) || n_text != 1 ||
+           spng_get_iccp(dec, &iccp) != SPNG_ECHUNKAVAIL ||
+           spng_get_unknown_chunks(dec, NULL, &n_text) != SPNG_ECHUNKAVAIL)
+        {
+            printf("unexpected chunks kept by chunk filter (input %d)\n", input);
+            ret = 1;
+            goto cleanup;
+        }
     }
 
-    if(test_case->test_flags & SPNGT_EXTENDED_TESTS)
+    /* The filter is set before any chunk is read */
+    if(spng_set_chunk_filter(dec, NULL, 0) != SPNG_EOPSTATE)
     {
-        rewind(spng.source.file);
-        ret = extended_tests(spng.source.file, test_case->fmt);
-        if(ret) printf("extended tests failed\n");
+        printf("chunk filter can be changed after decoding\n");
+        ret = 1;
     }
 
 cleanup:
-
-    if(spng.source.file) fclose(spng.source.file);
-    if(libpng.source.file) fclose(libpng.source.file);
+    if(file != NULL) fclose(file);
+#if defined(SPNGT_HAVE_PIPE)
+    if(piped != NULL) close_pipe(piped, child);
+#endif
+    free(encoded);
+    free(decoded);
+    spng_ctx_free(dec);
 
     return ret;
 }
 
-static int get_image_info(FILE *f, struct spng_ihdr *ihdr)
+/* Fed chunk lengths are checked against the chunk limits from the header,
+   chunks that are skipped are discarded as they arrive */
+static int feed_limit_tests(const struct spng_ihdr *src_ihdr, const struct spng_plte *plte,
+                            const unsigned char *image, size_t image_size, int fmt)
 {
-    spng_ctx *ctx = spng_ctx_new(0);
+    int ret = 0, config;
+    size_t len, offset;
+    const size_t chunk_size = 1024 * 1024;
+    unsigned char *encoded = NULL, *decoded = malloc(image_size), *chunk_data = calloc(1, chunk_size);
+    unsigned char header[41];
+    struct spng_ihdr ihdr = *src_ihdr;
+    struct spng_unknown_chunk chunk = { .location = SPNG_AFTER_IHDR, .type = "cHNK", .length = chunk_size };
+    struct spng_alloc alloc = { tracking_malloc, tracking_realloc, tracking_calloc, free };
+    const char *keep[] = { "gAMA" };
+    struct encode_chunks set = { .unknown = &chunk, .n_unknown = 1 };
+    spng_ctx *dec = NULL;
+
+    if(decoded == NULL || chunk_data == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
 
-    spng_set_crc_action(ctx, SPNG_CRC_USE, SPNG_CRC_USE);
+    ihdr.interlace_method = 0;
+    chunk.data = chunk_data;
 
-    spng_set_png_file(ctx, f);
+    encoded = encode_with_chunks(&ihdr, plte, image, image_size, fmt, &set, &len, &ret);
+    if(encoded == NULL)
+    {
+        printf("encoding a large unknown chunk failed: %s\n", spng_strerror(ret));
+        goto cleanup;
+    }
 
-    int ret = spng_get_ihdr(ctx, ihdr);
+    /* Signature, IHDR and the header of a 2 GiB tEXt chunk */
+    memcpy(header, encoded, 33);
+    memcpy(header + 33, "\x7f\xff\xff\xf0tEXt", 8);
 
-    spng_ctx_free(ctx);
+    dec = spng_ctx_new(0);
 
-    return ret;
-}
+    spng_set_chunk_limits(dec, chunk_size, chunk_size);
+    spng_feed(dec, header, sizeof(header));
 
-int main(int argc, char **argv)
-{
-    if(argc < 2)
+    ret = spng_decode_image(dec, decoded, image_size, fmt, 0);
+    if(ret != SPNG_ECHUNK_LIMITS)
     {
-        printf("no input file\n");
-        return 1;
+        printf("fed chunk above the chunk limits was not rejected: %s\n", spng_strerror(ret));
+        ret = 1;
+        goto cleanup;
     }
 
-    char *filename = argv[1];
-
-    if(!strcmp(filename, "info"))
+    /* The unknown chunk is discarded, then skipped by the chunk filter */
+    for(config=0; config < 2; config++)
     {
-        unsigned int png_ver = png_access_version_number();
+        spng_ctx_free(dec);
+        dec = spng_ctx_new2(&alloc, 0);
 
-        printf("spng header version: %u.%u.%u, library version: %s\n",
-               SPNG_VERSION_MAJOR, SPNG_VERSION_MINOR, SPNG_VERSION_PATCH,
-               spng_version_string());
-        printf("png header version: %u.%u.%u, library version: %u.%u.%u\n",
-               PNG_LIBPNG_VER_MAJOR, PNG_LIBPNG_VER_MINOR, PNG_LIBPNG_VER_RELEASE,
-               png_ver / 10000, png_ver / 100 % 100, png_ver % 100);
+        if(config) spng_set_option(dec, SPNG_KEEP_UNKNOWN_CHUNKS, 1);
+        if(config) spng_set_chunk_filter(dec, keep, 1);
 
+        largest_alloc = 0;
+        offset = 0;
 
-        return 0;
-    }
+        do
+        {
+            size_t n = len - offset > 4096 ? 4096 : len - offset;
 
-    FILE *file = fopen(filename, "rb");
+            if(n) spng_feed(dec, encoded + offset, n);
+            else spng_feed(dec, NULL, 0);
 
-    if(file == NULL)
-    {
-        printf("error opening input file %s\n", filename);
-        return 1;
-    }
+            offset += n;
 
-    struct spng_ihdr ihdr = {0};
+            ret = spng_decode_image(dec, decoded, image_size, fmt, 0);
+        }while(ret == SPNG_EAGAIN);
 
-    if(!get_image_info(file, &ihdr))
-    {
-        char *clr_type_str;
-        if(ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE)
-            clr_type_str = "GRAY";
-        else if(ihdr.color_type == SPNG_COLOR_TYPE_TRUECOLOR)
-            clr_type_str = "RGB";
-        else if(ihdr.color_type == SPNG_COLOR_TYPE_INDEXED)
-            clr_type_str = "INDEXED";
-        else if(ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE_ALPHA)
-            clr_type_str = "GRAY-ALPHA";
-        else
-            clr_type_str = "RGBA";
+        if(ret || memcmp(decoded, image, image_size))
+        {
+            printf("decoding fed image with a skipped chunk failed (config %d): %s\n", config, spng_strerror(ret));
+            if(!ret) ret = 1;
+            goto cleanup;
+        }
 
-        printf("%s %" PRIu8 "-bit, %" PRIu32 "x%" PRIu32 " %s\n",
-               clr_type_str, ihdr.bit_depth, ihdr.width, ihdr.height,
-               ihdr.interlace_method ? "interlaced" : "non-interlaced");
+        if(largest_alloc >= chunk_size / 4)
+        {
+            printf("skipped chunk was buffered (config %d), %zu byte allocation\n", config, largest_alloc);
+            ret = 1;
+            goto cleanup;
+        }
     }
-    else printf("failed to get image info\n");
-
-    fclose(file);
-
-/*  With libpng it's not possible to request 8/16-bit images regardless of
-    PNG format without calling functions that alias to png_set_expand(_16),
-    which acts as if png_set_tRNS_to_alpha() was called, as a result
-    there are no tests where transparency is not applied
-*/
-    int gamma_bug = 0;
-    int skip_encode = 0;
-    int fmt_limit = SPNGT_SKIP;
-    int fmt_limit_2 = SPNGT_SKIP;
 
-    /* https://github.com/randy408/libspng/issues/17 */
-    if(ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE) gamma_bug = SPNGT_SKIP;
+cleanup:
+    free(encoded);
+    free(decoded);
+    free(chunk_data);
+    spng_ctx_free(dec);
 
-    /* Some output formats are limited to certain PNG formats */
-    if(ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr.bit_depth <= 8) fmt_limit = 0;
-    if(ihdr.color_type == SPNG_COLOR_TYPE_GRAYSCALE && ihdr.bit_depth == 16) fmt_limit_2 = 0;
+    return ret;
+}
 
-    add_test_case(SPNG_FMT_PNG, 0, SPNGT_COMPARE_CHUNKS);
-    add_test_case(SPNG_FMT_PNG, 0, SPNGT_ENCODE_ROUNDTRIP | skip_encode);
-    add_test_case(SPNG_FMT_RAW, 0, SPNGT_ENCODE_ROUNDTRIP | skip_encode);
-    add_test_case(SPNG_FMT_RAW, 0, 0);
-    add_test_case(SPNG_FMT_RGBA8, SPNG_DECODE_TRNS, 0);
-    add_test_case(SPNG_FMT_RGBA8, SPNG_DECODE_TRNS | SPNG_DECODE_GAMMA, gamma_bug);
-    add_test_case(SPNG_FMT_RGBA16, SPNG_DECODE_TRNS, 0);
-    add_test_case(SPNG_FMT_RGBA16, SPNG_DECODE_TRNS | SPNG_DECODE_GAMMA, 0);
-    add_test_case(SPNG_FMT_RGB8, 0, 0);
-    add_test_case(SPNG_FMT_RGB8, SPNG_DECODE_GAMMA, gamma_bug);
+/* Decode and encode the image twice with the same context */
+static int reset_tests(FILE *file, const struct spng_ihdr *ihdr, const struct spng_plte *plte,
+                       const unsigned char *image, size_t image_size, int fmt)
+{
+    int i, ret = 0;
+    size_t size, len[2] = { 0 };
+    unsigned char *decoded = malloc(image_size);
+    unsigned char *encoded[2] = { NULL };
+    spng_ctx *dec = spng_ctx_new(0);
+    spng_ctx *enc = spng_ctx_new(SPNG_CTX_ENCODER);
 
-    add_test_case(SPNG_FMT_G8, 0, fmt_limit);
-    add_test_case(SPNG_FMT_GA8, 0, fmt_limit);
-    add_test_case(SPNG_FMT_GA8, SPNG_DECODE_TRNS, fmt_limit);
+    if(decoded == NULL || dec == NULL || enc == NULL)
+    {
+        ret = 1;
+        goto cleanup;
+    }
 
-    add_test_case(SPNG_FMT_GA16, 0, fmt_limit_2);
-    add_test_case(SPNG_FMT_GA16, SPNG_DECODE_TRNS, fmt_limit_2);
+    spng_set_option(enc, SPNG_ENCODE_TO_BUFFER, 1);
 
-    /* This tests the input->output format logic used in libvips,
-       it emulates the behavior of their old PNG loader which uses libpng. */
-    add_test_case(SPNGT_FMT_VIPS, SPNG_DECODE_TRNS, 0);
+    for(i=0; i < 2; i++)
+    {
+        rewind(file);
 
-    add_test_case(SPNG_FMT_PNG, 0, SPNGT_EXTENDED_TESTS);
+        ret = spng_set_png_file(dec, file);
+        if(ret) goto cleanup;
 
-    printf("%d test cases", n_test_cases);
+        ret = spng_decoded_image_size(dec, fmt, &size);
+        if(ret) goto cleanup;
 
-    if(n_test_cases != actual_count) printf(" (skipping %d)", n_test_cases - actual_count);
+        if(size != image_size)
+        {
+            printf("decoded image size mismatch after reset\n");
+            ret = 1;
+            goto cleanup;
+        }
 
-    printf("\n");
+        memset(decoded, 0, size);
 
-    int i, ret = 0;
-    for(i=0; i < n_test_cases; i++)
-    {
-        print_test_args(&test_cases[i]);
+        ret = spng_decode_image(dec, decoded, size, fmt, 0);
+        if(ret) goto cleanup;
 
-        if(test_cases[i].test_flags & SPNGT_SKIP) continue;
+        if(memcmp(decoded, image, size))
+        {
+            printf("decoded image is not identical after reset\n");
+            ret = 1;
+            goto cleanup;
+        }
 
-        int e = spngt_run_test(filename, &test_cases[i]);
-        if(!ret) ret = e;
-    }
+        spng_set_ihdr(enc, (struct spng_ihdr*)ihdr);
+        if(plte->n_entries) spng_set_plte(enc, (struct spng_plte*)plte);
 
-    return ret;
-}
+        ret = spng_encode_image(enc, image, image_size, fmt, SPNG_ENCODE_FINALIZE);
+        if(ret) goto cleanup;
 
-static int stream_write_checked(spng_ctx *ctx, void *user, void *data, size_t len)
-{
-    (void)ctx;
-    struct buf_state *state = user;
+        encoded[i] = spng_get_png_buffer(enc, &len[i], &ret);
+        if(ret) goto cleanup;
 
-    if(len > state->bytes_left) return SPNG_IO_EOF;
+        ret = spng_ctx_reset(dec);
+        if(!ret) ret = spng_ctx_reset(enc);
+        if(ret) goto cleanup;
+    }
 
-    if(memcmp(data, state->data, len))
+    if(len[0] != len[1] || memcmp(encoded[0], encoded[1], len[0]))
     {
-        printf("stream write does not match buffer data\n");
-        return SPNG_IO_ERROR;
+        printf("encoded image is not identical after reset\n");
+        ret = 1;
     }
 
-    state->data += len;
-    state->bytes_left -= len;
+cleanup:
+    if(ret) printf("reset test failed (%d): %s\n", ret, spng_strerror(ret));
 
-    return 0;
+    free(decoded);
+    free(encoded[0]);
+    free(encoded[1]);
+    spng_ctx_free(dec);
+    spng_ctx_free(enc);
+
+    return ret;
 }
 
 /* Tests that don't fit anywhere else */
@@ -1570,8 +4554,50 @@ static int extended_tests(FILE *file, int fmt)
     {
         printf("incomplete stream (%zu bytes shorter)\n", state.bytes_left);
         ret = 1;
+        goto cleanup;
     }
 
+    ret = strip_tests(&ihdr, &plte, image, image_size, fmt);
+    if(ret) goto cleanup;
+
+    ret = index_tests(&ihdr, &plte, image, image_size, fmt);
+    if(ret) goto cleanup;
+
+    ret = restart_tests(&ihdr, &plte, image, image_size, fmt);
+    if(ret) goto cleanup;
+
+    ret = speculative_tests(&ihdr, &plte, image, image_size, fmt);
+    if(ret) goto cleanup;
+
+    ret = apng_tests(&ihdr, &plte, image, image_size, fmt);
+    if(ret) goto cleanup;
+
+    ret = apng_encode_tests(&ihdr, &plte, image, image_size, fmt);
+    if(ret) goto cleanup;
+
+    ret = text_tests(&ihdr, &plte, image, image_size, fmt);
+    if(ret) goto cleanup;
+
+    ret = unknown_chunk_tests(&ihdr, &plte, image, image_size, fmt);
+    if(ret) goto cleanup;
+
+    ret = chunk_filter_tests(&ihdr, &plte, image, image_size, fmt);
+    if(ret) goto cleanup;
+
+    ret = feed_limit_tests(&ihdr, &plte, image, image_size, fmt);
+    if(ret) goto cleanup;
+
+    ret = crc_tests(&ihdr, &plte, image, image_size, fmt);
+    if(ret) goto cleanup;
+
+    ret = reset_tests(file, &ihdr, &plte, image, image_size, fmt);
+    if(ret) goto cleanup;
+
+    ret = deflate_backend_tests(&ihdr, &plte, image, image_size, fmt);
+    if(ret) goto cleanup;
+
+    ret = defilter_tests(&ihdr, &plte);
+
 cleanup:
     free(image);
     free(encoded);